@@ -25,6 +25,18 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 //
+// The player functions which the frames of tcomp --c-code output call
+//
+void oledWriteFlashBlock(byte *s, int iLen);
+void oledRepeatByte(byte b, int iLen);
+void oledWritePattern(const byte *pPattern, byte bPeriod, int iLen);
+static void oledSetOffset(int i);
+static void oledWindowStart(int x, int w, int y, int h);
+static void oledWindowData(int k, byte *s, const byte *pPattern, byte bPeriod, int j);
+static void oledWindowEnd(void);
+static void oledDisplayCommand(byte c, byte v);
+static byte *oledPlayFrame(byte *s);
+//
 // Packed animation data
 //
 const byte bAnimation[] PROGMEM = {
@@ -145,18 +157,41 @@ const byte bAnimation[] PROGMEM = {
 };
 
 //
-// Byte operands for compressing the data
-// The first 2 bits are the type, followed by the counts
-#define OP_MASK 0xc0
-#define OP_SKIPCOPY 0x00
-#define OP_COPYSKIP 0x40
-#define OP_REPEATSKIP 0x80
-#define OP_REPEAT 0xc0
+// The opcodes of the compressed data are documented in oled_decode.h
+//
+// Optional stream header: 0x80 'A' <flags low> <flags high>
+// (0x80 is a repeat+skip of 0 bytes which the encoder never writes)
+//
+#define STREAM_MARKER0 0x80
+#define STREAM_MARKER1 'A'
+#define STREAM_HEADER_SIZE 4
+#define STREAM_VERTICAL 0x0001 // frames are scanned column by column
+#define STREAM_WINDOWS 0x0002 // frames may contain window opcodes
+#define STREAM_PATTERNS 0x0004 // frames may contain pattern opcodes
+#define STREAM_PAGE_ALIGNED 0x0008 // no copy, repeat or pattern crosses a line
+#define STREAM_PINGPONG 0x0010 // the frames go back down to frame 0; loops start at frame 1
+#define STREAM_LOOP_FRAME 0x0020 // frame 1 goes from the last frame back to frame 0; loops start there
+#define STREAM_TILES 0x0040 // a tile table (count - 1, 8 bytes per tile) follows the header
+#define STREAM_COMMANDS 0x0080 // frames may contain display commands
+#define STREAM_FIELDS_MASK 0x0c00 // split of the skip+copy and copy+skip fields
+#define STREAM_FIELDS_SHIFT 10
+//
+// Multi-clip bundle: "OAB1", clips, chunks, stream flags (16-bits each),
+// clip table (first frame, frame count), chunk offsets (32-bits), and
+// the chunk number of each frame (16-bits); the tile table of the clips
+// goes after the chunk data
+//
+#define BUNDLE_HEADER_SIZE 10
 
 // Some globals
-static int iScreenOffset; // current write offset of screen data
+static int iScreenOffset; // current write offset of screen data (in scan order)
+static byte bVertical; // the animation uses vertical addressing mode
+static byte bPageAligned; // no write of the animation crosses a line
+static byte bFields; // field split of the skip+copy and copy+skip opcodes
+static const byte *pTiles; // tile table of the animation in flash (NULL = none)
 static int iFrameDelay; // milliseconds to pause between frames
 static byte oled_addr; // I2C address of the display
+static byte bInverted; // oledInit() inverted the display
 static void oledWriteCommand(unsigned char c);
 // Hardware ports of the AVR
 #define I2CPORT PORTB
@@ -174,8 +209,11 @@ static void oledWriteCommand(unsigned char c);
 //
 // If the display doesn't properly implement the horizontal addressing mode, it requires
 // additional effort to transmit the images
+// (avrsim defines GOOD_DISPLAY to build the sketch both ways)
 //
+#ifndef GOOD_DISPLAY
 #define BAD_DISPLAY
+#endif
 //
 // Transmit a byte and ack bit
 //
@@ -254,9 +292,10 @@ byte b;
 #ifdef BAD_DISPLAY
   {
   int j;
-     while (((iScreenOffset & 0x7f) + iLen) >= 128) // if it will hit the page end
+  int iLine = bVertical ? 1 : 128; // bytes until the address leaves the page
+     while ((!bPageAligned || bVertical) && ((iScreenOffset & (iLine-1)) + iLen) >= iLine) // if it will hit the page end
      {
-        j = 128 - (iScreenOffset & 0x7f); // amount we can write in one shot
+        j = iLine - (iScreenOffset & (iLine-1)); // amount we can write in one shot
         i2cBegin(oled_addr);
         i2cByteOut(0x40); // start of data
         for (i=0; i<j; i++)
@@ -267,7 +306,7 @@ byte b;
         i2cEnd(); 
         iLen -= j;
         iScreenOffset = (iScreenOffset + j) & 0x3ff;
-        oledSetPosition(iScreenOffset & 0x7f, (iScreenOffset >> 7));
+        oledSetOffset(iScreenOffset);
      } // while it needs some help
   }
 #endif // simpler case and leftover bytes
@@ -280,6 +319,10 @@ byte b;
   }
   i2cEnd();
   iScreenOffset = (iScreenOffset + iLen) & 0x3ff;
+#ifdef BAD_DISPLAY
+  if (bPageAligned && !bVertical && (iScreenOffset & 127) == 0) // reached the line end
+    oledSetOffset(iScreenOffset);
+#endif
 } /* oledWriteFlashBlock() */
 
 //
@@ -292,9 +335,10 @@ int i;
 #ifdef BAD_DISPLAY
   {
   int j;
-     while (((iScreenOffset & 0x7f) + iLen) >= 128) // if it will hit the page end
+  int iLine = bVertical ? 1 : 128; // bytes until the address leaves the page
+     while ((!bPageAligned || bVertical) && ((iScreenOffset & (iLine-1)) + iLen) >= iLine) // if it will hit the page end
      {
-        j = 128 - (iScreenOffset & 0x7f); // amount we can write in one shot
+        j = iLine - (iScreenOffset & (iLine-1)); // amount we can write in one shot
         i2cBegin(oled_addr);
         i2cByteOut(0x40); // start of data
         for (i=0; i<j; i++)
@@ -304,7 +348,7 @@ int i;
         i2cEnd(); 
         iLen -= j;
         iScreenOffset = (iScreenOffset + j) & 0x3ff;
-        oledSetPosition(iScreenOffset & 0x7f, (iScreenOffset >> 7));
+        oledSetOffset(iScreenOffset);
      } // while it needs some help
   }
 #endif // simpler case and leftover bytes
@@ -316,8 +360,58 @@ int i;
   }
   i2cEnd();  
   iScreenOffset += iLen;
+#ifdef BAD_DISPLAY
+  if (bPageAligned && !bVertical && (iScreenOffset & 127) == 0) // reached the line end
+    oledSetOffset(iScreenOffset & 0x3ff);
+#endif
 } /* oledRepeatByte() */
 
+//
+// Write a repeating 2-4 byte pattern (held in RAM) to the display
+//
+void oledWritePattern(const byte *pPattern, byte bPeriod, int iLen)
+{
+int i;
+byte j = 0;
+
+#ifdef BAD_DISPLAY
+  {
+  int k;
+  int iLine = bVertical ? 1 : 128; // bytes until the address leaves the page
+     while ((!bPageAligned || bVertical) && ((iScreenOffset & (iLine-1)) + iLen) >= iLine) // if it will hit the page end
+     {
+        k = iLine - (iScreenOffset & (iLine-1)); // amount we can write in one shot
+        i2cBegin(oled_addr);
+        i2cByteOut(0x40); // start of data
+        for (i=0; i<k; i++)
+           {
+              i2cByteOut(pPattern[j]);
+              if (++j == bPeriod)
+                 j = 0;
+           }
+        i2cEnd(); 
+        iLen -= k;
+        iScreenOffset = (iScreenOffset + k) & 0x3ff;
+        oledSetOffset(iScreenOffset);
+     } // while it needs some help
+  }
+#endif // simpler case and leftover bytes
+  i2cBegin(oled_addr);
+  i2cByteOut(0x40); // start of data
+  for (i=0; i<iLen; i++)
+  {
+    i2cByteOut(pPattern[j]);
+    if (++j == bPeriod)
+      j = 0;
+  }
+  i2cEnd();  
+  iScreenOffset += iLen;
+#ifdef BAD_DISPLAY
+  if (bPageAligned && !bVertical && (iScreenOffset & 127) == 0) // reached the line end
+    oledSetOffset(iScreenOffset & 0x3ff);
+#endif
+} /* oledWritePattern() */
+
 //
 // Initializes the OLED controller into "page mode"
 //
@@ -329,6 +423,7 @@ unsigned char oled_initbuf[]={0x00,0xae,0xa8,0x3f,0xd3,0x00,0x40,0xa1,0xc8,
       0xaf,0x20,0x00};
 
   oled_addr = bAddr;
+  bInverted = (bInvert != 0);
   I2CDDR &= ~(1 << BB_SDA);
   I2CDDR &= ~(1 << BB_SCL); // let them float high
   I2CPORT |= (1 << BB_SDA); // set both lines to get pulled up
@@ -386,6 +481,20 @@ void oledSetContrast(unsigned char ucContrast)
   oledWriteCommand2(0x81, ucContrast);
 } /* oledSetContrast() */
 
+//
+// Display command of the animation (normal/inverse video, off/on or
+// contrast v); video stays the other way around if oledInit() inverted it
+//
+static void oledDisplayCommand(byte c, byte v)
+{
+  if (c == 0x81)
+    oledWriteCommand2(c, v);
+  else if ((c & 0xfe) == 0xa6)
+    oledWriteCommand(c ^ bInverted);
+  else
+    oledWriteCommand(c);
+} /* oledDisplayCommand() */
+
 //
 // Send commands to position the "cursor" (aka memory write address)
 // to the given row and column
@@ -395,102 +504,267 @@ static void oledSetPosition(int x, int y)
   oledWriteCommand(0xb0 | y); // go to page Y
   oledWriteCommand(0x00 | (x & 0xf)); // // lower col addr
   oledWriteCommand(0x10 | ((x >> 4) & 0xf)); // upper col addr
-  iScreenOffset = (y*128)+x;
 }
 
+//
+// Position the "cursor" at an offset in the scan order of the animation
+// (row by row in horizontal mode, column by column in vertical mode)
+//
+static void oledSetOffset(int i)
+{
+  if (bVertical)
+    oledSetPosition(i >> 3, i & 7);
+  else
+    oledSetPosition(i & 0x7f, i >> 7);
+  iScreenOffset = i;
+}
+
+//
+// Start filling a rectangle of the display through a column/page window
+//
+static byte bWinX, bWinY, bWinW, bWinH;
+static void oledWindowStart(int x, int w, int y, int h)
+{
+  bWinX = x; bWinW = w;
+  bWinY = y; bWinH = h;
+#ifndef BAD_DISPLAY
+  oledWriteCommand(0x21); // column range
+  oledWriteCommand(x);
+  oledWriteCommand(x + w - 1);
+  oledWriteCommand(0x22); // page range
+  oledWriteCommand(y);
+  oledWriteCommand(y + h - 1);
+#endif
+} /* oledWindowStart() */
+
+//
+// Send n bytes of window data, either from flash or a repeated pattern
+// of 1-4 bytes in RAM
+// k is the number of window bytes already sent
+//
+static void oledWindowData(int k, byte *s, const byte *pPattern, byte bPeriod, int j)
+{
+int i, n;
+byte b, p = 0;
+
+  while (j)
+  {
+    n = j;
+#ifdef BAD_DISPLAY // no auto-increment; position at the start of each line
+    if (bVertical) // (or at each byte; page mode can't go down a column)
+    {
+      oledSetPosition(bWinX + k / bWinH, bWinY + k % bWinH);
+      n = 1;
+    }
+    else
+    {
+      if ((k % bWinW) == 0)
+        oledSetPosition(bWinX, bWinY + k / bWinW);
+      if (n > bWinW - (k % bWinW))
+        n = bWinW - (k % bWinW);
+    }
+#endif
+    i2cBegin(oled_addr);
+    i2cByteOut(0x40); // start of data
+    for (i=0; i<n; i++)
+    {
+      if (s)
+        b = pgm_read_byte(s++);
+      else
+      {
+        b = pPattern[p];
+        if (++p == bPeriod)
+          p = 0;
+      }
+      i2cByteOut(b);
+    }
+    i2cEnd();
+    k += n;
+    j -= n;
+  }
+} /* oledWindowData() */
+
+//
+// The window is full; restore the full window and the cursor
+// (the scan offset doesn't move)
+//
+static void oledWindowEnd(void)
+{
+#ifndef BAD_DISPLAY
+  oledWriteCommand(0x21); // back to the full display
+  oledWriteCommand(0);
+  oledWriteCommand(127);
+  oledWriteCommand(0x22);
+  oledWriteCommand(0);
+  oledWriteCommand(7);
+#endif
+  oledSetOffset(iScreenOffset);
+} /* oledWindowEnd() */
+
+//
+// The decoder core (shared with oledplay and tcomp) reads the
+// animation from flash and sends it straight to the display
+//
+#define ODEC_BYTE(p) pgm_read_byte(p)
+#define ODEC_FIELDS(pSink) bFields
+#define ODEC_TABLE PROGMEM
+#define ODEC_TILES(pSink) pTiles
+#define ODEC_SKIP(pSink, i) oledSetOffset(i)
+#define ODEC_COPY(pSink, i, p, n) oledWriteFlashBlock((byte *)(p), n)
+#define ODEC_REPEAT(pSink, i, b, n) oledRepeatByte(b, n)
+#define ODEC_PATTERN(pSink, i, p, k, n) oledWritePattern(p, k, n)
+#define ODEC_WINDOW(pSink, x, w, y, h) oledWindowStart(x, w, y, h)
+#define ODEC_WINDOW_COPY(pSink, k, p, n) oledWindowData(k, (byte *)(p), NULL, 0, n)
+#define ODEC_WINDOW_REPEAT(pSink, k, b, n) do { byte bRepeat = (b); oledWindowData(k, NULL, &bRepeat, 1, n); } while (0)
+#define ODEC_WINDOW_PATTERN(pSink, k, p, iPeriod, n) oledWindowData(k, NULL, p, iPeriod, n)
+#define ODEC_WINDOW_END(pSink) oledWindowEnd()
+#define ODEC_COMMAND(pSink, c, v) oledDisplayCommand(c, v)
+#include "oled_decode.h"
+
+//
+// Decode one frame from flash to the display
+// Returns a pointer to the start of the next frame
+//
+static byte *oledPlayFrame(byte *s)
+{
+   return (byte *)ODecodeFrame(NULL, s, NULL);
+} /* oledPlayFrame() */
+
+//
+// Set up the addressing mode for the stream flags
+//
+static void oledPlayStart(int iFlags)
+{
+   bVertical = (iFlags & STREAM_VERTICAL) != 0;
+   bPageAligned = (iFlags & STREAM_PAGE_ALIGNED) != 0;
+   bFields = (iFlags & STREAM_FIELDS_MASK) >> STREAM_FIELDS_SHIFT;
+   oledWriteCommand2(0x20, bVertical ? 0x01 : 0x00); // addressing mode
+} /* oledPlayStart() */
+
 void oledPlayAnim(int iRate, int iLoop)
 {
-byte *s;
+byte *s, *pStart;
 byte *pEnd;
-int j, l, i;
-unsigned char b, bCode;
+int l;
+int iFlags = 0;
 
    iFrameDelay = (1000UL / (long)iRate);
+   s = (byte *)bAnimation;
+   if (pgm_read_byte(s) == STREAM_MARKER0 && pgm_read_byte(s+1) == STREAM_MARKER1)
+   {
+      iFlags = pgm_read_byte(s+2) | (pgm_read_byte(s+3) << 8);
+      s += STREAM_HEADER_SIZE;
+   }
+   pTiles = NULL;
+   if (iFlags & STREAM_TILES) // tiles are sent straight from the table
+   {
+      pTiles = s;
+      s += 1 + (pgm_read_byte(s) + 1) * 8;
+   }
+   oledPlayStart(iFlags);
+   pStart = s;
+   if (iFlags & STREAM_PINGPONG) // tcomp --pingpong: the frames walk back to
+   {                             // frame 0, so each pass starts at frame 1
+      pStart = oledPlayFrame(s);
+      delay(iFrameDelay);
+   }
+   else if (iFlags & STREAM_LOOP_FRAME) // tcomp --loop-frame: frame 1 takes the
+   {                                    // last frame back to frame 0 and changes
+      pStart = oledPlayFrame(s);        // nothing after it, so each pass starts
+   }                                    // there (frames 0 and 1 share the delay)
    for (l=0; l<iLoop; l++)
    {
-      s = (byte *)bAnimation; // start of animation data
-      pEnd = &s[sizeof(bAnimation)];
+      s = pStart; // start of the frame data
+      pEnd = (byte *)&bAnimation[sizeof(bAnimation)];
       while (s < pEnd)
       {
-      i = 0;
-         oledSetPosition(0,0);
-         while (i < 1024) // try one frame
-         {
-            bCode = pgm_read_byte(s++);
-            switch (bCode & OP_MASK) // different compression types
-            {
-               case OP_SKIPCOPY: // skip/copy
-                  if (bCode == OP_SKIPCOPY) // big skip
-                  {
-                     b = pgm_read_byte(s++);
-                     i += b + 1;
-                     oledSetPosition(i & 0x7f, (i >> 7));
-                  }
-                  else // skip/copy
-                  {
-                     if (bCode & 0x38)
-                     {
-                        i += ((bCode & 0x38) >> 3); // skip amount
-                        oledSetPosition(i & 0x7f, (i >> 7));
-                     }
-                     if (bCode & 7)
-                     {
-                        oledWriteFlashBlock(s, bCode & 7);
-                        s += (bCode & 7);
-                        i += bCode & 7;
-                     }
-                  }
-               break;
-            case OP_COPYSKIP: // copy/skip
-               if (bCode == OP_COPYSKIP) // big copy
-               {
-                  b = pgm_read_byte(s++);
-                  j = b + 1;
-                  oledWriteFlashBlock(s, j);
-                  s += j;
-                  i += j;
-               }
-               else
-               {
-                  j = ((bCode & 0x38) >> 3);
-                  if (j)
-                  {
-                     oledWriteFlashBlock(s, j);
-                     s += j;
-                     i += j;
-                  }
-                  if (bCode & 7)
-                  {
-                     i += (bCode & 7); // skip
-                  oledSetPosition(i & 0x7f, (i >> 7));
-               }
-            }
-            break;
-               case OP_REPEATSKIP: // repeat/skip
-                  j = (bCode & 0x38) >> 3; // repeat count
-                  b = pgm_read_byte(s++);
-                  oledRepeatByte(b, j);
-                  i += j;
-                  if (bCode & 7)
-                  {
-                     i += (bCode & 7); // skip amount
-                     oledSetPosition(i & 0x7f, (i >> 7));
-                  }
-                  break;
-                  
-               case OP_REPEAT:
-                  j = (bCode & 0x3f) + 1;
-                  b = pgm_read_byte(s++);
-                  oledRepeatByte(b, j);
-                  i += j;
-                  break;  
-         } // switch on code type
-      } // while rendering frame
-   delay(iFrameDelay);
-   } // while playing frames
+         s = oledPlayFrame(s);
+         delay(iFrameDelay);
+      } // while playing frames
    } // for loop count
 } /* PlayAnim() */
 
+//
+// Play the frames of tcomp --c-code output: pPlayFrame(i) sends frame i
+// with constant positions and lengths (or hands it to the decoder if it
+// was left as data)
+//
+void oledPlayCode(void (*pPlayFrame)(int), int iFrames, int iFlags, int iRate, int iLoop)
+{
+int i, l, iStart = 0;
+
+   iFrameDelay = (1000UL / (long)iRate);
+   oledPlayStart(iFlags);
+   if ((iFlags & STREAM_PINGPONG) && iFrames > 1) // each pass starts at frame 1
+   {
+      (*pPlayFrame)(0);
+      delay(iFrameDelay);
+      iStart = 1;
+   }
+   else if ((iFlags & STREAM_LOOP_FRAME) && iFrames > 1) // so does frame 1 (the loop frame)
+   {
+      (*pPlayFrame)(0);
+      iStart = 1;
+   }
+   for (l=0; l<iLoop; l++)
+   {
+      for (i=iStart; i<iFrames; i++)
+      {
+         (*pPlayFrame)(i);
+         delay(iFrameDelay);
+      }
+   }
+} /* oledPlayCode() */
+
+//
+// Play one clip of a bundle written by tcomp --bundle --c
+// (AVR flash pointers are 16-bits, so only the low half of each
+// chunk offset is used)
+//
+void oledPlayClip(const byte *pBundle, int iClip, int iRate, int iLoop)
+{
+byte *pClip, *pChunks, *pIndex;
+int i, k, l, iClips, iChunks, iFirst, iCount, iFlags;
+
+   iFrameDelay = (1000UL / (long)iRate);
+   iClips = pgm_read_word(&pBundle[4]);
+   iChunks = pgm_read_word(&pBundle[6]);
+   if (iClip >= iClips)
+      return;
+   pClip = (byte *)&pBundle[BUNDLE_HEADER_SIZE + iClip*4];
+   pChunks = (byte *)&pBundle[BUNDLE_HEADER_SIZE + iClips*4];
+   pIndex = &pChunks[(iChunks + 1) * 4];
+   iFirst = pgm_read_word(pClip);
+   iCount = pgm_read_word(pClip + 2);
+   iFlags = pgm_read_word(&pBundle[8]);
+   pTiles = (iFlags & STREAM_TILES) ? &pBundle[pgm_read_word(&pChunks[iChunks*4])] : NULL; // after the chunk data
+   oledPlayStart(iFlags);
+   if ((iFlags & STREAM_PINGPONG) && iCount > 1) // each pass starts at frame 1
+   {
+      k = pgm_read_word(&pIndex[iFirst * 2]);
+      oledPlayFrame((byte *)&pBundle[pgm_read_word(&pChunks[k*4])]);
+      delay(iFrameDelay);
+      iFirst++;
+      iCount--;
+   }
+   else if ((iFlags & STREAM_LOOP_FRAME) && iCount > 1) // so does frame 1 (the loop frame)
+   {
+      k = pgm_read_word(&pIndex[iFirst * 2]);
+      oledPlayFrame((byte *)&pBundle[pgm_read_word(&pChunks[k*4])]);
+      iFirst++;
+      iCount--;
+   }
+   for (l=0; l<iLoop; l++)
+   {
+      for (i=0; i<iCount; i++)
+      {
+         k = pgm_read_word(&pIndex[(iFirst + i) * 2]);
+         oledPlayFrame((byte *)&pBundle[pgm_read_word(&pChunks[k*4])]);
+         delay(iFrameDelay);
+      }
+   }
+} /* oledPlayClip() */
+
 //
 // Fill the frame buffer with a byte pattern
 // e.g. all off (0x00) or all on (0xff)
@@ -501,7 +775,7 @@ int y;
 
   for (y=0; y<8; y++)
   {
-    oledSetPosition(0,y); // set to (0,Y)
+    oledSetOffset(y*128); // 1/8th of the display
     oledRepeatByte(ucData, 128); 
   } // for y
 } /* oledFill() */
@@ -516,4 +790,6 @@ void setup() {
 void loop() {
   // put your main code here, to run repeatedly:
    oledPlayAnim(30, 5); // play 5 loops at 20FPS
+   // with a bundle from tcomp --bundle --c: oledPlayClip(bBundle, 0, 30, 5);
+   // with tcomp --c-code: oledPlayCode(bAnimationPlayFrame, bAnimationFrames, bAnimationFlags, 30, 5);
 }
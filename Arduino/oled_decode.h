@@ -0,0 +1,418 @@
+//
+// OLED animation decoder core
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// The one copy of the opcode decoder. The Arduino sketch, oledplay
+// (play.c) and the PlayBack() check of tcomp all include it, so the code
+// timed on the host is the code which runs on the MCU. It lives in the
+// sketch folder because the Arduino IDE only builds files from there.
+//
+// Each frame covers the 1024 bytes of the display in the scan order of
+// the stream. The upper 2 bits of each command byte select the operation:
+// 00SSSCCC - skip+copy (in that order). The 3 bit lengths of each of the
+//    skip and copy represent 0-7
+// 00000000 - special case (long skip). The next byte is the len (1-256)
+// 01CCCSSS - copy+skip (in that order). Same as above
+// 01000000 - special case (long copy). The next byte is the len (1-256)
+//    Streams can split the 6 bits of these two differently (stream flags
+//    bits 10-11): 0 = 3 bit skip and copy, 1 = 4 bit skip and 2 bit copy
+//    (00SSSSCC, 01CCSSSS), 2 = 2 bit skip and 4 bit copy (00SSCCCC,
+//    01CCCCSS). The special cases stay the same.
+// 10RRRSSS - repeat+skip; the next byte is repeated 1-7 times
+// 11RRRRRR - Repeat the next byte 1-64 times.
+// 10000nnn - extended opcodes (a repeat+skip with a repeat count of 0)
+//    10000000 - never in a frame; it starts the optional stream header
+//    10000001 - window (x, w-1, page<<3 | h-1) followed by copy and repeat
+//       opcodes for the w*h bytes which fill that rectangle of the display
+//       (page by page, or column by column in vertical streams). The
+//       offset doesn't move.
+//    10000010 - pattern; the next byte is PPNNNNNN and P+2 pattern bytes
+//       follow. The 2-4 byte pattern is repeated N+1 times (1-64). P=3 is
+//       reserved. Allowed in frames and in window data.
+//    10000011 - tile; the next byte is the number of an 8 byte tile of
+//       the tile table of the stream, which goes to the offset (frames
+//       only). The table (stream flags bit 6) is the number of tiles - 1
+//       and their bytes, after the stream header (after the chunk data of
+//       a bundle), so it's read from wherever the stream is (AVR flash).
+//    10000100 - display command (frames only, stream flags bit 7); the
+//       next byte is 0xa6/0xa7 (normal/inverse video), 0xae/0xaf (display
+//       off/on) or 0x81 followed by the contrast. Pixels don't change.
+//
+// The includer defines a "sink" which says how a stream byte is read and
+// what to do with the decoded operations, then includes this file:
+// ODEC_SINK                        type of the pSink argument (default void)
+// ODEC_BYTE(p)                     read the stream byte at p (default *p;
+//                                  pgm_read_byte() for AVR flash)
+// ODEC_SKIP(pSink, i)              the offset moved to i (also i=0 at the
+//                                  start of each frame)
+// ODEC_COPY(pSink, i, p, n)        the n stream bytes at p go to offset i
+// ODEC_REPEAT(pSink, i, b, n)      n copies of byte b go to offset i
+// ODEC_PATTERN(pSink, i, p, k, n)  n bytes of the k byte pattern at p (in
+//                                  RAM) go to offset i
+// ODEC_WINDOW(pSink, x, w, y, h)   a window of w columns by h pages starts
+// ODEC_WINDOW_COPY(pSink, k, p, n) the n stream bytes at p go to the
+//                                  window, k bytes from its start
+// ODEC_WINDOW_REPEAT(pSink, k, b, n) n copies of b go to the window
+// ODEC_WINDOW_PATTERN(pSink, k, p, iPeriod, n) n bytes of the pattern go
+//                                  to the window
+// ODEC_WINDOW_END(pSink)           the window is complete
+// Optional:
+// ODEC_FIELDS(pSink)      field split of the stream (0-2, see above;
+//                         default 0)
+// ODEC_TABLE              where the field tables go (PROGMEM for AVR
+//                         flash; read with ODEC_BYTE)
+// ODEC_TILES(pSink)       the tile table of the stream (its count byte;
+//                         read with ODEC_BYTE, default none). Tiles go to
+//                         the sink with ODEC_COPY.
+// ODEC_COMMAND(pSink, c, v) display command c, with the contrast v for
+//                         0x81 (default ignored)
+// ODEC_CHECKED            check every read against pEnd, every write
+//                         against the end of the frame and every window
+//                         against the display. ODecodeFrame() returns NULL
+//                         for bad data instead of running off the end.
+// ODEC_NO_COMPUTED_GOTO   dispatch with a switch even on GCC
+//
+#ifndef __OLED_DECODE_H__
+#define __OLED_DECODE_H__
+
+#ifndef ODEC_SINK
+#define ODEC_SINK void
+#endif
+#ifndef ODEC_BYTE
+#define ODEC_BYTE(p) (*(p))
+#endif
+#ifndef ODEC_FIELDS
+#define ODEC_FIELDS(pSink) 0
+#endif
+#ifndef ODEC_TABLE
+#define ODEC_TABLE
+#endif
+#ifndef ODEC_TILES
+#define ODEC_TILES(pSink) ((const unsigned char *)0)
+#endif
+#ifndef ODEC_COMMAND
+#define ODEC_COMMAND(pSink, c, v)
+#endif
+
+#ifdef ODEC_CHECKED
+#define ODEC_NEED(n) if (pEnd - s < (n)) return 0
+#define ODEC_FITS(n, iMax) if (i + (n) > (iMax)) return 0
+#else
+#define ODEC_NEED(n)
+#define ODEC_FITS(n, iMax)
+#endif
+
+#if defined(__GNUC__) && !defined(ODEC_NO_COMPUTED_GOTO)
+#define ODEC_LABELS
+#endif
+
+//
+// The two length fields of the lower 6 bits of a skip+copy or copy+skip
+// opcode, looked up instead of shifted so that every field split decodes
+// at the same speed: the upper field (3, 4 or 2 bits) in the upper nibble
+// and the lower one in the lower nibble. A skip+copy opcode of split n
+// uses table n; a copy+skip opcode has the widths the other way around,
+// which is table (3 - n) % 3.
+//
+#define ODEC_F(w, b) ((((b) >> (6 - (w))) << 4) | ((b) & ((1 << (6 - (w))) - 1)))
+#define ODEC_F8(w, b) ODEC_F(w, b), ODEC_F(w, b+1), ODEC_F(w, b+2), ODEC_F(w, b+3), \
+   ODEC_F(w, b+4), ODEC_F(w, b+5), ODEC_F(w, b+6), ODEC_F(w, b+7)
+#define ODEC_F64(w) ODEC_F8(w, 0), ODEC_F8(w, 8), ODEC_F8(w, 16), ODEC_F8(w, 24), \
+   ODEC_F8(w, 32), ODEC_F8(w, 40), ODEC_F8(w, 48), ODEC_F8(w, 56)
+static const unsigned char ucODecodeFields[3][64] ODEC_TABLE = {{ODEC_F64(3)}, {ODEC_F64(4)}, {ODEC_F64(2)}};
+#undef ODEC_F64
+#undef ODEC_F8
+#undef ODEC_F
+
+//
+// Fill n bytes with a repeating pattern (for sinks which work in RAM)
+//
+static inline void ODecodeFill(unsigned char *d, const unsigned char *pPattern, int iPeriod, int n)
+{
+int i, j;
+
+   for (i=0, j=0; i<n; i++)
+   {
+      d[i] = pPattern[j];
+      if (++j == iPeriod)
+         j = 0;
+   }
+} /* ODecodeFill() */
+
+//
+// Read the operands of a pattern opcode; s points at the byte after it
+// The pattern is copied to the caller's 4 byte buffer so that the sink
+// never has to read the stream out of order (AVR flash)
+// Returns the number of bytes it expands to (0 for a reserved period)
+//
+static int ODecodePattern(const unsigned char *s, unsigned char *pPattern, int *iPeriod)
+{
+int i;
+unsigned char b;
+
+   b = ODEC_BYTE(s);
+   *iPeriod = (b >> 6) + 2;
+   if (*iPeriod > 4)
+      return 0;
+   for (i=0; i<*iPeriod; i++)
+      pPattern[i] = ODEC_BYTE(s+1+i);
+   return *iPeriod * ((b & 0x3f) + 1);
+} /* ODecodePattern() */
+
+//
+// Decode the data of a window; s points at the byte after the opcode
+// Returns a pointer past the window data (NULL for bad data when checked)
+//
+static const unsigned char *ODecodeWindow(ODEC_SINK *pSink, const unsigned char *s, const unsigned char *pEnd,
+   const unsigned char *pSkipCopy, const unsigned char *pCopySkip)
+{
+int i, j, x, y, w, h, iCount, iPeriod;
+unsigned char b, bCode, ucPattern[4];
+
+   (void)pEnd;
+   ODEC_NEED(3);
+   x = ODEC_BYTE(s);
+   w = ODEC_BYTE(s+1) + 1;
+   b = ODEC_BYTE(s+2);
+   y = b >> 3;
+   h = (b & 7) + 1;
+   s += 3;
+#ifdef ODEC_CHECKED
+   if (x + w > 128 || y + h > 8)
+      return 0;
+#endif
+   ODEC_WINDOW(pSink, x, w, y, h);
+   iCount = w * h;
+   i = 0;
+   while (i < iCount) // only copies and repeats; nothing is skipped
+   {
+      ODEC_NEED(2); // every opcode has at least one more byte
+      bCode = ODEC_BYTE(s++);
+      switch (bCode & 0xc0)
+      {
+         case 0x00: // short copy
+            j = ODEC_BYTE(&pSkipCopy[bCode & 0x3f]) & 0xf;
+            break;
+         case 0x40: // copy
+            if (bCode == 0x40) // long copy
+               j = ODEC_BYTE(s++) + 1;
+            else
+               j = ODEC_BYTE(&pCopySkip[bCode & 0x3f]) >> 4;
+            break;
+         case 0x80: // short repeat
+            if (bCode == 0x82) // pattern
+            {
+               ODEC_NEED(1);
+               ODEC_NEED(3 + (ODEC_BYTE(s) >> 6));
+               j = ODecodePattern(s, ucPattern, &iPeriod);
+#ifdef ODEC_CHECKED
+               if (j == 0)
+                  return 0;
+#endif
+               ODEC_FITS(j, iCount);
+               ODEC_WINDOW_PATTERN(pSink, i, ucPattern, iPeriod, j);
+               s += 1 + iPeriod;
+               i += j;
+               continue;
+            }
+            j = (bCode & 0x38) >> 3;
+            ODEC_FITS(j, iCount);
+            ODEC_WINDOW_REPEAT(pSink, i, ODEC_BYTE(s), j);
+            s++;
+            i += j;
+            continue;
+         default: // repeat
+            j = (bCode & 0x3f) + 1;
+            ODEC_FITS(j, iCount);
+            ODEC_WINDOW_REPEAT(pSink, i, ODEC_BYTE(s), j);
+            s++;
+            i += j;
+            continue;
+      }
+      ODEC_NEED(j);
+      ODEC_FITS(j, iCount);
+      ODEC_WINDOW_COPY(pSink, i, s, j);
+      s += j;
+      i += j;
+   }
+   ODEC_WINDOW_END(pSink);
+   return s;
+} /* ODecodeWindow() */
+
+//
+// Decode one frame
+// Returns a pointer to the start of the next frame (NULL for bad data
+// when checked)
+//
+static const unsigned char *ODecodeFrame(ODEC_SINK *pSink, const unsigned char *s, const unsigned char *pEnd)
+{
+int i, j, iPeriod;
+unsigned char b, bCode, ucPattern[4];
+const unsigned char *pSkipCopy, *pCopySkip;
+#ifdef ODEC_LABELS
+static const void *pOps[4] = {&&op_skipcopy, &&op_copyskip, &&op_repeatskip, &&op_repeat};
+#define ODEC_DISPATCH goto *pOps[bCode >> 6]
+#else
+#define ODEC_DISPATCH switch (bCode >> 6) { case 0: goto op_skipcopy; \
+   case 1: goto op_copyskip; case 2: goto op_repeatskip; default: goto op_repeat; }
+#endif
+// fetch the next opcode and jump straight to its code
+#define ODEC_NEXT if (i >= 1024) return s; ODEC_NEED(1); bCode = ODEC_BYTE(s++); ODEC_DISPATCH
+
+   (void)pEnd;
+   b = ODEC_FIELDS(pSink);
+#ifdef ODEC_CHECKED
+   if (b > 2)
+      return 0;
+#endif
+   pSkipCopy = ucODecodeFields[b];
+   pCopySkip = ucODecodeFields[(3 - b) % 3];
+   i = 0;
+   ODEC_SKIP(pSink, 0);
+   ODEC_NEXT;
+
+op_skipcopy:
+   if (bCode == 0x00) // long skip
+   {
+      ODEC_NEED(1);
+      i += ODEC_BYTE(s++) + 1;
+      ODEC_SKIP(pSink, i);
+      ODEC_NEXT;
+   }
+   b = ODEC_BYTE(&pSkipCopy[bCode & 0x3f]);
+   if (b >> 4)
+   {
+      i += b >> 4;
+      ODEC_SKIP(pSink, i);
+   }
+   j = b & 0xf;
+   if (j)
+   {
+      ODEC_NEED(j);
+      ODEC_FITS(j, 1024);
+      ODEC_COPY(pSink, i, s, j);
+      s += j;
+      i += j;
+   }
+   ODEC_NEXT;
+
+op_copyskip:
+   if (bCode == 0x40) // long copy
+   {
+      ODEC_NEED(1);
+      j = ODEC_BYTE(s++) + 1;
+      ODEC_NEED(j);
+      ODEC_FITS(j, 1024);
+      ODEC_COPY(pSink, i, s, j);
+      s += j;
+      i += j;
+      ODEC_NEXT;
+   }
+   b = ODEC_BYTE(&pCopySkip[bCode & 0x3f]);
+   j = b >> 4;
+   if (j)
+   {
+      ODEC_NEED(j);
+      ODEC_FITS(j, 1024);
+      ODEC_COPY(pSink, i, s, j);
+      s += j;
+      i += j;
+   }
+   if (b & 0xf)
+   {
+      i += b & 0xf;
+      ODEC_SKIP(pSink, i);
+   }
+   ODEC_NEXT;
+
+op_repeatskip:
+   j = (bCode & 0x38) >> 3;
+   if (j == 0) // extended opcode
+   {
+      if (bCode == 0x81) // window
+      {
+         s = ODecodeWindow(pSink, s, pEnd, pSkipCopy, pCopySkip);
+#ifdef ODEC_CHECKED
+         if (s == 0)
+            return 0;
+#endif
+         ODEC_NEXT;
+      }
+      if (bCode == 0x82) // pattern
+      {
+         ODEC_NEED(1);
+         ODEC_NEED(3 + (ODEC_BYTE(s) >> 6));
+         j = ODecodePattern(s, ucPattern, &iPeriod);
+#ifdef ODEC_CHECKED
+         if (j == 0)
+            return 0;
+#endif
+         ODEC_FITS(j, 1024);
+         ODEC_PATTERN(pSink, i, ucPattern, iPeriod, j);
+         s += 1 + iPeriod;
+         i += j;
+         ODEC_NEXT;
+      }
+      if (bCode == 0x83) // tile
+      {
+         ODEC_NEED(1);
+         b = ODEC_BYTE(s++);
+#ifdef ODEC_CHECKED
+         if (ODEC_TILES(pSink) == 0 || b > ODEC_BYTE(ODEC_TILES(pSink)))
+            return 0;
+#endif
+         ODEC_FITS(8, 1024);
+         ODEC_COPY(pSink, i, ODEC_TILES(pSink) + 1 + b * 8, 8);
+         i += 8;
+         ODEC_NEXT;
+      }
+      if (bCode == 0x84) // display command
+      {
+         ODEC_NEED(1);
+         b = ODEC_BYTE(s++);
+         j = 0;
+         if (b == 0x81)
+         {
+            ODEC_NEED(1);
+            j = ODEC_BYTE(s++);
+         }
+#ifdef ODEC_CHECKED
+         else if ((b & 0xfe) != 0xa6 && (b & 0xfe) != 0xae)
+            return 0;
+#endif
+         ODEC_COMMAND(pSink, b, j);
+         ODEC_NEXT;
+      }
+#ifdef ODEC_CHECKED
+      return 0; // not one we know
+#endif
+   }
+   ODEC_NEED(1);
+   b = ODEC_BYTE(s++);
+   if (j)
+   {
+      ODEC_FITS(j, 1024);
+      ODEC_REPEAT(pSink, i, b, j);
+      i += j;
+   }
+   if (bCode & 7)
+   {
+      i += bCode & 7;
+      ODEC_SKIP(pSink, i);
+   }
+   ODEC_NEXT;
+
+op_repeat:
+   j = (bCode & 0x3f) + 1;
+   ODEC_NEED(1);
+   b = ODEC_BYTE(s++);
+   ODEC_FITS(j, 1024);
+   ODEC_REPEAT(pSink, i, b, j);
+   i += j;
+   ODEC_NEXT;
+#undef ODEC_NEXT
+#undef ODEC_DISPATCH
+} /* ODecodeFrame() */
+
+#endif // __OLED_DECODE_H__
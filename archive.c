@@ -0,0 +1,445 @@
+//
+// Entropy coded archive of the animation stream
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Splits the opcode stream into opcodes, long-form counts and literals
+// and codes each with its own canonical Huffman table. Decoding uses a
+// single table lookup per symbol (ARC_MAX_BITS wide).
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "archive.h"
+
+#define OP_MASK 0xc0
+#define OP_SKIPCOPY 0x00
+#define OP_COPYSKIP 0x40
+#define OP_REPEATSKIP 0x80
+#define OP_REPEAT 0xc0
+#define OP_WINDOW 0x81 // x, w-1, (page<<3)|(h-1), then w*h bytes
+#define OP_PATTERN 0x82 // (period-2)<<6 | (count-1), then the pattern bytes
+#define OP_COMMAND 0x84 // display command, then the contrast for 0x81
+#define STREAM_FIELDS_MASK 0x0c00 // skip/copy field split of the short opcodes
+#define STREAM_FIELDS_SHIFT 10
+
+#define STREAM_OPS 0
+#define STREAM_COUNTS 1
+#define STREAM_LITERALS 2
+#define STREAM_TOTAL 3
+#define STREAM_HEADER_SIZE (8 + 128)
+
+typedef struct tag_bitwriter
+{
+   unsigned char *pOut;
+   int iLen;
+   uint32_t ulAcc;
+   int iBits;
+} BITWRITER;
+
+typedef struct tag_bitreader
+{
+   unsigned char *pIn, *pEnd;
+   uint64_t ullAcc;
+   int iBits;
+} BITREADER;
+
+static void WriteLong(unsigned char *d, uint32_t ul)
+{
+   d[0] = (unsigned char)ul;
+   d[1] = (unsigned char)(ul >> 8);
+   d[2] = (unsigned char)(ul >> 16);
+   d[3] = (unsigned char)(ul >> 24);
+} /* WriteLong() */
+
+static uint32_t ReadLong(unsigned char *s)
+{
+   return s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24);
+} /* ReadLong() */
+//
+// Returns the number of count bytes which follow an opcode
+//
+static int OpCounts(unsigned char c)
+{
+   if (c == OP_WINDOW) // x, width, page + height
+      return 3;
+   if (c == OP_PATTERN) // period + count
+      return 1;
+   if (c == OP_COMMAND) // the command
+      return 1;
+   return (c == OP_SKIPCOPY || c == OP_COPYSKIP);
+} /* OpCounts() */
+//
+// Returns the number of skip bits of the short skip/copy opcodes of the
+// stream (or bundle) whose first iLen bytes are at pData. Both sides
+// ask with the bytes they have so far, so the header flags only apply
+// past the header, the same way for both.
+//
+static int OpSkipBits(unsigned char *pData, int iLen)
+{
+static const int iSkipBits[4] = {3, 4, 2, 3};
+int iFlags = 0;
+
+   if (iLen >= 10 && memcmp(pData, "OAB1", 4) == 0)
+      iFlags = pData[8] | (pData[9] << 8);
+   else if (iLen >= 4 && pData[0] == 0x80 && pData[1] == 'A')
+      iFlags = pData[2] | (pData[3] << 8);
+   return iSkipBits[(iFlags & STREAM_FIELDS_MASK) >> STREAM_FIELDS_SHIFT];
+} /* OpSkipBits() */
+//
+// Returns the number of literal bytes which follow an opcode
+// (and its count bytes if it has any)
+//
+static int OpLiterals(unsigned char c, unsigned char *pCount, int iSkipBits)
+{
+   if (c == OP_WINDOW)
+      return (pCount[1] + 1) * ((pCount[2] & 7) + 1);
+   if (c == OP_PATTERN)
+      return (pCount[0] >> 6) + 2;
+   if (c == OP_COMMAND)
+      return (pCount[0] == 0x81);
+   switch (c & OP_MASK)
+   {
+      case OP_SKIPCOPY:
+         return (c == OP_SKIPCOPY) ? 0 : (c & ((1 << (6 - iSkipBits)) - 1));
+      case OP_COPYSKIP:
+         return (c == OP_COPYSKIP) ? pCount[0] + 1 : ((c & 0x3f) >> iSkipBits);
+      default: // both repeat types have a single byte value
+         return 1;
+   }
+} /* OpLiterals() */
+//
+// Calculate Huffman code lengths from the symbol frequencies
+// If the tree is too deep, the frequencies are flattened until it fits
+//
+static void MakeLengths(uint32_t *pFreq, unsigned char *pLen)
+{
+uint32_t ulWeight[512];
+int iParent[512];
+unsigned char bActive[512];
+int i, j, iNodes, iSymbols, iMax;
+int iLow1, iLow2;
+
+   memset(pLen, 0, 256);
+   iSymbols = 0;
+   for (i=0; i<256; i++)
+   {
+      ulWeight[i] = pFreq[i];
+      if (pFreq[i])
+         iSymbols++;
+   }
+   if (iSymbols == 0)
+      return;
+   if (iSymbols == 1) // a single symbol still needs a 1 bit code
+   {
+      for (i=0; i<256; i++)
+         if (pFreq[i])
+            pLen[i] = 1;
+      return;
+   }
+   while (1)
+   {
+      for (i=0; i<256; i++)
+      {
+         bActive[i] = (ulWeight[i] != 0);
+         iParent[i] = -1;
+      }
+      iNodes = 256;
+      for (j=1; j<iSymbols; j++) // each pass merges the 2 lightest nodes
+      {
+         iLow1 = iLow2 = -1;
+         for (i=0; i<iNodes; i++)
+         {
+            if (!bActive[i])
+               continue;
+            if (iLow1 < 0 || ulWeight[i] < ulWeight[iLow1])
+            {
+               iLow2 = iLow1;
+               iLow1 = i;
+            }
+            else if (iLow2 < 0 || ulWeight[i] < ulWeight[iLow2])
+               iLow2 = i;
+         }
+         ulWeight[iNodes] = ulWeight[iLow1] + ulWeight[iLow2];
+         bActive[iNodes] = 1;
+         iParent[iNodes] = -1;
+         bActive[iLow1] = bActive[iLow2] = 0;
+         iParent[iLow1] = iParent[iLow2] = iNodes;
+         iNodes++;
+      }
+      iMax = 0;
+      for (i=0; i<256; i++)
+      {
+         if (pFreq[i] == 0)
+            continue;
+         pLen[i] = 0;
+         for (j=iParent[i]; j >= 0; j=iParent[j])
+            pLen[i]++;
+         if (pLen[i] > iMax)
+            iMax = pLen[i];
+      }
+      if (iMax <= ARC_MAX_BITS)
+         return;
+      for (i=0; i<256; i++) // flatten the distribution and try again
+      {
+         if (ulWeight[i])
+            ulWeight[i] = (ulWeight[i] + 1) >> 1;
+      }
+   }
+} /* MakeLengths() */
+//
+// Assign canonical codes in order of length, then symbol value
+//
+static void MakeCodes(unsigned char *pLen, uint32_t *pCode)
+{
+int i, iLen;
+uint32_t ulCode = 0;
+
+   for (iLen=1; iLen<=ARC_MAX_BITS; iLen++)
+   {
+      for (i=0; i<256; i++)
+      {
+         if (pLen[i] == iLen)
+            pCode[i] = ulCode++;
+      }
+      ulCode <<= 1;
+   }
+} /* MakeCodes() */
+
+static void PutBits(BITWRITER *pBW, uint32_t ulCode, int iLen)
+{
+   pBW->ulAcc = (pBW->ulAcc << iLen) | ulCode;
+   pBW->iBits += iLen;
+   while (pBW->iBits >= 8)
+   {
+      pBW->iBits -= 8;
+      pBW->pOut[pBW->iLen++] = (unsigned char)(pBW->ulAcc >> pBW->iBits);
+   }
+} /* PutBits() */
+//
+// Huffman code one stream, returns the number of bytes written
+//
+static int CompressStream(unsigned char *pSrc, int iLen, unsigned char *pDest)
+{
+uint32_t ulFreq[256], ulCode[256];
+unsigned char ucLen[256];
+BITWRITER bw;
+int i;
+
+   memset(ulFreq, 0, sizeof(ulFreq));
+   for (i=0; i<iLen; i++)
+      ulFreq[pSrc[i]]++;
+   MakeLengths(ulFreq, ucLen);
+   MakeCodes(ucLen, ulCode);
+   for (i=0; i<128; i++)
+      pDest[8+i] = (unsigned char)((ucLen[i*2] << 4) | ucLen[i*2+1]);
+   bw.pOut = &pDest[STREAM_HEADER_SIZE];
+   bw.iLen = 0;
+   bw.ulAcc = 0;
+   bw.iBits = 0;
+   for (i=0; i<iLen; i++)
+      PutBits(&bw, ulCode[pSrc[i]], ucLen[pSrc[i]]);
+   if (bw.iBits) // flush the partial byte
+      PutBits(&bw, 0, 8 - bw.iBits);
+   WriteLong(pDest, (uint32_t)iLen);
+   WriteLong(&pDest[4], (uint32_t)bw.iLen);
+   return STREAM_HEADER_SIZE + bw.iLen;
+} /* CompressStream() */
+//
+// Decode one stream into its symbols, returns the number of
+// bytes of input consumed or -1 if it's corrupt
+//
+static int DecompressStream(unsigned char *pSrc, int iSrcLen, unsigned char *pDest, int iCount)
+{
+uint16_t usTable[1<<ARC_MAX_BITS];
+unsigned char ucLen[256];
+uint32_t ulCode[256];
+BITREADER br;
+int i, j, iEnd, iCodedLen, iFill;
+uint16_t us;
+
+   if (iSrcLen < STREAM_HEADER_SIZE)
+      return -1;
+   iCodedLen = (int)ReadLong(&pSrc[4]);
+   if (iCodedLen < 0 || iCodedLen > iSrcLen - STREAM_HEADER_SIZE)
+      return -1;
+   for (i=0; i<128; i++)
+   {
+      ucLen[i*2] = pSrc[8+i] >> 4;
+      ucLen[i*2+1] = pSrc[8+i] & 0xf;
+   }
+   MakeCodes(ucLen, ulCode);
+   memset(usTable, 0, sizeof(usTable));
+   iFill = 0;
+   for (i=0; i<256; i++)
+   {
+      if (ucLen[i] == 0)
+         continue;
+      if (ucLen[i] > ARC_MAX_BITS)
+         return -1;
+      j = ulCode[i] << (ARC_MAX_BITS - ucLen[i]);
+      iEnd = j + (1 << (ARC_MAX_BITS - ucLen[i]));
+      iFill += iEnd - j;
+      if (iFill > (1<<ARC_MAX_BITS) || iEnd > (1<<ARC_MAX_BITS)) // not a valid prefix code
+         return -1;
+      us = (uint16_t)(i | (ucLen[i] << 8));
+      while (j < iEnd)
+         usTable[j++] = us;
+   }
+   br.pIn = &pSrc[STREAM_HEADER_SIZE];
+   br.pEnd = &br.pIn[iCodedLen];
+   br.ullAcc = 0;
+   br.iBits = 0;
+   for (i=0; i<iCount; i++)
+   {
+      while (br.iBits <= 56) // keep the accumulator topped up
+      {
+         br.ullAcc <<= 8;
+         if (br.pIn < br.pEnd)
+            br.ullAcc |= *br.pIn++;
+         br.iBits += 8;
+      }
+      us = usTable[(br.ullAcc >> (br.iBits - ARC_MAX_BITS)) & ((1<<ARC_MAX_BITS)-1)];
+      if (us == 0) // unused code
+         return -1;
+      pDest[i] = (unsigned char)us;
+      br.iBits -= (us >> 8);
+   }
+   return STREAM_HEADER_SIZE + iCodedLen;
+} /* DecompressStream() */
+
+int ArcIsArchive(unsigned char *pData, int iLen)
+{
+   return (iLen >= ARC_HEADER_SIZE && memcmp(pData, "OAZ1", 4) == 0);
+} /* ArcIsArchive() */
+
+int ArcGetRawSize(unsigned char *pData, int iLen)
+{
+   if (!ArcIsArchive(pData, iLen))
+      return -1;
+   return (int)ReadLong(&pData[4]);
+} /* ArcGetRawSize() */
+
+int ArcMaxSize(int iSrcLen)
+{
+   return ARC_HEADER_SIZE + STREAM_TOTAL * STREAM_HEADER_SIZE + ((iSrcLen * ARC_MAX_BITS) / 8) + STREAM_TOTAL;
+} /* ArcMaxSize() */
+//
+// Split the stream into its 3 parts and code each one
+//
+int ArcCompress(unsigned char *pSrc, int iSrcLen, unsigned char *pDest)
+{
+unsigned char *pStream[STREAM_TOTAL];
+int iCount[STREAM_TOTAL];
+int i, j, k, iOut;
+unsigned char c, ucCount[3];
+
+   for (i=0; i<STREAM_TOTAL; i++)
+   {
+      pStream[i] = malloc(iSrcLen + 1);
+      iCount[i] = 0;
+   }
+   i = 0;
+   while (i < iSrcLen)
+   {
+      c = pSrc[i++];
+      pStream[STREAM_OPS][iCount[STREAM_OPS]++] = c;
+      memset(ucCount, 0, sizeof(ucCount));
+      for (k=0; k<OpCounts(c) && i < iSrcLen; k++)
+      {
+         ucCount[k] = pSrc[i++];
+         pStream[STREAM_COUNTS][iCount[STREAM_COUNTS]++] = ucCount[k];
+      }
+      j = OpLiterals(c, ucCount, OpSkipBits(pSrc, i));
+      if (j > iSrcLen - i) // truncated stream; keep what's there
+         j = iSrcLen - i;
+      memcpy(&pStream[STREAM_LITERALS][iCount[STREAM_LITERALS]], &pSrc[i], j);
+      iCount[STREAM_LITERALS] += j;
+      i += j;
+   }
+   memcpy(pDest, "OAZ1", 4);
+   WriteLong(&pDest[4], (uint32_t)iSrcLen);
+   iOut = ARC_HEADER_SIZE;
+   for (i=0; i<STREAM_TOTAL; i++)
+   {
+      iOut += CompressStream(pStream[i], iCount[i], &pDest[iOut]);
+      free(pStream[i]);
+   }
+   return iOut;
+} /* ArcCompress() */
+//
+// Decode the 3 streams and interleave them back into the original
+//
+int ArcDecompress(unsigned char *pSrc, int iSrcLen, unsigned char *pDest, int iDestLen)
+{
+unsigned char *pStream[STREAM_TOTAL];
+int iCount[STREAM_TOTAL], iPos[STREAM_TOTAL];
+int i, j, k, iOff, iRawLen, rc = -1;
+unsigned char c, ucCount[3];
+
+   iRawLen = ArcGetRawSize(pSrc, iSrcLen);
+   if (iRawLen < 0 || iRawLen > iDestLen)
+      return -1;
+   iOff = ARC_HEADER_SIZE;
+   for (i=0; i<STREAM_TOTAL; i++)
+   {
+      pStream[i] = NULL;
+      iPos[i] = 0;
+   }
+   for (i=0; i<STREAM_TOTAL; i++)
+   {
+      if (iOff + STREAM_HEADER_SIZE > iSrcLen)
+         goto arc_exit;
+      iCount[i] = (int)ReadLong(&pSrc[iOff]);
+      if (iCount[i] < 0 || iCount[i] > iRawLen)
+         goto arc_exit;
+      pStream[i] = malloc(iCount[i] + 1);
+      j = DecompressStream(&pSrc[iOff], iSrcLen - iOff, pStream[i], iCount[i]);
+      if (j < 0)
+         goto arc_exit;
+      iOff += j;
+   }
+   i = 0;
+   while (iPos[STREAM_OPS] < iCount[STREAM_OPS])
+   {
+      c = pStream[STREAM_OPS][iPos[STREAM_OPS]++];
+      if (i >= iRawLen)
+         goto arc_exit;
+      pDest[i++] = c;
+      memset(ucCount, 0, sizeof(ucCount));
+      for (k=0; k<OpCounts(c) && iPos[STREAM_COUNTS] < iCount[STREAM_COUNTS]; k++)
+      {
+         if (i >= iRawLen)
+            goto arc_exit;
+         ucCount[k] = pStream[STREAM_COUNTS][iPos[STREAM_COUNTS]++];
+         pDest[i++] = ucCount[k];
+      }
+      j = OpLiterals(c, ucCount, OpSkipBits(pDest, i));
+      if (j > iCount[STREAM_LITERALS] - iPos[STREAM_LITERALS])
+         j = iCount[STREAM_LITERALS] - iPos[STREAM_LITERALS];
+      if (j > iRawLen - i)
+         goto arc_exit;
+      memcpy(&pDest[i], &pStream[STREAM_LITERALS][iPos[STREAM_LITERALS]], j);
+      iPos[STREAM_LITERALS] += j;
+      i += j;
+   }
+   if (i == iRawLen)
+      rc = iRawLen;
+arc_exit:
+   for (i=0; i<STREAM_TOTAL; i++)
+      free(pStream[i]);
+   return rc;
+} /* ArcDecompress() */
@@ -0,0 +1,40 @@
+//
+// Entropy coded archive of the animation stream
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// The byte oriented opcode format is meant to be played directly from
+// flash on an MCU. For storage and distribution to Linux players, the
+// stream can be wrapped in an archive which splits it into 3 separate
+// streams (opcodes, long-form counts and literal bytes) and Huffman codes
+// each one. The player expands the archive back into the original stream
+// before playback.
+//
+// Archive layout (all integers are little endian):
+// "OAZ1"            - 4 byte signature
+// raw length        - 4 bytes, size of the expanded stream
+// 3 x {             - opcode, count and literal streams
+//    symbol count   - 4 bytes
+//    coded length   - 4 bytes
+//    code lengths   - 128 bytes, 4 bits per symbol (0 = unused)
+//    coded data     - MSB first canonical Huffman codes
+// }
+//
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#define ARC_HEADER_SIZE 8
+#define ARC_MAX_BITS 12 // longest Huffman code allowed (size of decode table)
+
+// Returns true if the data starts with the archive signature
+int ArcIsArchive(unsigned char *pData, int iLen);
+// Returns the expanded size of an archive or -1 if it's not valid
+int ArcGetRawSize(unsigned char *pData, int iLen);
+// Compress a raw stream into an archive, returns the archive size
+int ArcCompress(unsigned char *pSrc, int iSrcLen, unsigned char *pDest);
+// Returns the worst case archive size for a given stream length
+int ArcMaxSize(int iSrcLen);
+// Expand an archive, returns the raw size or -1 for corrupt data
+int ArcDecompress(unsigned char *pSrc, int iSrcLen, unsigned char *pDest, int iDestLen);
+
+#endif // __ARCHIVE_H__
@@ -0,0 +1,534 @@
+//
+// AVR cost simulator for the Arduino player
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Builds the sketch (Arduino/oled_animate.ino) on the host with the AVR
+// parts mocked: PORTB/DDRB are objects which count the port instructions
+// and watch SDA/SCL to decode the bit-banged I2C traffic, DELAY_CYCLES()
+// adds up the delays, pgm_read_byte()/pgm_read_word() count flash reads
+// and delay() marks the end of each frame. Any .bin stream or bundle
+// clip is played through the sketch's own oledPlayFrame()/oledPlayClip(),
+// so changes to i2cByteOut(), oledWriteFlashBlock() and friends show up
+// in the numbers without flashing a board.
+//
+// The sketch is included twice, with and without BAD_DISPLAY, each copy
+// in its own namespace.
+//
+// Cycles are a model, not an instruction level simulation: the port
+// instructions and delays are counted exactly, the code around them is
+// estimated with the AVR_*_CYCLES constants below (avr-gcc -Os output
+// for the ATtiny85). Good enough to compare streams and encoder options;
+// check a new board with a scope or a logic analyzer.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define AVR_IO_CYCLES 1 // IN or OUT
+#define AVR_SBI_CYCLES 2 // SBI or CBI (|= or &= of a single bit)
+#define AVR_RMW_CYCLES 3 // IN, ORI/ANDI, OUT (several bits at once)
+#define AVR_BIT_CYCLES 5 // bit loop of i2cByteOut(): ANDI, SBRC, ORI, LSL, DEC/BRNE
+#define AVR_BYTE_CYCLES 10 // the caller's loop and i2cByteOut() setup per byte
+#define AVR_READ_CYCLES 4 // LPM Z+ and the decoder's pointer bookkeeping
+#define AVR_TRANSACTION_CYCLES 40 // calls, returns and offset math around each
+                                  // i2cBegin() ... i2cEnd()
+#define MAX_FRAMES 65536
+#define MAX_CLOCKS 8
+
+typedef unsigned char byte;
+
+// What one frame cost
+typedef struct tag_avr_count
+{
+   long lBytes; // I2C bytes (address and control bytes too)
+   long lTransactions; // START ... STOP
+   long lToggles; // level changes of SDA and SCL
+   long lPortOps; // port instructions
+   long lPortCycles;
+   long lDelayCycles;
+   long lReads; // flash reads
+} AVRCOUNT;
+
+static AVRCOUNT count; // the frame being played
+static AVRCOUNT *pFrames;
+static int iFrames;
+static int bCounting;
+//
+// A port register. PORTB also follows SDA and SCL to decode the I2C
+// bytes (sampled on the rising edge of SCL, the 9th bit is the ack).
+//
+class AVRPort
+{
+public:
+   AVRPort(int bPins) : bValue(0), bI2C(bPins), iBits(0) {}
+   operator byte()
+   {
+      count.lPortOps++;
+      count.lPortCycles += AVR_IO_CYCLES;
+      return bValue;
+   }
+   AVRPort &operator=(int i)
+   {
+      Write((byte)i, AVR_IO_CYCLES);
+      return *this;
+   }
+   AVRPort &operator|=(int i)
+   {
+      Write(bValue | i, ((i & (i-1)) == 0) ? AVR_SBI_CYCLES : AVR_RMW_CYCLES);
+      return *this;
+   }
+   AVRPort &operator&=(int i)
+   {
+      byte bCleared = ~i;
+      Write(bValue & i, ((bCleared & (bCleared-1)) == 0) ? AVR_SBI_CYCLES : AVR_RMW_CYCLES);
+      return *this;
+   }
+private:
+   void Write(byte b, int iCycles);
+   byte bValue;
+   int bI2C;
+   int iBits; // bits of the current byte so far
+};
+
+// SDA and SCL of the sketch (BB_SDA, BB_SCL)
+#define SIM_SDA 0
+#define SIM_SCL 2
+
+void AVRPort::Write(byte b, int iCycles)
+{
+int bSDA, bSCL, bOldSDA, bOldSCL;
+
+   count.lPortOps++;
+   count.lPortCycles += iCycles;
+   bOldSDA = (bValue >> SIM_SDA) & 1;
+   bOldSCL = (bValue >> SIM_SCL) & 1;
+   bValue = b;
+   if (!bI2C)
+      return;
+   bSDA = (b >> SIM_SDA) & 1;
+   bSCL = (b >> SIM_SCL) & 1;
+   count.lToggles += (bSDA != bOldSDA) + (bSCL != bOldSCL);
+   if (bSCL && bOldSCL && bSDA != bOldSDA) // START or STOP
+   {
+      if (!bSDA)
+         count.lTransactions++;
+      iBits = 0;
+   }
+   else if (bSCL && !bOldSCL) // clock a bit in
+   {
+      if (++iBits == 9)
+      {
+         count.lBytes++;
+         iBits = 0;
+      }
+   }
+} /* Write() */
+
+static AVRPort PORTB(1), DDRB(0);
+
+#define PROGMEM
+#define DELAY_CYCLES(n) (count.lDelayCycles += (n))
+
+static byte pgm_read_byte(const void *p)
+{
+   count.lReads++;
+   return *(const byte *)p;
+} /* pgm_read_byte() */
+
+static unsigned int pgm_read_word(const void *p)
+{
+   count.lReads += 2;
+   return ((const byte *)p)[0] | (((const byte *)p)[1] << 8);
+} /* pgm_read_word() */
+
+// The sketch waits between frames; the frame is complete
+static void delay(unsigned long ms)
+{
+   (void)ms;
+   if (bCounting && iFrames < MAX_FRAMES)
+      pFrames[iFrames++] = count;
+   memset(&count, 0, sizeof(count));
+} /* delay() */
+
+namespace bad {
+#include "Arduino/oled_animate.ino"
+}
+#undef BAD_DISPLAY
+#undef __OLED_DECODE_H__
+#define GOOD_DISPLAY
+namespace good {
+#include "Arduino/oled_animate.ino"
+}
+
+// A third copy of the decoder checks the frames before the sketch,
+// which trusts its flash, plays them
+#undef __OLED_DECODE_H__
+#undef ODEC_BYTE
+#undef ODEC_NEED
+#undef ODEC_FITS
+#undef ODEC_SKIP
+#undef ODEC_COPY
+#undef ODEC_REPEAT
+#undef ODEC_PATTERN
+#undef ODEC_WINDOW
+#undef ODEC_WINDOW_COPY
+#undef ODEC_WINDOW_REPEAT
+#undef ODEC_WINDOW_PATTERN
+#undef ODEC_WINDOW_END
+#undef ODEC_FIELDS
+#undef ODEC_TABLE
+#undef ODEC_TILES
+#undef ODEC_COMMAND
+static int iCheckFields; // field split of the stream being checked
+static const unsigned char *pCheckTiles; // and its tile table
+#define ODEC_CHECKED
+#define ODEC_FIELDS(pSink) iCheckFields
+#define ODEC_TILES(pSink) pCheckTiles
+#define ODEC_SKIP(pSink, i)
+#define ODEC_COPY(pSink, i, p, n)
+#define ODEC_REPEAT(pSink, i, b, n) (void)(b)
+#define ODEC_PATTERN(pSink, i, p, k, n)
+#define ODEC_WINDOW(pSink, x, w, y, h)
+#define ODEC_WINDOW_COPY(pSink, k, p, n)
+#define ODEC_WINDOW_REPEAT(pSink, k, b, n) (void)(b)
+#define ODEC_WINDOW_PATTERN(pSink, k, p, iPeriod, n)
+#define ODEC_WINDOW_END(pSink)
+namespace check {
+#include "Arduino/oled_decode.h"
+}
+
+static char szIn[256];
+static int iClip = 0;
+static int bGoodDisplay = 0;
+static int bShowFrames = 0;
+static int iClocks = 4;
+static double dMHz[MAX_CLOCKS] = {1.0, 8.0, 16.0, 20.0};
+
+// Model the code around the port instructions
+static long FrameCycles(AVRCOUNT *pCount)
+{
+   return pCount->lPortCycles + pCount->lDelayCycles +
+      pCount->lBytes * (8 * AVR_BIT_CYCLES + AVR_BYTE_CYCLES) +
+      pCount->lReads * AVR_READ_CYCLES +
+      pCount->lTransactions * AVR_TRANSACTION_CYCLES;
+} /* FrameCycles() */
+
+// Read the whole file; returns its size or -1
+static int LoadFile(char *szName, unsigned char **ppData)
+{
+FILE *pf;
+unsigned char *pData;
+int iSize;
+
+   pf = fopen(szName, "rb");
+   if (pf == NULL)
+      return -1;
+   fseek(pf, 0L, SEEK_END);
+   iSize = (int)ftell(pf);
+   fseek(pf, 0L, SEEK_SET);
+   pData = (unsigned char *)malloc(iSize > 0 ? iSize : 1);
+   if (iSize <= 0 || fread(pData, iSize, 1, pf) != 1)
+   {
+      free(pData);
+      fclose(pf);
+      return -1;
+   }
+   fclose(pf);
+   *ppData = pData;
+   return iSize;
+} /* LoadFile() */
+
+//
+// Play a stream the way oledPlayAnim() does
+// Returns 0 for success, -1 for a corrupt stream
+//
+static int SimAnimation(unsigned char *pData, int iSize)
+{
+const unsigned char *s, *pEnd;
+int iFlags = 0;
+
+   if (iSize >= 4 && pData[0] == 0x80 && pData[1] == 'A')
+   {
+      iFlags = pData[2] | (pData[3] << 8);
+      pData += 4;
+      iSize -= 4;
+   }
+   pCheckTiles = NULL;
+   if (iFlags & 0x40) // the frames follow the tile table
+   {
+      if (iSize < 1 || 1 + (pData[0] + 1) * 8 > iSize)
+         return -1;
+      pCheckTiles = pData;
+      iSize -= 1 + (pData[0] + 1) * 8;
+      pData += 1 + (pData[0] + 1) * 8;
+   }
+   iCheckFields = (iFlags >> 10) & 3;
+   pEnd = &pData[iSize];
+   for (s = pData; s < pEnd; ) // check it first
+   {
+      s = check::ODecodeFrame(NULL, s, pEnd);
+      if (s == NULL)
+         return -1;
+   }
+   bCounting = 1;
+   s = pData;
+   good::pTiles = bad::pTiles = pCheckTiles; // (oledPlayAnim() finds it the same way)
+   if (bGoodDisplay)
+   {
+      good::oledPlayStart(iFlags);
+      while (s < pEnd)
+      {
+         s = good::oledPlayFrame((byte *)s);
+         delay(0);
+      }
+   }
+   else
+   {
+      bad::oledPlayStart(iFlags);
+      while (s < pEnd)
+      {
+         s = bad::oledPlayFrame((byte *)s);
+         delay(0);
+      }
+   }
+   return 0;
+} /* SimAnimation() */
+
+//
+// Play one clip of a bundle with oledPlayClip()
+// Returns 0 for success, -1 for a bad bundle or clip number, -2 if the
+// frames are past the 64K which AVR flash pointers reach
+//
+static int SimBundle(unsigned char *pData, int iSize)
+{
+int i, k, iClips, iChunks, iFirst, iCount, iOff;
+unsigned char *pChunks, *pIndex;
+
+   iClips = pData[4] | (pData[5] << 8);
+   iChunks = pData[6] | (pData[7] << 8);
+   iCheckFields = (pData[9] >> 2) & 3;
+   pChunks = &pData[10 + iClips * 4];
+   pIndex = &pChunks[(iChunks + 1) * 4];
+   if (iClip < 0 || iClip >= iClips || pIndex > &pData[iSize])
+      return -1;
+   iFirst = pData[10 + iClip*4] | (pData[10 + iClip*4 + 1] << 8);
+   iCount = pData[10 + iClip*4 + 2] | (pData[10 + iClip*4 + 3] << 8);
+   if (&pIndex[(iFirst + iCount) * 2] > &pData[iSize])
+      return -1;
+   pCheckTiles = NULL;
+   if (pData[8] & 0x40) // the tile table is after the chunk data
+   {
+      iOff = pChunks[iChunks*4] | (pChunks[iChunks*4+1] << 8) | (pChunks[iChunks*4+2] << 16) | (pChunks[iChunks*4+3] << 24);
+      if (iOff > 0xffff)
+         return -2;
+      if (iOff >= iSize || iOff + 1 + (pData[iOff] + 1) * 8 > iSize)
+         return -1;
+      pCheckTiles = &pData[iOff];
+   }
+   for (i=0; i<iCount; i++) // check every frame first
+   {
+      k = pIndex[(iFirst + i) * 2] | (pIndex[(iFirst + i) * 2 + 1] << 8);
+      if (k >= iChunks)
+         return -1;
+      iOff = pChunks[k*4] | (pChunks[k*4+1] << 8) | (pChunks[k*4+2] << 16) | (pChunks[k*4+3] << 24);
+      if (iOff > 0xffff)
+         return -2;
+      if (iOff >= iSize || check::ODecodeFrame(NULL, &pData[iOff], &pData[iSize]) == NULL)
+         return -1;
+   }
+   bCounting = 1;
+   if (bGoodDisplay)
+      good::oledPlayClip(pData, iClip, 30, 1);
+   else
+      bad::oledPlayClip(pData, iClip, 30, 1);
+   return 0;
+} /* SimBundle() */
+
+static void ShowCount(const char *szLabel, AVRCOUNT *pCount, double dDiv)
+{
+   printf("%-14s %9.1f %7.1f %9.1f %9.1f %8.1f %11.1f\n", szLabel,
+      pCount->lBytes / dDiv, pCount->lTransactions / dDiv,
+      pCount->lToggles / dDiv, pCount->lPortOps / dDiv,
+      pCount->lReads / dDiv, FrameCycles(pCount) / dDiv);
+} /* ShowCount() */
+
+static void ShowReport(void)
+{
+AVRCOUNT total;
+int i, iWorst = 0;
+long lCycles, lBits, lBusCycles;
+char szLabel[32];
+
+   memset(&total, 0, sizeof(total));
+   for (i=0; i<iFrames; i++)
+   {
+      total.lBytes += pFrames[i].lBytes;
+      total.lTransactions += pFrames[i].lTransactions;
+      total.lToggles += pFrames[i].lToggles;
+      total.lPortOps += pFrames[i].lPortOps;
+      total.lPortCycles += pFrames[i].lPortCycles;
+      total.lDelayCycles += pFrames[i].lDelayCycles;
+      total.lReads += pFrames[i].lReads;
+      if (FrameCycles(&pFrames[i]) > FrameCycles(&pFrames[iWorst]))
+         iWorst = i;
+   }
+   printf("%-14s %9s %7s %9s %9s %8s %11s\n", "frame", "bytes", "xfers", "toggles", "port ops", "reads", "cycles");
+   if (bShowFrames)
+   {
+      for (i=0; i<iFrames; i++)
+      {
+         sprintf(szLabel, "%d", i);
+         ShowCount(szLabel, &pFrames[i], 1.0);
+      }
+   }
+   ShowCount("average", &total, (double)iFrames);
+   sprintf(szLabel, "worst (%d)", iWorst);
+   ShowCount(szLabel, &pFrames[iWorst], 1.0);
+   ShowCount("total", &total, 1.0);
+   lCycles = FrameCycles(&total);
+   // everything spent sending the bits, for the speed of the bus
+   lBits = total.lBytes * 9;
+   lBusCycles = total.lPortCycles + total.lDelayCycles + total.lBytes * (8 * AVR_BIT_CYCLES + AVR_BYTE_CYCLES);
+   printf("\n%8s %10s %10s %9s\n", "MHz", "avg FPS", "worst FPS", "bus kHz");
+   for (i=0; i<iClocks; i++)
+   {
+      printf("%8.1f %10.1f %10.1f %9.0f\n", dMHz[i],
+         dMHz[i] * 1e6 * iFrames / (double)lCycles,
+         dMHz[i] * 1e6 / (double)FrameCycles(&pFrames[iWorst]),
+         lBits ? dMHz[i] * 1e3 * lBits / (double)lBusCycles : 0.0);
+   }
+} /* ShowReport() */
+
+// Parse a comma separated list of clock speeds in MHz
+static void ParseClocks(char *szList)
+{
+char *s;
+
+   iClocks = 0;
+   for (s = strtok(szList, ","); s != NULL && iClocks < MAX_CLOCKS; s = strtok(NULL, ","))
+   {
+      dMHz[iClocks] = atof(s);
+      if (dMHz[iClocks] > 0.0)
+         iClocks++;
+   }
+} /* ParseClocks() */
+
+static void parse_opts(int argc, char *argv[])
+{
+int i = 1;
+
+    while (i < argc)
+    {
+        /* if it isn't a cmdline option, we're done */
+        if (0 != strncmp("--", argv[i], 2))
+            break;
+        if (0 == strcmp("--", argv[i]))
+        {
+            i += 1;
+            break;
+        }
+        /* test for each specific flag */
+        if (0 == strcmp("--in", argv[i]) && i+1 < argc) {
+            strncpy(szIn, argv[i+1], sizeof(szIn)-1);
+            i += 2;
+        } else if (0 == strcmp("--clip", argv[i]) && i+1 < argc) {
+            iClip = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--mhz", argv[i]) && i+1 < argc) {
+            ParseClocks(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--good", argv[i])) {
+            bGoodDisplay = 1;
+            i++;
+        } else if (0 == strcmp("--frames", argv[i])) {
+            bShowFrames = 1;
+            i++;
+        } else {
+            fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+} /* parse_opts() */
+
+int main(int argc, char *argv[])
+{
+unsigned char *pData;
+int iSize, rc;
+
+   if (argc < 2)
+   {
+      printf("avrsim - cost of the Arduino player on an AVR\n");
+      printf("usage:\n\n");
+      printf("./avrsim <options>\n\n");
+      printf("--in     stream (.bin) or bundle file\n");
+      printf("--clip   clip number of a bundle; defaults to 0\n");
+      printf("--good   the display has a working horizontal addressing mode\n");
+      printf("         (the sketch without BAD_DISPLAY)\n");
+      printf("--mhz    clock speeds to report, e.g. 1,8,16; defaults to 1,8,16,20\n");
+      printf("--frames list every frame\n");
+      return -1;
+   }
+   parse_opts(argc, argv);
+   iSize = LoadFile(szIn, &pData);
+   if (iSize < 0)
+   {
+      printf("Error opening %s\n", szIn);
+      return -1;
+   }
+   if (iSize >= 4 && memcmp(pData, "OAZ1", 4) == 0)
+   {
+      printf("%s is an archive; the AVR player needs the .bin\n", szIn);
+      free(pData);
+      return -1;
+   }
+   if (iClocks == 0)
+   {
+      printf("No clock speeds given\n");
+      free(pData);
+      return -1;
+   }
+   pFrames = (AVRCOUNT *)malloc(MAX_FRAMES * sizeof(AVRCOUNT));
+   // the cost of setup() isn't part of any frame
+   if (bGoodDisplay)
+   {
+      good::oledInit(0x3c, 0, 0);
+      good::oledFill(0);
+   }
+   else
+   {
+      bad::oledInit(0x3c, 0, 0);
+      bad::oledFill(0);
+   }
+   memset(&count, 0, sizeof(count));
+   if (iSize >= 10 && memcmp(pData, "OAB1", 4) == 0)
+      rc = SimBundle(pData, iSize);
+   else
+      rc = SimAnimation(pData, iSize);
+   if (rc == -2)
+      printf("Error playing clip %d of %s; it's past the first 64K of the bundle\n", iClip, szIn);
+   else if (rc != 0 || iFrames == 0)
+      printf("Error playing %s; corrupt stream or bad clip number\n", szIn);
+   else
+   {
+      printf("%s: %d frames, %s sketch\n", szIn, iFrames, bGoodDisplay ? "good display" : "BAD_DISPLAY");
+      ShowReport();
+   }
+   free(pFrames);
+   free(pData);
+   return (rc != 0 || iFrames == 0) ? -1 : 0;
+} /* main() */
@@ -0,0 +1,305 @@
+//
+// On-disk cache of encoder results for tcomp
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// The entries are kept in an open addressing hash table indexed by the
+// low bits of their keys (which are already hashes). Each entry remembers
+// the last run which used it; when the cache is written back, the most
+// recently used entries are kept until the size limit is reached.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define CACHE_MIN_SLOTS 1024
+#define CACHE_MAX_PATH 512
+
+typedef struct tag_cache_entry
+{
+   uint64_t ullKey;
+   uint32_t ulRun; // last run which used it
+   int iLen;
+   unsigned char *pData; // NULL = empty slot
+} CACHEENTRY;
+
+struct tag_cache
+{
+   char szName[CACHE_MAX_PATH];
+   long lMaxBytes;
+   uint32_t ulRun;
+   int iSlots, iCount; // table size (power of 2) and entries used
+   CACHEENTRY *pEntries;
+   pthread_mutex_t mutex;
+};
+
+static void WriteLong(unsigned char *d, uint32_t ul)
+{
+   d[0] = (unsigned char)ul;
+   d[1] = (unsigned char)(ul >> 8);
+   d[2] = (unsigned char)(ul >> 16);
+   d[3] = (unsigned char)(ul >> 24);
+} /* WriteLong() */
+
+static uint32_t ReadLong(unsigned char *s)
+{
+   return s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24);
+} /* ReadLong() */
+
+uint64_t CacheHash(const void *pData, int iLen, uint64_t ullHash)
+{
+const unsigned char *s = (const unsigned char *)pData;
+int i;
+
+   for (i=0; i<iLen; i++)
+   {
+      ullHash ^= s[i];
+      ullHash *= 0x100000001b3ULL; // FNV prime
+   }
+   return ullHash;
+} /* CacheHash() */
+//
+// Returns the slot of a key, or the empty slot where it belongs
+//
+static CACHEENTRY *CacheSlot(CACHE *pCache, uint64_t ullKey)
+{
+int i;
+
+   i = (int)(ullKey & (pCache->iSlots - 1));
+   while (pCache->pEntries[i].pData != NULL && pCache->pEntries[i].ullKey != ullKey)
+      i = (i + 1) & (pCache->iSlots - 1);
+   return &pCache->pEntries[i];
+} /* CacheSlot() */
+//
+// Add an entry which isn't in the table yet, growing it as needed
+// Keeps the load below 1/2 so the probes stay short
+//
+static void CacheInsert(CACHE *pCache, uint64_t ullKey, uint32_t ulRun, unsigned char *pData, int iLen)
+{
+CACHEENTRY *pOld, *pEntry;
+int i, iOldSlots;
+
+   if ((pCache->iCount + 1) * 2 > pCache->iSlots)
+   {
+      pOld = pCache->pEntries;
+      iOldSlots = pCache->iSlots;
+      pCache->iSlots *= 2;
+      pCache->pEntries = calloc(pCache->iSlots, sizeof(CACHEENTRY));
+      for (i=0; i<iOldSlots; i++)
+      {
+         if (pOld[i].pData != NULL)
+            *CacheSlot(pCache, pOld[i].ullKey) = pOld[i];
+      }
+      free(pOld);
+   }
+   pEntry = CacheSlot(pCache, ullKey);
+   pEntry->ullKey = ullKey;
+   pEntry->ulRun = ulRun;
+   pEntry->iLen = iLen;
+   pEntry->pData = pData;
+   pCache->iCount++;
+} /* CacheInsert() */
+//
+// Read the entries of a cache file; a damaged file just leaves the
+// cache with what could be read before the damage
+//
+static void CacheLoad(CACHE *pCache, FILE *pf)
+{
+unsigned char ucTemp[CACHE_ENTRY_SIZE], *pData;
+uint64_t ullKey;
+int i, iCount, iLen;
+
+   if (fread(ucTemp, 1, CACHE_HEADER_SIZE, pf) != CACHE_HEADER_SIZE || memcmp(ucTemp, "OEC1", 4) != 0)
+      return;
+   iCount = (int)ReadLong(&ucTemp[4]);
+   pCache->ulRun = ReadLong(&ucTemp[8]);
+   for (i=0; i<iCount; i++)
+   {
+      if (fread(ucTemp, 1, CACHE_ENTRY_SIZE, pf) != CACHE_ENTRY_SIZE)
+         break;
+      ullKey = ReadLong(ucTemp) | ((uint64_t)ReadLong(&ucTemp[4]) << 32);
+      iLen = (int)ReadLong(&ucTemp[12]);
+      if (iLen <= 0 || iLen > 0x1000000)
+         break;
+      pData = malloc(iLen);
+      if (fread(pData, 1, iLen, pf) != (size_t)iLen)
+      {
+         free(pData);
+         break;
+      }
+      if (CacheSlot(pCache, ullKey)->pData == NULL) // (keys are unique)
+         CacheInsert(pCache, ullKey, ReadLong(&ucTemp[8]), pData, iLen);
+      else
+         free(pData);
+   }
+} /* CacheLoad() */
+
+CACHE *CacheOpen(char *szDir, long lMaxBytes)
+{
+CACHE *pCache;
+struct stat st;
+FILE *pf;
+
+   if (mkdir(szDir, 0777) != 0 && errno != EEXIST)
+      return NULL;
+   if (stat(szDir, &st) != 0 || !S_ISDIR(st.st_mode))
+      return NULL;
+   if (strlen(szDir) + strlen(CACHE_FILE) + 6 > CACHE_MAX_PATH) // room for .tmp
+      return NULL;
+   pCache = calloc(1, sizeof(CACHE));
+   sprintf(pCache->szName, "%s/%s", szDir, CACHE_FILE);
+   pCache->lMaxBytes = lMaxBytes;
+   pCache->iSlots = CACHE_MIN_SLOTS;
+   pCache->pEntries = calloc(pCache->iSlots, sizeof(CACHEENTRY));
+   pthread_mutex_init(&pCache->mutex, NULL);
+   pf = fopen(pCache->szName, "rb");
+   if (pf != NULL)
+   {
+      CacheLoad(pCache, pf);
+      fclose(pf);
+   }
+   pCache->ulRun++; // this run
+   return pCache;
+} /* CacheOpen() */
+
+int CacheFind(CACHE *pCache, uint64_t ullKey, unsigned char *pData, int iMax)
+{
+CACHEENTRY *pEntry;
+int iLen = -1;
+
+   pthread_mutex_lock(&pCache->mutex);
+   pEntry = CacheSlot(pCache, ullKey);
+   if (pEntry->pData != NULL && pEntry->iLen <= iMax)
+   {
+      memcpy(pData, pEntry->pData, pEntry->iLen);
+      iLen = pEntry->iLen;
+      pEntry->ulRun = pCache->ulRun;
+   }
+   pthread_mutex_unlock(&pCache->mutex);
+   return iLen;
+} /* CacheFind() */
+
+void CacheStore(CACHE *pCache, uint64_t ullKey, unsigned char *pData, int iLen)
+{
+CACHEENTRY *pEntry;
+unsigned char *pCopy;
+
+   if (iLen <= 0)
+      return;
+   pCopy = malloc(iLen);
+   memcpy(pCopy, pData, iLen);
+   pthread_mutex_lock(&pCache->mutex);
+   pEntry = CacheSlot(pCache, ullKey);
+   if (pEntry->pData != NULL) // replace it
+   {
+      free(pEntry->pData);
+      pEntry->pData = pCopy;
+      pEntry->iLen = iLen;
+      pEntry->ulRun = pCache->ulRun;
+   }
+   else
+   {
+      CacheInsert(pCache, ullKey, pCache->ulRun, pCopy, iLen);
+   }
+   pthread_mutex_unlock(&pCache->mutex);
+} /* CacheStore() */
+//
+// Most recently used first (then by key so the file doesn't depend on
+// the order of the table)
+//
+static int CacheByRun(const void *a, const void *b)
+{
+const CACHEENTRY *pA = *(const CACHEENTRY **)a, *pB = *(const CACHEENTRY **)b;
+
+   if (pA->ulRun != pB->ulRun)
+      return (pA->ulRun < pB->ulRun) ? 1 : -1;
+   if (pA->ullKey != pB->ullKey)
+      return (pA->ullKey < pB->ullKey) ? -1 : 1;
+   return 0;
+} /* CacheByRun() */
+
+int CacheClose(CACHE *pCache, CACHEINFO *pInfo)
+{
+CACHEENTRY **pSorted, *pEntry;
+unsigned char ucTemp[CACHE_ENTRY_SIZE];
+char szTemp[CACHE_MAX_PATH+8];
+FILE *pf;
+long lBytes;
+int i, iCount, rc = 0;
+
+   pSorted = malloc((pCache->iCount + 1) * sizeof(CACHEENTRY *));
+   iCount = 0;
+   for (i=0; i<pCache->iSlots; i++)
+   {
+      if (pCache->pEntries[i].pData != NULL)
+         pSorted[iCount++] = &pCache->pEntries[i];
+   }
+   qsort(pSorted, iCount, sizeof(CACHEENTRY *), CacheByRun);
+   lBytes = CACHE_HEADER_SIZE;
+   for (i=0; i<iCount; i++) // keep what fits, newest first
+   {
+      if (pCache->lMaxBytes && lBytes + CACHE_ENTRY_SIZE + pSorted[i]->iLen > pCache->lMaxBytes)
+         break;
+      lBytes += CACHE_ENTRY_SIZE + pSorted[i]->iLen;
+   }
+   if (pInfo)
+   {
+      pInfo->iEntries = i;
+      pInfo->lBytes = lBytes;
+      pInfo->iEvicted = iCount - i;
+   }
+   iCount = i;
+   sprintf(szTemp, "%s.tmp", pCache->szName);
+   pf = fopen(szTemp, "wb");
+   if (pf == NULL)
+      rc = -1;
+   else
+   {
+      memcpy(ucTemp, "OEC1", 4);
+      WriteLong(&ucTemp[4], (uint32_t)iCount);
+      WriteLong(&ucTemp[8], pCache->ulRun);
+      if (fwrite(ucTemp, 1, CACHE_HEADER_SIZE, pf) != CACHE_HEADER_SIZE)
+         rc = -1;
+      for (i=0; i<iCount && rc == 0; i++)
+      {
+         pEntry = pSorted[i];
+         WriteLong(ucTemp, (uint32_t)pEntry->ullKey);
+         WriteLong(&ucTemp[4], (uint32_t)(pEntry->ullKey >> 32));
+         WriteLong(&ucTemp[8], pEntry->ulRun);
+         WriteLong(&ucTemp[12], (uint32_t)pEntry->iLen);
+         if (fwrite(ucTemp, 1, CACHE_ENTRY_SIZE, pf) != CACHE_ENTRY_SIZE ||
+             fwrite(pEntry->pData, 1, pEntry->iLen, pf) != (size_t)pEntry->iLen)
+            rc = -1;
+      }
+      if (fclose(pf) != 0)
+         rc = -1;
+      if (rc == 0 && rename(szTemp, pCache->szName) != 0)
+         rc = -1;
+      if (rc != 0)
+         remove(szTemp);
+   }
+   for (i=0; i<pCache->iSlots; i++)
+      free(pCache->pEntries[i].pData);
+   free(pSorted);
+   free(pCache->pEntries);
+   pthread_mutex_destroy(&pCache->mutex);
+   free(pCache);
+   return rc;
+} /* CacheClose() */
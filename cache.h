@@ -0,0 +1,58 @@
+//
+// On-disk cache of encoder results for tcomp
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Maps a 64-bit content hash (of the frame bitmaps, the previous frame
+// and the encoder settings) to the bytes the encoder produced for it, so
+// that rebuilding an asset library only encodes what changed. The whole
+// cache is loaded into memory when it's opened and written back (to a
+// .tmp file which is then renamed) when it's closed. The entries which
+// were used least recently are dropped to keep it under its size limit.
+// Batch jobs share one cache, so every call takes a lock.
+//
+// File layout (all integers are little endian):
+// "OEC1"            - 4 byte signature
+// entry count       - 4 bytes
+// run number        - 4 bytes, incremented each time the cache is used
+// entries {
+//    key            - 8 bytes
+//    last run used  - 4 bytes
+//    length         - 4 bytes
+//    data           - length bytes
+// }
+//
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#define CACHE_FILE "tcomp.cache"
+#define CACHE_HEADER_SIZE 12
+#define CACHE_ENTRY_SIZE 16 // bytes of each entry besides its data
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL // starting value for CacheHash()
+
+typedef struct tag_cache CACHE;
+typedef struct tag_cache_info
+{
+   int iEntries; // entries written back
+   long lBytes; // size of the cache file
+   int iEvicted; // entries dropped to stay under the limit
+} CACHEINFO;
+
+// Hash a block of data (64-bit FNV-1a); chain calls by passing the
+// previous result, start with CACHE_HASH_INIT
+uint64_t CacheHash(const void *pData, int iLen, uint64_t ullHash);
+// Load (or start) the cache in a directory; lMaxBytes = 0 for no limit
+// Returns NULL if the directory can't be used
+CACHE *CacheOpen(char *szDir, long lMaxBytes);
+// Copy the data of an entry to pData (up to iMax bytes)
+// Returns its length or -1 if it isn't there
+int CacheFind(CACHE *pCache, uint64_t ullKey, unsigned char *pData, int iMax);
+// Add (or replace) an entry
+void CacheStore(CACHE *pCache, uint64_t ullKey, unsigned char *pData, int iLen);
+// Evict entries down to the size limit, write the cache back and free it
+// pInfo (if not NULL) receives what was written; returns 0 for success
+int CacheClose(CACHE *pCache, CACHEINFO *pInfo);
+
+#endif // __CACHE_H__
@@ -0,0 +1,343 @@
+//
+// Streaming animated GIF decoder for tcomp
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Reads the GIF blocks sequentially, LZW decodes each image directly
+// onto the canvas (honoring transparency, interlacing and the disposal
+// method of the previous frame) and returns after every frame.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "gif.h"
+
+#define GIF_EXTENSION 0x21
+#define GIF_IMAGE 0x2c
+#define GIF_TRAILER 0x3b
+#define GIF_CONTROL 0xf9 // graphic control extension label
+
+#define DISPOSE_BACKGROUND 2
+#define DISPOSE_PREVIOUS 3
+
+static int ReadWord(FILE *pf)
+{
+int i;
+
+   i = fgetc(pf);
+   return i | (fgetc(pf) << 8);
+} /* ReadWord() */
+//
+// Read a color table and convert it to luma
+// The colors are reduced to RGB565 first; a pixel is white in the
+// 1-bpp output when its luma is above 128 (R+G+B > 384)
+//
+static int ReadPalette(FILE *pf, int iColors, unsigned char *pLUT)
+{
+unsigned char ucRGB[768];
+int i, r, g, b;
+
+   if (fread(ucRGB, 3, iColors, pf) != (size_t)iColors)
+      return -1;
+   memset(pLUT, 0, 256);
+   for (i=0; i<iColors; i++)
+   {
+      r = ucRGB[i*3] & 0xf8;
+      g = ucRGB[i*3+1] & 0xfc;
+      b = ucRGB[i*3+2] & 0xf8;
+      pLUT[i] = (unsigned char)((r + g + b + 2) / 3);
+   }
+   return 0;
+} /* ReadPalette() */
+//
+// Skip a chain of data sub-blocks
+//
+static int SkipBlocks(FILE *pf)
+{
+int iLen;
+
+   while ((iLen = fgetc(pf)) > 0)
+   {
+      if (fseek(pf, iLen, SEEK_CUR))
+         return -1;
+   }
+   return (iLen == 0) ? 0 : -1;
+} /* SkipBlocks() */
+//
+// Read the next LZW code from the image data sub-blocks
+// Returns -1 if the data ran out
+//
+static int GetCode(GIFANIM *pGIF, int iCodeSize)
+{
+int c;
+
+   while (pGIF->iBits < iCodeSize)
+   {
+      if (pGIF->iBlockLeft == 0)
+      {
+         pGIF->iBlockLeft = fgetc(pGIF->pFile);
+         if (pGIF->iBlockLeft <= 0) // terminator or end of file
+         {
+            pGIF->iBlockLeft = -1;
+            return -1;
+         }
+      }
+      if (pGIF->iBlockLeft < 0)
+         return -1;
+      c = fgetc(pGIF->pFile);
+      if (c < 0)
+         return -1;
+      pGIF->iBlockLeft--;
+      pGIF->ulAcc |= (unsigned long)c << pGIF->iBits;
+      pGIF->iBits += 8;
+   }
+   c = (int)(pGIF->ulAcc & ((1 << iCodeSize) - 1));
+   pGIF->ulAcc >>= iCodeSize;
+   pGIF->iBits -= iCodeSize;
+   return c;
+} /* GetCode() */
+//
+// Fill a rectangle of the canvas (clipped to the screen)
+//
+static void FillRect(GIFANIM *pGIF, int x, int y, int w, int h, unsigned char ucLuma)
+{
+int i;
+
+   if (x < 0) { w += x; x = 0; }
+   if (y < 0) { h += y; y = 0; }
+   if (x + w > pGIF->iWidth) w = pGIF->iWidth - x;
+   if (y + h > pGIF->iHeight) h = pGIF->iHeight - y;
+   for (i=0; i<h && w > 0; i++)
+      memset(&pGIF->pCanvas[(y + i) * pGIF->iWidth + x], ucLuma, w);
+} /* FillRect() */
+//
+// LZW decode one image onto the canvas
+//
+static int DecodeImage(GIFANIM *pGIF, int x0, int y0, int w, int h, int bInterlace)
+{
+static const unsigned char ucStart[4] = {0, 4, 2, 1};
+static const unsigned char ucStep[4] = {8, 8, 4, 2};
+int iMinSize, iCodeSize, iClear, iNext, iCode, iOld, iIn, iSP;
+int x, y, iPass, iPixels;
+unsigned char ucFirst, *d;
+
+   iMinSize = fgetc(pGIF->pFile);
+   if (iMinSize < 1 || iMinSize > 11)
+      return -1;
+   iClear = 1 << iMinSize;
+   iCodeSize = iMinSize + 1;
+   iNext = iClear + 2;
+   for (x=0; x<iClear; x++)
+   {
+      pGIF->usPrefix[x] = 0;
+      pGIF->ucSuffix[x] = (unsigned char)x;
+   }
+   pGIF->iBlockLeft = pGIF->iBits = 0;
+   pGIF->ulAcc = 0;
+   iOld = -1;
+   ucFirst = 0;
+   x = y = iPass = 0;
+   iPixels = w * h;
+   while (iPixels > 0)
+   {
+      iCode = GetCode(pGIF, iCodeSize);
+      if (iCode < 0 || iCode == iClear + 1) // out of data or end code
+         break;
+      if (iCode == iClear)
+      {
+         iCodeSize = iMinSize + 1;
+         iNext = iClear + 2;
+         iOld = -1;
+         continue;
+      }
+      iSP = 0;
+      if (iOld == -1) // first code after a clear
+      {
+         if (iCode >= iClear)
+            return -1;
+         ucFirst = (unsigned char)iCode;
+         pGIF->ucStack[iSP++] = ucFirst;
+         iOld = iCode;
+      }
+      else
+      {
+         iIn = iCode;
+         if (iCode >= iNext) // the code being defined (KwKwK)
+         {
+            pGIF->ucStack[iSP++] = ucFirst;
+            iCode = iOld;
+         }
+         while (iCode >= iClear)
+         {
+            pGIF->ucStack[iSP++] = pGIF->ucSuffix[iCode];
+            iCode = pGIF->usPrefix[iCode];
+         }
+         ucFirst = pGIF->ucSuffix[iCode];
+         pGIF->ucStack[iSP++] = ucFirst;
+         if (iNext < (1 << GIF_MAX_CODE_BITS))
+         {
+            pGIF->usPrefix[iNext] = (unsigned short)iOld;
+            pGIF->ucSuffix[iNext] = ucFirst;
+            iNext++;
+            if (iNext == (1 << iCodeSize) && iCodeSize < GIF_MAX_CODE_BITS)
+               iCodeSize++;
+         }
+         iOld = iIn;
+      }
+      while (iSP && iPixels > 0) // the stack holds the string backwards
+      {
+         iCode = pGIF->ucStack[--iSP];
+         if (iCode != pGIF->iTransparent && x0 + x < pGIF->iWidth && y0 + y < pGIF->iHeight)
+         {
+            d = &pGIF->pCanvas[(y0 + y) * pGIF->iWidth + x0 + x];
+            *d = pGIF->ucLUT[iCode];
+         }
+         iPixels--;
+         if (++x == w) // next line
+         {
+            x = 0;
+            if (bInterlace)
+            {
+               y += ucStep[iPass];
+               while (y >= h && iPass < 3)
+               {
+                  iPass++;
+                  y = ucStart[iPass];
+               }
+            }
+            else
+               y++;
+         }
+      }
+   }
+   // skip whatever is left of the image data
+   if (pGIF->iBlockLeft > 0 && fseek(pGIF->pFile, pGIF->iBlockLeft, SEEK_CUR))
+      return -1;
+   if (pGIF->iBlockLeft >= 0)
+      return SkipBlocks(pGIF->pFile);
+   return 0;
+} /* DecodeImage() */
+
+int GIFOpen(GIFANIM *pGIF, char *szName)
+{
+unsigned char ucHeader[13];
+int iBackground;
+
+   memset(pGIF, 0, sizeof(GIFANIM));
+   pGIF->pFile = fopen(szName, "rb");
+   if (pGIF->pFile == NULL)
+      return -1;
+   if (fread(ucHeader, 1, 13, pGIF->pFile) != 13 || memcmp(ucHeader, "GIF8", 4) != 0)
+   {
+      GIFClose(pGIF);
+      return -1;
+   }
+   pGIF->iWidth = ucHeader[6] | (ucHeader[7] << 8);
+   pGIF->iHeight = ucHeader[8] | (ucHeader[9] << 8);
+   iBackground = ucHeader[11];
+   if (ucHeader[10] & 0x80) // global color table
+   {
+      if (ReadPalette(pGIF->pFile, 2 << (ucHeader[10] & 7), pGIF->ucGlobalLUT))
+      {
+         GIFClose(pGIF);
+         return -1;
+      }
+      pGIF->iBackground = pGIF->ucGlobalLUT[iBackground];
+   }
+   if (pGIF->iWidth == 0 || pGIF->iHeight == 0)
+   {
+      GIFClose(pGIF);
+      return -1;
+   }
+   pGIF->pCanvas = malloc(pGIF->iWidth * pGIF->iHeight);
+   memset(pGIF->pCanvas, pGIF->iBackground, pGIF->iWidth * pGIF->iHeight);
+   pGIF->iTransparent = -1;
+   return 0;
+} /* GIFOpen() */
+
+int GIFNextFrame(GIFANIM *pGIF)
+{
+FILE *pf = pGIF->pFile;
+unsigned char ucDesc[9];
+int c, x, y, w, h;
+
+   while (1)
+   {
+      c = fgetc(pf);
+      if (c == GIF_TRAILER || c == EOF)
+         return 0;
+      if (c == GIF_EXTENSION)
+      {
+         c = fgetc(pf);
+         if (c == GIF_CONTROL && fgetc(pf) == 4)
+         {
+            c = fgetc(pf);
+            pGIF->iDisposal = (c >> 2) & 7;
+            pGIF->iDelay = ReadWord(pf);
+            pGIF->iTransparent = fgetc(pf);
+            if (!(c & 1))
+               pGIF->iTransparent = -1;
+         }
+         if (SkipBlocks(pf))
+            return -1;
+         continue;
+      }
+      if (c != GIF_IMAGE)
+         return -1;
+      if (fread(ucDesc, 1, 9, pf) != 9)
+         return -1;
+      x = ucDesc[0] | (ucDesc[1] << 8);
+      y = ucDesc[2] | (ucDesc[3] << 8);
+      w = ucDesc[4] | (ucDesc[5] << 8);
+      h = ucDesc[6] | (ucDesc[7] << 8);
+      if (ucDesc[8] & 0x80) // local color table
+      {
+         if (ReadPalette(pf, 2 << (ucDesc[8] & 7), pGIF->ucLUT))
+            return -1;
+      }
+      else
+         memcpy(pGIF->ucLUT, pGIF->ucGlobalLUT, 256);
+      // dispose of the previous frame
+      if (pGIF->iPrevDisposal == DISPOSE_BACKGROUND)
+         FillRect(pGIF, pGIF->iPrevX, pGIF->iPrevY, pGIF->iPrevW, pGIF->iPrevH, (unsigned char)pGIF->iBackground);
+      else if (pGIF->iPrevDisposal == DISPOSE_PREVIOUS && pGIF->pSaved)
+         memcpy(pGIF->pCanvas, pGIF->pSaved, pGIF->iWidth * pGIF->iHeight);
+      if (pGIF->iDisposal == DISPOSE_PREVIOUS)
+      {
+         if (pGIF->pSaved == NULL)
+            pGIF->pSaved = malloc(pGIF->iWidth * pGIF->iHeight);
+         memcpy(pGIF->pSaved, pGIF->pCanvas, pGIF->iWidth * pGIF->iHeight);
+      }
+      if (DecodeImage(pGIF, x, y, w, h, (ucDesc[8] & 0x40) != 0))
+         return -1;
+      pGIF->iPrevX = x; pGIF->iPrevY = y;
+      pGIF->iPrevW = w; pGIF->iPrevH = h;
+      pGIF->iPrevDisposal = pGIF->iDisposal;
+      pGIF->iDisposal = 0; // the control extension only applies once
+      pGIF->iTransparent = -1;
+      pGIF->iFrames++;
+      return 1;
+   }
+} /* GIFNextFrame() */
+
+void GIFClose(GIFANIM *pGIF)
+{
+   if (pGIF->pFile)
+      fclose(pGIF->pFile);
+   free(pGIF->pCanvas);
+   free(pGIF->pSaved);
+   pGIF->pFile = NULL;
+   pGIF->pCanvas = pGIF->pSaved = NULL;
+} /* GIFClose() */
@@ -0,0 +1,50 @@
+//
+// Streaming animated GIF decoder for tcomp
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Frames are decoded one at a time straight from the file onto a single
+// canvas the size of the GIF's logical screen. Each palette is turned
+// into a luma lookup table as it's read, so the canvas holds one luma
+// byte per pixel and the 1-bpp conversion doesn't need to know about
+// colors at all. Only a "restore to previous" disposal needs a second
+// copy of the canvas and it's allocated the first time one is seen.
+//
+#ifndef __GIF_H__
+#define __GIF_H__
+
+#include <stdio.h>
+
+#define GIF_MAX_CODE_BITS 12
+
+typedef struct tag_gif_anim
+{
+   FILE *pFile;
+   int iWidth, iHeight; // logical screen size
+   int iBackground; // luma of the background color
+   unsigned char ucGlobalLUT[256]; // global palette -> luma
+   unsigned char ucLUT[256]; // palette of the current frame -> luma
+   unsigned char *pCanvas; // iWidth x iHeight luma bytes
+   unsigned char *pSaved; // canvas to restore after a disposal 3 frame
+   int iFrames; // frames decoded so far
+   // from the graphic control extension of the next frame
+   int iDisposal, iTransparent, iDelay; // iTransparent = -1 for none
+   // previous frame; its disposal is done before drawing the next one
+   int iPrevX, iPrevY, iPrevW, iPrevH, iPrevDisposal;
+   // LZW bit reader over the image data sub-blocks
+   int iBlockLeft; // bytes left in the current sub-block
+   int iBits; // number of valid bits in ulAcc
+   unsigned long ulAcc;
+   unsigned short usPrefix[1 << GIF_MAX_CODE_BITS];
+   unsigned char ucSuffix[1 << GIF_MAX_CODE_BITS];
+   unsigned char ucStack[(1 << GIF_MAX_CODE_BITS) + 1];
+} GIFANIM;
+
+// Open a GIF file and read the logical screen; returns 0 for success
+int GIFOpen(GIFANIM *pGIF, char *szName);
+// Decode the next frame onto the canvas
+// Returns 1 for a new frame, 0 at the end of the file, -1 for bad data
+int GIFNextFrame(GIFANIM *pGIF);
+void GIFClose(GIFANIM *pGIF);
+
+#endif // __GIF_H__
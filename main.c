@@ -10,16 +10,204 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include "pil.h"
-#include "pil_io.h"
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "gif.h"
+#include "cache.h"
 
 #define MAX_PATH 260
-static char szIn[MAX_PATH];
+//
+// Optional 4 byte stream header; streams without it are plain frames
+// 0x80 'A' <flags low> <flags high>
+// (0x80 is a repeat+skip of 0 bytes which the encoder never writes)
+//
+#define STREAM_MARKER0 0x80
+#define STREAM_MARKER1 'A'
+#define STREAM_HEADER_SIZE 4
+#define STREAM_VERTICAL 0x0001 // frames are scanned column by column
+#define STREAM_WINDOWS 0x0002 // frames may contain window opcodes
+#define STREAM_PATTERNS 0x0004 // frames may contain pattern opcodes
+#define STREAM_PAGE_ALIGNED 0x0008 // no copy, repeat or pattern crosses a line
+#define STREAM_PINGPONG 0x0010 // the frames go back down to frame 0; loops start at frame 1
+#define STREAM_LOOP_FRAME 0x0020 // frame 1 goes from the last frame back to frame 0; loops start there
+#define STREAM_TILES 0x0040 // a tile table follows the header (see OP_TILE)
+#define STREAM_COMMANDS 0x0080 // frames may contain display commands (see OP_COMMAND)
+#define STREAM_PLANES_MASK 0x0300 // grayscale bit planes per frame - 1 (most significant first)
+#define STREAM_PLANES_SHIFT 8
+#define GRAY_MAX_PLANES 3
+#define STREAM_FIELDS_MASK 0x0c00 // split of the skip+copy and copy+skip fields (FIELDS_*)
+#define STREAM_FIELDS_SHIFT 10
+#define STREAM_FIELDS(iFlags) (((iFlags) & STREAM_FIELDS_MASK) >> STREAM_FIELDS_SHIFT)
+//
+// Multi-clip bundle (all integers are little endian)
+// "OAB1", clip count (2), chunk count (2), stream flags (2)
+// clip table  - first frame index (2) and frame count (2) of each clip
+// chunk table - offset of each chunk from the start of the bundle (4),
+//               plus one more for the end of the last chunk
+// frame index - chunk number of every frame of every clip (2 each)
+// chunk data  - the unique encoded frames; clips share identical ones
+// tile table  - with STREAM_TILES, the one table of all the clips (at the
+//               end offset of the chunk table)
+//
+#define BUNDLE_HEADER_SIZE 10
+#define MAX_CLIPS 32
+#define MAX_JOBS 64 // batch worker threads
+//
+// Scan orders
+//
+#define SCAN_AUTO 0
+#define SCAN_HORIZONTAL 1
+#define SCAN_VERTICAL 2
+//
+// Field splits of the skip+copy (00SSSCCC) and copy+skip (01CCCSSS)
+// opcodes; the skip field gets the bits given, the copy field the rest
+// of the 6 (see oled_decode.h)
+//
+#define FIELDS_AUTO -1
+#define FIELDS_3_3 0
+#define FIELDS_4_2 1
+#define FIELDS_2_4 2
+#define FIELDS_COUNT 3
+static const int iFieldSkipBits[FIELDS_COUNT] = {3, 4, 2};
+static const char *szFieldNames[FIELDS_COUNT] = {"3/3", "4/2", "2/4"};
+static char szIn[MAX_CLIPS][MAX_PATH];
+static int iInClip[MAX_CLIPS]; // clip of a bundle given as input (-1 = whole file)
+static int iClips = 0; // number of input files
+static int bBundle = 0; // write a multi-clip bundle
 static char szOut[MAX_PATH];
+static char szBatch[MAX_PATH]; // directory or manifest of files to encode
+static char szOutDir[MAX_PATH]; // where batch outputs go
+static int iJobs = 0; // batch worker threads (0 = one per CPU)
 static int iTop = -1;
 static int iLeft = -1;
 static int bC = 0; // write C code instead of binary data to output file
+static int bCCode = 0; // write the frames as C functions (--c-code)
+static int iCodeKB = 0; // flash budget of the --c-code functions (0 = no limit)
 static int bInvert = 0; // invert the bitmap colors
+static int bArchive = 0; // write an entropy coded archive instead of raw data
+static int iMaxFrameBytes = 0; // bus byte budget per frame (0 = no limit)
+static int iTargetFPS = 0;
+static int iBusKHz = 0;
+static int iScan = SCAN_AUTO;
+static int iFields = FIELDS_AUTO; // skip/copy field split (--fields)
+static int iLossy = 0; // suppress changes of fewer than N pixels (0 = lossless)
+static int bLossyTiles = 0; // measure changes per 8x8 tile instead of per byte
+static int iLossyFrames = 4; // held back pixels are sent after iLossy * N pixel-frames
+static int bWindows = 0; // send rectangles of changes through a display window
+static int bPatterns = 0; // code repeating 2-4 byte patterns
+static int bTiles = 0; // draw repeated tiles from a table of the stream
+static int bCommands = 0; // invert, dim and blank the display with commands
+static int bPageAligned = 0; // keep writes within a page (horizontal scan only)
+static int bPingPong = 0; // follow the frames with the way back to frame 0
+static int bLoopFrame = 0; // add a delta from the last frame back to frame 0 for loops
+static int iGrayBits = 1; // bit planes per frame (--gray N)
+static int bStats = 0; // print the compression report
+static char szStatsJSON[MAX_PATH]; // optional JSON copy of the report
+static char szStatsPBM[MAX_PATH]; // optional change heatmap image
+static char szCache[MAX_PATH]; // directory of the encode cache
+static int iCacheMB = 64; // size limit of the encode cache
+static CACHE *pCache = NULL;
+//
+// Tile table (--tiles)
+// A tile is the 8 bytes of the scan order which start at a multiple of 8:
+// an 8x8 cell of a page, or a whole column in vertical streams
+//
+#define TILE_SIZE 8
+#define TILE_MAX 256
+#define TILE_MIN_CHANGED 4 // changed bytes a tile has to cover to be drawn
+#define TILE_HASH 1024 // lookup slots (a power of 2, more than TILE_MAX)
+#define TILE_CANDIDATES 0x40000 // distinct tiles counted per dictionary (a power of 2)
+//
+// Display commands (--commands)
+// Frames can invert the display, change its contrast or switch it off
+// instead of rewriting its RAM. The state they leave is kept in an int;
+// each frame of a clip also has a contrast level (255 = full), which
+// fades found in the GIF lower.
+//
+#define DISPLAY_CONTRAST 0x00ff
+#define DISPLAY_INVERTED 0x0100
+#define DISPLAY_OFF 0x0200
+#define DISPLAY_DEFAULT 0x00ff // as the players initialize it
+#define INVERT_MIN_SAVE 4 // changed bytes inverting the display has to save
+#define FADE_TOLERANCE 24 // luma a dimmed pixel may be off from the scaled key frame
+#define FADE_MIN_LEVEL 8 // levels below this are a blank frame
+//
+// Everything which changes while a clip is loaded and encoded
+// The options above are only read once they're parsed, so batch jobs
+// can each have one of these and run at the same time
+//
+typedef struct tag_encoder
+{
+   int iTop, iLeft; // crop origin (-1 = top left corner)
+   int bInvert; // invert the bitmap colors
+   int iWidth, iHeight; // size of the GIF which was loaded
+   int bVertical; // scan order of the stream being encoded
+   int iFields; // field split of the stream being encoded (FIELDS_*)
+   int iSkipBits, iSkipMax, iCopyMax; // of that split (see SetFields())
+   int bPingPong; // --pingpong, or a ping-pong stream was loaded
+   int bLoopFrame; // --loop-frame, or a stream with a loop frame was loaded
+   int bTranscode; // the clip was decoded from a stream, not a GIF
+   int bCommands; // --commands, or a stream with display commands was loaded
+   int iState; // display state the frames so far leave (DISPLAY_*)
+   int iStateUsed; // the DISPLAY_* bits any frame changed
+   unsigned char ucTiles[TILE_MAX][TILE_SIZE]; // tile table of the streams (see SetTiles())
+   int iTiles; // (0 = none)
+   short iTileHash[TILE_HASH]; // tile number + 1 in each lookup slot (0 = empty)
+   unsigned char ucAge[1024]; // frames each display byte has been held back
+   unsigned short usError[1024]; // accumulated pixel error of each byte
+   unsigned char ucPlaneAge[GRAY_MAX_PLANES][1024]; // the same for the other
+   unsigned short usPlaneError[GRAY_MAX_PLANES][1024]; // grayscale planes
+   int iRateLimited, iRateAdded; // statistics
+   int iLossySaved, iLossyPixels;
+   int iWindowCount, iWindowBytes;
+   int iClipHits, iClipEncodes, iFrameHits, iFrameEncodes; // cache (not reset per clip)
+} ENCODER;
+#define RATE_MAX_RUN 32 // longest run of changes rate control treats as a unit
+#define RATE_MIN_BYTES 25 // bus bytes to write 1 byte wherever it is (skips included)
+//
+// Encode cache (--cache)
+// Clip entries are the stream followed by the CLIP_INFO counters of the
+// ENCODER; frame entries are the frame's opcodes followed by its window
+// count and bytes. Bump CACHE_VERSION whenever the encoder output changes.
+//
+#define CACHE_VERSION 1
+#define CACHE_CLIP 0
+#define CACHE_FRAME 1
+#define CACHE_FIRST 2 // the intra frame of a clip
+#define CLIP_INFO 7
+#define FRAME_INFO 2
+#define MAX_FRAME_ENTRY 4096
+//
+// Compression statistics (--stats)
+// Gathered from the finished stream so that trial encodes made by rate
+// control and window selection aren't counted and normal runs pay nothing
+//
+#define STAT_SKIPCOPY 0
+#define STAT_LONGSKIP 1
+#define STAT_COPYSKIP 2
+#define STAT_LONGCOPY 3
+#define STAT_REPEATSKIP 4
+#define STAT_REPEAT 5
+#define STAT_WINDOW 6
+#define STAT_PATTERN 7
+#define STAT_TILE 8
+#define STAT_COMMAND 9
+#define STAT_OPS 10
+#define STAT_BUCKETS 9 // run lengths 1, 2, 3-4, 5-8 ... 129-256
+#define STAT_TOP 5 // number of most expensive frames listed
+typedef struct tag_stats
+{
+   int iFrames, iBytes, iBus;
+   int iOps[STAT_OPS], iOpBytes[STAT_OPS]; // count and stream bytes of each
+   int iSkipRuns[STAT_BUCKETS], iCopyRuns[STAT_BUCKETS], iRepeatRuns[STAT_BUCKETS];
+   int iMaxFrames; // size of the per frame arrays (grown as needed)
+   int *pFrameSize, *pFrameBus, *pFrameChanged;
+   int iHeat[1024]; // number of frames in which each display byte changed
+} STATS;
 //#define DEBUG_LOG
 //#define SAVE_INPUT_FRAMES
 //#define SAVE_OUTPUT_FRAMES
@@ -32,6 +220,18 @@ static int bInvert = 0; // invert the bitmap colors
 #define OP_REPEATSKIP 0x80
 #define OP_REPEAT 0xc0
 //
+// Extended opcodes use the repeat+skip codes with a repeat count of 0
+// (10000nnn) which the encoder never writes for linear data
+//
+#define OP_WINDOW 0x81 // x, w-1, (page<<3)|(h-1), then copies/repeats of w*h bytes
+#define OP_PATTERN 0x82 // (period-2)<<6 | (count-1), then the 2-4 pattern bytes
+#define PATTERN_PERIOD(b) (((b) >> 6) + 2) // from the operand byte
+#define PATTERN_COUNT(b) (PATTERN_PERIOD(b) * (((b) & 0x3f) + 1)) // bytes it expands to
+#define PATTERN_MIN_SAVE 3 // stream bytes a pattern must save over a copy
+#define OP_TILE 0x83 // tile number; its 8 bytes come from the tile table
+#define OP_COMMAND 0x84 // display command 0xa6/0xa7, 0xae/0xaf, or 0x81 and the contrast
+#define WINDOW_GAP 4 // changes this close on a page belong to the same box
+//
 // ShowHelp
 //
 // Display the help info when incorrect or no command line parameters are passed
@@ -42,9 +242,50 @@ void ShowHelp(void)
 	"tiny_compress - compress bitonal animated GIF\n\n"
 	"usage: ./tcomp <options>\n"
 	"valid options:\n\n"
-        " --in <infile>       Input file\n"
+        " --in <infile>       Input file (repeat for each clip of a bundle);\n"
+	"                     a .bin stream, archive or bundle is transcoded\n"
 	" --out <outfile>     Output file\n"
+	" --batch <dir|list>  Encode every GIF of a directory or manifest file\n"
+	" --out-dir <dir>     Where --batch writes its output files\n"
+	" --jobs N            Encode N batch files at once (default: CPU count)\n"
 	" --c                 Write C code to output file\n"
+	" --c-code            Write the frames as C functions for the Arduino player\n"
+	" --code-kb N         Keep the --c-code functions to about N KB of flash;\n"
+	"                     the other frames stay data (default: no limit)\n"
+	" --bundle            Write all inputs as one bundle of clips\n"
+	" --archive           Write a Huffman coded archive (Linux players)\n"
+	" --max-bytes-per-frame N  Limit each frame to N bytes of I2C traffic\n"
+	"                     (at least 25, the cost of 1 byte)\n"
+	" --target-fps N      Limit each frame to what the bus can send at N FPS\n"
+	" --bus-khz N         I2C bus speed for --target-fps (default 400)\n"
+	" --scan <order>      auto (default), horizontal or vertical\n"
+	" --fields <split>    Skip/copy bits of the short opcodes: auto (default),\n"
+	"                     3/3, 4/2 (longer skips) or 2/4 (longer copies)\n"
+	" --lossy N           Ignore changes of fewer than N pixels per byte\n"
+	" --lossy-tiles       Measure --lossy changes per 8x8 tile\n"
+	" --lossy-frames N    Send ignored changes once they add up to --lossy * N\n"
+	"                     pixel-frames (default 4)\n"
+	" --windows           Send changed rectangles through a column/page window\n"
+	" --patterns          Code repeating 2-4 byte patterns (dithers, stripes)\n"
+	" --tiles             Store 8x8 tiles which repeat across the clip once\n"
+	"                     and draw them from the table (sprites, tile maps)\n"
+	" --commands          Invert, dim and blank the display with controller\n"
+	"                     commands (flashes, fades, black frames)\n"
+	" --page-aligned      Never write across a page; for displays without\n"
+	"                     horizontal addressing (SH1106 and --bad players),\n"
+	"                     scans horizontally\n"
+	" --pingpong          Add the frames back to the first (forward then\n"
+	"                     backward loops on the AVR; about doubles the size)\n"
+	" --loop-frame        Add a delta from the last frame back to the first\n"
+	"                     so loops don't send the first frame again\n"
+	"                     (not with a byte budget)\n"
+	" --gray N            N bit planes of grayscale (2 or 3) for oledplay;\n"
+	"                     --max-bytes-per-frame then applies to each plane\n"
+	" --stats             Print opcode, run length, cost and change statistics\n"
+	" --stats-json <file> Also write the statistics as JSON\n"
+	" --stats-pbm <file>  Write the change heatmap as a dithered PBM image\n"
+	" --cache <dir>       Reuse earlier encodes of unchanged clips and frames\n"
+	" --cache-mb N        Size limit of the cache (default 64MB)\n"
 	" --invert            Invert bitmap colors\n"
 	" --top N             Top of cropped area\n"
 	" --left N            Left of cropped area\n"
@@ -71,11 +312,24 @@ int i = 1;
         }
         /* test for each specific flag */
         if (0 == strcmp("--in", argv[i])) {
-            strcpy(szIn, argv[i+1]);
+            if (iClips < MAX_CLIPS)
+            {
+               iInClip[iClips] = -1;
+               strcpy(szIn[iClips++], argv[i+1]);
+            }
             i += 2;
         } else if (0 == strcmp("--out", argv[i])) {
             strcpy(szOut, argv[i+1]);
             i += 2;
+        } else if (0 == strcmp("--batch", argv[i])) {
+            strcpy(szBatch, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--out-dir", argv[i])) {
+            strcpy(szOutDir, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--jobs", argv[i])) {
+            iJobs = atoi(argv[i+1]);
+            i += 2;
         } else if (0 == strcmp("--left", argv[i])) {
             iLeft = atoi(argv[i+1]);
             i += 2;
@@ -85,6 +339,96 @@ int i = 1;
         } else if (0 == strcmp("--c", argv[i])) {
             bC = 1;
             i++;
+        } else if (0 == strcmp("--c-code", argv[i])) {
+            bC = bCCode = 1;
+            i++;
+        } else if (0 == strcmp("--code-kb", argv[i])) {
+            iCodeKB = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--bundle", argv[i])) {
+            bBundle = 1;
+            i++;
+        } else if (0 == strcmp("--archive", argv[i])) {
+            bArchive = 1;
+            i++;
+        } else if (0 == strcmp("--max-bytes-per-frame", argv[i])) {
+            iMaxFrameBytes = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--target-fps", argv[i])) {
+            iTargetFPS = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--bus-khz", argv[i])) {
+            iBusKHz = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--scan", argv[i])) {
+            if (0 == strcmp("horizontal", argv[i+1]))
+               iScan = SCAN_HORIZONTAL;
+            else if (0 == strcmp("vertical", argv[i+1]))
+               iScan = SCAN_VERTICAL;
+            else
+               iScan = SCAN_AUTO;
+            i += 2;
+        } else if (0 == strcmp("--fields", argv[i])) {
+            for (iFields=FIELDS_COUNT-1; iFields>=0; iFields--)
+            {
+               if (0 == strcmp(szFieldNames[iFields], argv[i+1]))
+                  break;
+            }
+            i += 2;
+        } else if (0 == strcmp("--lossy", argv[i])) {
+            iLossy = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--lossy-tiles", argv[i])) {
+            bLossyTiles = 1;
+            i++;
+        } else if (0 == strcmp("--lossy-frames", argv[i])) {
+            iLossyFrames = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--windows", argv[i])) {
+            bWindows = 1;
+            i++;
+        } else if (0 == strcmp("--patterns", argv[i])) {
+            bPatterns = 1;
+            i++;
+        } else if (0 == strcmp("--tiles", argv[i])) {
+            bTiles = 1;
+            i++;
+        } else if (0 == strcmp("--commands", argv[i])) {
+            bCommands = 1;
+            i++;
+        } else if (0 == strcmp("--page-aligned", argv[i])) {
+            bPageAligned = 1;
+            i++;
+        } else if (0 == strcmp("--pingpong", argv[i])) {
+            bPingPong = 1;
+            i++;
+        } else if (0 == strcmp("--loop-frame", argv[i])) {
+            bLoopFrame = 1;
+            i++;
+        } else if (0 == strcmp("--gray", argv[i])) {
+            iGrayBits = atoi(argv[i+1]);
+            if (iGrayBits < 1)
+               iGrayBits = 1;
+            if (iGrayBits > GRAY_MAX_PLANES)
+               iGrayBits = GRAY_MAX_PLANES;
+            i += 2;
+        } else if (0 == strcmp("--stats", argv[i])) {
+            bStats = 1;
+            i++;
+        } else if (0 == strcmp("--stats-json", argv[i])) {
+            bStats = 1;
+            strcpy(szStatsJSON, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--stats-pbm", argv[i])) {
+            bStats = 1;
+            strcpy(szStatsPBM, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--cache", argv[i])) {
+            strcpy(szCache, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--cache-mb", argv[i])) {
+            iCacheMB = atoi(argv[i+1]);
+            i += 2;
 	} else if (0 == strcmp("--invert", argv[i])) {
             bInvert = 1;
             i++;
@@ -93,6 +437,53 @@ int i = 1;
             exit(1);
         }
     }
+    if (iClips > 1)
+        bBundle = 1;
+    if (bCCode && (bBundle || iGrayBits > 1 || bTiles))
+    {
+        fprintf(stderr, "--c-code takes a single clip and no --gray or --tiles\n");
+        exit(1);
+    }
+    if (iLossy > 0 && (iLossyFrames < 1 || iLossy * iLossyFrames > 65535))
+    {
+        fprintf(stderr, "--lossy * --lossy-frames must be 1 to 65535\n");
+        exit(1);
+    }
+    if (bPageAligned) // page addressing can't go down a column
+    {
+        if (iScan == SCAN_VERTICAL)
+        {
+            fprintf(stderr, "--page-aligned streams are scanned horizontally\n");
+            exit(1);
+        }
+        iScan = SCAN_HORIZONTAL;
+    }
+    if (bCommands && iGrayBits > 1)
+    {
+        fprintf(stderr, "--commands can't be combined with --gray\n");
+        exit(1);
+    }
+    if (iTargetFPS && !iMaxFrameBytes) // each I2C byte takes 9 clocks
+    {
+        if (iBusKHz == 0)
+           iBusKHz = 400;
+        iMaxFrameBytes = (iBusKHz * 1000) / (9 * iTargetFPS);
+        if (iMaxFrameBytes < RATE_MIN_BYTES)
+        {
+            fprintf(stderr, "--target-fps can be at most %d at %d kHz\n", (iBusKHz * 1000) / (9 * RATE_MIN_BYTES), iBusKHz);
+            exit(1);
+        }
+    }
+    if (iMaxFrameBytes < 0 || (iMaxFrameBytes > 0 && iMaxFrameBytes < RATE_MIN_BYTES))
+    { // rate controlled frames must be able to send at least 1 byte
+        fprintf(stderr, "--max-bytes-per-frame must be at least %d\n", RATE_MIN_BYTES);
+        exit(1);
+    }
+    if (bLoopFrame && iMaxFrameBytes) // it goes out whole at the loop point
+    {
+        fprintf(stderr, "--loop-frame can't be combined with --max-bytes-per-frame or --target-fps\n");
+        exit(1);
+    }
 } /* parse_opts() */
 //
 // Gather a vertical byte from horizontal pixels
@@ -144,185 +535,257 @@ int i;
    return 1; // yes, all bytes are equal
 } /* CheckShortRepeat() */
 //
-// Find repeats in a length of "different" bytes
+// Set up the encoder for a field split (FIELDS_*)
 //
-int TryRepeat(int *iDiffCount, unsigned char *pTemp, unsigned char *pDest, int *iLen)
+static void SetFields(ENCODER *pEnc, int iSplit)
 {
-int i, j, x;
-int iCount, iStart;
-int iRepeat;
-unsigned char ucMatch;
+   pEnc->iFields = iSplit;
+   pEnc->iSkipBits = iFieldSkipBits[iSplit];
+   pEnc->iSkipMax = (1 << pEnc->iSkipBits) - 1;
+   pEnc->iCopyMax = (1 << (6 - pEnc->iSkipBits)) - 1;
+} /* SetFields() */
+//
+// Hash of the 8 bytes of a tile (the upper bits are the best mixed)
+//
+static uint64_t TileHash(unsigned char *s)
+{
+uint64_t ull;
 
-#ifdef DEBUG_LOG
-printf("Entering TryRepeat(), iDiffCount = %d\n", *iDiffCount);
-#endif
+   memcpy(&ull, s, TILE_SIZE);
+   return ull * 0x9e3779b97f4a7c15ULL;
+} /* TileHash() */
+//
+// Set up the encoder to draw the iCount tiles at pTiles (0 = none)
+//
+static void SetTiles(ENCODER *pEnc, unsigned char *pTiles, int iCount)
+{
+int i, j;
 
-   i = *iLen; // output offset
-   iCount = *iDiffCount;
-   iStart = 0;
-   iRepeat = 1;
-   ucMatch = pTemp[0];
-   for (x=1; x<iCount; x++)
+   pEnc->iTiles = iCount;
+   memmove(pEnc->ucTiles, pTiles, iCount * TILE_SIZE);
+   memset(pEnc->iTileHash, 0, sizeof(pEnc->iTileHash));
+   for (i=0; i<iCount; i++)
+   {
+      j = (int)(TileHash(pEnc->ucTiles[i]) >> 54) & (TILE_HASH - 1);
+      while (pEnc->iTileHash[j]) // (never full)
+         j = (j + 1) & (TILE_HASH - 1);
+      pEnc->iTileHash[j] = (short)(i + 1);
+   }
+} /* SetTiles() */
+//
+// Number of the tile to draw at offset i of the scan order instead of
+// coding the bytes which changed there; -1 if there's no such tile or
+// too few of its bytes changed for it to pay off
+//
+static int FindTile(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, int i)
+{
+int j, k, iChanged;
+
+   if (pEnc->iTiles == 0 || (i & (TILE_SIZE-1)))
+      return -1;
+   for (j=iChanged=0; j<TILE_SIZE; j++)
+      iChanged += (pCur[i+j] != pPrev[i+j]);
+   if (iChanged < TILE_MIN_CHANGED)
+      return -1;
+   for (j=(int)(TileHash(&pCur[i]) >> 54) & (TILE_HASH-1); (k = pEnc->iTileHash[j]) != 0; j=(j+1) & (TILE_HASH-1))
+   {
+      if (memcmp(pEnc->ucTiles[k-1], &pCur[i], TILE_SIZE) == 0)
+         return k-1;
+   }
+   return -1;
+} /* FindTile() */
+//
+// Short skip+copy and copy+skip opcodes of the encoder's field split
+//
+#define SKIPCOPY(pEnc, s, c) (unsigned char)(OP_SKIPCOPY | ((s) << (6 - (pEnc)->iSkipBits)) | (c))
+#define COPYSKIP(pEnc, c, s) (unsigned char)(OP_COPYSKIP | ((c) << (pEnc)->iSkipBits) | (s))
+//
+// Skip and copy lengths of a short skip+copy or copy+skip opcode in a
+// stream of field split iSplit
+//
+static void OpFields(unsigned char bCode, int iSplit, int *iSkip, int *iCopy)
+{
+int iSkipBits = iFieldSkipBits[iSplit];
+
+   if ((bCode & OP_MASK) == OP_SKIPCOPY)
+   {
+      *iSkip = (bCode & 0x3f) >> (6 - iSkipBits);
+      *iCopy = bCode & ((1 << (6 - iSkipBits)) - 1);
+   }
+   else
+   {
+      *iCopy = (bCode & 0x3f) >> iSkipBits;
+      *iSkip = bCode & ((1 << iSkipBits) - 1);
+   }
+} /* OpFields() */
+//
+// Store a run of bytes which don't repeat as long and short copies
+//
+static void PackCopy(ENCODER *pEnc, unsigned char *pDest, int *iLen, unsigned char *pSrc, int j)
+{
+int i = *iLen;
+
+   while (j >= 256)
    {
-      if (ucMatch == pTemp[x]) // count repeats
-      {
-          iRepeat++;
-      }
-      else // start a new search, take care of old
-      {
-         if (iRepeat >= 3)
-         {
-             j = (x - iStart) - iRepeat; // non-repeats before this section
-             if (j != 0) // non-repeats before the repeating bytes
-             {
-                 if (j > 7) // big copy
-                 {
-                    while (j >= 256)
-                    {
 #ifdef DEBUG_LOG
 printf("big copy 256\n");
 #endif
-                        pDest[i++] = OP_COPYSKIP; // big copy
-                        pDest[i++] = 0xff; // max length 256
-                        memcpy(&pDest[i], &pTemp[iStart], 256);
-                        i += 256;
-                        j -= 256;
-                        iStart += 256;
-                    }
-                    if (j > 7)
-                    {
+      pDest[i++] = OP_COPYSKIP; // big copy
+      pDest[i++] = 0xff; // max length 256
+      memcpy(&pDest[i], pSrc, 256);
+      i += 256;
+      pSrc += 256;
+      j -= 256;
+   }
+   if (j > pEnc->iCopyMax)
+   {
 #ifdef DEBUG_LOG
 printf("big copy %d,", j);
-DumpHex(&pTemp[iStart], j);
+DumpHex(pSrc, j);
 #endif
-                        pDest[i++] = OP_COPYSKIP;
-                        pDest[i++] = (unsigned char)(j - 1);
-                        memcpy(&pDest[i], &pTemp[iStart], j);
-                        i += j;
-                        iStart += j;
-                        j = 0;
-                    }
-                 }
-                 if (j > 0 && j <= 7) // short diff
-                 {
+      pDest[i++] = OP_COPYSKIP;
+      pDest[i++] = (unsigned char)(j - 1);
+      memcpy(&pDest[i], pSrc, j);
+      i += j;
+      j = 0;
+   }
+   if (j > 0) // short diff
+   {
 #ifdef DEBUG_LOG
 printf("short copy %d,", j);
-DumpHex(&pTemp[iStart], j);
+DumpHex(pSrc, j);
 #endif
-                     if (CheckShortRepeat(&pTemp[iStart], j))
-                     {
-                        pDest[i++] = OP_REPEAT + (j-1);
-                        pDest[i++] = pTemp[iStart];
-                     }
-                     else
-                     {
-                        pDest[i++] = OP_COPYSKIP + (j<<3);
-                        memcpy(&pDest[i], &pTemp[iStart], j);
-                        i += j;
-                     }
-                     iStart += j;
-                 }
-             }
-             // now encode the repeat
-             while (iRepeat >= 64)
-             {
+      if (CheckShortRepeat(pSrc, j))
+      {
+         pDest[i++] = OP_REPEAT + (j-1);
+         pDest[i++] = pSrc[0];
+      }
+      else
+      {
+         pDest[i++] = COPYSKIP(pEnc, j, 0);
+         memcpy(&pDest[i], pSrc, j);
+         i += j;
+      }
+   }
+   *iLen = i;
+} /* PackCopy() */
+//
+// Store a run of identical bytes
+//
+static void PackRepeat(unsigned char *pDest, int *iLen, unsigned char ucMatch, int iRepeat)
+{
+int i = *iLen;
+
+   while (iRepeat >= 64)
+   {
 #ifdef DEBUG_LOG
 printf("repeat 64, 0x%02x\n", ucMatch);
 #endif
-                 pDest[i++] = OP_REPEAT | 0x3f; // 64
-                 pDest[i++] = ucMatch;
-                 iRepeat -= 64;
-                 iStart += 64;
-             }
-             if (iRepeat) // last repeat
-             {
+      pDest[i++] = OP_REPEAT | 0x3f; // 64
+      pDest[i++] = ucMatch;
+      iRepeat -= 64;
+   }
+   if (iRepeat) // last repeat
+   {
 #ifdef DEBUG_LOG
 printf("repeat %d, 0x%02x\n", iRepeat, ucMatch);
 #endif
-                 pDest[i++] = OP_REPEAT | (unsigned char)(iRepeat-1);
-                 pDest[i++] = ucMatch;
-                 iStart += iRepeat;
-             }
-         } // repeat >= 3
-         ucMatch = pTemp[x];
-         iRepeat = 1;
-      }
-   } // for x
-// Pack the non-repeats and repeats as needed
-   if (iRepeat >= 3) // pack the last set of repeats
-   {
-             j = (x - iStart) - iRepeat; // non-repeats before this section
-             if (j != 0) // non-repeats before the repeating bytes
-             {
-                 if (j > 7) // big diff
-                 {
-                    while (j >= 256)
-                    {
-#ifdef DEBUG_LOG
-printf("big copy 256\n");
-#endif
-                        pDest[i++] = OP_COPYSKIP; // big copy
-                        pDest[i++] =0xff; // max length 256
-                        memcpy(&pDest[i], &pTemp[iStart], 256);
-                        i += 256;
-                        j -= 256;
-                        iStart += 256;
-                    }
-                    if (j > 7)
-                    {
-#ifdef DEBUG_LOG
-printf("big copy %d", j);
-DumpHex(&pTemp[iStart], j);
-#endif
-                        pDest[i++] = OP_COPYSKIP;
-                        pDest[i++] = (unsigned char)(j - 1);
-                        memcpy(&pDest[i], &pTemp[iStart], j);
-			i += j;
-                        iStart += j;
-                        j = 0;
-                    }
-                 }
-                 if (j > 0 && j <= 7) // short diff
-                 {
-#ifdef DEBUG_LOG
-printf("short copy %d,", j);
-DumpHex(&pTemp[iStart], j);
-#endif
-                     if (CheckShortRepeat(&pTemp[iStart], j))
-                     {
-                        pDest[i++] = OP_REPEAT + (j-1);
-                        pDest[i++] = pTemp[iStart];
-                     }
-                     else
-                     {
-                        pDest[i++] = OP_COPYSKIP + (j<<3);
-                        memcpy(&pDest[i], &pTemp[iStart], j);
-                        i += j;
-                     }
-                     iStart += j;
-                 }
-             }
-             // now encode the repeat
-             while (iRepeat >= 64)
-             {
+      pDest[i++] = OP_REPEAT | (unsigned char)(iRepeat-1);
+      pDest[i++] = ucMatch;
+   }
+   *iLen = i;
+} /* PackRepeat() */
+//
+// Find the 2-4 byte pattern which repeats from the start of s and saves
+// the most stream bytes over copying it (at least PATTERN_MIN_SAVE)
+// Returns the number of bytes it covers (whole patterns) or 0 for none
+//
+static int FindPattern(unsigned char *s, int iCount, int *iPeriod, int *iSaved)
+{
+int i, p, iLen, iSave, iBest = 0;
+
+   *iSaved = PATTERN_MIN_SAVE - 1;
+   for (p=2; p<=4 && p*2 <= iCount; p++)
+   {
+      if (CheckShortRepeat(s, p)) // a single byte is a plain repeat
+         continue;
+      for (i=p; i<iCount && s[i] == s[i-p]; i++);
+      iLen = i - (i % p);
+      iSave = iLen - ((iLen/p + 63) / 64) * (2 + p);
+      if (iSave > *iSaved)
+      {
+         *iSaved = iSave;
+         *iPeriod = p;
+         iBest = iLen;
+      }
+   }
+   return iBest;
+} /* FindPattern() */
+//
+// Store iCount bytes (whole patterns) of the iPeriod byte pattern at s
+//
+static void PackPattern(unsigned char *pDest, int *iLen, unsigned char *s, int iPeriod, int iCount)
+{
+int i = *iLen;
+int iReps;
+
+   iCount /= iPeriod;
+   while (iCount)
+   {
+      iReps = (iCount > 64) ? 64 : iCount;
 #ifdef DEBUG_LOG
-printf("repeat 64, 0x%02x\n", ucMatch);
+printf("pattern %d x %d,", iReps, iPeriod);
+DumpHex(s, iPeriod);
 #endif
-                 pDest[i++] = OP_REPEAT | 0x3f; // 64
-                 pDest[i++] = ucMatch;
-                 iRepeat -= 64;
-                 iStart += 64;
-             }
-             if (iRepeat)
-             {
+      pDest[i++] = OP_PATTERN;
+      pDest[i++] = (unsigned char)(((iPeriod - 2) << 6) | (iReps - 1));
+      memcpy(&pDest[i], s, iPeriod);
+      i += iPeriod;
+      iCount -= iReps;
+   }
+   *iLen = i;
+} /* PackPattern() */
+//
+// Find repeats (and with --patterns, repeating 2-4 byte patterns) in a
+// length of "different" bytes. Runs of 3 or more identical bytes are
+// packed along with the copies before them; the bytes after the last
+// one are left for the caller.
+//
+int TryRepeat(ENCODER *pEnc, int *iDiffCount, unsigned char *pTemp, unsigned char *pDest, int *iLen)
+{
+int i, x;
+int iCount, iStart;
+int iRepeat, iPattern, iPeriod, iSaved;
+
 #ifdef DEBUG_LOG
-printf("repeat %d, 0x%02x\n", iRepeat, ucMatch);
+printf("Entering TryRepeat(), iDiffCount = %d\n", *iDiffCount);
 #endif
-                 pDest[i++] = OP_REPEAT | (iRepeat-1); // big repeat
-                 pDest[i++] = ucMatch;
-                 iStart += iRepeat;
-             }
-   } // pack last set of repeats
+
+   i = *iLen; // output offset
+   iCount = *iDiffCount;
+   iStart = 0;
+   x = 0;
+   while (x < iCount)
+   {
+      for (iRepeat=1; x+iRepeat < iCount && pTemp[x+iRepeat] == pTemp[x]; iRepeat++);
+      iPattern = bPatterns ? FindPattern(&pTemp[x], iCount - x, &iPeriod, &iSaved) : 0;
+      if (iPattern && iSaved > iRepeat - 2) // beats the plain repeat
+      {
+         PackCopy(pEnc, pDest, &i, &pTemp[iStart], x - iStart);
+         PackPattern(pDest, &i, &pTemp[x], iPeriod, iPattern);
+         x += iPattern;
+         iStart = x;
+      }
+      else if (iRepeat >= 3)
+      {
+         PackCopy(pEnc, pDest, &i, &pTemp[iStart], x - iStart);
+         PackRepeat(pDest, &i, pTemp[x], iRepeat);
+         x += iRepeat;
+         iStart = x;
+      }
+      else // (a shorter run can't hold the start of a longer one)
+         x++;
+   }
    // we could have lingering non-repeats that we couldn't pack
    *iDiffCount -= iStart;
    *iLen = i;
@@ -333,7 +796,7 @@ printf("repeat %d, 0x%02x\n", iRepeat, ucMatch);
 // When entering this function, either there will be both a skip and diff
 // count, or it will be the last set of data at the end of the frame
 //
-void CompressIt(unsigned char *pDest, int *iLen, int *iSkipCount, int *iDiffCount, unsigned char *pTemp, int bFinal)
+void CompressIt(ENCODER *pEnc, unsigned char *pDest, int *iLen, int *iSkipCount, int *iDiffCount, unsigned char *pTemp, int bFinal)
 {
 int i = *iLen; // local copy of length
 
@@ -344,7 +807,7 @@ printf("Entering CompressIt, size = %d\n", i);
    if (*iSkipCount & 0x8000) // skipped bytes are first
    {
       *iSkipCount &= 0x7fff;
-      if (*iSkipCount > 7) // big skip
+      if (*iSkipCount > pEnc->iSkipMax) // big skip
       {
          while(*iSkipCount >= 256)
          {
@@ -355,7 +818,7 @@ printf("BigSkip 256\n");
             pDest[i++] = 0xff; // max skip = 256 at a time
             *iSkipCount -= 256; 
          }
-         if (*iSkipCount > 7) // another big skip
+         if (*iSkipCount > pEnc->iSkipMax) // another big skip
          {
 #ifdef DEBUG_LOG
 printf("BigSkip %d\n", *iSkipCount);
@@ -363,7 +826,7 @@ printf("BigSkip %d\n", *iSkipCount);
             pDest[i++] = 0x00; // big skip
             pDest[i++] = (unsigned char)(*iSkipCount - 1);
             *iSkipCount = 0;
-            if (!bFinal && *iDiffCount > 0 && *iDiffCount <= 7) // diff count becomes 'first'
+            if (!bFinal && *iDiffCount > 0 && *iDiffCount <= pEnc->iCopyMax) // diff count becomes 'first'
             {
                *iDiffCount |= 0x8000; // diff is now first
                *iLen = i;
@@ -371,7 +834,7 @@ printf("BigSkip %d\n", *iSkipCount);
             }
          }
       } // big skip
-      if (*iSkipCount <= 7 && *iDiffCount > 0 && *iDiffCount <= 7) // 2 short
+      if (*iSkipCount <= pEnc->iSkipMax && *iDiffCount > 0 && *iDiffCount <= pEnc->iCopyMax) // 2 short
       { // skip/copy (both short)
 #ifdef DEBUG_LOG
 printf("skip+copy %d,%d,", *iSkipCount, *iDiffCount);
@@ -380,13 +843,13 @@ DumpHex(pTemp, *iDiffCount);
          if (CheckShortRepeat(pTemp, *iDiffCount))
          {
             if (*iSkipCount)
-               pDest[i++] = OP_SKIPCOPY | (unsigned char)(*iSkipCount << 3);
+               pDest[i++] = SKIPCOPY(pEnc, *iSkipCount, 0);
             pDest[i++] = OP_REPEAT | (*iDiffCount-1); // repeat
             pDest[i++] = pTemp[0];
          }
          else
          {
-            pDest[i++] = OP_SKIPCOPY | (unsigned char)((*iSkipCount << 3) | (*iDiffCount));
+            pDest[i++] = SKIPCOPY(pEnc, *iSkipCount, *iDiffCount);
             memcpy(&pDest[i], pTemp, *iDiffCount);
             i += *iDiffCount;
          }
@@ -394,17 +857,17 @@ DumpHex(pTemp, *iDiffCount);
          *iLen = i;
          return;
       }
-      if (*iSkipCount <=7 && *iDiffCount > 7) // need to do a short skip, long diff
+      if (*iSkipCount <= pEnc->iSkipMax && *iDiffCount > pEnc->iCopyMax) // need to do a short skip, long diff
       {
          if (*iSkipCount != 0) // store just the skip by itself
          {
 #ifdef DEBUG_LOG
 printf( "skip+copy %d,0\n", *iSkipCount);
 #endif
-            pDest[i++] = OP_SKIPCOPY | (unsigned char)(*iSkipCount << 3);
+            pDest[i++] = SKIPCOPY(pEnc, *iSkipCount, 0);
             *iSkipCount = 0;
          }
-         pTemp += TryRepeat(iDiffCount, pTemp, pDest, &i);
+         pTemp += TryRepeat(pEnc, iDiffCount, pTemp, pDest, &i);
          while (*iDiffCount >= 256) // store long diffs
          {
 #ifdef DEBUG_LOG
@@ -416,7 +879,7 @@ printf("big copy 256\n");
             i += 256; pTemp += 256;
             *iDiffCount -= 256;
          } // while >= 256 diff
-         if (*iDiffCount > 7) // wrap up the rest as a long diff
+         if (*iDiffCount > pEnc->iCopyMax) // wrap up the rest as a long diff
          {
 #ifdef DEBUG_LOG
 printf("big copy %d,", *iDiffCount);
@@ -441,7 +904,7 @@ DumpHex(pTemp, *iDiffCount);
             }
             else
             {
-               pDest[i++] = OP_COPYSKIP | (*iDiffCount << 3); // short copy
+               pDest[i++] = COPYSKIP(pEnc, *iDiffCount, 0); // short copy
                memcpy(&pDest[i], pTemp, *iDiffCount);
                i += *iDiffCount;
             }
@@ -455,7 +918,7 @@ DumpHex(pTemp, *iDiffCount);
 #ifdef DEBUG_LOG
 printf("final skip %d\n", *iSkipCount);
 #endif
-         pDest[i++] = OP_SKIPCOPY | (unsigned char)(*iSkipCount << 3);
+         pDest[i++] = SKIPCOPY(pEnc, *iSkipCount, 0);
          *iLen = i;
          return;
       }
@@ -472,7 +935,7 @@ printf("big copy final 256\n");
             i += 256; pTemp += 256;
             *iDiffCount -= 256;
          }
-         if (*iDiffCount > 7) // wrap up the rest as a long diff
+         if (*iDiffCount > pEnc->iCopyMax) // wrap up the rest as a long diff
          {
 #ifdef DEBUG_LOG
 printf("big copy final %d,", *iDiffCount);
@@ -497,7 +960,7 @@ DumpHex(pTemp, *iDiffCount);
             }
             else
             {
-               pDest[i++] = OP_COPYSKIP | (*iDiffCount << 3); // short copy
+               pDest[i++] = COPYSKIP(pEnc, *iDiffCount, 0); // short copy
                memcpy(&pDest[i], pTemp, *iDiffCount);
                i += *iDiffCount;
             }
@@ -510,9 +973,9 @@ DumpHex(pTemp, *iDiffCount);
    else // copy bytes are first
    {
       *iDiffCount &= 0x7fff;
-      if (*iDiffCount > 7) // big diff first
+      if (*iDiffCount > pEnc->iCopyMax) // big diff first
       {
-         pTemp += TryRepeat(iDiffCount, pTemp, pDest, &i);
+         pTemp += TryRepeat(pEnc, iDiffCount, pTemp, pDest, &i);
          while (*iDiffCount >= 256) // long ones
          {
 #ifdef DEBUG_LOG
@@ -524,7 +987,7 @@ printf("big copy 256\n");
             i += 256; pTemp += 256;
             *iDiffCount -= 256;
          }
-         if (*iDiffCount > 7) // last long count
+         if (*iDiffCount > pEnc->iCopyMax) // last long count
          {
 #ifdef DEBUG_LOG
 printf("big copy %d,", *iDiffCount);
@@ -540,7 +1003,7 @@ DumpHex(pTemp, *iDiffCount);
       } // big diff
       if (*iDiffCount) // small diff left over?
       {
-         if (*iSkipCount <= 7) // small small
+         if (*iSkipCount <= pEnc->iSkipMax) // small small
          {
 #ifdef DEBUG_LOG
 printf("copy+skip %d,%d,", *iDiffCount, *iSkipCount);
@@ -548,14 +1011,24 @@ DumpHex(pTemp, *iDiffCount);
 #endif
             if (CheckShortRepeat(pTemp, *iDiffCount))
             {
-               pDest[i++] = OP_REPEATSKIP | (unsigned char)((*iDiffCount << 3) + (*iSkipCount));
-               pDest[i++] = pTemp[0];
+               if (*iDiffCount <= 7 && *iSkipCount <= 7)
+               {
+                  pDest[i++] = OP_REPEATSKIP | (unsigned char)((*iDiffCount << 3) + (*iSkipCount));
+                  pDest[i++] = pTemp[0];
+               }
+               else // (a repeat+skip always has 3 bit fields)
+               {
+                  pDest[i++] = OP_REPEAT | (*iDiffCount-1);
+                  pDest[i++] = pTemp[0];
+                  if (*iSkipCount)
+                     pDest[i++] = SKIPCOPY(pEnc, *iSkipCount, 0);
+               }
                pTemp += *iDiffCount;
                *iDiffCount = *iSkipCount = 0;
             }
             if (*iDiffCount || *iSkipCount) // may not have any
             {
-               pDest[i++] = OP_COPYSKIP | (unsigned char)((*iDiffCount << 3) | *iSkipCount);
+               pDest[i++] = COPYSKIP(pEnc, *iDiffCount, *iSkipCount);
                memcpy(&pDest[i], pTemp, *iDiffCount);
                pTemp += *iDiffCount;
                i += *iDiffCount;
@@ -575,7 +1048,7 @@ DumpHex(pTemp, *iDiffCount);
             }
             else
             {
-               pDest[i++] = OP_COPYSKIP | (*iDiffCount << 3);
+               pDest[i++] = COPYSKIP(pEnc, *iDiffCount, 0);
                memcpy(&pDest[i], pTemp, *iDiffCount);
                i += *iDiffCount;
             }
@@ -590,7 +1063,7 @@ printf("big skip 256\n");
                pDest[i++] = 0xff; // skip 256
                *iSkipCount -= 256;
             } // while skip >= 256
-            if (*iSkipCount > 7) // last big skip
+            if (*iSkipCount > pEnc->iSkipMax) // last big skip
             {
 #ifdef DEBUG_LOG
 printf("big skip %d\n", *iSkipCount);
@@ -628,375 +1101,3525 @@ printf("big skip final %d\n", *iSkipCount);
    *iLen = i;
 } /* CompressIt() */
 //
-// Convert the current GIF frame into 1-bpp by simple thresholding
+// Write a 1-bpp frame (MSB first, 16 bytes per line) as a PBM image
+// For debugging
+//
+void SavePBM(char *szName, unsigned char *pFrame)
+{
+FILE *pf;
+unsigned char ucLine[16];
+int x, y;
+
+   pf = fopen(szName, "wb");
+   if (pf == NULL)
+      return;
+   fprintf(pf, "P4\n128 64\n");
+   for (y=0; y<64; y++)
+   {
+      for (x=0; x<16; x++)
+         ucLine[x] = ~pFrame[y*16 + x]; // 1 = black in PBM
+      fwrite(ucLine, 1, 16, pf);
+   }
+   fclose(pf);
+} /* SavePBM() */
 //
-void Make1Bit(unsigned char *pFrame, PIL_PAGE *pp)
+// Convert the current GIF frame into 1-bpp; ucBit maps each luma value
+// of the canvas to 0 or 1
+//
+static void MakeBitmap(ENCODER *pEnc, unsigned char *pFrame, GIFANIM *pGIF, unsigned char *ucBit)
 {
-int y, x, r, g, b;
+int y, x, x0, y0;
 unsigned char *s, *d;
 unsigned char ucMask;
 
    memset(pFrame, 0, 128*8);
    // grab the current frame in "normal" bit/byte order
-   // simple threshold to 1-bpp
-   if (pp->cBitsperpixel == 16) // need to co
+   x0 = y0 = 0;
+   if (pEnc->iTop != -1 && pEnc->iLeft != -1)
+   {
+      x0 = pEnc->iLeft;
+      y0 = pEnc->iTop;
+   }
+   for (y=0; y<64; y++)
    {
-      for (y=0; y<64; y++)
+      if (y0 + y >= pGIF->iHeight)
+         break;
+      s = &pGIF->pCanvas[(y0 + y) * pGIF->iWidth];
+      d = &pFrame[y*16];
+      ucMask = 0x80;
+      for (x=0; x<128; x++)
       {
-         if (iTop != -1 && iLeft != -1)
-            s = pp->pData + (iLeft*2) + (y+iTop)*pp->iPitch;
-         else
-            s = pp->pData + pp->iPitch * y;
-         d = &pFrame[y*16];
-         ucMask = 0x80;
-         for (x=0; x<128; x++)
+         if (x0 + x < pGIF->iWidth && ucBit[s[x0 + x]]) // it's white
+            d[0] |= ucMask;
+         ucMask >>= 1;
+         if (ucMask == 0)
          {
-            r = s[1] & 0xf8;
-            g = (s[0] & 0xe0) >> 3;
-            g |= ((s[1] & 7) << 5);
-            b = ((s[0] & 0x1f) << 3);
-            if ((r + g + b) > 384) // it's white
-               d[0] |= ucMask;
-            s += 2;
-            ucMask >>= 1;
-            if (ucMask == 0)
-            {
-               d++;
-               ucMask = 0x80;
-            }
-         } // for x
-      } // for y
-   } // 16-bpp
+            d++;
+            ucMask = 0x80;
+         }
+      } // for x
+   } // for y
 // Invert if requested
-   if (bInvert)
+   if (pEnc->bInvert)
    {
      for (x=0; x<1024; x++)
      {
         pFrame[x] = ~pFrame[x];
      }
    }
-} /* Make1Bit() */
+} /* MakeBitmap() */
 //
-// Compress the current frame against the previous
+// Convert the current GIF frame into 1-bpp by simple thresholding
+// of the canvas luma
 //
-void AddFrame(PIL_PAGE *pp, unsigned char *pPrev, unsigned char *pData, int *iSize, int bFirst)
+void Make1Bit(ENCODER *pEnc, unsigned char *pFrame, GIFANIM *pGIF)
 {
-int iLen = *iSize;
-unsigned char *pFrame = PILIOAlloc(128*8); // temporary frame
-unsigned char ucTemp[1024];
-int iDiffCount, iSkipCount;
-int x, y;
-
-   Make1Bit(pFrame, pp);
+unsigned char ucBit[256];
+int i;
 
+   for (i=0; i<256; i++)
+      ucBit[i] = (i > 128);
+   MakeBitmap(pEnc, pFrame, pGIF, ucBit);
+} /* Make1Bit() */
 //
-// Compress the data using the pixel layout of the SSD1306
+// Convert a 1-bpp frame into the pixel layout of the SSD1306
 // vertical bytes with the LSB at the top
 // 128 bytes per row, 8 rows total
 //
-   if (bFirst) // First frame only has intra coding, not inter
+void MakeOLED(unsigned char *pFrame, unsigned char *pOLED)
+{
+int x, y;
+
+   for (y = 0; y<64; y+=8)
    {
-      iDiffCount = iSkipCount = 0;
-      for (y = 0; y<64; y+=8)
+      for (x=0; x<128; x++)
       {
-         for (x=0; x<128; x++)
-         {
-            ucTemp[iDiffCount++] = GetByte(pFrame, x, y);
-         } // for x
-      } // for y
-      iDiffCount |= 0x8000; // mark it as 'first'
-      CompressIt(pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1); // do it in one shot
-   }
-   else
-   { // find differences between the current and previous frame
-   iSkipCount = 0;
-   iDiffCount = 0;
-   x = y = 0;
-   while (y < 64)
+         *pOLED++ = GetByte(pFrame, x, y);
+      } // for x
+   } // for y
+} /* MakeOLED() */
+//
+// Convert the current GIF frame into iGrayBits bit planes in SSD1306
+// layout, most significant first; the luma is spread evenly over the
+// gray levels and the player shows each plane for a time that goes with
+// its weight
+//
+void MakeGray(ENCODER *pEnc, unsigned char *pPlanes, GIFANIM *pGIF)
+{
+unsigned char ucBit[256], ucFrame[1024];
+int i, p, iLevels;
+
+   iLevels = (1 << iGrayBits) - 1;
+   for (p=0; p<iGrayBits; p++)
    {
-      while (y < 64 && GetByte(pFrame, x, y) == GetByte(pPrev, x, y)) // unchanged bytes from previous frame
-      {
-         if (iDiffCount == 0 && iSkipCount == 0)
-            iSkipCount = 0x8000; // mark this as being first
-         iSkipCount++;
-         x++;
-         if (x == 128) // next line
-         {
-            x = 0;
-            y += 8;
-         }
-      } // while counting "skip" bytes 
-      if ((iSkipCount & 0x7fff) && (iDiffCount & 0x7fff)) // if have both, store them
-         CompressIt(pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 0);
-      while (y < 64 && GetByte(pFrame, x, y) != GetByte(pPrev, x, y)) // changed
-      {
-         if (iDiffCount == 0 && iSkipCount == 0)
-            iDiffCount = 0x8000; // mark this as being first
-         ucTemp[(iDiffCount & 0x7fff)] = GetByte(pFrame, x, y);
-         iDiffCount++;
-         x++;
-         if (x == 128) // next line
-         {
-            x = 0;
-            y += 8;
-         }
-      } // while counting "copy" bytes
-      if ((iSkipCount & 0x7fff) && (iDiffCount & 0x7fff)) // if have both, store them
-         CompressIt(pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 0);
-   } // while compressing frame
-   CompressIt(pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1); // compress last part
-   } // not the first frame
-   memcpy(pPrev, pFrame, 128*8); // old becomes the current
-   PILIOFree(pFrame);
-   *iSize = iLen;
-} /* AddFrame() */
+      for (i=0; i<256; i++)
+         ucBit[i] = (((i * iLevels + 127) / 255) >> (iGrayBits - 1 - p)) & 1;
+      MakeBitmap(pEnc, ucFrame, pGIF, ucBit);
+      MakeOLED(ucFrame, &pPlanes[p * 1024]);
+   }
+} /* MakeGray() */
 //
-// Play the frames back into destination image to test
+// Copy the luma of the cropped 128x64 area of the current GIF frame
 //
-void PlayBack(unsigned char *pData, int iLen)
+static void GetLuma(ENCODER *pEnc, unsigned char *pLuma, GIFANIM *pGIF)
 {
-int x, y;
-int iFrame, i, j, iOff;
-unsigned char b, bCode;
-unsigned char ucScreen[2024]; // destination bitmap
-unsigned char ucBMP[1024]; // for generating output BMP
+int y, x, x0, y0;
 
-   iFrame = iOff = 0;
-   while (iOff < iLen) // process all compressed data
+   memset(pLuma, 0, 128*64);
+   x0 = y0 = 0;
+   if (pEnc->iTop != -1 && pEnc->iLeft != -1)
    {
-      i = 0; // graphics offset on SSD1306
-      while (i < 1024) // while decompressing the current frame
+      x0 = pEnc->iLeft;
+      y0 = pEnc->iTop;
+   }
+   for (y=0; y<64 && y0 + y < pGIF->iHeight; y++)
+   {
+      for (x=0; x<128 && x0 + x < pGIF->iWidth; x++)
+         pLuma[y*128 + x] = pGIF->pCanvas[(y0 + y) * pGIF->iWidth + x0 + x];
+   }
+} /* GetLuma() */
+//
+// Contrast level (0-255) at which the luma of a frame is that of a key
+// frame scaled down, give or take FADE_TOLERANCE per pixel
+// Returns -1 if it isn't a dimmed copy of the key
+//
+static int FadeLevel(unsigned char *pLuma, unsigned char *pKey)
+{
+int i, iLevel;
+int64_t llDot = 0, llKey = 0;
+
+   for (i=0; i<128*64; i++)
+   {
+      llDot += pLuma[i] * pKey[i];
+      llKey += pKey[i] * pKey[i];
+   }
+   if (llKey == 0)
+      return -1;
+   iLevel = (int)((llDot * 255 + llKey / 2) / llKey);
+   if (iLevel > 255)
+      return -1;
+   for (i=0; i<128*64; i++)
+   {
+      if (abs(pLuma[i] * 255 - pKey[i] * iLevel) > FADE_TOLERANCE * 255)
+         return -1;
+   }
+   return iLevel;
+} /* FadeLevel() */
+//
+// Find the fades of a clip (--commands): runs of frames whose luma is
+// one key frame (the brightest) at different brightness. Each frame of
+// a run gets the bitmap of the key and its brightness as contrast level,
+// so the display is dimmed instead of rewritten as the image thins out;
+// frames dimmer than FADE_MIN_LEVEL are blank.
+//
+static void FindFades(unsigned char *pFrames, unsigned char *pLevels, unsigned char *pLuma, int iCount)
+{
+int i, j, k, iKey, iNext, iMin;
+int64_t *pSums;
+
+   pSums = malloc(iCount * sizeof(int64_t));
+   for (i=0; i<iCount; i++)
+   {
+      pSums[i] = 0;
+      for (j=0; j<128*64; j++)
+         pSums[i] += pLuma[i*128*64 + j];
+   }
+   for (i=0; i<iCount; i=j)
+   {
+      iKey = i;
+      for (j=i+1; j<iCount; j++) // grow the run while it stays one image
+      {
+         iNext = (pSums[j] > pSums[iKey]) ? j : iKey;
+         for (k=(iNext == iKey) ? j : i; k<=j; k++)
+         {
+            if (FadeLevel(&pLuma[k*128*64], &pLuma[iNext*128*64]) < 0)
+               break;
+         }
+         if (k <= j)
+            break;
+         iKey = iNext;
+      }
+      iMin = 255;
+      for (k=i; k<j; k++)
+      {
+         pLevels[k] = (unsigned char)FadeLevel(&pLuma[k*128*64], &pLuma[iKey*128*64]);
+         if (pLevels[k] < iMin)
+            iMin = pLevels[k];
+      }
+      if (iMin >= 255 - FADE_TOLERANCE) // just noise
+      {
+         memset(&pLevels[i], 255, j - i);
+         continue;
+      }
+      for (k=i; k<j; k++)
+      {
+         if (pLevels[k] < FADE_MIN_LEVEL)
+            memset(&pFrames[k*1024], 0, 1024);
+         else if (k != iKey)
+            memcpy(&pFrames[k*1024], &pFrames[iKey*1024], 1024);
+      }
+   }
+   free(pSums);
+} /* FindFades() */
+//
+// Compress a frame (in SSD1306 layout) against the previous one
+// in the current scan order using only the linear opcodes
+// With --page-aligned, a run of changed bytes is cut (and stored) at the
+// end of each page, so that no copy, repeat or pattern wraps to the next
+// one; skips still cross pages since they end in an explicit position
+// anyway. parse_opts() only allows it with the horizontal scan.
+// With a tile table, whatever is pending is stored at each tile which
+// the frame draws, and the tile opcode goes after it
+//
+static void EncodeLinear(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pData, int *iSize, int bFirst)
+{
+int iLen = *iSize;
+unsigned char ucTemp[1024], ucScanCur[1024], ucScanPrev[1024];
+int iDiffCount, iSkipCount;
+int i, k, iLine;
+
+   if (pEnc->bVertical) // walk the display column by column (8 bytes each)
+   {
+      for (i=0; i<1024; i++)
+      {
+         ucScanCur[i] = pCur[((i & 7) << 7) + (i >> 3)];
+         ucScanPrev[i] = pPrev[((i & 7) << 7) + (i >> 3)];
+      }
+      pCur = ucScanCur;
+      pPrev = ucScanPrev;
+   }
+   iLine = bPageAligned ? 128 : 1024;
+   if (bFirst && pEnc->iTiles) // code it as a change from a screen which
+   {                           // differs everywhere to find its tiles
+      for (i=0; i<1024; i++)
+         ucScanPrev[i] = ~pCur[i];
+      pPrev = ucScanPrev;
+      bFirst = 0;
+   }
+   if (bFirst) // First frame only has intra coding, not inter
+   {
+      for (i=0; i<1024; i+=iLine) // (in one shot unless page aligned)
+      {
+         memcpy(ucTemp, &pCur[i], iLine);
+         iDiffCount = iLine | 0x8000; // mark it as 'first'
+         iSkipCount = 0;
+         CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1);
+      }
+   }
+   else
+   { // find differences between the current and previous frame
+   iSkipCount = 0;
+   iDiffCount = 0;
+   i = 0;
+   while (i < 1024)
+   {
+      k = FindTile(pEnc, pCur, pPrev, i);
+      if (k >= 0)
+      {
+         CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1);
+         iSkipCount = iDiffCount = 0;
+         pData[iLen++] = OP_TILE;
+         pData[iLen++] = (unsigned char)k;
+         i += TILE_SIZE;
+         continue;
+      }
+      while (i < 1024 && pCur[i] == pPrev[i] && FindTile(pEnc, pCur, pPrev, i) < 0) // unchanged bytes from previous frame
+      {
+         if (iDiffCount == 0 && iSkipCount == 0)
+            iSkipCount = 0x8000; // mark this as being first
+         iSkipCount++;
+         i++;
+      } // while counting "skip" bytes 
+      if ((iSkipCount & 0x7fff) && (iDiffCount & 0x7fff)) // if have both, store them
+         CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 0);
+      while (i < 1024 && pCur[i] != pPrev[i] && FindTile(pEnc, pCur, pPrev, i) < 0) // changed
+      {
+         if (iDiffCount == 0 && iSkipCount == 0)
+            iDiffCount = 0x8000; // mark this as being first
+         ucTemp[(iDiffCount & 0x7fff)] = pCur[i];
+         iDiffCount++;
+         i++;
+         if ((i & (iLine-1)) == 0 && i < 1024) // end of a line; store it all
+         {
+            CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1);
+            iSkipCount = iDiffCount = 0;
+         }
+      } // while counting "copy" bytes
+      if ((iSkipCount & 0x7fff) && (iDiffCount & 0x7fff)) // if have both, store them
+         CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 0);
+   } // while compressing frame
+   CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucTemp, 1); // compress last part
+   } // not the first frame
+   *iSize = iLen;
+} /* EncodeLinear() */
+//
+// Expand a pattern opcode; s points at its operand byte
+// Returns the number of bytes written
+//
+static int ExpandPattern(unsigned char *s, unsigned char *pOut)
+{
+int i, iPeriod, iCount;
+
+   iPeriod = PATTERN_PERIOD(s[0]);
+   iCount = PATTERN_COUNT(s[0]);
+   for (i=0; i<iCount; i++)
+      pOut[i] = s[1 + (i % iPeriod)];
+   return iCount;
+} /* ExpandPattern() */
+//
+// Expand the copy, repeat and pattern opcodes which carry the data of a
+// window (iSplit is the field split of the stream)
+// Returns the number of stream bytes used
+//
+int ExpandWindow(unsigned char *pData, unsigned char *pOut, int iCount, int iSplit)
+{
+unsigned char *s, bCode;
+int i, j, iSkip;
+
+   s = pData;
+   i = 0;
+   while (i < iCount)
+   {
+      bCode = *s++;
+      switch (bCode & OP_MASK)
       {
-      bCode = pData[iOff++];
-      switch (bCode & 0xc0) // different compression types
+         case OP_SKIPCOPY: // short copy
+            OpFields(bCode, iSplit, &iSkip, &j);
+            memcpy(&pOut[i], s, j);
+            s += j;
+            break;
+         case OP_COPYSKIP:
+            if (bCode == OP_COPYSKIP)
+               j = *s++ + 1;
+            else
+               OpFields(bCode, iSplit, &iSkip, &j);
+            memcpy(&pOut[i], s, j);
+            s += j;
+            break;
+         case OP_REPEATSKIP:
+            if (bCode == OP_PATTERN)
+            {
+               j = ExpandPattern(s, &pOut[i]);
+               s += 1 + PATTERN_PERIOD(s[0]);
+               break;
+            }
+            j = (bCode & 0x38) >> 3;
+            memset(&pOut[i], *s++, j);
+            break;
+         default: // OP_REPEAT
+            j = (bCode & 0x3f) + 1;
+            memset(&pOut[i], *s++, j);
+            break;
+      }
+      i += j;
+   }
+   return (int)(s - pData);
+} /* ExpandWindow() */
+//
+// Offset of the first frame of a stream, past its header and tile table
+// if it has them; *iFlags receives the header flags (0 without one)
+//
+static int StreamStart(unsigned char *pData, int iLen, int *iFlags)
+{
+int iOff = 0;
+
+   *iFlags = 0;
+   if (iLen >= STREAM_HEADER_SIZE && pData[0] == STREAM_MARKER0 && pData[1] == STREAM_MARKER1)
+   {
+      *iFlags = pData[2] | (pData[3] << 8);
+      iOff = STREAM_HEADER_SIZE;
+      if ((*iFlags & STREAM_TILES) && iOff < iLen)
+         iOff += 1 + (pData[iOff] + 1) * TILE_SIZE;
+   }
+   return (iOff < iLen) ? iOff : iLen;
+} /* StreamStart() */
+//
+// Tile table of a stream or bundle (its count byte), 0 if it has none
+// or the table doesn't fit
+//
+static unsigned char *StreamTiles(unsigned char *pData, int iLen)
+{
+unsigned char *s;
+int iOff;
+
+   if (iLen >= BUNDLE_HEADER_SIZE && memcmp(pData, "OAB1", 4) == 0)
+   {
+      if (!(pData[8] & STREAM_TILES))
+         return 0;
+      iOff = BUNDLE_HEADER_SIZE + (pData[4] | (pData[5] << 8)) * 4 + (pData[6] | (pData[7] << 8)) * 4;
+      if (iOff + 4 > iLen)
+         return 0;
+      s = &pData[iOff]; // the end of the chunk data
+      iOff = s[0] | (s[1] << 8) | (s[2] << 16) | (s[3] << 24);
+   }
+   else if (iLen >= STREAM_HEADER_SIZE && pData[0] == STREAM_MARKER0 && pData[1] == STREAM_MARKER1 && (pData[2] & STREAM_TILES))
+      iOff = STREAM_HEADER_SIZE;
+   else
+      return 0;
+   if (iOff < 0 || iOff >= iLen || iOff + 1 + (pData[iOff] + 1) * TILE_SIZE > iLen)
+      return 0;
+   return &pData[iOff];
+} /* StreamTiles() */
+//
+// Model of the bytes sent over I2C to play one encoded frame
+// Each data write costs the address and control bytes plus the data.
+// Repositioning costs 3 command bytes; consecutive positioning commands
+// share a single transaction (address + control byte).
+// iSplit is the field split of the stream.
+// Returns the number of bytes and updates the stream offset
+//
+int FrameBusCost(unsigned char *pData, int *iOffset, int iSplit)
+{
+int i, j, iCost, bMoved, iSkip1, iSkip2;
+unsigned char *s, bCode;
+
+   s = &pData[*iOffset];
+   i = 0;
+   bMoved = 1; // every frame starts with a position command
+   iCost = 2 + 3;
+   while (i < 1024)
+   {
+      bCode = *s++;
+      iSkip1 = iSkip2 = j = 0;
+      switch (bCode & OP_MASK)
       {
-         case OP_SKIPCOPY: // skip/copy
+         case OP_SKIPCOPY:
             if (bCode == OP_SKIPCOPY) // big skip
+               iSkip1 = *s++ + 1;
+            else
+               OpFields(bCode, iSplit, &iSkip1, &j);
+            s += j;
+            break;
+         case OP_COPYSKIP:
+            if (bCode == OP_COPYSKIP) // big copy
+               j = *s++ + 1;
+            else
+               OpFields(bCode, iSplit, &iSkip2, &j);
+            s += j;
+            break;
+         case OP_REPEATSKIP:
+            if (bCode == OP_WINDOW) // set window, data, restore + reposition
             {
-               b = pData[iOff++];
-               i += b + 1;
+            unsigned char ucTemp[1024];
+               j = (s[1] + 1) * ((s[2] & 7) + 1);
+               s += 3;
+               s += ExpandWindow(s, ucTemp, j, iSplit);
+               iCost += (bMoved ? 6 : 8) + 2 + j + 2 + 6 + 3;
+               bMoved = 1;
+               continue;
             }
-            else // skip/copy
+            if (bCode == OP_PATTERN)
             {
-               i += ((bCode & 0x38) >> 3); // skip amount
-               memcpy(&ucScreen[i], &pData[iOff], bCode & 7);
-               iOff += (bCode & 7);
-               i += bCode & 7;
+               j = PATTERN_COUNT(s[0]);
+               s += 1 + PATTERN_PERIOD(s[0]);
+               break;
             }
-            break;
-         case OP_COPYSKIP: // copy/skip
-            if (bCode == OP_COPYSKIP) // big copy
+            if (bCode == OP_TILE)
             {
-               b = pData[iOff++];
-               j = b + 1;
-               memcpy(&ucScreen[i], &pData[iOff], j); // copy
-               iOff += j;
-               i += j;
+               j = TILE_SIZE;
+               s++;
+               break;
             }
-            else
+            if (bCode == OP_COMMAND) // shares the transaction of other commands
             {
-               j = ((bCode & 0x38) >> 3);
-               memcpy(&ucScreen[i], &pData[iOff], j); // copy
-               iOff += j;
-               i += j;
-               i += (bCode & 7); // skip
+               j = (s[0] == 0x81) ? 2 : 1;
+               s += j;
+               iCost += bMoved ? j : 2 + j;
+               bMoved = 1;
+               continue;
             }
-            break;
-         case OP_REPEATSKIP:
-            j = ((bCode & 0x38) >> 3); // repeat
-            b = pData[iOff++];
-            memset(&ucScreen[i], b, j);
-            i += j;
-            i += (bCode & 7); // skip
+            j = (bCode & 0x38) >> 3;
+            iSkip2 = bCode & 7;
+            s++;
             break;
          case OP_REPEAT:
             j = (bCode & 0x3f) + 1;
-            b = pData[iOff++];
-            memset(&ucScreen[i], b, j);
-            i += j;
-            break;  
-      } // switch on code type
-      } // while decompressing the current frame
-// Convert SSD1306 style bytes into "normal" byte order
-      memset(ucBMP, 0, 1024);
-      i = 0;
-      for (y=0; y<64; y+=8)
+            s++;
+            break;
+      }
+      if (iSkip1)
       {
-         for (x=0; x<128; x++)
+         i += iSkip1;
+         iCost += bMoved ? 3 : 5;
+         bMoved = 1;
+      }
+      if (j)
+      {
+         i += j;
+         iCost += 2 + j;
+         bMoved = 0;
+      }
+      if (iSkip2)
+      {
+         i += iSkip2;
+         iCost += bMoved ? 3 : 5;
+         bMoved = 1;
+      }
+   }
+   *iOffset = (int)(s - pData);
+   return iCost;
+} /* FrameBusCost() */
+//
+// Find the bounding boxes of the areas which changed
+// Changed bytes belong to the same area when they are on the same page
+// within WINDOW_GAP columns or on neighboring pages within 1 column
+// pBoxes receives x, page, width, height for each box
+// Returns the number of boxes
+//
+static int FindBoxes(unsigned char *pCur, unsigned char *pPrev, int *pBoxes)
+{
+unsigned char ucSeen[1024];
+int iStack[1024];
+int i, j, x, y, dx, dy, iSP, iCount, iGap;
+int iLeft, iRight, iTop, iBottom;
+
+   memset(ucSeen, 0, sizeof(ucSeen));
+   iCount = 0;
+   for (i=0; i<1024; i++)
+   {
+      if (ucSeen[i] || pCur[i] == pPrev[i])
+         continue;
+      iLeft = iRight = i & 127;
+      iTop = iBottom = i >> 7;
+      ucSeen[i] = 1;
+      iStack[0] = i;
+      iSP = 1;
+      while (iSP) // flood fill the area
+      {
+         j = iStack[--iSP];
+         x = j & 127; y = j >> 7;
+         if (x < iLeft) iLeft = x;
+         if (x > iRight) iRight = x;
+         if (y < iTop) iTop = y;
+         if (y > iBottom) iBottom = y;
+         for (dy=-1; dy<=1; dy++)
          {
-            bCode = 0x80 >> (x & 7);
-            b = ucScreen[i];
-            for (j=0; j<8; j++)
+            if (y + dy < 0 || y + dy > 7)
+               continue;
+            iGap = dy ? 1 : WINDOW_GAP;
+            for (dx=-iGap; dx<=iGap; dx++)
             {
-               if (b & 1) // LSB first
-                  ucBMP[(x>>3) + ((y+j)*16)] |= bCode;
-               b >>= 1;
+               if (x + dx < 0 || x + dx > 127)
+                  continue;
+               j = ((y + dy) << 7) + x + dx;
+               if (!ucSeen[j] && pCur[j] != pPrev[j])
+               {
+                  ucSeen[j] = 1;
+                  iStack[iSP++] = j;
+               }
             }
-            i++; // next byte column
          }
-      } // for y
-#ifdef SAVE_OUTPUT_FRAMES
-      // Write it to a file
+      }
+      pBoxes[iCount*4] = iLeft;
+      pBoxes[iCount*4+1] = iTop;
+      pBoxes[iCount*4+2] = iRight - iLeft + 1;
+      pBoxes[iCount*4+3] = iBottom - iTop + 1;
+      iCount++;
+   }
+   return iCount;
+} /* FindBoxes() */
+//
+// Write a window opcode with the box contents of the current frame
+// The data is in the order the display fills the window and is coded
+// like an intra frame (copies and repeats only)
+//
+static void AddWindow(ENCODER *pEnc, unsigned char *pCur, int *pBox, unsigned char *pData, int *iSize)
+{
+unsigned char ucBox[1024];
+int iLen = *iSize;
+int x, y, iCount, iSkipCount, iDiffCount;
+
+   pData[iLen++] = OP_WINDOW;
+   pData[iLen++] = (unsigned char)pBox[0];
+   pData[iLen++] = (unsigned char)(pBox[2] - 1);
+   pData[iLen++] = (unsigned char)((pBox[1] << 3) | (pBox[3] - 1));
+   iCount = 0;
+   if (pEnc->bVertical) // column by column
+   {
+      for (x=pBox[0]; x<pBox[0]+pBox[2]; x++)
+         for (y=pBox[1]; y<pBox[1]+pBox[3]; y++)
+            ucBox[iCount++] = pCur[(y << 7) + x];
+   }
+   else // page by page
+   {
+      for (y=pBox[1]; y<pBox[1]+pBox[3]; y++)
+         for (x=pBox[0]; x<pBox[0]+pBox[2]; x++)
+            ucBox[iCount++] = pCur[(y << 7) + x];
+   }
+   iDiffCount = iCount | 0x8000;
+   iSkipCount = 0;
+   CompressIt(pEnc, pData, &iLen, &iSkipCount, &iDiffCount, ucBox, 1);
+   *iSize = iLen;
+} /* AddWindow() */
+//
+// Compress a frame, sending boxes of changes which span several pages
+// through a window when that lowers the bus cost. The window opcodes come
+// first; the linear opcodes then skip over the bytes they covered.
+//
+static void EncodeWindows(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pData, int *iSize)
+{
+int iBoxes[1024*4];
+unsigned char ucLinear[1024], ucTry[1024], ucWindows[4096], ucTemp[4096];
+int i, y, iCount, iWinLen, iLen, iOffset, iCost, iBest;
+
+   iCount = FindBoxes(pCur, pPrev, iBoxes);
+   memcpy(ucLinear, pCur, 1024);
+   iLen = iOffset = 0;
+   EncodeLinear(pEnc, ucLinear, pPrev, ucTemp, &iLen, 0);
+   iBest = FrameBusCost(ucTemp, &iOffset, pEnc->iFields) + iLen;
+   iWinLen = 0;
+   for (i=0; i<iCount; i++)
+   {
+      if (iBoxes[i*4+3] < 2) // a single page is no better than a copy
+         continue;
+      memcpy(ucTry, ucLinear, 1024);
+      for (y=iBoxes[i*4+1]; y<iBoxes[i*4+1]+iBoxes[i*4+3]; y++)
+         memcpy(&ucTry[(y << 7) + iBoxes[i*4]], &pPrev[(y << 7) + iBoxes[i*4]], iBoxes[i*4+2]);
+      memcpy(ucTemp, ucWindows, iWinLen);
+      iLen = iWinLen;
+      AddWindow(pEnc, pCur, &iBoxes[i*4], ucTemp, &iLen);
+      EncodeLinear(pEnc, ucTry, pPrev, ucTemp, &iLen, 0);
+      iOffset = 0;
+      iCost = FrameBusCost(ucTemp, &iOffset, pEnc->iFields) + iLen;
+      if (iCost < iBest)
       {
-         PIL_FILE pf;
-         PIL_PAGE pp;
-         char szName[32];
-            memset(&pp, 0, sizeof(pp));
-            pp.iWidth = 128;
-            pp.iHeight = 64;
-            pp.iPitch = 16;
-            pp.cBitsperpixel = 1;
-            pp.iDataSize = 1024;
-            pp.cCompression = PIL_COMP_NONE;
-            pp.pData = ucBMP;
-            pp.cFlags = PIL_PAGEFLAGS_TOPDOWN;
-            sprintf(szName, "out%d.bmp", iFrame);
-            PILCreate(szName, &pf, 0, PIL_FILE_WINBMP);
-            PILWrite(&pf, &pp, 0);
-            PILClose(&pf);
+         iBest = iCost;
+         memcpy(ucLinear, ucTry, 1024);
+         AddWindow(pEnc, pCur, &iBoxes[i*4], ucWindows, &iWinLen);
       }
-#endif // SAVE_OUTPUT_FRAMES
-      iFrame++;
-   } // while processing compressed data
-} /* PlayBack() */
+   }
+   memcpy(&pData[*iSize], ucWindows, iWinLen);
+   *iSize += iWinLen;
+   EncodeLinear(pEnc, ucLinear, pPrev, pData, iSize, 0);
+} /* EncodeWindows() */
+//
+// Compress a frame (in SSD1306 layout) against the previous one
+// in the current scan order
+//
+void EncodeFrame(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pData, int *iSize, int bFirst)
+{
+   if (bWindows && !bFirst)
+      EncodeWindows(pEnc, pCur, pPrev, pData, iSize);
+   else
+      EncodeLinear(pEnc, pCur, pPrev, pData, iSize, bFirst);
+} /* EncodeFrame() */
+//
+// Display byte (SSD1306 layout) at offset i of the scan order
+//
+static int ScanByte(ENCODER *pEnc, int i)
+{
+   return pEnc->bVertical ? ((i & 7) << 7) + (i >> 3) : i;
+} /* ScanByte() */
+//
+// Bus cost of a frame if only the first iRuns (in priority order)
+// of the changed runs (scan offset and length) are sent
+//
+static int RateTryRuns(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pTarget, int *pRuns, int iRuns)
+{
+unsigned char ucData[2048];
+int i, j, n, iLen, iOffset;
 
+   memcpy(pTarget, pPrev, 1024);
+   for (i=0; i<iRuns; i++)
+   {
+      for (j=0; j<pRuns[i*2+1]; j++)
+      {
+         n = ScanByte(pEnc, pRuns[i*2] + j);
+         pTarget[n] = pCur[n];
+      }
+   }
+   iLen = iOffset = 0;
+   EncodeFrame(pEnc, pTarget, pPrev, ucData, &iLen, 0);
+   return FrameBusCost(ucData, &iOffset, pEnc->iFields);
+} /* RateTryRuns() */
 //
-// Write the binary data as C statements
-// ready to drop into an Arduino project
+// Limit the frame to the bus byte budget by sending only the most
+// important runs of changed bytes. A run's importance is the number of
+// pixels which differ, scaled by how many frames its bytes have waited.
+// The runs are found in the scan order of the stream, so that each one
+// is a single write. If not even the most important run fits, as much
+// of it as fits is sent (at least 1 byte, so that the frame progresses).
+// pTarget receives what the display will show after this frame.
+// Returns the number of bytes still left to send
 //
-void MakeCode(void *ohandle, unsigned char *pData, int iLen)
+int RateControl(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pTarget)
 {
-int i;
-char szLine[256], szTemp[16];
+int iRuns[1024*2], iScore[1024];
+int i, j, k, n, iCount, iLow, iHigh, iPending;
+unsigned char c;
 
-	PILIOWrite(ohandle, "const byte bAnimation[] PROGMEM = {\n", 36); 
-	for (i=0; i<iLen; i++)
-	{
-		if ((i & 15) == 0)
-			sprintf(szLine,"  ");
-		if (i == iLen-1)
-			sprintf(szTemp, "0x%02x", pData[i]);
-		else
-			sprintf(szTemp, "0x%02x,", pData[i]);
-		strcat(szLine, szTemp);
-		if (i == iLen-1 || (i & 15) == 15)
-		{
-			strcat(szLine, "\n");
-			PILIOWrite(ohandle, szLine, strlen(szLine));
-		}
-	}
-	PILIOWrite(ohandle, "};\n", 3);
-} /* MakeCode() */
+   iCount = 0;
+   for (i=0; i<1024;) // gather the runs of changed bytes
+   {
+      n = ScanByte(pEnc, i);
+      if (pCur[n] == pPrev[n])
+      {
+         pEnc->ucAge[n] = 0;
+         i++;
+         continue;
+      }
+      iRuns[iCount*2] = i;
+      iScore[iCount] = 0;
+      while (i < 1024 && i - iRuns[iCount*2] < RATE_MAX_RUN)
+      {
+         n = ScanByte(pEnc, i);
+         c = pCur[n] ^ pPrev[n];
+         if (c == 0)
+            break;
+         for (j=0; j<8; j++) // number of pixels changed, weighted by age
+            iScore[iCount] += ((c >> j) & 1) * (1 + pEnc->ucAge[n]);
+         i++;
+      }
+      iRuns[iCount*2+1] = i - iRuns[iCount*2];
+      iCount++;
+   }
+   for (i=1; i<iCount; i++) // sort by descending importance
+   {
+      for (j=i; j>0 && iScore[j] > iScore[j-1]; j--)
+      {
+         k = iScore[j]; iScore[j] = iScore[j-1]; iScore[j-1] = k;
+         k = iRuns[j*2]; iRuns[j*2] = iRuns[(j-1)*2]; iRuns[(j-1)*2] = k;
+         k = iRuns[j*2+1]; iRuns[j*2+1] = iRuns[(j-1)*2+1]; iRuns[(j-1)*2+1] = k;
+      }
+   }
+   if (RateTryRuns(pEnc, pCur, pPrev, pTarget, iRuns, iCount) <= iMaxFrameBytes)
+      return 0; // everything fits
+   iLow = 0; iHigh = iCount; // find the most runs which fit
+   while (iHigh - iLow > 1)
+   {
+      k = (iLow + iHigh) / 2;
+      if (RateTryRuns(pEnc, pCur, pPrev, pTarget, iRuns, k) <= iMaxFrameBytes)
+         iLow = k;
+      else
+         iHigh = k;
+   }
+   if (iLow == 0) // send the start of the first run
+   {
+      iLow = 1; iHigh = iRuns[1] + 1; // (the longest which fits)
+      while (iHigh - iLow > 1)
+      {
+         iRuns[1] = (iLow + iHigh) / 2;
+         if (RateTryRuns(pEnc, pCur, pPrev, pTarget, iRuns, 1) <= iMaxFrameBytes)
+            iLow = iRuns[1];
+         else
+            iHigh = iRuns[1];
+      }
+      iRuns[1] = iLow;
+      iLow = 1;
+   }
+   RateTryRuns(pEnc, pCur, pPrev, pTarget, iRuns, iLow);
+   iPending = 0;
+   for (i=0; i<1024; i++)
+   {
+      if (pTarget[i] != pCur[i])
+      {
+         if (pEnc->ucAge[i] < 255)
+            pEnc->ucAge[i]++;
+         iPending++;
+      }
+   }
+   return iPending;
+} /* RateControl() */
+//
+// Count the bits set in a byte
+//
+static int CountBits(unsigned char c)
+{
+int i, iCount = 0;
 
-int main( int argc, char *argv[ ], char *envp[ ] )
+   for (i=0; i<8; i++)
+      iCount += (c >> i) & 1;
+   return iCount;
+} /* CountBits() */
+//
+// Lossy noise suppression
+// Changes of fewer than iLossy pixels (per byte or per 8x8 tile) are left
+// off the display. The skipped pixels are added to an error total for
+// each byte; once it reaches iLossy * iLossyFrames pixel-frames, the
+// change is sent so that content which really changed still shows up
+// (a 1 pixel change waits iLossy * iLossyFrames frames, a bigger one
+// less). parse_opts() keeps that product within the 16-bit counters.
+//
+void LossyFilter(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev)
 {
-PIL_FILE pf;
-PIL_PAGE pp1, pp2;
-int err;
-int i, iLen;
-unsigned char *pCompressed, *pPrevious;
+int i, j, iStep, iBits, iError;
 
-   if (argc < 3)
+   iStep = bLossyTiles ? 8 : 1;
+   for (i=0; i<1024; i+=iStep)
+   {
+      iBits = iError = 0;
+      for (j=i; j<i+iStep; j++)
       {
-      ShowHelp();
-      return 0;
+         iBits += CountBits(pCur[j] ^ pPrev[j]);
+         iError += pEnc->usError[j];
       }
-   parse_opts(argc, argv);
-   pCompressed = NULL;
-   iLen = 0;
-	err = PILOpen(szIn, &pf, 0, "BitBank", 0x35c4);
-	if (err == 0)
-	{
-		pCompressed = PILIOAlloc(0x40000); // try 256k
-		pPrevious = PILIOAlloc(128*8); // previous frame for compare
-		memset(pPrevious, 0, 128*8);
-		iLen = 0;
-		printf("size: %dx%d, bpp=%d, frames=%d\n", pf.iX, pf.iY, pf.cBpp, pf.iPageTotal);
-		// Read each frame one at a time
-		memset(&pp2, 0, sizeof(pp2));
-		pp2.iWidth = pf.iX;
-		pp2.iHeight = pf.iY;
-		pp2.cBitsperpixel = 16; // has to be
-		pp2.pData = PILIOAlloc(512*512*2);
-		pp2.iPitch = 1024;
-		pp2.iDataSize = pp2.iPitch * pp2.iHeight;
-		pp2.cFlags = PIL_PAGEFLAGS_TOPDOWN;
-		pp2.cCompression = PIL_COMP_NONE;
-		pp2.pPalette = PILIOAlloc(2048);
-if (pf.iPageTotal > 200) pf.iPageTotal = 200;
-		for (i=0; i<pf.iPageTotal; i++)
-		{
-		PIL_PAGE ppSrc;
-
-	                err = PILRead(&pf, &pp1, i, 0);
-        	        if (err)
-                	{       
-                        	printf("PILRead returned %d\n", err);
-                        	return -1;
-                	}
-
-			memset(&ppSrc, 0, sizeof(ppSrc));
-			ppSrc.cCompression = PIL_COMP_NONE;
-			err = PILConvert(&pp1, &ppSrc, 0, NULL, NULL);
-			if (err)
-			{
-				printf("PILConvert returned %d\n", err);
-				return -1;
-			}
-			if (i == 0) // get global color table from first frame
-			{
-				memcpy(pp2.pPalette, ppSrc.pPalette, 768);
-			}
-			err = PILAnimateGIF(&pp2, &ppSrc);
-			PILFree(&ppSrc);
-			PILFree(&pp1);
-			if (err == 0)
-			{
-#ifdef DEBUG_LOG
-printf("About to enter AddFrame() for frame %d\n", i);
-#endif
-				AddFrame(&pp2, pPrevious, pCompressed, &iLen, i == 0);
-#ifdef SAVE_INPUT_FRAMES
-				{
-				PIL_FILE pf2;
-                                char szName[32];
-					sprintf(szName, "in%d.bmp", i);
-					PILCreate(szName,&pf2, 0, PIL_FILE_WINBMP);
-					PILWrite(&pf2, &pp2, 0);
-					PILClose(&pf2);
-				}
-#endif // SAVE_INPUT_FRAMES
-			}
-			else
-			{
-				printf("Frame: %d, PILAnimate returned %d\n", i, err);
-			}
-		} // for i
-		if (iLen)
+      if (iBits == 0) // no change, nothing owed
+      {
+         memset(&pEnc->usError[i], 0, iStep * sizeof(pEnc->usError[0]));
+      }
+      else if (iBits < iLossy && iError + iBits < iLossy * iLossyFrames)
+      { // insignificant; keep showing the old pixels
+         for (j=i; j<i+iStep; j++)
+         {
+            pEnc->usError[j] += (unsigned short)CountBits(pCur[j] ^ pPrev[j]);
+            pCur[j] = pPrev[j];
+         }
+      }
+      else // significant or owed for too long
+      {
+         memset(&pEnc->usError[i], 0, iStep * sizeof(pEnc->usError[0]));
+      }
+   }
+} /* LossyFilter() */
+//
+// Compress the current frame against the previous
+// pCur and pPrev are in SSD1306 layout; pPrev holds what the display
+// is showing
+// Returns the number of changed bytes which were held back by rate control
+//
+int AddFrame(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pData, int *iSize, int bFirst)
+{
+unsigned char ucCur[1024], ucTarget[1024];
+int i, iPending = 0, iStart;
+
+   memcpy(ucCur, pCur, 1024);
+   if (iLossy && !bFirst)
+   {
+   unsigned char ucData[2048];
+   int iLossless = 0, iFiltered = 0;
+      EncodeFrame(pEnc, pCur, pPrev, ucData, &iLossless, 0);
+      LossyFilter(pEnc, ucCur, pPrev);
+      EncodeFrame(pEnc, ucCur, pPrev, ucData, &iFiltered, 0);
+      pEnc->iLossySaved += iLossless - iFiltered;
+      for (i=0; i<1024; i++)
+         pEnc->iLossyPixels += CountBits(ucCur[i] ^ pCur[i]);
+   }
+   if (iMaxFrameBytes && !bFirst)
+      iPending = RateControl(pEnc, ucCur, pPrev, ucTarget);
+   else
+      memcpy(ucTarget, ucCur, 1024);
+   iStart = *iSize;
+   EncodeFrame(pEnc, ucTarget, pPrev, pData, iSize, bFirst);
+   while (pData[iStart] == OP_WINDOW) // window opcodes lead the frame
+   {
+      pEnc->iWindowCount++;
+      i = (pData[iStart+2] + 1) * ((pData[iStart+3] & 7) + 1);
+      pEnc->iWindowBytes += i;
+      iStart += 4;
+      iStart += ExpandWindow(&pData[iStart], ucCur, i, pEnc->iFields); // ucCur is free now
+   }
+   memcpy(pPrev, ucTarget, 1024); // the display now shows this
+   return iPending;
+} /* AddFrame() */
+//
+// Trade the lossy and rate control state of the encoder for that of a
+// grayscale plane (calling it again trades it back)
+//
+static void GraySwap(ENCODER *pEnc, int iPlane)
+{
+unsigned char ucTemp[1024];
+unsigned short usTemp[1024];
+
+   if (iGrayBits == 1)
+      return;
+   memcpy(ucTemp, pEnc->ucAge, 1024);
+   memcpy(pEnc->ucAge, pEnc->ucPlaneAge[iPlane], 1024);
+   memcpy(pEnc->ucPlaneAge[iPlane], ucTemp, 1024);
+   memcpy(usTemp, pEnc->usError, sizeof(usTemp));
+   memcpy(pEnc->usError, pEnc->usPlaneError[iPlane], sizeof(usTemp));
+   memcpy(pEnc->usPlaneError[iPlane], usTemp, sizeof(usTemp));
+} /* GraySwap() */
+//
+// Hash of everything besides the bitmaps which the output depends on
+//
+static uint64_t CacheSettings(ENCODER *pEnc, int iType)
+{
+int iSettings[16];
+
+   iSettings[0] = CACHE_VERSION;
+   iSettings[1] = iType;
+   iSettings[2] = pEnc->bVertical;
+   iSettings[3] = iMaxFrameBytes;
+   iSettings[4] = iLossy;
+   iSettings[5] = bLossyTiles;
+   iSettings[6] = iLossyFrames;
+   iSettings[7] = bWindows;
+   iSettings[8] = bPatterns;
+   iSettings[9] = bPageAligned;
+   iSettings[10] = pEnc->bPingPong;
+   iSettings[11] = pEnc->bLoopFrame;
+   iSettings[12] = iGrayBits;
+   iSettings[13] = pEnc->iFields;
+   iSettings[14] = pEnc->iTiles;
+   iSettings[15] = pEnc->bCommands;
+   return CacheHash(pEnc->ucTiles, pEnc->iTiles * TILE_SIZE, CacheHash(iSettings, sizeof(iSettings), CACHE_HASH_INIT));
+} /* CacheSettings() */
+//
+// AddFrame() through the encode cache
+// A lossless frame without a byte budget only depends on the two bitmaps;
+// lossy and rate controlled frames carry state from frame to frame, so
+// they're only cached as part of their clip
+//
+static int CachedAddFrame(ENCODER *pEnc, unsigned char *pCur, unsigned char *pPrev, unsigned char *pData, int *iSize, int bFirst)
+{
+uint64_t ullKey;
+int iLen, iPending, iInfo[FRAME_INFO];
+
+   if (pCache == NULL || iLossy || iMaxFrameBytes)
+      return AddFrame(pEnc, pCur, pPrev, pData, iSize, bFirst);
+   ullKey = CacheSettings(pEnc, bFirst ? CACHE_FIRST : CACHE_FRAME);
+   ullKey = CacheHash(pPrev, 1024, CacheHash(pCur, 1024, ullKey));
+   iLen = CacheFind(pCache, ullKey, &pData[*iSize], MAX_FRAME_ENTRY);
+   if (iLen >= (int)sizeof(iInfo))
+   {
+      iLen -= sizeof(iInfo);
+      memcpy(iInfo, &pData[*iSize + iLen], sizeof(iInfo));
+      pEnc->iWindowCount += iInfo[0];
+      pEnc->iWindowBytes += iInfo[1];
+      *iSize += iLen;
+      memcpy(pPrev, pCur, 1024); // the display now shows this
+      pEnc->iFrameHits++;
+      return 0;
+   }
+   iInfo[0] = pEnc->iWindowCount;
+   iInfo[1] = pEnc->iWindowBytes;
+   iLen = *iSize;
+   iPending = AddFrame(pEnc, pCur, pPrev, pData, iSize, bFirst);
+   iInfo[0] = pEnc->iWindowCount - iInfo[0];
+   iInfo[1] = pEnc->iWindowBytes - iInfo[1];
+   memcpy(&pData[*iSize], iInfo, sizeof(iInfo)); // (past the end for now)
+   CacheStore(pCache, ullKey, &pData[iLen], *iSize - iLen + sizeof(iInfo));
+   pEnc->iFrameEncodes++;
+   return iPending;
+} /* CachedAddFrame() */
+//
+// Returns 1 if nothing of a frame is lit
+//
+static int FrameBlank(unsigned char *pFrame)
+{
+int i;
+
+   for (i=0; i<1024 && pFrame[i] == 0; i++)
+      ;
+   return (i == 1024);
+} /* FrameBlank() */
+//
+// Write the display commands which take the display from the state the
+// frames so far leave to iState (DISPLAY_*). It goes off first and on
+// last so that nothing in between shows.
+//
+static void EncodeState(ENCODER *pEnc, int iState, unsigned char *pData, int *iSize)
+{
+int iLen = *iSize;
+int iChange = iState ^ pEnc->iState;
+
+   if ((iChange & DISPLAY_OFF) && (iState & DISPLAY_OFF))
+   {
+      pData[iLen++] = OP_COMMAND;
+      pData[iLen++] = 0xae;
+   }
+   if (iChange & DISPLAY_INVERTED)
+   {
+      pData[iLen++] = OP_COMMAND;
+      pData[iLen++] = (iState & DISPLAY_INVERTED) ? 0xa7 : 0xa6;
+   }
+   if (iChange & DISPLAY_CONTRAST)
+   {
+      pData[iLen++] = OP_COMMAND;
+      pData[iLen++] = 0x81;
+      pData[iLen++] = (unsigned char)(iState & DISPLAY_CONTRAST);
+   }
+   if ((iChange & DISPLAY_OFF) && !(iState & DISPLAY_OFF))
+   {
+      pData[iLen++] = OP_COMMAND;
+      pData[iLen++] = 0xaf;
+   }
+   pEnc->iStateUsed |= iChange;
+   pEnc->iState = iState;
+   *iSize = iLen;
+} /* EncodeState() */
+//
+// Pick the display commands for a frame (what the display should show,
+// at contrast iLevel) and write them
+// A blank frame switches the display off and leaves its RAM alone; a
+// frame closer to the inverse of the RAM than to the RAM itself inverts
+// the display. Returns the bytes the RAM has to hold (in pRam).
+//
+static unsigned char *CommandFrame(ENCODER *pEnc, unsigned char *pCur, int iLevel, unsigned char *pPrev, unsigned char *pRam, unsigned char *pData, int *iSize)
+{
+int i, iState, iKeep, iFlip;
+unsigned char ucMask;
+
+   iState = pEnc->iState;
+   ucMask = (iState & DISPLAY_INVERTED) ? 0xff : 0x00;
+   if (FrameBlank(pCur))
+   {
+      memcpy(pRam, pPrev, 1024);
+      for (i=0; i<1024 && pPrev[i] == ucMask; i++) // (already showing nothing)
+         ;
+      if (i < 1024)
+         iState |= DISPLAY_OFF;
+   }
+   else
+   {
+      iState = (iState & DISPLAY_INVERTED) | iLevel;
+      iKeep = iFlip = 0;
+      for (i=0; i<1024; i++)
+      {
+         iKeep += (pPrev[i] != (pCur[i] ^ ucMask));
+         iFlip += (pPrev[i] != (unsigned char)~(pCur[i] ^ ucMask));
+      }
+      if (iFlip + INVERT_MIN_SAVE < iKeep)
+      {
+         iState ^= DISPLAY_INVERTED;
+         ucMask = ~ucMask;
+      }
+      for (i=0; i<1024; i++)
+         pRam[i] = pCur[i] ^ ucMask;
+   }
+   EncodeState(pEnc, iState, pData, iSize);
+   return pRam;
+} /* CommandFrame() */
+//
+// Size of a buffer which holds the stream of a clip of iCount frames
+// at worst: 2 bytes for each display byte (an opcode for every literal)
+// plus window headers and display commands, for the way back or loop
+// frame too, the tile table and the clip info which goes into the cache.
+// Rate control catch-up adds up to 1024 frames (each sends at least 1
+// byte), which carry no commands and so take no more stream bytes than
+// the bus bytes of the budget
+//
+int StreamSize(int iCount)
+{
+int iCatchUp = 0;
+
+   if (iMaxFrameBytes)
+      iCatchUp = 1024 * ((iMaxFrameBytes < 2 * 1024 + 64) ? iMaxFrameBytes : 2 * 1024 + 64);
+   return STREAM_HEADER_SIZE + 1 + TILE_MAX * TILE_SIZE + CLIP_INFO * sizeof(int) + (iCount * 2 * (2 * 1024 + 64) + iCatchUp) * iGrayBits;
+} /* StreamSize() */
+//
+// Encode a whole clip of frames (SSD1306 layout) in the current scan order
+// Returns the stream length; *iOutFrames receives the number of frames
+// in the stream (rate control may add some at the end)
+// With --pingpong, frames n-2 ... 0 follow the clip. The display can't be
+// read back and the AVR has no frame buffer, so the way back is coded as
+// deltas of its own (about as big as the way there; oledplay can play
+// any clip backward without them). Players loop from frame 1 instead of
+// sending the intra frame again.
+// With --loop-frame, the way from the last frame back to frame 0 is
+// stored as frame 1. Coming after frame 0 it changes nothing, so players
+// play frames 0 and 1 as one; looping players start each later pass at
+// frame 1 instead of sending the intra frame again. It's left out when it
+// would cost as many bus bytes as frame 0, and with rate control (it
+// goes out whole, so it would break the budget at every loop point).
+// With --gray, each frame is iGrayBits bit planes (most significant
+// first) and each plane is coded against the same plane of the frame
+// before, with its own lossy and rate control state.
+// With --tiles, the tile table of the encoder follows the header.
+// With --commands, display commands lead the frames which invert, dim
+// (pLevels, the contrast of each frame) or blank the display. Frame 0
+// also sets whatever any frame changes, and the way back or loop frame
+// restores its state.
+// With --cache, a clip which was encoded before with the same frames and
+// settings is copied from the cache
+//
+int EncodeClip(ENCODER *pEnc, unsigned char *pFrames, unsigned char *pLevels, int iCount, unsigned char *pOut, int *iOutFrames)
+{
+unsigned char ucPrev[GRAY_MAX_PLANES][1024], ucRam[1024], ucState[8], *pTemp, *pCur = NULL;
+int i, k, p, iLen, iTotal, iFirstStart, iFirstEnd, iFirstState, iLoopBus, iPending = 0;
+int iFlags = 0;
+int bClose = pEnc->bLoopFrame && !pEnc->bPingPong && !iMaxFrameBytes && iCount > 1 && iGrayBits == 1; // (ping-pong ends on frame 0)
+int iInfo[CLIP_INFO];
+uint64_t ullKey = 0;
+
+   if (pCache)
+   {
+      ullKey = CacheHash(&iCount, sizeof(iCount), CacheSettings(pEnc, CACHE_CLIP));
+      ullKey = CacheHash(pFrames, iCount * iGrayBits * 1024, ullKey);
+      if (pEnc->bCommands)
+         ullKey = CacheHash(pLevels, iCount, ullKey);
+      iLen = CacheFind(pCache, ullKey, pOut, StreamSize(iCount));
+      if (iLen >= (int)sizeof(iInfo))
+      {
+         iLen -= sizeof(iInfo);
+         memcpy(iInfo, &pOut[iLen], sizeof(iInfo));
+         *iOutFrames = iInfo[0];
+         pEnc->iRateLimited = iInfo[1];
+         pEnc->iRateAdded = iInfo[2];
+         pEnc->iLossySaved = iInfo[3];
+         pEnc->iLossyPixels = iInfo[4];
+         pEnc->iWindowCount = iInfo[5];
+         pEnc->iWindowBytes = iInfo[6];
+         pEnc->iClipHits++;
+         return iLen;
+      }
+   }
+   memset(ucPrev, 0, sizeof(ucPrev));
+   memset(pEnc->ucAge, 0, sizeof(pEnc->ucAge));
+   memset(pEnc->usError, 0, sizeof(pEnc->usError));
+   memset(pEnc->ucPlaneAge, 0, sizeof(pEnc->ucPlaneAge));
+   memset(pEnc->usPlaneError, 0, sizeof(pEnc->usPlaneError));
+   pEnc->iLossySaved = pEnc->iLossyPixels = pEnc->iRateLimited = pEnc->iRateAdded = 0;
+   pEnc->iWindowCount = pEnc->iWindowBytes = 0;
+   iFirstState = DISPLAY_DEFAULT;
+   if (pEnc->bCommands && !FrameBlank(pFrames))
+      iFirstState = pLevels[0];
+   pEnc->iState = iFirstState;
+   pEnc->iStateUsed = iFirstState ^ DISPLAY_DEFAULT;
+   iLen = 0;
+   if (pEnc->bVertical)
+      iFlags |= STREAM_VERTICAL;
+   if (bWindows)
+      iFlags |= STREAM_WINDOWS;
+   if (bPatterns)
+      iFlags |= STREAM_PATTERNS;
+   if (bPageAligned)
+      iFlags |= STREAM_PAGE_ALIGNED;
+   iTotal = iCount;
+   if (pEnc->bPingPong)
+   {
+      iFlags |= STREAM_PINGPONG;
+      iTotal = iCount * 2 - 1;
+   }
+   if (bClose)
+      iFlags |= STREAM_LOOP_FRAME;
+   iFlags |= (iGrayBits - 1) << STREAM_PLANES_SHIFT;
+   iFlags |= pEnc->iFields << STREAM_FIELDS_SHIFT;
+   if (pEnc->iTiles)
+      iFlags |= STREAM_TILES;
+   if (pEnc->bCommands)
+      iFlags |= STREAM_COMMANDS;
+   if (iFlags) // older players only know plain horizontal streams
+   {
+      pOut[iLen++] = STREAM_MARKER0;
+      pOut[iLen++] = STREAM_MARKER1;
+      pOut[iLen++] = (unsigned char)iFlags;
+      pOut[iLen++] = (unsigned char)(iFlags >> 8);
+   }
+   if (pEnc->iTiles) // the tile table follows the header
+   {
+      pOut[iLen++] = (unsigned char)(pEnc->iTiles - 1);
+      memcpy(&pOut[iLen], pEnc->ucTiles, pEnc->iTiles * TILE_SIZE);
+      iLen += pEnc->iTiles * TILE_SIZE;
+   }
+   iFirstStart = iLen;
+   k = iFirstEnd = 0;
+   for (i=0; i<iTotal; i++)
+   {
+      k = (i < iCount) ? i : (iCount - 1) * 2 - i; // (back down with --pingpong)
+#ifdef DEBUG_LOG
+printf("About to enter AddFrame() for frame %d\n", k);
+#endif
+      iPending = 0;
+      for (p=0; p<iGrayBits; p++)
+      {
+         pCur = &pFrames[(k*iGrayBits + p)*1024];
+         if (pEnc->bCommands && i > 0 && pEnc->bPingPong && i == iTotal - 1)
+            EncodeState(pEnc, iFirstState, pOut, &iLen); // back to frame 0 as it started
+         else if (pEnc->bCommands && i > 0) // (1-bpp)
+            pCur = CommandFrame(pEnc, pCur, pLevels[k], ucPrev[p], ucRam, pOut, &iLen);
+         GraySwap(pEnc, p);
+         iPending |= CachedAddFrame(pEnc, pCur, ucPrev[p], pOut, &iLen, i == 0);
+         GraySwap(pEnc, p);
+      }
+      if (iPending)
+         pEnc->iRateLimited++;
+      if (i == 0)
+         iFirstEnd = iLen;
+   }
+   if (iMaxFrameBytes) // finish sending the last frame (each frame sends at
+   {                   // least 1 byte, so this ends within 1024 frames)
+      while (iPending)
+      {
+         iPending = 0;
+         for (p=0; p<iGrayBits; p++)
+         {
+            GraySwap(pEnc, p);
+            iPending |= AddFrame(pEnc, pEnc->bCommands ? pCur : &pFrames[(k*iGrayBits + p)*1024], ucPrev[p], pOut, &iLen, 0);
+            GraySwap(pEnc, p);
+         }
+         pEnc->iRateAdded++;
+      }
+   }
+   for (p=0; p<iGrayBits && memcmp(ucPrev[p], &pFrames[p*1024], 1024) == 0; p++)
+      ;
+   if (pEnc->bPingPong && iCount > 1 && (p < iGrayBits || pEnc->iState != iFirstState))
+   {
+      // lossy frames didn't quite get back to frame 0, which frame 1 is
+      // coded against; send the rest exactly
+      EncodeState(pEnc, iFirstState, pOut, &iLen);
+      for (p=0; p<iGrayBits; p++)
+      {
+         EncodeFrame(pEnc, &pFrames[p*1024], ucPrev[p], pOut, &iLen, 0);
+         memcpy(ucPrev[p], &pFrames[p*1024], 1024);
+      }
+      pEnc->iRateAdded++;
+   }
+   if (bClose) // exact, so frame 1 can be coded against frame 0; move it there
+   {
+      i = iLen;
+      EncodeState(pEnc, iFirstState, pOut, &iLen);
+      EncodeFrame(pEnc, pFrames, ucPrev[0], pOut, &iLen, 0);
+      k = i;
+      iLoopBus = FrameBusCost(pOut, &k, pEnc->iFields);
+      k = iFirstStart;
+      if (iLoopBus >= FrameBusCost(pOut, &k, pEnc->iFields)) // sending frame 0 again is cheaper
+      {
+         iLen = i;
+         iFlags &= ~STREAM_LOOP_FRAME;
+         pOut[2] = (unsigned char)iFlags;
+         if (iFlags == 0) // a plain stream after all
+         {
+            iLen -= STREAM_HEADER_SIZE;
+            memmove(pOut, &pOut[STREAM_HEADER_SIZE], iLen);
+         }
+         bClose = 0;
+      }
+   }
+   if (bClose)
+   {
+      pTemp = malloc(iLen - i);
+      memcpy(pTemp, &pOut[i], iLen - i);
+      memmove(&pOut[iFirstEnd + iLen - i], &pOut[iFirstEnd], i - iFirstEnd);
+      memcpy(&pOut[iFirstEnd], pTemp, iLen - i);
+      free(pTemp);
+      iTotal++;
+   }
+   if (pEnc->iStateUsed) // frame 0 sets what the others change (the display
+   {                     // may come from another clip or the end of a loop)
+      k = 0;
+      if (pEnc->iStateUsed & DISPLAY_INVERTED)
+      {
+         ucState[k++] = OP_COMMAND;
+         ucState[k++] = 0xa6;
+      }
+      if (pEnc->iStateUsed & DISPLAY_CONTRAST)
+      {
+         ucState[k++] = OP_COMMAND;
+         ucState[k++] = 0x81;
+         ucState[k++] = (unsigned char)iFirstState;
+      }
+      if (pEnc->iStateUsed & DISPLAY_OFF)
+      {
+         ucState[k++] = OP_COMMAND;
+         ucState[k++] = 0xaf;
+      }
+      memmove(&pOut[iFirstStart + k], &pOut[iFirstStart], iLen - iFirstStart);
+      memcpy(&pOut[iFirstStart], ucState, k);
+      iLen += k;
+   }
+   *iOutFrames = (iTotal + pEnc->iRateAdded) * iGrayBits;
+   if (pCache)
+   {
+      iInfo[0] = *iOutFrames;
+      iInfo[1] = pEnc->iRateLimited;
+      iInfo[2] = pEnc->iRateAdded;
+      iInfo[3] = pEnc->iLossySaved;
+      iInfo[4] = pEnc->iLossyPixels;
+      iInfo[5] = pEnc->iWindowCount;
+      iInfo[6] = pEnc->iWindowBytes;
+      memcpy(&pOut[iLen], iInfo, sizeof(iInfo));
+      CacheStore(pCache, ullKey, pOut, iLen + sizeof(iInfo));
+      pEnc->iClipEncodes++;
+   }
+   return iLen;
+} /* EncodeClip() */
+//
+// Estimate the bytes of the skip and copy opcodes of a stream under each
+// field split from the lengths of its skip and copy runs (added to
+// iCosts). Runs longer than the short fields take long opcodes of up to
+// 256; a short skip next to a short copy shares its opcode with it.
+// Repeats, patterns, windows and tiles cost the same with any split.
+//
+static void FieldCosts(unsigned char *pData, int iLen, int *iCosts)
+{
+int i, f, k, n, iOff, iFlags, iSkip, iCopy, iRuns, iMax, iCost, bOpen;
+int iRun[1024*2]; // (skip length << 1) or (copy length << 1) | 1
+unsigned char bCode, ucTemp[1024];
+
+   iOff = StreamStart(pData, iLen, &iFlags);
+   while (iOff < iLen)
+   {
+      iRuns = 0;
+      i = 0;
+      while (i < 1024) // gather the runs of the frame
+      {
+         bCode = pData[iOff++];
+         iSkip = iCopy = 0;
+         switch (bCode & OP_MASK)
+         {
+            case OP_SKIPCOPY:
+               if (bCode == OP_SKIPCOPY)
+                  iSkip = pData[iOff++] + 1;
+               else
+                  OpFields(bCode, STREAM_FIELDS(iFlags), &iSkip, &iCopy);
+               if (iSkip)
+                  iRun[iRuns++] = iSkip << 1;
+               if (iCopy)
+                  iRun[iRuns++] = (iCopy << 1) | 1;
+               i += iSkip; // (the skip comes first, so it's added here)
+               iSkip = 0;
+               break;
+            case OP_COPYSKIP:
+               if (bCode == OP_COPYSKIP)
+                  iCopy = pData[iOff++] + 1;
+               else
+                  OpFields(bCode, STREAM_FIELDS(iFlags), &iSkip, &iCopy);
+               if (iCopy)
+                  iRun[iRuns++] = (iCopy << 1) | 1;
+               break;
+            case OP_REPEATSKIP:
+               if (bCode == OP_WINDOW) // (covers no bytes of the frame)
+               {
+                  n = (pData[iOff+1] + 1) * ((pData[iOff+2] & 7) + 1);
+                  iOff += 3;
+                  iOff += ExpandWindow(&pData[iOff], ucTemp, n, STREAM_FIELDS(iFlags));
+                  continue;
+               }
+               if (bCode == OP_COMMAND) // (neither)
+               {
+                  iOff += (pData[iOff] == 0x81) ? 2 : 1;
+                  continue;
+               }
+               iRun[iRuns++] = 0; // neither
+               if (bCode == OP_PATTERN)
+               {
+                  i += PATTERN_COUNT(pData[iOff]);
+                  iOff += 1 + PATTERN_PERIOD(pData[iOff]);
+                  continue;
+               }
+               if (bCode == OP_TILE)
+               {
+                  i += TILE_SIZE;
+                  iOff++;
+                  continue;
+               }
+               i += (bCode & 0x38) >> 3;
+               iSkip = bCode & 7;
+               iOff++;
+               break;
+            default: // OP_REPEAT
+               iRun[iRuns++] = 0;
+               i += (bCode & 0x3f) + 1;
+               iOff++;
+               break;
+         }
+         iOff += iCopy;
+         i += iCopy + iSkip;
+         if (iSkip)
+            iRun[iRuns++] = iSkip << 1;
+      }
+      for (k=0, n=0; k<iRuns; k++) // join the runs which the opcodes split
+      {
+         if (n && iRun[k] && (iRun[k] & 1) == (iRun[n-1] & 1))
+            iRun[n-1] += iRun[k] & ~1;
+         else
+            iRun[n++] = iRun[k];
+      }
+      iRuns = n;
+      for (f=0; f<FIELDS_COUNT; f++)
+      {
+         iCost = 0;
+         bOpen = 0; // the run before ends with a short opcode to share
+         for (k=0; k<iRuns; k++)
+         {
+            n = iRun[k] >> 1;
+            iMax = (iRun[k] & 1) ? (1 << (6 - iFieldSkipBits[f])) - 1 : (1 << iFieldSkipBits[f]) - 1;
+            if (iRun[k] & 1)
+               iCost += n; // the data
+            iCost += (n / 256) * 2;
+            n &= 255;
+            if (iRun[k] == 0 || n == 0)
+               bOpen = 0;
+            else if (n > iMax)
+            {
+               iCost += 2;
+               bOpen = 0;
+            }
+            else if (bOpen)
+               bOpen = 0; // shares the opcode of the run before
+            else
+            {
+               iCost++;
+               bOpen = 1;
+            }
+         }
+         iCosts[f] += iCost;
+      }
+   }
+} /* FieldCosts() */
+//
+// Pick the field split for --fields auto: the clips are encoded with 3/3
+// and each split is estimated from their runs; the best one is only
+// used if encoding the clips with it really makes them smaller
+// (bundled clips share one split). iLen receives the total size with
+// each split tried (0 if not tried)
+//
+static int ChooseFields(ENCODER *pEnc, unsigned char **pFrames, unsigned char **pLevels, int *iCount, int iClips, unsigned char **pStreams, int *iLen)
+{
+int i, f, n, iBest, iFrames, iCosts[FIELDS_COUNT];
+
+   memset(iLen, 0, sizeof(int) * FIELDS_COUNT);
+   memset(iCosts, 0, sizeof(iCosts));
+   SetFields(pEnc, FIELDS_3_3);
+   for (i=0; i<iClips; i++)
+   {
+      n = EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+      FieldCosts(pStreams[i], n, iCosts);
+      iLen[FIELDS_3_3] += n;
+   }
+   for (iBest=FIELDS_3_3, f=1; f<FIELDS_COUNT; f++)
+   {
+      if (iCosts[f] < iCosts[iBest])
+         iBest = f;
+   }
+   if (iBest != FIELDS_3_3)
+   {
+      SetFields(pEnc, iBest);
+      for (i=0; i<iClips; i++)
+         iLen[iBest] += EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+      if (iLen[iBest] >= iLen[FIELDS_3_3])
+         iBest = FIELDS_3_3;
+   }
+   return iBest;
+} /* ChooseFields() */
+//
+// A tile counted by ChooseTiles()
+//
+typedef struct tag_tile_count
+{
+   unsigned char ucTile[TILE_SIZE];
+   int iSaved; // stream bytes it would save (0 = free slot)
+} TILECOUNT;
+
+static int TileBySaving(const void *a, const void *b)
+{
+   const TILECOUNT *pA = (const TILECOUNT *)a, *pB = (const TILECOUNT *)b;
+   if (pA->iSaved != pB->iSaved)
+      return pB->iSaved - pA->iSaved;
+   return memcmp(pA->ucTile, pB->ucTile, TILE_SIZE);
+} /* TileBySaving() */
+//
+// Pick the tile table for --tiles: every tile of every frame which would
+// replace at least TILE_MIN_CHANGED changed bytes is counted with the
+// bytes it would save there (the first frame changes everything), and
+// the TILE_MAX tiles which save the most, and more than they cost in the
+// table, are kept. Like the field split, the table is only used if it
+// really makes the clips smaller (bundled clips share it). iLen receives
+// the total size without and with it (0 if not tried).
+// Returns the number of tiles the encoder was set up with
+//
+static int ChooseTiles(ENCODER *pEnc, unsigned char **pFrames, unsigned char **pLevels, int *iCount, int iClips, unsigned char **pStreams, int *iLen)
+{
+TILECOUNT *pCounts;
+unsigned char ucTiles[TILE_MAX][TILE_SIZE], ucCur[1024], ucPrev[1024], *s;
+int i, j, k, n, iSlot, iUsed, iChanged, iFrames;
+
+   pCounts = calloc(TILE_CANDIDATES, sizeof(TILECOUNT));
+   iUsed = 0;
+   for (i=0; i<iClips; i++)
+   {
+      for (k=0; k<iCount[i]*iGrayBits; k++) // (planes are coded against the same plane)
+      {
+         s = &pFrames[i][k*1024];
+         for (j=0; j<1024; j++) // in the scan order of the stream
+         {
+            n = pEnc->bVertical ? ((j & 7) << 7) + (j >> 3) : j;
+            ucCur[j] = s[n];
+            ucPrev[j] = (k >= iGrayBits) ? s[n - iGrayBits*1024] : ~s[n];
+         }
+         for (j=0; j<1024; j+=TILE_SIZE)
+         {
+            for (n=iChanged=0; n<TILE_SIZE; n++)
+               iChanged += (ucCur[j+n] != ucPrev[j+n]);
+            if (iChanged < TILE_MIN_CHANGED || CheckShortRepeat(&ucCur[j], TILE_SIZE)) // (a repeat does better)
+               continue;
+            iSlot = (int)(TileHash(&ucCur[j]) >> 40) & (TILE_CANDIDATES - 1);
+            while (pCounts[iSlot].iSaved && memcmp(pCounts[iSlot].ucTile, &ucCur[j], TILE_SIZE) != 0)
+               iSlot = (iSlot + 1) & (TILE_CANDIDATES - 1);
+            if (pCounts[iSlot].iSaved == 0)
+            {
+               if (iUsed >= TILE_CANDIDATES / 2) // count the ones already seen
+                  continue;
+               memcpy(pCounts[iSlot].ucTile, &ucCur[j], TILE_SIZE);
+               iUsed++;
+            }
+            pCounts[iSlot].iSaved += iChanged - 2; // instead of the changed bytes: OP_TILE, tile number
+         }
+      }
+   }
+   for (i=n=0; i<TILE_CANDIDATES; i++) // the ones worth a table entry
+   {
+      if (pCounts[i].iSaved > TILE_SIZE)
+         pCounts[n++] = pCounts[i];
+   }
+   qsort(pCounts, n, sizeof(TILECOUNT), TileBySaving);
+   if (n > TILE_MAX)
+      n = TILE_MAX;
+   for (i=0; i<n; i++)
+      memcpy(ucTiles[i], pCounts[i].ucTile, TILE_SIZE);
+   free(pCounts);
+   iLen[0] = iLen[1] = 0;
+   SetTiles(pEnc, ucTiles[0], 0);
+   for (i=0; i<iClips; i++)
+      iLen[0] += EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+   if (n)
+   {
+      SetTiles(pEnc, ucTiles[0], n);
+      for (i=0; i<iClips; i++)
+         iLen[1] += EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+      if (iLen[1] >= iLen[0])
+         SetTiles(pEnc, ucTiles[0], 0);
+   }
+   return pEnc->iTiles;
+} /* ChooseTiles() */
+//
+// Sink of the shared decoder core for PlayBack(): the frame is rebuilt
+// in memory, in the scan order of the stream, with bounds checking so
+// that a bad stream is reported instead of overrunning the buffer
+//
+typedef struct tag_screen_sink
+{
+   unsigned char ucScreen[1024]; // display bytes in scan order
+   unsigned char ucWindow[1024];
+   int x, y, w, h;
+   int bVertical;
+   int iFields; // field split of the stream
+   int iLine; // page aligned streams: no write may cross a line this long
+   int bCrossed; // one did
+   const unsigned char *pTiles; // tile table of the stream (0 = none)
+   int iState; // what the display commands left (DISPLAY_*)
+} SCREENSINK;
+//
+// Put the data of a finished window on the screen
+//
+static void ScreenWindow(SCREENSINK *pSink)
+{
+int j, x, y;
+
+   for (j=0; j<pSink->w*pSink->h; j++)
+   {
+      if (pSink->bVertical) // columns of h bytes
+      {
+         x = pSink->x + j / pSink->h; y = pSink->y + (j % pSink->h);
+         pSink->ucScreen[(x << 3) + y] = pSink->ucWindow[j];
+      }
+      else // pages of w bytes
+      {
+         x = pSink->x + (j % pSink->w); y = pSink->y + j / pSink->w;
+         pSink->ucScreen[(y << 7) + x] = pSink->ucWindow[j];
+      }
+   }
+} /* ScreenWindow() */
+//
+// Check that a write stays within a line of a page aligned stream
+//
+static void ScreenCheck(SCREENSINK *pSink, int i, int n)
+{
+   if (pSink->iLine && (i & (pSink->iLine - 1)) + n > pSink->iLine)
+      pSink->bCrossed = 1;
+} /* ScreenCheck() */
+//
+// Keep track of the display state a display command changes
+//
+static void ScreenCommand(SCREENSINK *pSink, int c, int v)
+{
+   if (c == 0x81)
+      pSink->iState = (pSink->iState & ~DISPLAY_CONTRAST) | v;
+   else if (c == 0xa6 || c == 0xa7)
+      pSink->iState = (c & 1) ? (pSink->iState | DISPLAY_INVERTED) : (pSink->iState & ~DISPLAY_INVERTED);
+   else // 0xae/0xaf
+      pSink->iState = (c & 1) ? (pSink->iState & ~DISPLAY_OFF) : (pSink->iState | DISPLAY_OFF);
+} /* ScreenCommand() */
+//
+// The byte the display shows for screen byte b
+//
+static unsigned char ScreenShows(SCREENSINK *pSink, unsigned char b)
+{
+   if (pSink->iState & DISPLAY_OFF)
+      return 0;
+   return (pSink->iState & DISPLAY_INVERTED) ? ~b : b;
+} /* ScreenShows() */
+
+#define ODEC_CHECKED
+#define ODEC_SINK SCREENSINK
+#define ODEC_FIELDS(pSink) ((pSink)->iFields)
+#define ODEC_TILES(pSink) ((pSink)->pTiles)
+#define ODEC_SKIP(pSink, i)
+#define ODEC_COPY(pSink, i, p, n) (ScreenCheck(pSink, i, n), memcpy(&(pSink)->ucScreen[i], p, n))
+#define ODEC_REPEAT(pSink, i, b, n) (ScreenCheck(pSink, i, n), memset(&(pSink)->ucScreen[i], b, n))
+#define ODEC_PATTERN(pSink, i, p, k, n) (ScreenCheck(pSink, i, n), ODecodeFill(&(pSink)->ucScreen[i], p, k, n))
+#define ODEC_WINDOW(pSink, x0, w0, y0, h0) ((pSink)->x = (x0), (pSink)->w = (w0), (pSink)->y = (y0), (pSink)->h = (h0))
+#define ODEC_WINDOW_COPY(pSink, k, p, n) memcpy(&(pSink)->ucWindow[k], p, n)
+#define ODEC_WINDOW_REPEAT(pSink, k, b, n) memset(&(pSink)->ucWindow[k], b, n)
+#define ODEC_WINDOW_PATTERN(pSink, k, p, iPeriod, n) ODecodeFill(&(pSink)->ucWindow[k], p, iPeriod, n)
+#define ODEC_WINDOW_END(pSink) ScreenWindow(pSink)
+#define ODEC_COMMAND(pSink, c, v) ScreenCommand(pSink, c, v)
+#include "Arduino/oled_decode.h"
+//
+// Play the frames back into destination image to test
+// Returns 0 for success, -1 if the stream doesn't decode (or a page
+// aligned stream writes across a line)
+//
+int PlayBack(unsigned char *pData, int iLen)
+{
+int x, y;
+int iFrame, i, j, iFlags;
+unsigned char b, bCode;
+unsigned char ucBMP[1024]; // for generating output BMP
+const unsigned char *s, *pEnd;
+SCREENSINK *pSink;
+
+   pSink = calloc(1, sizeof(SCREENSINK));
+   pSink->iState = DISPLAY_DEFAULT;
+   iFrame = 0;
+   s = &pData[StreamStart(pData, iLen, &iFlags)];
+   pEnd = &pData[iLen];
+   pSink->bVertical = (iFlags & STREAM_VERTICAL) != 0;
+   pSink->iFields = STREAM_FIELDS(iFlags);
+   if (iFlags & STREAM_PAGE_ALIGNED)
+      pSink->iLine = pSink->bVertical ? 8 : 128;
+   pSink->pTiles = StreamTiles(pData, iLen);
+   while (s < pEnd) // process all compressed data
+   {
+      s = ODecodeFrame(pSink, s, pEnd);
+      if (s == NULL || pSink->bCrossed)
+      {
+         free(pSink);
+         return -1;
+      }
+// Convert SSD1306 style bytes into "normal" byte order
+      memset(ucBMP, 0, 1024);
+      i = 0;
+      for (y=0; y<64; y+=8)
+      {
+         for (x=0; x<128; x++)
+         {
+            bCode = 0x80 >> (x & 7);
+            if (pSink->bVertical) // column by column
+               b = pSink->ucScreen[(x << 3) + (y >> 3)];
+            else
+               b = pSink->ucScreen[i];
+            b = ScreenShows(pSink, b);
+            for (j=0; j<8; j++)
+            {
+               if (b & 1) // LSB first
+                  ucBMP[(x>>3) + ((y+j)*16)] |= bCode;
+               b >>= 1;
+            }
+            i++; // next byte column
+         }
+      } // for y
+#ifdef SAVE_OUTPUT_FRAMES
+      // Write it to a file
+      {
+         char szName[32];
+            sprintf(szName, "out%d.pbm", iFrame);
+            SavePBM(szName, ucBMP);
+      }
+#endif // SAVE_OUTPUT_FRAMES
+      iFrame++;
+   } // while processing compressed data
+   free(pSink);
+   return 0;
+} /* PlayBack() */
+
+//
+// Histogram bucket of a run length (1, 2, 3-4, 5-8 ... 129-256)
+//
+static int StatBucket(int iLen)
+{
+int i = 0;
+
+   iLen--;
+   while (iLen && i < STAT_BUCKETS-1)
+   {
+      iLen >>= 1;
+      i++;
+   }
+   return i;
+} /* StatBucket() */
+//
+// Walk an encoded stream and gather its statistics
+// pStats starts out zeroed (calloc) and keeps its per frame arrays from
+// one stream to the next; the caller frees them with FreeStats()
+//
+void GatherStats(unsigned char *pData, int iLen, STATS *pStats)
+{
+unsigned char ucScreen[1024+256], ucPrev[1024], ucTemp[1024];
+int i, j, k, iOff, iStart, iBus, iFlags, iSkip, iCopy, iRepeat, iOp;
+int iMax, *pSize, *pBus, *pChanged;
+unsigned char bCode;
+
+   iMax = pStats->iMaxFrames;
+   pSize = pStats->pFrameSize;
+   pBus = pStats->pFrameBus;
+   pChanged = pStats->pFrameChanged;
+   memset(pStats, 0, sizeof(STATS));
+   memset(ucScreen, 0, sizeof(ucScreen));
+   iOff = StreamStart(pData, iLen, &iFlags);
+   while (iOff < iLen)
+   {
+      if (pStats->iFrames == iMax)
+      {
+         iMax = iMax ? iMax * 2 : 256;
+         pSize = realloc(pSize, iMax * sizeof(int));
+         pBus = realloc(pBus, iMax * sizeof(int));
+         pChanged = realloc(pChanged, iMax * sizeof(int));
+      }
+      pStats->iMaxFrames = iMax;
+      pStats->pFrameSize = pSize;
+      pStats->pFrameBus = pBus;
+      pStats->pFrameChanged = pChanged;
+      iStart = iOff;
+      iBus = FrameBusCost(pData, &iStart, STREAM_FIELDS(iFlags)); // (iStart moves to the next frame)
+      iStart = iOff;
+      memcpy(ucPrev, ucScreen, 1024);
+      i = 0;
+      while (i < 1024)
+      {
+         bCode = pData[iOff++];
+         iSkip = iCopy = iRepeat = 0;
+         k = iOff; // start of the operands
+         switch (bCode & OP_MASK)
+         {
+            case OP_SKIPCOPY:
+               if (bCode == OP_SKIPCOPY)
+               {
+                  iOp = STAT_LONGSKIP;
+                  iSkip = pData[iOff++] + 1;
+               }
+               else
+               {
+                  iOp = STAT_SKIPCOPY;
+                  OpFields(bCode, STREAM_FIELDS(iFlags), &iSkip, &iCopy);
+               }
+               i += iSkip;
+               break;
+            case OP_COPYSKIP:
+               if (bCode == OP_COPYSKIP)
+               {
+                  iOp = STAT_LONGCOPY;
+                  iCopy = pData[iOff++] + 1;
+               }
+               else
+               {
+                  iOp = STAT_COPYSKIP;
+                  OpFields(bCode, STREAM_FIELDS(iFlags), &iSkip, &iCopy);
+               }
+               break;
+            case OP_REPEATSKIP:
+               if (bCode == OP_WINDOW)
+               {
+               int x0, w, y0, h, x, y;
+                  iOp = STAT_WINDOW;
+                  x0 = pData[iOff]; w = pData[iOff+1] + 1;
+                  y0 = pData[iOff+2] >> 3; h = (pData[iOff+2] & 7) + 1;
+                  iOff += 3;
+                  iOff += ExpandWindow(&pData[iOff], ucTemp, w*h, STREAM_FIELDS(iFlags));
+                  for (j=0; j<w*h; j++)
+                  {
+                     if (iFlags & STREAM_VERTICAL)
+                     {
+                        x = x0 + j / h; y = y0 + (j % h);
+                        ucScreen[(x << 3) + y] = ucTemp[j];
+                     }
+                     else
+                     {
+                        x = x0 + (j % w); y = y0 + j / w;
+                        ucScreen[(y << 7) + x] = ucTemp[j];
+                     }
+                  }
+                  break;
+               }
+               if (bCode == OP_PATTERN)
+               {
+                  iOp = STAT_PATTERN;
+                  iRepeat = ExpandPattern(&pData[iOff], &ucScreen[i]);
+                  iOff += 1 + PATTERN_PERIOD(pData[iOff]);
+                  i += iRepeat;
+                  break;
+               }
+               if (bCode == OP_TILE) // (the table follows the header)
+               {
+                  iOp = STAT_TILE;
+                  memcpy(&ucScreen[i], &pData[STREAM_HEADER_SIZE + 1 + pData[iOff++] * TILE_SIZE], TILE_SIZE);
+                  i += TILE_SIZE;
+                  break;
+               }
+               if (bCode == OP_COMMAND) // (the image stays)
+               {
+                  iOp = STAT_COMMAND;
+                  iOff += (pData[iOff] == 0x81) ? 2 : 1;
+                  break;
+               }
+               iOp = STAT_REPEATSKIP;
+               iRepeat = (bCode & 0x38) >> 3;
+               iSkip = bCode & 7;
+               memset(&ucScreen[i], pData[iOff++], iRepeat);
+               i += iRepeat;
+               break;
+            default: // OP_REPEAT
+               iOp = STAT_REPEAT;
+               iRepeat = (bCode & 0x3f) + 1;
+               memset(&ucScreen[i], pData[iOff++], iRepeat);
+               i += iRepeat;
+               break;
+         }
+         if (iCopy) // the copied bytes follow the operands
+         {
+            memcpy(&ucScreen[i], &pData[iOff], iCopy);
+            iOff += iCopy;
+            i += iCopy;
+         }
+         if (iOp == STAT_COPYSKIP || iOp == STAT_REPEATSKIP) // skip comes last
+            i += iSkip;
+         pStats->iOps[iOp]++;
+         pStats->iOpBytes[iOp] += iOff - k + 1;
+         if (iSkip)
+            pStats->iSkipRuns[StatBucket(iSkip)]++;
+         if (iCopy)
+            pStats->iCopyRuns[StatBucket(iCopy)]++;
+         if (iRepeat)
+            pStats->iRepeatRuns[StatBucket(iRepeat)]++;
+      }
+      k = 0;
+      for (i=0; i<1024; i++) // changes in display (page-major) order
+      {
+         j = (iFlags & STREAM_VERTICAL) ? ((i & 127) << 3) + (i >> 7) : i;
+         if (ucScreen[j] != ucPrev[j])
+         {
+            k++;
+            if (pStats->iFrames) // the first frame paints everything
+               pStats->iHeat[i]++;
+         }
+      }
+      pStats->pFrameSize[pStats->iFrames] = iOff - iStart;
+      pStats->pFrameBus[pStats->iFrames] = iBus;
+      pStats->pFrameChanged[pStats->iFrames] = k;
+      pStats->iBytes += iOff - iStart;
+      pStats->iBus += iBus;
+      pStats->iFrames++;
+   }
+} /* GatherStats() */
+//
+// Free the per frame arrays of the statistics and the statistics
+//
+static void FreeStats(STATS *pStats)
+{
+   free(pStats->pFrameSize);
+   free(pStats->pFrameBus);
+   free(pStats->pFrameChanged);
+   free(pStats);
+} /* FreeStats() */
+//
+// Frame numbers sorted by descending bus cost (up to STAT_TOP)
+//
+static int StatsTopFrames(STATS *pStats, int *pTop)
+{
+int i, j, iCount = 0;
+
+   for (i=0; i<pStats->iFrames; i++)
+   {
+      for (j=iCount; j>0 && pStats->pFrameBus[pTop[j-1]] < pStats->pFrameBus[i]; j--)
+      {
+         if (j < STAT_TOP)
+            pTop[j] = pTop[j-1];
+      }
+      if (j < STAT_TOP)
+      {
+         pTop[j] = i;
+         if (iCount < STAT_TOP)
+            iCount++;
+      }
+   }
+   return iCount;
+} /* StatsTopFrames() */
+//
+// Print the statistics of a clip and optionally append them to a JSON file
+//
+void PrintStats(char *szName, STATS *pStats, FILE *pJSON, int bFirst)
+{
+static const char *szOps[STAT_OPS] = {"skip+copy", "long skip", "copy+skip", "long copy", "repeat+skip", "repeat", "window", "pattern", "tile", "command"};
+static const char *szBuckets[STAT_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65-128", "129-256"};
+static const char *szShades = " .:-=+*#%@";
+int iTop[STAT_TOP];
+int i, j, k, iCount, iFrames, iDeltas;
+char szLine[80];
+
+   iFrames = pStats->iFrames ? pStats->iFrames : 1;
+   iDeltas = (pStats->iFrames > 1) ? pStats->iFrames - 1 : 1; // frames in the heatmap
+   printf("Statistics for %s\n", szName);
+   printf("  %d frames, %d stream bytes (%d per frame), %d bus bytes (%d per frame)\n", pStats->iFrames, pStats->iBytes, pStats->iBytes / iFrames, pStats->iBus, pStats->iBus / iFrames);
+   printf("  opcode         count    bytes\n");
+   for (i=0; i<STAT_OPS; i++)
+      printf("  %-12s %7d  %7d\n", szOps[i], pStats->iOps[i], pStats->iOpBytes[i]);
+   printf("  run length ");
+   for (i=0; i<STAT_BUCKETS; i++)
+      printf(" %7s", szBuckets[i]);
+   printf("\n  skip       ");
+   for (i=0; i<STAT_BUCKETS; i++)
+      printf(" %7d", pStats->iSkipRuns[i]);
+   printf("\n  copy       ");
+   for (i=0; i<STAT_BUCKETS; i++)
+      printf(" %7d", pStats->iCopyRuns[i]);
+   printf("\n  repeat     ");
+   for (i=0; i<STAT_BUCKETS; i++)
+      printf(" %7d", pStats->iRepeatRuns[i]);
+   printf("\n  changes per display byte (2 columns per character, ' ' = never, '@' = every frame)\n");
+   for (j=0; j<8; j++)
+   {
+      for (i=0; i<64; i++)
+      {
+         k = pStats->iHeat[j*128 + i*2];
+         if (pStats->iHeat[j*128 + i*2 + 1] > k)
+            k = pStats->iHeat[j*128 + i*2 + 1];
+         k = (k * 9 + iDeltas - 1) / iDeltas; // round up so any change shows
+         szLine[i] = szShades[k > 9 ? 9 : k];
+      }
+      szLine[64] = 0;
+      printf("  |%s|\n", szLine);
+   }
+   iCount = StatsTopFrames(pStats, iTop);
+   printf("  most expensive frames:\n");
+   for (i=0; i<iCount; i++)
+      printf("    frame %d: %d bus bytes, %d stream bytes, %d bytes changed\n", iTop[i], pStats->pFrameBus[iTop[i]], pStats->pFrameSize[iTop[i]], pStats->pFrameChanged[iTop[i]]);
+   if (pJSON == NULL)
+      return;
+   fprintf(pJSON, "%s  {\n    \"name\": \"%s\",\n", bFirst ? "" : ",\n", szName);
+   fprintf(pJSON, "    \"frames\": %d,\n    \"stream_bytes\": %d,\n    \"bus_bytes\": %d,\n", pStats->iFrames, pStats->iBytes, pStats->iBus);
+   fprintf(pJSON, "    \"opcodes\": {");
+   for (i=0; i<STAT_OPS; i++)
+      fprintf(pJSON, "%s\"%s\": {\"count\": %d, \"bytes\": %d}", i ? ", " : "", szOps[i], pStats->iOps[i], pStats->iOpBytes[i]);
+   fprintf(pJSON, "},\n    \"run_buckets\": [");
+   for (i=0; i<STAT_BUCKETS; i++)
+      fprintf(pJSON, "%s\"%s\"", i ? ", " : "", szBuckets[i]);
+   fprintf(pJSON, "],\n    \"skip_runs\": [");
+   for (i=0; i<STAT_BUCKETS; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->iSkipRuns[i]);
+   fprintf(pJSON, "],\n    \"copy_runs\": [");
+   for (i=0; i<STAT_BUCKETS; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->iCopyRuns[i]);
+   fprintf(pJSON, "],\n    \"repeat_runs\": [");
+   for (i=0; i<STAT_BUCKETS; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->iRepeatRuns[i]);
+   fprintf(pJSON, "],\n    \"frame_stream_bytes\": [");
+   for (i=0; i<pStats->iFrames; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->pFrameSize[i]);
+   fprintf(pJSON, "],\n    \"frame_bus_bytes\": [");
+   for (i=0; i<pStats->iFrames; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->pFrameBus[i]);
+   fprintf(pJSON, "],\n    \"frame_changed_bytes\": [");
+   for (i=0; i<pStats->iFrames; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", pStats->pFrameChanged[i]);
+   fprintf(pJSON, "],\n    \"most_expensive_frames\": [");
+   for (i=0; i<iCount; i++)
+      fprintf(pJSON, "%s%d", i ? ", " : "", iTop[i]);
+   fprintf(pJSON, "],\n    \"heatmap\": [");
+   for (j=0; j<8; j++) // one row of 128 counts per page
+   {
+      fprintf(pJSON, "%s\n      [", j ? "," : "");
+      for (i=0; i<128; i++)
+         fprintf(pJSON, "%s%d", i ? ", " : "", pStats->iHeat[j*128 + i]);
+      fprintf(pJSON, "]");
+   }
+   fprintf(pJSON, "\n    ]\n  }");
+} /* PrintStats() */
+//
+// Write the change heatmap as a 128x64 PBM image
+// Each display byte becomes a column of 8 pixels, ordered dithered
+// by how often it changed (black = every frame)
+//
+int WriteHeatmapPBM(char *szName, STATS *pStats)
+{
+static const unsigned char ucBayer[16] = {0,8,2,10,12,4,14,6,3,11,1,9,15,7,13,5};
+FILE *pf;
+unsigned char ucRow[16];
+int x, y, iLevel, iFrames;
+
+   pf = fopen(szName, "wb");
+   if (pf == NULL)
+      return -1;
+   iFrames = (pStats->iFrames > 1) ? pStats->iFrames - 1 : 1;
+   fprintf(pf, "P4\n128 64\n");
+   for (y=0; y<64; y++)
+   {
+      memset(ucRow, 0, sizeof(ucRow));
+      for (x=0; x<128; x++)
+      {
+         // 0 = never changed, 1-16 = rounded up so any change leaves a trace
+         iLevel = (pStats->iHeat[((y >> 3) << 7) + x] * 16 + iFrames - 1) / iFrames;
+         if (iLevel > ucBayer[((y & 3) << 2) + (x & 3)])
+            ucRow[x >> 3] |= 0x80 >> (x & 7); // 1 = black in PBM
+      }
+      fwrite(ucRow, 1, 16, pf);
+   }
+   fclose(pf);
+   return 0;
+} /* WriteHeatmapPBM() */
+//
+// Write the binary data as C statements
+// ready to drop into an Arduino project
+//
+void MakeCode(FILE *ohandle, char *szName, unsigned char *pData, int iLen)
+{
+int i;
+char szLine[256], szTemp[16];
+
+	sprintf(szLine, "const byte %s[] PROGMEM = {\n", szName);
+	fwrite(szLine, 1, strlen(szLine), ohandle);
+	for (i=0; i<iLen; i++)
+	{
+		if ((i & 15) == 0)
+			sprintf(szLine,"  ");
+		if (i == iLen-1)
+			sprintf(szTemp, "0x%02x", pData[i]);
+		else
+			sprintf(szTemp, "0x%02x,", pData[i]);
+		strcat(szLine, szTemp);
+		if (i == iLen-1 || (i & 15) == 15)
+		{
+			strcat(szLine, "\n");
+			fwrite(szLine, 1, strlen(szLine), ohandle);
+		}
+	}
+	fwrite("};\n", 1, 3, ohandle);
+} /* MakeCode() */
+//
+// Flash of the Arduino player's frame functions (--c-code), to keep the
+// code within --code-kb
+//
+#define CODE_CALL_BYTES 12 // a call with constant arguments
+#define CODE_FRAME_BYTES 10 // entry, return and the case of the frame
+#define CODE_TEXT_SIZE 0x80000 // C statements of one frame
+//
+// State of the C code written for a frame (--c-code)
+//
+typedef struct tag_code_gen
+{
+   char *szName; // of the data array
+   char *pText; // statements of the frame
+   int iText;
+   int iCalls; // calls of the player made by the frame
+   unsigned char *pLit; // the data array: literals and frames kept as data
+   int iLit;
+   int iPos; // offset of the display cursor (-1 = unknown)
+   int iCopyPos, iCopyLen; // copy which the next one may join
+   int iLine; // bytes per line of page aligned streams (else 0)
+} CODEGEN;
+//
+// Add a call of the player to the frame
+//
+static void CodeCall(CODEGEN *pGen, char *szCall)
+{
+   pGen->iText += sprintf(&pGen->pText[pGen->iText], "   %s\n", szCall);
+   pGen->iCalls++;
+} /* CodeCall() */
+//
+// Position the cursor unless it's already there
+//
+static void CodeMove(CODEGEN *pGen, int iPos)
+{
+char szCall[64];
+
+   if (pGen->iPos != iPos)
+   {
+      sprintf(szCall, "oledSetOffset(%d);", iPos);
+      CodeCall(pGen, szCall);
+      pGen->iPos = iPos;
+   }
+} /* CodeMove() */
+//
+// Write the copy which is waiting for the next one
+//
+static void CodeFlush(CODEGEN *pGen)
+{
+char szCall[128];
+
+   if (pGen->iCopyLen)
+   {
+      CodeMove(pGen, pGen->iCopyPos);
+      sprintf(szCall, "oledWriteFlashBlock((byte *)&%s[%d], %d);", pGen->szName, pGen->iLit - pGen->iCopyLen, pGen->iCopyLen);
+      CodeCall(pGen, szCall);
+      pGen->iPos = (pGen->iCopyPos + pGen->iCopyLen) & 0x3ff;
+      pGen->iCopyLen = 0;
+   }
+} /* CodeFlush() */
+//
+// Copy n literal bytes to offset iPos; copies which follow each other
+// on the display (and don't cross a line of a page aligned stream) are
+// sent as one
+//
+static void CodeCopy(CODEGEN *pGen, int iPos, unsigned char *s, int n)
+{
+   if (pGen->iCopyLen && pGen->iCopyPos + pGen->iCopyLen == iPos &&
+       (pGen->iLine == 0 || pGen->iCopyPos / pGen->iLine == (iPos + n - 1) / pGen->iLine))
+      pGen->iCopyLen += n;
+   else
+   {
+      CodeFlush(pGen);
+      pGen->iCopyPos = iPos;
+      pGen->iCopyLen = n;
+   }
+   memcpy(&pGen->pLit[pGen->iLit], s, n);
+   pGen->iLit += n;
+} /* CodeCopy() */
+//
+// The bytes of a pattern as a C initializer
+//
+static void CodePatternBytes(char *szOut, unsigned char *s, int iPeriod)
+{
+int i;
+
+   for (i=0; i<iPeriod; i++)
+      szOut += sprintf(szOut, i ? ", 0x%02x" : "0x%02x", s[i]);
+} /* CodePatternBytes() */
+//
+// Repeat byte b n times, or a pattern (s, iPeriod) until n bytes are sent
+//
+static void CodeRepeat(CODEGEN *pGen, int iPos, unsigned char b, unsigned char *s, int iPeriod, int n)
+{
+char szCall[128], szBytes[32];
+
+   CodeFlush(pGen);
+   CodeMove(pGen, iPos);
+   if (s)
+   {
+      CodePatternBytes(szBytes, s, iPeriod);
+      sprintf(szCall, "{ byte p[] = {%s}; oledWritePattern(p, %d, %d); }", szBytes, iPeriod, n);
+   }
+   else
+      sprintf(szCall, "oledRepeatByte(0x%02x, %d);", b, n);
+   CodeCall(pGen, szCall);
+   pGen->iPos = (iPos + n) & 0x3ff;
+} /* CodeRepeat() */
+//
+// Send a window (s points past the opcode); the cursor goes back to
+// iPos afterwards
+// Returns the number of stream bytes used
+//
+static int CodeWindow(CODEGEN *pGen, int iPos, unsigned char *pData, int iSplit)
+{
+char szCall[128], szBytes[32];
+unsigned char *s, bCode;
+int k, j, iCount, iSkip;
+
+   CodeFlush(pGen);
+   CodeMove(pGen, iPos); // (where the window leaves the cursor)
+   s = pData;
+   sprintf(szCall, "oledWindowStart(%d, %d, %d, %d);", s[0], s[1] + 1, s[2] >> 3, (s[2] & 7) + 1);
+   CodeCall(pGen, szCall);
+   iCount = (s[1] + 1) * ((s[2] & 7) + 1);
+   s += 3;
+   for (k=0; k<iCount; k += j)
+   {
+      bCode = *s++;
+      switch (bCode & OP_MASK)
+      {
+         case OP_SKIPCOPY: // short copy
+         case OP_COPYSKIP:
+            if (bCode == OP_COPYSKIP)
+               j = *s++ + 1;
+            else
+               OpFields(bCode, iSplit, &iSkip, &j);
+            sprintf(szCall, "oledWindowData(%d, (byte *)&%s[%d], NULL, 0, %d);", k, pGen->szName, pGen->iLit, j);
+            memcpy(&pGen->pLit[pGen->iLit], s, j);
+            pGen->iLit += j;
+            s += j;
+            break;
+         case OP_REPEATSKIP:
+            if (bCode == OP_PATTERN)
+            {
+               j = PATTERN_COUNT(s[0]);
+               CodePatternBytes(szBytes, &s[1], PATTERN_PERIOD(s[0]));
+               sprintf(szCall, "{ byte p[] = {%s}; oledWindowData(%d, NULL, p, %d, %d); }", szBytes, k, PATTERN_PERIOD(s[0]), j);
+               s += 1 + PATTERN_PERIOD(s[0]);
+               break;
+            }
+            j = (bCode & 0x38) >> 3;
+            sprintf(szCall, "{ byte b = 0x%02x; oledWindowData(%d, NULL, &b, 1, %d); }", *s++, k, j);
+            break;
+         default: // OP_REPEAT
+            j = (bCode & 0x3f) + 1;
+            sprintf(szCall, "{ byte b = 0x%02x; oledWindowData(%d, NULL, &b, 1, %d); }", *s++, k, j);
+            break;
+      }
+      CodeCall(pGen, szCall);
+   }
+   CodeCall(pGen, "oledWindowEnd();");
+   pGen->iPos = iPos;
+   return (int)(s - pData);
+} /* CodeWindow() */
+//
+// Turn one encoded frame into calls of the player; the literals go to
+// the data array
+// Returns the number of stream bytes of the frame
+//
+static int CodeFrame(CODEGEN *pGen, unsigned char *pData, int iSplit)
+{
+int i, j, iSkip;
+char szCall[64];
+unsigned char *s, bCode;
+
+   s = pData;
+   i = 0;
+   pGen->iText = pGen->iCalls = pGen->iCopyLen = 0;
+   pGen->iPos = -1; // wherever the last frame left it
+   while (i < 1024)
+   {
+      bCode = *s++;
+      iSkip = j = 0;
+      switch (bCode & OP_MASK)
+      {
+         case OP_SKIPCOPY:
+            if (bCode == OP_SKIPCOPY) // big skip
+            {
+               i += *s++ + 1;
+               break;
+            }
+            OpFields(bCode, iSplit, &iSkip, &j);
+            i += iSkip;
+            if (j)
+               CodeCopy(pGen, i, s, j);
+            s += j;
+            i += j;
+            break;
+         case OP_COPYSKIP:
+            if (bCode == OP_COPYSKIP) // big copy
+               j = *s++ + 1;
+            else
+               OpFields(bCode, iSplit, &iSkip, &j);
+            if (j)
+               CodeCopy(pGen, i, s, j);
+            s += j;
+            i += j + iSkip;
+            break;
+         case OP_REPEATSKIP:
+            if (bCode == OP_WINDOW)
+            {
+               s += CodeWindow(pGen, i, s, iSplit);
+               break;
+            }
+            if (bCode == OP_PATTERN)
+            {
+               j = PATTERN_COUNT(s[0]);
+               CodeRepeat(pGen, i, 0, &s[1], PATTERN_PERIOD(s[0]), j);
+               s += 1 + PATTERN_PERIOD(s[0]);
+               i += j;
+               break;
+            }
+            if (bCode == OP_COMMAND) // (the cursor stays)
+            {
+               CodeFlush(pGen);
+               j = (s[0] == 0x81) ? 2 : 1;
+               sprintf(szCall, "oledDisplayCommand(0x%02x, %d);", s[0], (j == 2) ? s[1] : 0);
+               CodeCall(pGen, szCall);
+               s += j;
+               break;
+            }
+            j = (bCode & 0x38) >> 3;
+            CodeRepeat(pGen, i, *s++, NULL, 0, j);
+            i += j + (bCode & 7);
+            break;
+         case OP_REPEAT:
+            j = (bCode & 0x3f) + 1;
+            CodeRepeat(pGen, i, *s++, NULL, 0, j);
+            i += j;
+            break;
+      }
+   }
+   CodeFlush(pGen);
+   return (int)(s - pData);
+} /* CodeFrame() */
+//
+// Write a stream as C code for the Arduino player (--c-code). Each frame
+// becomes a function which calls the player with constant offsets and
+// lengths, so no opcodes are read or dispatched, and only the literals
+// stay in the data array. The frames with the most calls are the slowest
+// and gain the most, so they are compiled first; those which don't fit
+// in --code-kb, and a frame 0 which is only played once (ping-pong and
+// loop frame streams), stay opcode data for oledPlayFrame()
+//
+void MakeFrameCode(FILE *ohandle, char *szName, unsigned char *pData, int iLen)
+{
+CODEGEN gen;
+int i, iOff, iFlags, iFrames, iBest, iCode, iCompiled;
+int *iStart, *iCalls, *iLitStart;
+unsigned char *bCompiled;
+
+   iOff = StreamStart(pData, iLen, &iFlags);
+   gen.szName = szName;
+   gen.pText = malloc(CODE_TEXT_SIZE);
+   gen.pLit = malloc(iLen + 1);
+   gen.iLine = (iFlags & STREAM_PAGE_ALIGNED) ? ((iFlags & STREAM_VERTICAL) ? 8 : 128) : 0;
+   iStart = malloc((iLen + 1) * sizeof(int));
+   iCalls = malloc((iLen + 1) * sizeof(int));
+   iLitStart = malloc((iLen + 1) * sizeof(int));
+   bCompiled = calloc(iLen + 1, 1);
+   for (iFrames=0; iOff < iLen; iFrames++) // the calls of every frame
+   {
+      iStart[iFrames] = iOff;
+      gen.iLit = 0;
+      iOff += CodeFrame(&gen, &pData[iOff], STREAM_FIELDS(iFlags));
+      iCalls[iFrames] = gen.iCalls;
+   }
+   iStart[iFrames] = iOff;
+   iCode = iFrames * (CODE_FRAME_BYTES + CODE_CALL_BYTES); // all data
+   iCompiled = 0;
+   while (1) // compile the frames with the most calls while they fit
+   {
+      iBest = -1;
+      for (i=0; i<iFrames; i++)
+      {
+         if (bCompiled[i] || (i == 0 && iFrames > 1 && (iFlags & (STREAM_PINGPONG | STREAM_LOOP_FRAME))))
+            continue;
+         if (iCodeKB && iCode + (iCalls[i] - 1) * CODE_CALL_BYTES > iCodeKB * 1024)
+            continue;
+         if (iBest < 0 || iCalls[i] > iCalls[iBest])
+            iBest = i;
+      }
+      if (iBest < 0)
+         break;
+      bCompiled[iBest] = 1;
+      iCode += (iCalls[iBest] - 1) * CODE_CALL_BYTES;
+      iCompiled++;
+   }
+   gen.iLit = 0;
+   for (i=0; i<iFrames; i++) // the data array
+   {
+      iLitStart[i] = gen.iLit;
+      if (bCompiled[i])
+         CodeFrame(&gen, &pData[iStart[i]], STREAM_FIELDS(iFlags));
+      else
+      {
+         memcpy(&gen.pLit[gen.iLit], &pData[iStart[i]], iStart[i+1] - iStart[i]);
+         gen.iLit += iStart[i+1] - iStart[i];
+      }
+   }
+   if (gen.iLit == 0) // (C has no empty arrays)
+      gen.pLit[gen.iLit++] = 0;
+   fprintf(ohandle, "//\n// tcomp --c-code: %d of %d frames compiled (about %d bytes of code);\n", iCompiled, iFrames, iCode);
+   fprintf(ohandle, "// play with oledPlayCode(%sPlayFrame, %sFrames, %sFlags, fps, loops)\n//\n", szName, szName, szName);
+   MakeCode(ohandle, szName, gen.pLit, gen.iLit);
+   for (i=0; i<iFrames; i++) // a function per frame
+   {
+      fprintf(ohandle, "static void %sFrame%d(void)\n{\n", szName, i);
+      if (bCompiled[i])
+      {
+         gen.iLit = iLitStart[i];
+         CodeFrame(&gen, &pData[iStart[i]], STREAM_FIELDS(iFlags));
+         fwrite(gen.pText, 1, gen.iText, ohandle);
+      }
+      else
+         fprintf(ohandle, "   oledPlayFrame((byte *)&%s[%d]);\n", szName, iLitStart[i]);
+      fprintf(ohandle, "}\n");
+   }
+   fprintf(ohandle, "void %sPlayFrame(int iFrame)\n{\n   switch (iFrame)\n   {\n", szName);
+   for (i=0; i<iFrames; i++)
+      fprintf(ohandle, "      case %d: %sFrame%d(); break;\n", i, szName, i);
+   fprintf(ohandle, "   }\n}\n");
+   fprintf(ohandle, "const int %sFrames = %d;\nconst int %sFlags = 0x%04x;\n", szName, iFrames, szName, iFlags);
+   free(gen.pText);
+   free(gen.pLit);
+   free(iStart);
+   free(iCalls);
+   free(iLitStart);
+   free(bCompiled);
+} /* MakeFrameCode() */
+//
+// Combine the streams of several clips into a bundle
+// Each clip's stream is split into frames; identical encoded frames
+// (within a clip or across clips) are stored only once. The clips share
+// one tile table, which goes after the chunk data.
+// Returns the bundle size
+//
+int MakeBundle(unsigned char **pStreams, int *iLens, int iCount, unsigned char *pOut)
+{
+int *iStart, *iSize, *iIndex;
+int iEnd[MAX_CLIPS];
+int i, j, k, iFrames, iChunks, iOff, iFirst, iFlags, iLen, iTotal, iData;
+unsigned char *s, *pTiles = 0;
+
+   iTotal = 0;
+   for (i=0; i<iCount; i++)
+      iTotal += iLens[i];
+   iStart = malloc(iTotal * sizeof(int)); // more than enough entries
+   iSize = malloc(iTotal * sizeof(int));
+   iIndex = malloc(iTotal * sizeof(int));
+   iFrames = iChunks = iFlags = 0;
+   for (i=0; i<iCount; i++) // find the frames and the unique chunks
+   {
+      s = pStreams[i];
+      iOff = StreamStart(s, iLens[i], &iFlags); // all clips are encoded the same way
+      if (pTiles == 0)
+         pTiles = StreamTiles(s, iLens[i]);
+      while (iOff < iLens[i])
+      {
+         iFirst = iOff;
+         FrameBusCost(s, &iOff, STREAM_FIELDS(iFlags));
+         iLen = iOff - iFirst;
+         for (k=0; k<iChunks; k++)
+         {
+            if (iSize[k] == iLen && memcmp(&pOut[iStart[k]], &s[iFirst], iLen) == 0)
+               break;
+         }
+         if (k == iChunks) // new chunk; collect them at the start of pOut for now
+         {
+            iStart[k] = (k == 0) ? 0 : iStart[k-1] + iSize[k-1];
+            iSize[k] = iLen;
+            memcpy(&pOut[iStart[k]], &s[iFirst], iLen);
+            iChunks++;
+         }
+         iIndex[iFrames++] = k;
+      }
+      iEnd[i] = iFrames;
+   }
+   iData = iStart[iChunks-1] + iSize[iChunks-1];
+   iOff = BUNDLE_HEADER_SIZE + iCount * 4 + (iChunks + 1) * 4 + iFrames * 2;
+   memmove(&pOut[iOff], pOut, iData);
+   memcpy(pOut, "OAB1", 4);
+   pOut[4] = (unsigned char)iCount; pOut[5] = (unsigned char)(iCount >> 8);
+   pOut[6] = (unsigned char)iChunks; pOut[7] = (unsigned char)(iChunks >> 8);
+   pOut[8] = (unsigned char)iFlags; pOut[9] = (unsigned char)(iFlags >> 8);
+   j = BUNDLE_HEADER_SIZE;
+   for (i=0; i<iCount; i++) // clip table
+   {
+      iFirst = (i == 0) ? 0 : iEnd[i-1];
+      k = iEnd[i] - iFirst;
+      pOut[j++] = (unsigned char)iFirst; pOut[j++] = (unsigned char)(iFirst >> 8);
+      pOut[j++] = (unsigned char)k; pOut[j++] = (unsigned char)(k >> 8);
+   }
+   for (i=0; i<=iChunks; i++) // chunk table
+   {
+      k = iOff + ((i == iChunks) ? iData : iStart[i]);
+      pOut[j++] = (unsigned char)k; pOut[j++] = (unsigned char)(k >> 8);
+      pOut[j++] = (unsigned char)(k >> 16); pOut[j++] = (unsigned char)(k >> 24);
+   }
+   for (i=0; i<iFrames; i++) // frame index
+   {
+      pOut[j++] = (unsigned char)iIndex[i];
+      pOut[j++] = (unsigned char)(iIndex[i] >> 8);
+   }
+   printf("Bundle: %d clips, %d frames, %d unique (%d of %d bytes)\n", iCount, iFrames, iChunks, iData, iTotal);
+   iLen = iOff + iData;
+   if (pTiles)
+   {
+      memcpy(&pOut[iLen], pTiles, 1 + (pTiles[0] + 1) * TILE_SIZE);
+      iLen += 1 + (pTiles[0] + 1) * TILE_SIZE;
+   }
+   free(iIndex);
+   free(iSize);
+   free(iStart);
+   return iLen;
+} /* MakeBundle() */
+//
+// Compare the speed of expanding the archive with decoding
+// the opcode stream, both in frames per second
+//
+void BenchArchive(unsigned char *pData, int iLen, unsigned char *pArchive, int iArcLen, int iFrames)
+{
+unsigned char *pTemp;
+clock_t tStart, tElapsed;
+int iCount;
+
+   pTemp = malloc(iLen);
+   iCount = 0;
+   tStart = clock();
+   do {
+      ArcDecompress(pArchive, iArcLen, pTemp, iLen);
+      iCount++;
+      tElapsed = clock() - tStart;
+   } while (tElapsed < CLOCKS_PER_SEC/4);
+   printf("Archive expand:  %d frames/sec\n", (int)(((double)iCount * iFrames * CLOCKS_PER_SEC) / tElapsed));
+   iCount = 0;
+   tStart = clock();
+   do {
+      PlayBack(pData, iLen);
+      iCount++;
+      tElapsed = clock() - tStart;
+   } while (tElapsed < CLOCKS_PER_SEC/4);
+   printf("PlayBack decode: %d frames/sec\n", (int)(((double)iCount * iFrames * CLOCKS_PER_SEC) / tElapsed));
+   free(pTemp);
+} /* BenchArchive() */
+
+//
+// Write the output file (C code or binary data) under a temporary name
+// and rename it into place, so that a failed or interrupted encode never
+// leaves a partial file where a player would pick it up
+// Returns 0 for success
+//
+int SaveOutput(char *szName, char *szArray, unsigned char *pData, int iLen)
+{
+char szTemp[MAX_PATH+8];
+FILE *ohandle;
+int rc = 0;
+
+   sprintf(szTemp, "%s.tmp", szName);
+   ohandle = fopen(szTemp, "wb");
+   if (ohandle == NULL)
+      return -1;
+   if (bCCode) // write the frames as functions
+      MakeFrameCode(ohandle, szArray, pData, iLen);
+   else if (bC) // write C code
+      MakeCode(ohandle, szArray, pData, iLen);
+   else if (fwrite(pData, 1, iLen, ohandle) != (size_t)iLen)
+      rc = -1;
+   if (fclose(ohandle) != 0)
+      rc = -1;
+   if (rc == 0 && rename(szTemp, szName) != 0)
+      rc = -1;
+   if (rc != 0)
+      remove(szTemp);
+   return rc;
+} /* SaveOutput() */
+//
+// Read a whole file, expanding it if it's an archive
+// Returns its size (the data is in *ppData) or -1 for an error
+//
+static int ReadStream(char *szName, unsigned char **ppData)
+{
+FILE *pf;
+unsigned char *pData, *pRaw;
+int iSize, iRawSize;
+
+   pf = fopen(szName, "rb");
+   if (pf == NULL)
+      return -1;
+   fseek(pf, 0L, SEEK_END);
+   iSize = (int)ftell(pf);
+   fseek(pf, 0L, SEEK_SET);
+   pData = malloc(iSize > 0 ? iSize : 1);
+   if (iSize <= 0 || fread(pData, iSize, 1, pf) != 1)
+   {
+      free(pData);
+      fclose(pf);
+      return -1;
+   }
+   fclose(pf);
+   if (ArcIsArchive(pData, iSize))
+   {
+      iRawSize = ArcGetRawSize(pData, iSize);
+      pRaw = (iRawSize > 0) ? malloc(iRawSize) : NULL;
+      if (pRaw == NULL || ArcDecompress(pData, iSize, pRaw, iRawSize) != iRawSize)
+      {
+         free(pRaw);
+         free(pData);
+         return -1;
+      }
+      free(pData);
+      pData = pRaw;
+      iSize = iRawSize;
+   }
+   *ppData = pData;
+   return iSize;
+} /* ReadStream() */
+//
+// Number of clips in a bundle (0 if the data isn't a bundle)
+//
+static int BundleClips(unsigned char *pData, int iLen)
+{
+   if (iLen < BUNDLE_HEADER_SIZE || memcmp(pData, "OAB1", 4) != 0)
+      return 0;
+   return pData[4] | (pData[5] << 8);
+} /* BundleClips() */
+//
+// Copy what the decoder's screen shows to a frame in SSD1306 layout and
+// its contrast to *pLevel
+//
+static void StoreScreen(SCREENSINK *pSink, unsigned char *pFrame, unsigned char *pLevel)
+{
+int x, y;
+
+   for (y=0; y<8; y++) // (column by column -> page by page)
+   {
+      for (x=0; x<128; x++)
+         pFrame[y*128 + x] = ScreenShows(pSink, pSink->ucScreen[pSink->bVertical ? (x << 3) + y : y*128 + x]);
+   }
+   *pLevel = (unsigned char)(pSink->iState & DISPLAY_CONTRAST);
+} /* StoreScreen() */
+//
+// Play a stream, or clip iClip of a bundle, back into frames in SSD1306
+// layout the way PlayBack() does, with the contrast of each in pLevels;
+// only the first iMax frames are kept
+// *iFlags receives the stream flags
+// Returns the number of frames or -1 if it doesn't decode
+//
+static int DecodeStream(unsigned char *pData, int iLen, int iClip, unsigned char *pFrames, unsigned char *pLevels, int iMax, int *iFlags)
+{
+SCREENSINK *pSink;
+const unsigned char *s, *pEnd;
+unsigned char *pChunks, *pIndex;
+int i, k, iCount, iFirst, iChunks, iStart, iEnd;
+
+   pSink = calloc(1, sizeof(SCREENSINK));
+   pSink->iState = DISPLAY_DEFAULT;
+   *iFlags = 0;
+   iCount = 0;
+   if (BundleClips(pData, iLen))
+   {
+      iChunks = pData[6] | (pData[7] << 8);
+      *iFlags = pData[8] | (pData[9] << 8);
+      pSink->bVertical = (*iFlags & STREAM_VERTICAL) != 0;
+      pSink->iFields = STREAM_FIELDS(*iFlags);
+      pSink->pTiles = StreamTiles(pData, iLen);
+      pChunks = &pData[BUNDLE_HEADER_SIZE + BundleClips(pData, iLen) * 4];
+      pIndex = &pChunks[(iChunks + 1) * 4];
+      if (iClip < 0 || iClip >= BundleClips(pData, iLen) || pIndex > &pData[iLen])
+      {
+         free(pSink);
+         return -1;
+      }
+      s = &pData[BUNDLE_HEADER_SIZE + iClip * 4];
+      iFirst = s[0] | (s[1] << 8);
+      k = s[2] | (s[3] << 8);
+      if (&pIndex[(iFirst + k) * 2] > &pData[iLen])
+      {
+         free(pSink);
+         return -1;
+      }
+      for (i=0; i<k; i++) // every frame is a chunk
+      {
+         iChunks = pIndex[(iFirst + i) * 2] | (pIndex[(iFirst + i) * 2 + 1] << 8);
+         s = &pChunks[iChunks * 4];
+         iStart = s[0] | (s[1] << 8) | (s[2] << 16) | (s[3] << 24);
+         iEnd = s[4] | (s[5] << 8) | (s[6] << 16) | (s[7] << 24);
+         if (&s[8] > pIndex || iStart < 0 || iEnd > iLen || iStart >= iEnd ||
+             ODecodeFrame(pSink, &pData[iStart], &pData[iEnd]) != &pData[iEnd])
+         {
+            free(pSink);
+            return -1;
+         }
+         if (iCount < iMax)
+            StoreScreen(pSink, &pFrames[iCount * 1024], &pLevels[iCount]);
+         iCount++;
+      }
+   }
+   else
+   {
+      s = &pData[StreamStart(pData, iLen, iFlags)];
+      pEnd = &pData[iLen];
+      pSink->bVertical = (*iFlags & STREAM_VERTICAL) != 0;
+      pSink->iFields = STREAM_FIELDS(*iFlags);
+      pSink->pTiles = StreamTiles(pData, iLen);
+      while (s < pEnd)
+      {
+         s = ODecodeFrame(pSink, s, pEnd);
+         if (s == NULL)
+         {
+            free(pSink);
+            return -1;
+         }
+         if (iCount < iMax)
+            StoreScreen(pSink, &pFrames[iCount * 1024], &pLevels[iCount]);
+         iCount++;
+      }
+   }
+   free(pSink);
+   return iCount;
+} /* DecodeStream() */
+//
+// Returns 1 if frames i and j of a clip show the same (at the same
+// contrast, unless nothing is lit)
+//
+static int SameFrame(unsigned char *pFrames, unsigned char *pLevels, int i, int j)
+{
+   if (memcmp(&pFrames[i*1024], &pFrames[j*1024], 1024) != 0)
+      return 0;
+   return (pLevels[i] == pLevels[j] || FrameBlank(&pFrames[i*1024]));
+} /* SameFrame() */
+//
+// Decode a stream (or bundle clip) given as input so that it can be
+// encoded again with the current options; a ping-pong stream gives
+// back its forward frames and turns on ping-pong for the encoder, and
+// the loop frame of a stream is dropped and turned on the same way (so
+// are display commands)
+// Returns the number of frames or -1 for an error
+//
+static int LoadStream(ENCODER *pEnc, char *szName, unsigned char *pData, int iLen, int iClip, unsigned char **ppFrames, unsigned char **ppLevels)
+{
+int i, iCount, iFlags;
+unsigned char *pFrames, *pLevels;
+
+   if (iClip < 0 && BundleClips(pData, iLen) > 1)
+   {
+      printf("%s: give each clip of a bundle its own --in\n", szName);
+      return -1;
+   }
+   iCount = DecodeStream(pData, iLen, iClip < 0 ? 0 : iClip, NULL, NULL, 0, &iFlags); // count them
+   if (iCount < 0)
+   {
+      printf("%s: not a GIF or a stream which decodes\n", szName);
+      return -1;
+   }
+   pFrames = *ppFrames = malloc((iCount + 1) * 1024);
+   pLevels = *ppLevels = malloc(iCount + 1);
+   DecodeStream(pData, iLen, iClip < 0 ? 0 : iClip, pFrames, pLevels, iCount, &iFlags);
+   if ((iFlags & STREAM_PLANES_MASK) || iGrayBits > 1) // (the luma is gone)
+   {
+      printf("%s: grayscale needs the GIF; streams are transcoded in 1-bpp only\n", szName);
+      return -1;
+   }
+   if ((iFlags & STREAM_PINGPONG) && (iCount & 1) && iCount > 1)
+   {
+      for (i=0; i<iCount/2; i++) // just the way back (not lossy or rate controlled)
+      {
+         if (!SameFrame(pFrames, pLevels, i, iCount-1-i))
+            break;
+      }
+      if (i == iCount/2)
+      {
+         iCount = iCount/2 + 1;
+         pEnc->bPingPong = 1;
+      }
+   }
+   else if ((iFlags & STREAM_LOOP_FRAME) && iCount > 2 && SameFrame(pFrames, pLevels, 0, 1))
+   {
+      memmove(&pFrames[1024], &pFrames[2048], (iCount - 2) * 1024); // drop the loop frame
+      memmove(&pLevels[1], &pLevels[2], iCount - 2);
+      iCount--;
+      pEnc->bLoopFrame = 1;
+   }
+   if (iFlags & STREAM_COMMANDS)
+      pEnc->bCommands = 1;
+   if (pEnc->bInvert)
+   {
+      for (i=0; i<iCount*1024; i++)
+         pFrames[i] = ~pFrames[i];
+   }
+   pEnc->bTranscode = 1;
+   pEnc->iWidth = 128;
+   pEnc->iHeight = 64;
+   return iCount;
+} /* LoadStream() */
+//
+// Check that a transcoded clip plays back exactly the frames it was
+// decoded from (with the way back of a ping-pong clip, or frame 0 again
+// where the loop frame is), at the same contrast where anything is lit
+// Returns 0 if it does, 1 + the first frame which differs or -1 if the
+// stream doesn't decode
+//
+static int VerifyClip(ENCODER *pEnc, unsigned char *pFrames, unsigned char *pLevels, int iCount, unsigned char *pStream, int iLen)
+{
+unsigned char *pCheck, *pCheckLevels;
+int i, k, iTotal, iFlags, bClose, rc;
+
+   iTotal = pEnc->bPingPong ? iCount * 2 - 1 : iCount;
+   pCheck = malloc((iTotal + 1) * 1024);
+   pCheckLevels = malloc(iTotal + 1);
+   rc = 0;
+   i = DecodeStream(pStream, iLen, 0, pCheck, pCheckLevels, iTotal + 1, &iFlags);
+   bClose = (iFlags & STREAM_LOOP_FRAME) != 0;
+   iTotal += bClose;
+   if (i != iTotal)
+      rc = -1;
+   for (i=0; i<iTotal && rc == 0; i++)
+   {
+      k = (i < iCount) ? i : (iCount - 1) * 2 - i;
+      if (bClose)
+         k = (i > 0) ? i - 1 : 0;
+      if (memcmp(&pCheck[i*1024], &pFrames[k*1024], 1024) != 0 || (pCheckLevels[i] != pLevels[k] && !FrameBlank(&pFrames[k*1024])))
+         rc = i + 1;
+   }
+   free(pCheckLevels);
+   free(pCheck);
+   return rc;
+} /* VerifyClip() */
+//
+// Report what the loop frame of a stream saves on every pass of a loop
+//
+static void PrintLoopFrame(unsigned char *pStream, int iLen)
+{
+int iOff, iFirst, iLoop, iSplit, iFlags;
+
+   if (iLen < STREAM_HEADER_SIZE || pStream[0] != STREAM_MARKER0 || pStream[1] != STREAM_MARKER1 || !(pStream[2] & STREAM_LOOP_FRAME))
+   {
+      printf("Loop frame: left out (it costs as much as frame 0)\n");
+      return;
+   }
+   iOff = StreamStart(pStream, iLen, &iFlags);
+   iSplit = STREAM_FIELDS(iFlags);
+   iFirst = FrameBusCost(pStream, &iOff, iSplit);
+   iLoop = FrameBusCost(pStream, &iOff, iSplit);
+   printf("Loop frame: %d bus bytes per loop instead of %d\n", iLoop, iFirst);
+} /* PrintLoopFrame() */
+//
+// Grow the buffers of a clip from iCount to iMax frames (planes), their
+// contrast levels (full for the new ones) and, if there is one, their luma
+// Returns 0 for success, -1 if out of memory
+//
+static int GrowClip(int iCount, int iMax, unsigned char **ppFrames, unsigned char **ppLevels, unsigned char **ppLuma)
+{
+unsigned char *p;
+
+	p = realloc(*ppFrames, iMax * iGrayBits * 1024);
+	if (p == NULL)
+		return -1;
+	*ppFrames = p;
+	p = realloc(*ppLevels, iMax);
+	if (p == NULL)
+		return -1;
+	memset(&p[iCount], 255, iMax - iCount);
+	*ppLevels = p;
+	if (*ppLuma)
+	{
+		p = realloc(*ppLuma, iMax * 128*64);
+		if (p == NULL)
+			return -1;
+		*ppLuma = p;
+	}
+	return 0;
+} /* GrowClip() */
+//
+// Read an animated GIF, or an encoded stream, archive or bundle clip
+// (iClip, -1 for a file of one clip), into frames in SSD1306 layout and
+// their contrast levels (see FindFades())
+// The buffers are allocated here (and grown to hold every frame); the
+// caller frees *ppFrames and *ppLevels, also after an error
+// pEnc receives the size of the GIF
+// Returns the number of frames or -1 for an error
+//
+int LoadClip(ENCODER *pEnc, char *szName, int iClip, unsigned char **ppFrames, unsigned char **ppLevels)
+{
+GIFANIM *pGIF;
+int rc, iCount, iMax;
+unsigned char ucFrame[1024]; // temporary 1-bpp frame
+unsigned char *pData, *pFrames, *pLuma = NULL;
+
+	pEnc->bTranscode = 0;
+	*ppFrames = *ppLevels = NULL;
+	iCount = ReadStream(szName, &pData);
+	if (iCount < 0)
+		return -1;
+	if (iCount < 4 || memcmp(pData, "GIF8", 4) != 0) // transcode it
+	{
+		iCount = LoadStream(pEnc, szName, pData, iCount, iClip, ppFrames, ppLevels);
+		free(pData);
+		return iCount;
+	}
+	free(pData);
+	pGIF = malloc(sizeof(GIFANIM));
+	if (GIFOpen(pGIF, szName))
+	{
+		free(pGIF);
+		return -1;
+	}
+	if (pEnc->bCommands && iGrayBits == 1 && !pEnc->bInvert) // (fades to black)
+		pLuma = malloc(128*64); // (grown with the frames)
+	iCount = iMax = 0;
+	while ((rc = GIFNextFrame(pGIF)) == 1)
+	{
+		if (iCount == iMax) // double the buffers
 		{
-		void *ohandle;
-		ohandle = PILIOCreate(szOut);
-			printf("Generated %d bytes of compressed output\n", iLen);
-			if (ohandle != (void *)-1)
+			iMax = iMax ? iMax * 2 : 64;
+			if (GrowClip(iCount, iMax, ppFrames, ppLevels, &pLuma))
 			{
-				if (bC) // write C code
-				{
-					MakeCode(ohandle, pCompressed, iLen);
-				}
-				else // write binary data
-				{
-					PILIOWrite(ohandle, pCompressed, iLen);
-				}
-				PILIOClose(ohandle);
+				printf("%s: out of memory at frame %d\n", szName, iCount);
+				rc = 0;
+				iCount = -1;
+				break;
 			}
 		}
-		PILClose(&pf);
-	} // if file loaded successfully
-        else
-        {
-           printf("Error loading %s\n", szIn);
-           return -1;
-        }
-   PlayBack(pCompressed, iLen);
+		pFrames = *ppFrames;
+		if (iGrayBits > 1)
+		{
+			MakeGray(pEnc, &pFrames[iCount*iGrayBits*1024], pGIF);
+			iCount++;
+			continue;
+		}
+		Make1Bit(pEnc, ucFrame, pGIF);
+		MakeOLED(ucFrame, &pFrames[iCount*1024]);
+		if (pLuma)
+			GetLuma(pEnc, &pLuma[iCount*128*64], pGIF);
+#ifdef SAVE_INPUT_FRAMES
+		{
+		char szFile[32];
+			sprintf(szFile, "in%d.pbm", iCount);
+			SavePBM(szFile, ucFrame);
+		}
+#endif // SAVE_INPUT_FRAMES
+		iCount++;
+	}
+	if (rc < 0)
+		printf("%s: frame %d, bad GIF data\n", szName, iCount);
+	if (pLuma)
+	{
+		if (iCount > 0)
+			FindFades(*ppFrames, *ppLevels, pLuma, iCount);
+		free(pLuma);
+	}
+	pEnc->iWidth = pGIF->iWidth;
+	pEnc->iHeight = pGIF->iHeight;
+	GIFClose(pGIF);
+	free(pGIF);
+	return iCount;
+} /* LoadClip() */
+//
+// Print how much of the work the encode cache saved
+//
+static void PrintCacheStats(int iClipHits, int iClipEncodes, int iFrameHits, int iFrameEncodes)
+{
+   printf("Cache: %d of %d clip encodes and %d of %d frames reused\n", iClipHits, iClipHits + iClipEncodes, iFrameHits, iFrameHits + iFrameEncodes);
+} /* PrintCacheStats() */
+//
+// Write the encode cache back to its directory
+//
+static void CloseCache(void)
+{
+CACHEINFO info;
+
+   if (pCache == NULL)
+      return;
+   if (CacheClose(pCache, &info))
+      printf("Error writing the cache in %s\n", szCache);
+   else
+      printf("Cache: %d entries, %ldKB, %d evicted\n", info.iEntries, info.lBytes >> 10, info.iEvicted);
+   pCache = NULL;
+} /* CloseCache() */
+//
+// Batch mode (--batch)
+// Every GIF of a directory or manifest is encoded with the options given
+// on the command line. Each job has its own ENCODER, so the jobs run on a
+// pool of worker threads; the list is sorted biggest file first and each
+// worker takes the next job when it's done, which keeps all of them busy
+// until the end.
+//
+typedef struct tag_job
+{
+   ENCODER enc;
+   char szIn[MAX_PATH], szOut[MAX_PATH];
+   int iOrder; // position in the directory or manifest
+   long lSize; // input file size
+   int iFrames; // frames in the stream
+   int iLen; // bytes written
+   int iMS; // encode time
+   int rc; // 0 = success
+} JOB;
+static JOB *pJobList = NULL;
+static int iJobCount = 0, iNextJob = 0;
+static pthread_mutex_t mutexJobs = PTHREAD_MUTEX_INITIALIZER;
+
+static int TimeMS(void)
+{
+struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+} /* TimeMS() */
+//
+// Add a file to the batch; without an output name it gets the input name
+// with a .bin or .c extension, in --out-dir if one was given
+//
+static void BatchAddJob(char *szName, char *szOutName, int iJobTop, int iJobLeft, int bJobInvert)
+{
+JOB *pJob;
+struct stat st;
+char szTemp[MAX_PATH*2+8];
+char *p, *pExt;
+
+   if (szOutName != NULL)
+   {
+      strcpy(szTemp, szOutName);
+   }
+   else
+   {
+      p = strrchr(szName, '/');
+      if (szOutDir[0])
+         sprintf(szTemp, "%s/%s", szOutDir, p ? p+1 : szName);
+      else
+         strcpy(szTemp, szName);
+      p = strrchr(szTemp, '/');
+      pExt = strrchr(szTemp, '.');
+      if (pExt && (p == NULL || pExt > p))
+         *pExt = 0;
+      strcat(szTemp, bC ? ".c" : ".bin");
+   }
+   if (strcmp(szTemp, szName) == 0) // a transcoded .bin
+   {
+      printf("%s: the output would replace the input; use --out-dir\n", szName);
+      return;
+   }
+   if (strlen(szTemp) >= MAX_PATH - 4) // room for .tmp
+   {
+      printf("%s: output name is too long\n", szName);
+      return;
+   }
+   if ((iJobCount & 63) == 0)
+      pJobList = realloc(pJobList, (iJobCount + 64) * sizeof(JOB));
+   pJob = &pJobList[iJobCount];
+   memset(pJob, 0, sizeof(JOB));
+   strcpy(pJob->szIn, szName);
+   strcpy(pJob->szOut, szTemp);
+   pJob->enc.iTop = iJobTop;
+   pJob->enc.iLeft = iJobLeft;
+   pJob->enc.bInvert = bJobInvert;
+   pJob->enc.bPingPong = bPingPong;
+   pJob->enc.bLoopFrame = bLoopFrame;
+   pJob->enc.bCommands = bCommands;
+   pJob->iOrder = iJobCount;
+   if (stat(szName, &st) == 0)
+      pJob->lSize = (long)st.st_size;
+   iJobCount++;
+} /* BatchAddJob() */
+static int BatchByName(const void *a, const void *b)
+{
+   return strcmp(((const JOB *)a)->szIn, ((const JOB *)b)->szIn);
+} /* BatchByName() */
+//
+// Add every .gif file of a directory to the batch
+//
+static int BatchReadDir(char *szDir)
+{
+DIR *pDir;
+struct dirent *pEntry;
+char szName[MAX_PATH];
+char *pExt;
+int i;
+
+   pDir = opendir(szDir);
+   if (pDir == NULL)
+      return -1;
+   while ((pEntry = readdir(pDir)) != NULL)
+   {
+      pExt = strrchr(pEntry->d_name, '.');
+      if (pExt == NULL || (strcmp(pExt, ".gif") != 0 && strcmp(pExt, ".GIF") != 0))
+         continue;
+      if (strlen(szDir) + strlen(pEntry->d_name) + 2 > MAX_PATH)
+         continue;
+      sprintf(szName, "%s/%s", szDir, pEntry->d_name);
+      BatchAddJob(szName, NULL, iTop, iLeft, bInvert);
+   }
+   closedir(pDir);
+   qsort(pJobList, iJobCount, sizeof(JOB), BatchByName); // readdir() order is random
+   for (i=0; i<iJobCount; i++)
+      pJobList[i].iOrder = i;
+   return 0;
+} /* BatchReadDir() */
+//
+// Add the files of a manifest to the batch
+// One file per line: <input> [<output>] [--top N] [--left N] [--invert]
+// Blank lines and lines starting with # are ignored
+//
+static int BatchReadManifest(char *szName)
+{
+FILE *pf;
+char szLine[1024];
+char *pIn, *pOutName, *pToken;
+int iJobTop, iJobLeft, bJobInvert;
+
+   pf = fopen(szName, "rb");
+   if (pf == NULL)
+      return -1;
+   while (fgets(szLine, sizeof(szLine), pf) != NULL)
+   {
+      pIn = strtok(szLine, " \t\r\n");
+      if (pIn == NULL || pIn[0] == '#')
+         continue;
+      pOutName = NULL;
+      iJobTop = iTop; iJobLeft = iLeft; bJobInvert = bInvert;
+      while ((pToken = strtok(NULL, " \t\r\n")) != NULL)
+      {
+         if (0 == strcmp("--top", pToken) && (pToken = strtok(NULL, " \t\r\n")) != NULL)
+            iJobTop = atoi(pToken);
+         else if (0 == strcmp("--left", pToken) && (pToken = strtok(NULL, " \t\r\n")) != NULL)
+            iJobLeft = atoi(pToken);
+         else if (0 == strcmp("--invert", pToken))
+            bJobInvert = 1;
+         else if (pOutName == NULL && strncmp("--", pToken, 2) != 0)
+            pOutName = pToken;
+         else
+            printf("%s: ignoring '%s'\n", pIn, pToken);
+      }
+      if (strlen(pIn) < MAX_PATH && (pOutName == NULL || strlen(pOutName) < MAX_PATH))
+         BatchAddJob(pIn, pOutName, iJobTop, iJobLeft, bJobInvert);
+   }
+   fclose(pf);
+   return 0;
+} /* BatchReadManifest() */
+//
+// Encode and write one clip of the batch
+// Returns the length of the output or -1 for an error
+//
+static int BatchWrite(JOB *pJob, unsigned char *pFrames, unsigned char *pLevels, int iCount, unsigned char *pStream)
+{
+ENCODER *pEnc = &pJob->enc;
+char szArray[MAX_PATH], *p;
+unsigned char *pData, *pArchive = NULL;
+int i, rc, iLen, iHorizontal, iVertical, iSplitLen[FIELDS_COUNT], iTileLen[2];
+
+   pEnc->bVertical = (iScan == SCAN_VERTICAL);
+   SetFields(pEnc, (iFields == FIELDS_AUTO) ? FIELDS_3_3 : iFields);
+   if (iScan == SCAN_AUTO) // try both and keep the smaller
+   {
+      pEnc->bVertical = 0;
+      iHorizontal = EncodeClip(pEnc, pFrames, pLevels, iCount, pStream, &pJob->iFrames);
+      pEnc->bVertical = 1;
+      iVertical = EncodeClip(pEnc, pFrames, pLevels, iCount, pStream, &pJob->iFrames);
+      pEnc->bVertical = (iVertical < iHorizontal);
+   }
+   if (iFields == FIELDS_AUTO)
+      SetFields(pEnc, ChooseFields(pEnc, &pFrames, &pLevels, &iCount, 1, &pStream, iSplitLen));
+   if (bTiles)
+      ChooseTiles(pEnc, &pFrames, &pLevels, &iCount, 1, &pStream, iTileLen);
+   iLen = EncodeClip(pEnc, pFrames, pLevels, iCount, pStream, &pJob->iFrames);
+   if (pEnc->bTranscode && !iLossy && !iMaxFrameBytes && VerifyClip(pEnc, pFrames, pLevels, iCount, pStream, iLen) != 0)
+   {
+      printf("%s: the transcoded stream doesn't play back the same frames\n", pJob->szIn);
+      return -1;
+   }
+   pData = pStream;
+   if (bArchive && !bC)
+   {
+      pArchive = malloc(ArcMaxSize(iLen));
+      iLen = ArcCompress(pStream, iLen, pArchive);
+      pData = pArchive;
+   }
+   // each array of C output is named after its file
+   p = strrchr(pJob->szOut, '/');
+   strcpy(szArray, p ? p+1 : pJob->szOut);
+   p = strrchr(szArray, '.');
+   if (p)
+      *p = 0;
+   for (i=0; szArray[i]; i++)
+   {
+      if (!isalnum((unsigned char)szArray[i]))
+         szArray[i] = '_';
+   }
+   rc = SaveOutput(pJob->szOut, isdigit((unsigned char)szArray[0]) ? "bAnimation" : szArray, pData, iLen);
+   if (pArchive)
+      free(pArchive);
+   return rc ? -1 : iLen;
+} /* BatchWrite() */
+//
+// Load, encode and write one file of the batch
+// The buffers are sized for the clip, so each job allocates its own
+//
+static void BatchEncode(JOB *pJob)
+{
+unsigned char *pFrames, *pLevels, *pStream;
+int iCount;
+
+   pJob->rc = -1;
+   iCount = LoadClip(&pJob->enc, pJob->szIn, -1, &pFrames, &pLevels);
+   if (iCount > 0)
+   {
+      pStream = malloc(StreamSize(iCount));
+      pJob->iLen = BatchWrite(pJob, pFrames, pLevels, iCount, pStream);
+      if (pJob->iLen >= 0)
+         pJob->rc = 0;
+      free(pStream);
+   }
+   free(pFrames);
+   free(pLevels);
+} /* BatchEncode() */
+
+static void *BatchWorker(void *pArg)
+{
+JOB *pJob;
+int iStart;
+
+   (void)pArg;
+   for (;;)
+   {
+      pthread_mutex_lock(&mutexJobs);
+      pJob = (iNextJob < iJobCount) ? &pJobList[iNextJob++] : NULL;
+      pthread_mutex_unlock(&mutexJobs);
+      if (pJob == NULL)
+         break;
+      iStart = TimeMS();
+      BatchEncode(pJob);
+      pJob->iMS = TimeMS() - iStart;
+   }
+   return NULL;
+} /* BatchWorker() */
+
+static int BatchBySize(const void *a, const void *b)
+{
+   const JOB *pA = (const JOB *)a, *pB = (const JOB *)b;
+   if (pA->lSize != pB->lSize)
+      return (pA->lSize < pB->lSize) ? 1 : -1;
+   return pA->iOrder - pB->iOrder;
+} /* BatchBySize() */
+
+static int BatchByOrder(const void *a, const void *b)
+{
+   return ((const JOB *)a)->iOrder - ((const JOB *)b)->iOrder;
+} /* BatchByOrder() */
+//
+// Encode all of the files of the batch and print a summary table
+// Returns the number of files which failed
+//
+int Batch(void)
+{
+pthread_t tid[MAX_JOBS];
+struct stat st;
+JOB *pJob;
+int i, iThreads, iStart, iErrors, iCPU;
+int iClipHits, iClipEncodes, iFrameHits, iFrameEncodes;
+long lRaw, lOut, lCPU;
+
+   if (stat(szBatch, &st) == 0 && S_ISDIR(st.st_mode))
+      i = BatchReadDir(szBatch);
+   else
+      i = BatchReadManifest(szBatch);
+   if (i != 0)
+   {
+      printf("Error reading %s\n", szBatch);
+      return 1;
+   }
+   if (iJobCount == 0)
+   {
+      printf("No input files in %s\n", szBatch);
+      return 1;
+   }
+   iThreads = iJobs;
+   if (iThreads <= 0)
+      iThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (iThreads < 1)
+      iThreads = 1;
+   if (iThreads > MAX_JOBS)
+      iThreads = MAX_JOBS;
+   if (iThreads > iJobCount)
+      iThreads = iJobCount;
+   qsort(pJobList, iJobCount, sizeof(JOB), BatchBySize);
+   iStart = TimeMS();
+   for (i=0; i<iThreads; i++)
+      pthread_create(&tid[i], NULL, BatchWorker, NULL);
+   for (i=0; i<iThreads; i++)
+      pthread_join(tid[i], NULL);
+   iStart = TimeMS() - iStart;
+   qsort(pJobList, iJobCount, sizeof(JOB), BatchByOrder);
+   printf("%-32s %6s %9s %8s %6s %7s\n", "file", "frames", "raw", "output", "ratio", "ms");
+   lRaw = lOut = lCPU = 0;
+   iErrors = 0;
+   iClipHits = iClipEncodes = iFrameHits = iFrameEncodes = 0;
+   for (i=0; i<iJobCount; i++)
+   {
+      pJob = &pJobList[i];
+      iClipHits += pJob->enc.iClipHits;
+      iClipEncodes += pJob->enc.iClipEncodes;
+      iFrameHits += pJob->enc.iFrameHits;
+      iFrameEncodes += pJob->enc.iFrameEncodes;
+      if (pJob->rc != 0)
+      {
+         printf("%-32s error\n", pJob->szIn);
+         iErrors++;
+         continue;
+      }
+      printf("%-32s %6d %9d %8d %5.1f:1 %7d\n", pJob->szIn, pJob->iFrames, pJob->iFrames * 1024, pJob->iLen, (double)(pJob->iFrames * 1024) / pJob->iLen, pJob->iMS);
+      lRaw += pJob->iFrames * 1024;
+      lOut += pJob->iLen;
+      lCPU += pJob->iMS;
+   }
+   iCPU = (int)lCPU;
+   printf("%d files, %d errors, %ld bytes -> %ld bytes", iJobCount, iErrors, lRaw, lOut);
+   if (lOut)
+      printf(" (%.1f:1)", (double)lRaw / lOut);
+   printf("\n%d threads, %d ms (%d ms of encoding", iThreads, iStart, iCPU);
+   if (iStart)
+      printf(", %.1fx", (double)iCPU / iStart);
+   printf(")\n");
+   if (pCache)
+      PrintCacheStats(iClipHits, iClipEncodes, iFrameHits, iFrameEncodes);
+   free(pJobList);
+   return iErrors;
+} /* Batch() */
+
+//
+// Give each clip of a bundle given as input a slot of its own, so that a
+// bundle is transcoded into a bundle of the same clips
+//
+static void ExpandBundles(void)
+{
+unsigned char *pData;
+int i, j, iLen, iCount;
+
+   for (i=0; i<iClips; i++)
+   {
+      iLen = ReadStream(szIn[i], &pData);
+      if (iLen < 0)
+         continue;
+      iCount = BundleClips(pData, iLen);
+      free(pData);
+      if (iCount == 0)
+         continue;
+      bBundle = 1;
+      if (iClips + iCount - 1 > MAX_CLIPS)
+      {
+         printf("%s: only %d clips fit in the bundle\n", szIn[i], MAX_CLIPS - iClips + 1);
+         iCount = MAX_CLIPS - iClips + 1;
+      }
+      memmove(&szIn[i+iCount], &szIn[i+1], (iClips - i - 1) * MAX_PATH);
+      memmove(&iInClip[i+iCount], &iInClip[i+1], (iClips - i - 1) * sizeof(int));
+      for (j=0; j<iCount; j++)
+      {
+         if (j)
+            strcpy(szIn[i+j], szIn[i]);
+         iInClip[i+j] = j;
+      }
+      iClips += iCount - 1;
+      i += iCount - 1;
+   }
+} /* ExpandBundles() */
+
+int main( int argc, char *argv[ ], char *envp[ ] )
+{
+int i, iLen, iFrames, iTotal;
+int iCount[MAX_CLIPS], iLens[MAX_CLIPS], bTranscode[MAX_CLIPS];
+unsigned char *pCompressed, *pFrames[MAX_CLIPS], *pLevels[MAX_CLIPS], *pStreams[MAX_CLIPS];
+STATS *pStats = NULL;
+FILE *pJSON = NULL;
+ENCODER *pEnc;
+
+   if (argc < 3)
+      {
+      ShowHelp();
+      return 0;
+      }
+   parse_opts(argc, argv);
+   if (szCache[0])
+   {
+      pCache = CacheOpen(szCache, (long)iCacheMB << 20);
+      if (pCache == NULL)
+         printf("Error opening the cache in %s; encoding everything\n", szCache);
+   }
+   if (szBatch[0])
+   {
+      i = Batch();
+      CloseCache();
+      return i ? 1 : 0;
+   }
+   pEnc = calloc(1, sizeof(ENCODER));
+   pEnc->iTop = iTop;
+   pEnc->iLeft = iLeft;
+   pEnc->bInvert = bInvert;
+   pEnc->bPingPong = bPingPong;
+   pEnc->bLoopFrame = bLoopFrame;
+   pEnc->bCommands = bCommands;
+   ExpandBundles();
+   iLen = iFrames = iTotal = 0;
+   for (i=0; i<iClips; i++)
+   {
+      // all frames (planes) in SSD1306 layout and their contrast
+      iCount[i] = LoadClip(pEnc, szIn[i], iInClip[i], &pFrames[i], &pLevels[i]);
+      if (iCount[i] <= 0)
+      {
+         printf("Error loading %s\n", szIn[i]);
+         return -1;
+      }
+      pStreams[i] = malloc(StreamSize(iCount[i]));
+      bTranscode[i] = pEnc->bTranscode;
+      if (iInClip[i] >= 0)
+         printf("%s clip %d: %dx%d, frames=%d\n", szIn[i], iInClip[i], pEnc->iWidth, pEnc->iHeight, iCount[i]);
+      else
+         printf("%s: %dx%d, frames=%d\n", szIn[i], pEnc->iWidth, pEnc->iHeight, iCount[i]);
+   }
+   if (iClips == 0)
+   {
+      printf("No input file\n");
+      return -1;
+   }
+   SetFields(pEnc, (iFields == FIELDS_AUTO) ? FIELDS_3_3 : iFields);
+   if (iScan == SCAN_AUTO) // try both and keep the smaller
+   {
+   int iHorizontal = 0, iVertical = 0;
+      for (i=0; i<iClips; i++) // bundled clips share the scan order
+      {
+         pEnc->bVertical = 0;
+         iHorizontal += EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+         pEnc->bVertical = 1;
+         iVertical += EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+      }
+      printf("Scan order: horizontal = %d bytes, vertical = %d bytes\n", iHorizontal, iVertical);
+      iScan = (iVertical < iHorizontal) ? SCAN_VERTICAL : SCAN_HORIZONTAL;
+   }
+   pEnc->bVertical = (iScan == SCAN_VERTICAL);
+   if (iFields == FIELDS_AUTO) // bundled clips share the field split too
+   {
+   int iSplitLen[FIELDS_COUNT];
+      iFields = ChooseFields(pEnc, pFrames, pLevels, iCount, iClips, pStreams, iSplitLen);
+      printf("Field split: 3/3 = %d bytes", iSplitLen[FIELDS_3_3]);
+      for (i=1; i<FIELDS_COUNT; i++)
+      {
+         if (iSplitLen[i])
+            printf(", %s = %d bytes", szFieldNames[i], iSplitLen[i]);
+      }
+      printf(", using %s\n", szFieldNames[iFields]);
+      SetFields(pEnc, iFields);
+   }
+   if (bTiles) // and the tile table
+   {
+   int iTileLen[2];
+      if (ChooseTiles(pEnc, pFrames, pLevels, iCount, iClips, pStreams, iTileLen))
+         printf("Tiles: %d tiles, %d bytes instead of %d\n", pEnc->iTiles, iTileLen[1], iTileLen[0]);
+      else
+         printf("Tiles: none make the clips smaller\n");
+   }
+   if (bStats)
+   {
+      pStats = calloc(1, sizeof(STATS));
+      if (szStatsJSON[0])
+      {
+         pJSON = fopen(szStatsJSON, "wb");
+         if (pJSON == NULL)
+            printf("Error creating %s\n", szStatsJSON);
+         else
+            fprintf(pJSON, "{\n  \"scan\": \"%s\",\n  \"clips\": [\n", pEnc->bVertical ? "vertical" : "horizontal");
+      }
+   }
+   for (i=0; i<iClips; i++)
+   {
+      iLens[i] = EncodeClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], &iFrames);
+      iTotal += iFrames;
+      if (bTranscode[i])
+      {
+         if (iLossy || iMaxFrameBytes)
+            printf("Transcode: lossy or rate controlled, frames not verified\n");
+         else if (VerifyClip(pEnc, pFrames[i], pLevels[i], iCount[i], pStreams[i], iLens[i]) != 0)
+         {
+            printf("Error - the transcoded %s doesn't play back the same frames\n", szIn[i]);
+            return -1;
+         }
+         else
+            printf("Transcode: all %d frames play back exactly\n", iFrames);
+      }
+      if (iMaxFrameBytes)
+         printf("Rate control: %d bytes per frame, %d frames limited, %d frames added\n", iMaxFrameBytes, pEnc->iRateLimited, pEnc->iRateAdded);
+      if (bWindows)
+         printf("Windows: %d windows, %d bytes\n", pEnc->iWindowCount, pEnc->iWindowBytes);
+      if (pEnc->bLoopFrame && !pEnc->bPingPong && iCount[i] > 1)
+      {
+         if (iMaxFrameBytes) // (a transcoded stream had one)
+            printf("Loop frame: left out (it doesn't fit the byte budget)\n");
+         else
+            PrintLoopFrame(pStreams[i], iLens[i]);
+      }
+      if (iLossy && iFrames)
+         printf("Lossy: saved %d bytes, %d pixels deviated (%d.%02d%% of all frame pixels)\n", pEnc->iLossySaved, pEnc->iLossyPixels, (pEnc->iLossyPixels * 100) / (iFrames * 8192), ((pEnc->iLossyPixels * 10000) / (iFrames * 8192)) % 100);
+      iLen += iLens[i];
+      if (bStats)
+      {
+         GatherStats(pStreams[i], iLens[i], pStats);
+         PrintStats(szIn[i], pStats, pJSON, i == 0);
+         if (szStatsPBM[0] && i == 0) // heatmap of the first clip
+         {
+            if (WriteHeatmapPBM(szStatsPBM, pStats))
+               printf("Error creating %s\n", szStatsPBM);
+         }
+      }
+   }
+   if (pJSON)
+   {
+      fprintf(pJSON, "\n  ]\n}\n");
+      fclose(pJSON);
+   }
+   if (pStats)
+      FreeStats(pStats);
+   if (pCache)
+      PrintCacheStats(pEnc->iClipHits, pEnc->iClipEncodes, pEnc->iFrameHits, pEnc->iFrameEncodes);
+   CloseCache();
+   if (bBundle)
+   {
+      pCompressed = malloc(iLen + BUNDLE_HEADER_SIZE + (iClips + 1) * 4 + iTotal * 6);
+      iLen = MakeBundle(pStreams, iLens, iClips, pCompressed);
+   }
+   else
+   {
+      pCompressed = pStreams[0];
+   }
+   if (iLen)
+   {
+   unsigned char *pArchive = NULL, *pData = pCompressed;
+   int iOutLen = iLen;
+      printf("Generated %d bytes of compressed output\n", iLen);
+      if (bArchive && !bC) // Huffman coded for Linux players
+      {
+      unsigned char *pCheck;
+         pArchive = malloc(ArcMaxSize(iLen));
+         pCheck = malloc(iLen);
+         iOutLen = ArcCompress(pCompressed, iLen, pArchive);
+         printf("Archive is %d bytes (%d%% of raw)\n", iOutLen, (iOutLen * 100) / iLen);
+         if (ArcDecompress(pArchive, iOutLen, pCheck, iLen) != iLen || memcmp(pCheck, pCompressed, iLen) != 0)
+            printf("Error - archive failed to verify\n");
+         if (!bBundle)
+            BenchArchive(pCompressed, iLen, pArchive, iOutLen, iTotal);
+         free(pCheck);
+         pData = pArchive;
+      }
+      if (SaveOutput(szOut, bBundle ? "bBundle" : "bAnimation", pData, iOutLen))
+         printf("Error creating %s\n", szOut);
+      if (pArchive)
+         free(pArchive);
+   }
+   for (i=0; i<iClips; i++)
+   {
+      if (PlayBack(pStreams[i], iLens[i]))
+         printf("Error - %s failed to decode\n", szIn[i]);
+      free(pStreams[i]);
+      free(pFrames[i]);
+      free(pLevels[i]);
+   }
+   if (bBundle)
+      free(pCompressed);
+   free(pEnc);
    return 0;
 }
@@ -20,14 +20,9 @@
 // In order to not keep a copy of the display memory on the player, the
 // skip operations just move the write address (cursor position) on the
 // OLED display. The bytes are packed such that the highest 2 bits of each
-// command byte determine the treatment. They are:
-// 00SSSCCC - skip+copy (in that order). The 3 bit lengths of each of the
-//    skip and copy represent 0-7
-// 00000000 - special case (long skip). The next byte is the len (1-256)
-// 01CCCSSS - copy+skip (in that order). Same as above
-// 01000000 - special case (long copy). The next byte is the len (1-256)
-// 10RRRSSS - repeat+skip
-// 11RRRRRR - Repeat the next byte 1-64 times.
+// command byte determine the treatment; the opcodes are documented with
+// the decoder core in Arduino/oled_decode.h, which this player shares
+// with the Arduino sketch and tcomp.
 //
 // With those simple operations, typical animated GIF's get compressed between
 // 3 and 6 to 1 (each 1024 byte frame becomes 170 to 341 bytes of compressed
@@ -51,174 +46,281 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
-#include "oled96.h"
-
-// Masks defining the upper 2 bit "commands" for the compressed data
-#define OP_MASK 0xc0
-#define OP_SKIPCOPY 0x00
-#define OP_COPYSKIP 0x40
-#define OP_REPEATSKIP 0x80
-#define OP_REPEAT 0xc0
-
-static int file_i2c = 0;
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "archive.h"
+#include "transport.h"
+
+// Optional stream header: 0x80 'A' <flags low> <flags high>
+#define STREAM_MARKER0 0x80
+#define STREAM_MARKER1 'A'
+#define STREAM_HEADER_SIZE 4
+#define STREAM_VERTICAL 0x0001 // frames are scanned column by column
+#define STREAM_WINDOWS 0x0002 // frames may contain window opcodes
+#define STREAM_PATTERNS 0x0004 // frames may contain pattern opcodes
+#define STREAM_PAGE_ALIGNED 0x0008 // no copy, repeat or pattern crosses a line
+#define STREAM_PINGPONG 0x0010 // the frames go back down to frame 0; loops start at frame 1
+#define STREAM_LOOP_FRAME 0x0020 // frame 1 goes from the last frame back to frame 0; loops start there
+#define STREAM_TILES 0x0040 // a tile table (count - 1, 8 bytes per tile) follows the header
+#define TILE_SIZE 8
+#define STREAM_COMMANDS 0x0080 // frames may contain display commands
+#define STREAM_PLANES_MASK 0x0300 // bit planes per frame - 1 (grayscale)
+#define STREAM_PLANES_SHIFT 8
+#define STREAM_FIELDS_MASK 0x0c00 // split of the skip+copy and copy+skip fields
+#define STREAM_FIELDS_SHIFT 10
+#define STREAM_FIELDS(iFlags) (((iFlags) & STREAM_FIELDS_MASK) >> STREAM_FIELDS_SHIFT)
+#define GRAY_MAX_PLANES 3
+// State of the display which the display commands of a stream change
+#define DISPLAY_CONTRAST 0x00ff
+#define DISPLAY_INVERTED 0x0100
+#define DISPLAY_OFF 0x0200
+#define DISPLAY_DEFAULT 0x00ff // as oledInit() leaves it
+// Multi-clip bundle: "OAB1", clips, chunks, stream flags (16-bits each),
+// clip table (first frame, frame count), chunk offsets (32-bits), and
+// the chunk number of each frame (16-bits); the tile table of the clips
+// goes after the chunk data
+#define BUNDLE_HEADER_SIZE 10
+
+static TRANSPORT *pTransport = NULL;
 static int iOffset;
 static int bBadDisplay = 0;
+static int bInverted = 0; // oledInit() inverted the display
+static int bVertical = 0; // stream uses vertical addressing mode
+static int bPageAligned = 0; // no write of the stream crosses a line
 static int bLoop = 0;
+static int bPingPong = 0; // play the frames forward, then backward
+static int bReverse = 0; // play the frames backward
 static char szIn[512];
+static int iTransport = TRANSPORT_I2C;
+static char szDevice[512]; // SPI, framebuffer or capture file name
+static char szReplay[512]; // captured bus traffic to play back
+static int iClip = 0; // clip to play from a bundle
 static int iChannel = 1; // default I2C channel
 static int iAddress = 0x3c; // default I2C address
+static int iSPISpeed = 8000000; // default SPI clock
+static int iGPIOChip = 0; // GPIO chip of the SPI D/C and reset lines
+static int iDCLine = 24; // default SPI D/C line
+static int iResetLine = -1; // optional SPI reset line
 static int iFrameRate = 15; // 15 FPS
 static int iDelay; // based on framerate
+static int iPlaneHz = 180; // sub-frames per second of grayscale clips
+static int iScriptKB = 4096; // memory cap of a pre-rendered loop (0 = none)
+static SCRIPT *pScript = NULL; // bus traffic of the first pass of a loop
 
 static void oledWriteCommand(unsigned char);
 //
-// Opens a file system handle to the I2C device
-// Initializes the OLED controller into "page mode"
-// Prepares the font data for the orientation of the display
+// Opens the selected transport to the display
+// Initializes the OLED controller into "horizontal addressing mode"
 // Returns 0 for success, 1 for failure
 //
-int oledInit(int iChannel, int iAddr, int bFlip, int bInvert)
+int oledInit(int bFlip, int bInvert)
 {
-const unsigned char initbuf[]={0x00,0xae,0xa8,0x3f,0xd3,0x00,0x40,0xa1,0xc8,
+const unsigned char initbuf[]={0xae,0xa8,0x3f,0xd3,0x00,0x40,0xa1,0xc8,
 			0xda,0x12,0x81,0xff,0xa4,0xa6,0xd5,0x80,0x8d,0x14,
 			0xaf,0x20,0x00};
-char filename[32];
-int rc;
 unsigned char uc[4];
 
-	sprintf(filename, "/dev/i2c-%d", iChannel);
-	if ((file_i2c = open(filename, O_RDWR)) < 0)
+	switch (iTransport)
 	{
-		fprintf(stderr, "Failed to open the i2c bus\n");
-		file_i2c = 0;
-		return 1;
+		case TRANSPORT_I2C:
+			pTransport = TransportOpenI2C(iChannel, iAddress);
+			break;
+		case TRANSPORT_SPI:
+			pTransport = TransportOpenSPI(szDevice, iSPISpeed, iGPIOChip, iDCLine, iResetLine);
+			break;
+		case TRANSPORT_FB:
+			pTransport = TransportOpenFB(szDevice);
+			break;
+		case TRANSPORT_FILE:
+			pTransport = TransportOpenFile(szDevice);
+			break;
 	}
-
-	if (ioctl(file_i2c, I2C_SLAVE, iAddr) < 0)
-	{
-		fprintf(stderr, "Failed to acquire bus access or talk to slave\n");
-		file_i2c = 0;
+	if (pTransport == NULL)
 		return 1;
-	}
 
-	rc = write(file_i2c, initbuf, sizeof(initbuf));
-	if (rc != sizeof(initbuf))
+	if (TransportCommand(pTransport, (unsigned char *)initbuf, sizeof(initbuf)))
 		return 1;
+	bInverted = (bInvert != 0);
 	if (bInvert)
 	{
-		uc[0] = 0; // command
-		uc[1] = 0xa7; // invert command
-		rc = write(file_i2c, uc, 2);
+		uc[0] = 0xa7; // invert command
+		TransportCommand(pTransport, uc, 1);
 	}
 	if (bFlip) // rotate display 180
 	{
-		uc[0] = 0; // command
-		uc[1] = 0xa0;
-		rc = write(file_i2c, uc, 2);
+		uc[0] = 0xa0;
 		uc[1] = 0xc0;
-		rc = write(file_i2c, uc, 2);
+		TransportCommand(pTransport, uc, 2);
 	}
+	TransportFlush(pTransport);
 	return 0;
 } /* oledInit() */
 
 // Sends a command to turn off the OLED display
-// Closes the I2C file handle
+// Closes the transport
 void oledShutdown()
 {
-	if (file_i2c != 0)
+	if (pTransport != NULL)
 	{
 		oledWriteCommand(0xaE); // turn off OLED
-		close(file_i2c);
-		file_i2c = 0;
+		TransportClose(pTransport);
+		pTransport = NULL;
 	}
 }
 
 // Send a single byte command to the OLED controller
 static void oledWriteCommand(unsigned char c)
 {
-unsigned char buf[2];
-int rc;
-
-	buf[0] = 0x00; // command introducer
-	buf[1] = c;
-	rc = write(file_i2c, buf, 2);
-	if (rc) {} // suppress warning
+	TransportCommand(pTransport, &c, 1);
 } /* oledWriteCommand() */
 
 static void oledWriteCommand2(unsigned char c, unsigned char d)
 {
-unsigned char buf[3];
-int rc;
+unsigned char buf[2];
 
-	buf[0] = 0x00;
-	buf[1] = c;
-	buf[2] = d;
-	rc = write(file_i2c, buf, 3);
-	if (rc) {} // suppress warning
+	buf[0] = c;
+	buf[1] = d;
+	TransportCommand(pTransport, buf, 2);
 } /* oledWriteCommand2() */
 
 int oledSetContrast(unsigned char ucContrast)
 {
-        if (file_i2c == 0)
+        if (pTransport == NULL)
                 return -1;
 
 	oledWriteCommand2(0x81, ucContrast);
+	TransportFlush(pTransport);
 	return 0;
 } /* oledSetContrast() */
 
+// Display command of a stream (normal/inverse video, off/on or contrast
+// v); video stays the other way around if oledInit() inverted it
+static void oledDisplayCommand(int c, int v)
+{
+	if (c == 0x81)
+		oledWriteCommand2(c, v);
+	else if ((c & 0xfe) == 0xa6)
+		oledWriteCommand(c ^ bInverted);
+	else
+		oledWriteCommand(c);
+} /* oledDisplayCommand() */
+
 // Send commands to position the "cursor" to the given
 // row and column
 static void oledSetPosition(int x, int y)
 {
-	oledWriteCommand(0xb0 | y); // go to page Y
-	oledWriteCommand(0x00 | (x & 0xf)); // // lower col addr
-	oledWriteCommand(0x10 | ((x >> 4) & 0xf)); // upper col addr
-	iOffset = (y<<7)+x;
+unsigned char buf[3];
+
+	buf[0] = 0xb0 | y; // go to page Y
+	buf[1] = 0x00 | (x & 0xf); // lower col addr
+	buf[2] = 0x10 | ((x >> 4) & 0xf); // upper col addr
+	TransportCommand(pTransport, buf, 3);
+}
+
+// Position the "cursor" at an offset in the scan order of the stream
+// (row by row in horizontal mode, column by column in vertical mode)
+static void oledSetOffset(int i)
+{
+	if (bVertical)
+		oledSetPosition(i >> 3, i & 7);
+	else
+		oledSetPosition(i & 0x7f, i >> 7);
+	iOffset = i;
 }
 
 // Write a block of pixel data to the OLED
 // Length can be anything from 1 to 1024 (whole display)
 static void oledWriteDataBlock(unsigned char *ucBuf, int iLen)
 {
-unsigned char ucTemp[1028];
-int rc;
-
-	ucTemp[0] = 0x40; // data command
 //
 // Badly behaving horizontal addressing mode
 // basically behaves the same as page mode (needs to be explicitly sent to
-// the next page instead of auto-incrementing)
+// the next page instead of auto-incrementing). Page mode only moves along
+// a page, so each byte of a vertical stream needs its own position.
 //
-	if (bBadDisplay)
+	if (bBadDisplay && bPageAligned && !bVertical) // tcomp cut the writes at the line ends
+	{
+		TransportData(pTransport, ucBuf, iLen);
+		iOffset += iLen;
+		if ((iOffset & 127) == 0) // the address wraps within the line
+			oledSetOffset(iOffset & 0x3ff);
+	}
+	else if (bBadDisplay)
 	{
 	int j, i = 0;
-		while (((iOffset & 0x7f) + iLen) >= 128) // if it will hit the page end
+	int iLine = bVertical ? 1 : 128; // bytes until the address leaves the line
+		while (((iOffset & (iLine-1)) + iLen) >= iLine) // if it will hit the page end
 		{
-			j = 128 - (iOffset & 0x7f); // amount we can write
-			memcpy(&ucTemp[1], &ucBuf[i], j);
-			rc = write(file_i2c, ucTemp, j+1);	
+			j = iLine - (iOffset & (iLine-1)); // amount we can write
+			TransportData(pTransport, &ucBuf[i], j);
 			i += j; iLen -= j;
 			iOffset = (iOffset + j) & 0x3ff;
-			oledSetPosition(iOffset & 0x7f, (iOffset >> 7));
+			oledSetOffset(iOffset);
 		} // while it needs help
 		if (iLen)
 		{
-			memcpy(&ucTemp[1], &ucBuf[i], iLen);
-			rc = write(file_i2c, ucTemp, iLen+1);
+			TransportData(pTransport, &ucBuf[i], iLen);
 			iOffset += iLen;
 		}
 	}
 	else // can write in one shot
 	{
-		memcpy(&ucTemp[1], ucBuf, iLen);
-		rc = write(file_i2c, ucTemp, iLen+1);
+		TransportData(pTransport, ucBuf, iLen);
 		iOffset += iLen;
 		iOffset &= 0x3ff;
 	}
-	if (rc) {} // suppress warning
+}
+
+// Set the column and page range which the data pointer wraps within
+static void oledSetWindow(int x, int y, int w, int h)
+{
+unsigned char buf[6];
+
+	buf[0] = 0x21; // column range
+	buf[1] = x;
+	buf[2] = x + w - 1;
+	buf[3] = 0x22; // page range
+	buf[4] = y;
+	buf[5] = y + h - 1;
+	TransportCommand(pTransport, buf, 6);
+}
+
+// Fill a rectangle of the display with w*h bytes in the order of
+// the addressing mode, then restore the full window and the offset
+static void oledWriteWindow(unsigned char *ucBuf, int x, int y, int w, int h)
+{
+int i;
+
+	if (bBadDisplay) // no auto-increment; send each page on its own
+	{
+	unsigned char ucLine[128];
+	int j;
+		for (i=0; i<h; i++)
+		{
+			oledSetPosition(x, y + i);
+			if (bVertical) // gather the page from the columns
+			{
+				for (j=0; j<w; j++)
+					ucLine[j] = ucBuf[j*h + i];
+				TransportData(pTransport, ucLine, w);
+			}
+			else
+				TransportData(pTransport, &ucBuf[i*w], w);
+		}
+	}
+	else
+	{
+		oledSetWindow(x, y, w, h);
+		TransportData(pTransport, ucBuf, w*h);
+		oledSetWindow(0, 0, 128, 8);
+	}
+	oledSetOffset(iOffset);
 }
 
 // Fill the frame buffer with a byte pattern
@@ -228,111 +330,1277 @@ int oledFill(unsigned char ucData)
 int y;
 unsigned char temp[128];
 
-	if (file_i2c == 0) return -1; // not initialized
+	if (pTransport == NULL) return -1; // not initialized
 
 	memset(temp, ucData, 128);
 	for (y=0; y<8; y++)
 	{
-		oledSetPosition(0,y); // set to (0,Y)
+		oledSetOffset(y*128); // 1/8th of the display
 		oledWriteDataBlock(temp, 128); // fill with data byte
 	} // for y
 	return 0;
 } /* oledFill() */
 
-void PlayAnimation(unsigned char *pData, int iSize)
+// Write a repeated byte to the OLED
+static void oledRepeatByte(unsigned char b, int iLen)
 {
-unsigned char *s, *pEnd;
-int j, i;
-unsigned char b, bCode;
 unsigned char ucTemp[256];
 
+	memset(ucTemp, b, iLen);
+	oledWriteDataBlock(ucTemp, iLen);
+}
+
+// Write a repeated 2-4 byte pattern to the OLED (up to 256 bytes)
+static void oledWritePattern(const unsigned char *pPattern, int iPeriod, int iLen)
+{
+unsigned char ucTemp[256];
+int i;
+
+	for (i=0; i<iLen; i++)
+		ucTemp[i] = pPattern[i % iPeriod];
+	oledWriteDataBlock(ucTemp, iLen);
+}
+
+//
+// Sink of the shared decoder core: positioning and data go straight to
+// the display. Window data is gathered first because the controller
+// wants it in one piece. Streams come from files, so it's bounds-checked.
+// Every write is also applied to an image of the display (page by page,
+// whatever the scan order), which the playlist daemon diffs against the
+// first frame of the next clip. Display commands only change the state
+// kept next to it. With bImageOnly set, only the image and state are
+// drawn; that's how clips are checked while they're preloaded.
+//
+typedef struct tag_play_sink
+{
+	unsigned char ucWindow[1024];
+	unsigned char ucImage[1024];
+	int x, y, w, h;
+	int bVertical; // scan order of the stream being decoded
+	int iFields; // field split of its skip+copy and copy+skip opcodes
+	const unsigned char *pTiles; // its tile table (NULL = none)
+	int iState; // DISPLAY_* state left by the display commands
+	int bImageOnly; // don't touch the display
+} PLAYSINK;
+static PLAYSINK sink;
+
+// Offset in the image of an offset in the scan order of the stream
+static inline int PlayAddr(PLAYSINK *pSink, int i)
+{
+	return pSink->bVertical ? ((i & 7) << 7) | (i >> 3) : i;
+}
+
+static void PlaySkip(PLAYSINK *pSink, int i)
+{
+	if (!pSink->bImageOnly)
+		oledSetOffset(i);
+}
+
+static void PlayCopy(PLAYSINK *pSink, int i, const unsigned char *p, int n)
+{
+int j;
+
+	for (j=0; j<n; j++)
+		pSink->ucImage[PlayAddr(pSink, i+j)] = p[j];
+	if (!pSink->bImageOnly)
+		oledWriteDataBlock((unsigned char *)p, n);
+}
+
+static void PlayRepeat(PLAYSINK *pSink, int i, unsigned char b, int n)
+{
+int j;
+
+	for (j=0; j<n; j++)
+		pSink->ucImage[PlayAddr(pSink, i+j)] = b;
+	if (!pSink->bImageOnly)
+		oledRepeatByte(b, n);
+}
+
+static void PlayPattern(PLAYSINK *pSink, int i, const unsigned char *pPattern, int iPeriod, int n)
+{
+int j;
+
+	for (j=0; j<n; j++)
+		pSink->ucImage[PlayAddr(pSink, i+j)] = pPattern[j % iPeriod];
+	if (!pSink->bImageOnly)
+		oledWritePattern(pPattern, iPeriod, n);
+}
+
+// The window data is complete; the bytes are in the scan order too
+// (rows of w bytes, or columns of h bytes in vertical mode)
+static void PlayWindowEnd(PLAYSINK *pSink)
+{
+int c, r;
+
+	for (r=0; r<pSink->h; r++)
+	{
+		for (c=0; c<pSink->w; c++)
+			pSink->ucImage[(pSink->y + r)*128 + pSink->x + c] = pSink->bVertical ?
+				pSink->ucWindow[c*pSink->h + r] : pSink->ucWindow[r*pSink->w + c];
+	}
+	if (!pSink->bImageOnly)
+		oledWriteWindow(pSink->ucWindow, pSink->x, pSink->y, pSink->w, pSink->h);
+}
+
+// Display state after display command c (with contrast v)
+static int PlayNewState(int iState, int c, int v)
+{
+	if (c == 0x81)
+		return (iState & ~DISPLAY_CONTRAST) | v;
+	if ((c & 0xfe) == 0xa6)
+		return (c & 1) ? (iState | DISPLAY_INVERTED) : (iState & ~DISPLAY_INVERTED);
+	return (c & 1) ? (iState & ~DISPLAY_OFF) : (iState | DISPLAY_OFF); // 0xae/0xaf
+}
+
+static void PlayCommand(PLAYSINK *pSink, int c, int v)
+{
+	pSink->iState = PlayNewState(pSink->iState, c, v);
+	if (!pSink->bImageOnly)
+		oledDisplayCommand(c, v);
+}
+
+#define ODEC_CHECKED
+#define ODEC_SINK PLAYSINK
+#define ODEC_FIELDS(pSink) ((pSink)->iFields)
+#define ODEC_TILES(pSink) ((pSink)->pTiles)
+#define ODEC_SKIP(pSink, i) PlaySkip(pSink, i)
+#define ODEC_COPY(pSink, i, p, n) PlayCopy(pSink, i, p, n)
+#define ODEC_REPEAT(pSink, i, b, n) PlayRepeat(pSink, i, b, n)
+#define ODEC_PATTERN(pSink, i, p, k, n) PlayPattern(pSink, i, p, k, n)
+#define ODEC_WINDOW(pSink, x0, w0, y0, h0) ((pSink)->x = (x0), (pSink)->w = (w0), (pSink)->y = (y0), (pSink)->h = (h0))
+#define ODEC_WINDOW_COPY(pSink, k, p, n) memcpy(&(pSink)->ucWindow[k], p, n)
+#define ODEC_WINDOW_REPEAT(pSink, k, b, n) memset(&(pSink)->ucWindow[k], b, n)
+#define ODEC_WINDOW_PATTERN(pSink, k, p, iPeriod, n) ODecodeFill(&(pSink)->ucWindow[k], p, iPeriod, n)
+#define ODEC_WINDOW_END(pSink) PlayWindowEnd(pSink)
+#define ODEC_COMMAND(pSink, c, v) PlayCommand(pSink, c, v)
+#include "Arduino/oled_decode.h"
+
+// Decode one frame of the stream to the display
+// Returns a pointer to the start of the next frame or NULL for bad data
+static unsigned char *PlayFrame(unsigned char *s, unsigned char *pEnd)
+{
+	return (unsigned char *)ODecodeFrame(&sink, s, pEnd);
+} /* PlayFrame() */
+
+// Set up the addressing mode for the stream flags
+static void PlayStart(int iFlags)
+{
+   bVertical = sink.bVertical = (iFlags & STREAM_VERTICAL) != 0;
+   bPageAligned = (iFlags & STREAM_PAGE_ALIGNED) != 0;
+   sink.iFields = STREAM_FIELDS(iFlags);
+   oledWriteCommand2(0x20, bVertical ? 0x01 : 0x00); // addressing mode
+} /* PlayStart() */
+
+// A looped clip has the bus traffic of its first pass recorded
+static void PlayRecord(void)
+{
+   if (bLoop && iScriptKB > 0)
+   {
+      pScript = ScriptAlloc(iScriptKB * 1024);
+      TransportRecord(pTransport, pScript);
+   }
+} /* PlayRecord() */
+
+// Called after the first pass of a looped clip
+// Returns 1 if the rest of the passes can be sent from the recording,
+// 0 if the clip didn't fit in the memory cap and has to be decoded
+static int PlayScriptReady(void)
+{
+   if (pScript == NULL)
+      return 0;
+   TransportRecord(pTransport, NULL);
+   if (pScript->bFull)
+   {
+      fprintf(stderr, "Clip needs more than %dKB to pre-render; decoding each pass\n", iScriptKB);
+      ScriptFree(pScript);
+      pScript = NULL;
+      return 0;
+   }
+   return 1;
+} /* PlayScriptReady() */
+
+// Returns the tile table (its count byte) of a stream or bundle, NULL if
+// it has none or the table doesn't fit in the file
+static unsigned char *StreamTiles(unsigned char *pData, int iSize)
+{
+unsigned char *s;
+int iOff;
+
+   if (iSize >= BUNDLE_HEADER_SIZE && memcmp(pData, "OAB1", 4) == 0)
+   {
+      if (!(pData[8] & STREAM_TILES))
+         return NULL;
+      iOff = BUNDLE_HEADER_SIZE + (pData[4] | (pData[5] << 8)) * 4 + (pData[6] | (pData[7] << 8)) * 4;
+      if (iOff + 4 > iSize)
+         return NULL;
+      s = &pData[iOff]; // end of the chunk data
+      iOff = s[0] | (s[1] << 8) | (s[2] << 16) | (s[3] << 24);
+   }
+   else if (iSize >= STREAM_HEADER_SIZE && pData[0] == STREAM_MARKER0 && pData[1] == STREAM_MARKER1 && (pData[2] & STREAM_TILES))
+      iOff = STREAM_HEADER_SIZE;
+   else
+      return NULL;
+   if (iOff < 0 || iOff >= iSize || iOff + 1 + (pData[iOff] + 1) * TILE_SIZE > iSize)
+      return NULL;
+   return &pData[iOff];
+} /* StreamTiles() */
+
+// Returns 0 for success, -1 for a corrupt stream
+int PlayAnimation(unsigned char *pData, int iSize)
+{
+unsigned char *s, *pEnd;
+int iFlags = 0;
+
+   sink.pTiles = StreamTiles(pData, iSize);
+   if (iSize >= STREAM_HEADER_SIZE && pData[0] == STREAM_MARKER0 && pData[1] == STREAM_MARKER1)
+   {
+      iFlags = pData[2] | (pData[3] << 8);
+      pData += STREAM_HEADER_SIZE;
+      iSize -= STREAM_HEADER_SIZE;
+   }
+   if (iFlags & STREAM_TILES) // the frames follow the tile table
+   {
+      if (sink.pTiles == NULL)
+         return -1;
+      pData += 1 + (sink.pTiles[0] + 1) * TILE_SIZE;
+      iSize -= 1 + (sink.pTiles[0] + 1) * TILE_SIZE;
+   }
+   pEnd = &pData[iSize];
+   PlayStart(iFlags);
+   if (iFlags & STREAM_PINGPONG) // the passes after the first one start at frame 1
+   {
+      pData = PlayFrame(pData, pEnd);
+      if (pData == NULL)
+         return -1;
+      TransportEndFrame(pTransport);
+      usleep(iDelay);
+      if (pData == pEnd) // nothing else to play
+         return 0;
+   }
+   else if (iFlags & STREAM_LOOP_FRAME) // frame 1 changes nothing after frame 0,
+   {                                    // so the two go out as one frame
+      pData = PlayFrame(pData, pEnd);
+      if (pData == NULL)
+         return -1;
+   }
+   PlayRecord();
 do {
    s = pData;
-   pEnd = &s[iSize];
    while (s < pEnd)
    {
-    i = 0;
-    oledSetPosition(0,0);
-    while (i < 1024) // try one frame
-     {
-        bCode = *s++;
-        switch (bCode & OP_MASK) // different compression types
-        {
-            case OP_SKIPCOPY: // skip/copy
-            if (bCode == OP_SKIPCOPY) // big skip
-            {
-               b = *s++;
-               i += b + 1;
-               oledSetPosition(i & 0x7f, (i >> 7));
-            }
-            else // skip/copy
-            {
-               if (bCode & 0x38)
-               {
-                  i += ((bCode & 0x38) >> 3); // skip amount
-                  oledSetPosition(i & 0x7f, (i >> 7));
-               }
-               if (bCode & 7)
-               {
-                   oledWriteDataBlock(s, bCode & 7);
-                   s += (bCode & 7);
-                   i += bCode & 7;
-               }
-           }
-           break;
-          case OP_COPYSKIP: // copy/skip
-          if (bCode == OP_COPYSKIP) // big copy
-          {
-             b = *s++;
-             j = b + 1;
-	     oledWriteDataBlock(s, j);
-             s += j;
-             i += j;
-          }
-	  else
-	  {
-             j = ((bCode & 0x38) >> 3);
-             if (j)
-             {
-                oledWriteDataBlock(s, j);
-                s += j;
-                i += j;
-             }
-             if (bCode & 7)
-             {
-                 i += (bCode & 7); // skip
-                 oledSetPosition(i & 0x7f, (i >> 7));
-             }
-           }
-	break;
-
-      case OP_REPEATSKIP: // repeat+skip
-          j = (bCode & 0x38) >> 3; // repeat count
-          b = *s++;
-          memset(ucTemp, b, j);
-          oledWriteDataBlock(ucTemp, j);
-          i += j;
-          if (bCode & 7)
-          {
-             i += (bCode & 7); // skip amount
-             oledSetPosition(i & 0x7f, (i >> 7));
-          }
-          break;
-
-      case OP_REPEAT:
-          j = (bCode & 0x3f) + 1;
-          b = *s++;
-	  memset(ucTemp, b, j);
-          oledWriteDataBlock(ucTemp, j);
-          i += j;
-          break;  
-        } // switch on code type
-     } // while rendering frame
+     s = PlayFrame(s, pEnd);
+     if (s == NULL)
+        return -1;
+     TransportEndFrame(pTransport);
      usleep(iDelay);
     } // while playing frames
-  } while (bLoop);
+  } while (bLoop && !PlayScriptReady());
+  while (bLoop) // the same traffic again, without decoding
+     TransportPlayScript(pTransport, pScript, iDelay);
+  return 0;
 } /* PlayAnimation() */
 
+// Play frame i of a bundle clip; pIndex points at the clip's first entry
+// in the frame index. bEnd = 0 sends it with the next frame instead of
+// ending the frame and waiting
+// Returns 0 for success, -1 for a bad chunk
+static int PlayBundleFrame(unsigned char *pData, int iSize, unsigned char *pChunks, int iChunks, unsigned char *pIndex, int i, int bEnd)
+{
+int k, iOff;
+
+   k = pIndex[i * 2] | (pIndex[i * 2 + 1] << 8);
+   if (k >= iChunks)
+      return -1;
+   iOff = pChunks[k*4] | (pChunks[k*4+1] << 8) | (pChunks[k*4+2] << 16) | (pChunks[k*4+3] << 24);
+   if (iOff >= iSize)
+      return -1;
+   if (PlayFrame(&pData[iOff], &pData[iSize]) == NULL)
+      return -1;
+   if (bEnd)
+   {
+      TransportEndFrame(pTransport);
+      usleep(iDelay);
+   }
+   return 0;
+} /* PlayBundleFrame() */
+
+// Play one clip of a bundle
+// Returns 0 for success, -1 for a bad bundle or clip number
+int PlayBundle(unsigned char *pData, int iSize, int iClip)
+{
+int i, iClips, iChunks, iFirst, iCount, iFlags, iStart = 0;
+unsigned char *pChunks, *pIndex;
+
+   if (iSize < BUNDLE_HEADER_SIZE || memcmp(pData, "OAB1", 4) != 0)
+      return -1;
+   iClips = pData[4] | (pData[5] << 8);
+   iChunks = pData[6] | (pData[7] << 8);
+   iFlags = pData[8] | (pData[9] << 8);
+   pChunks = &pData[BUNDLE_HEADER_SIZE + iClips * 4];
+   pIndex = &pChunks[(iChunks + 1) * 4];
+   if (iClip < 0 || iClip >= iClips || pIndex > &pData[iSize])
+      return -1;
+   iFirst = pData[BUNDLE_HEADER_SIZE + iClip*4] | (pData[BUNDLE_HEADER_SIZE + iClip*4 + 1] << 8);
+   iCount = pData[BUNDLE_HEADER_SIZE + iClip*4 + 2] | (pData[BUNDLE_HEADER_SIZE + iClip*4 + 3] << 8);
+   if (&pIndex[(iFirst + iCount) * 2] > &pData[iSize])
+      return -1;
+   pIndex += iFirst * 2;
+   sink.pTiles = StreamTiles(pData, iSize);
+   if ((iFlags & STREAM_TILES) && sink.pTiles == NULL)
+      return -1;
+   PlayStart(iFlags);
+   if ((iFlags & STREAM_PINGPONG) && iCount > 0) // the passes after the first one start at frame 1
+   {
+      if (PlayBundleFrame(pData, iSize, pChunks, iChunks, pIndex, 0, 1))
+         return -1;
+      if (iCount == 1) // nothing else to play
+         return 0;
+      iStart = 1;
+   }
+   else if ((iFlags & STREAM_LOOP_FRAME) && iCount > 1) // frame 1 changes nothing after
+   {                                                   // frame 0; they go out as one
+      if (PlayBundleFrame(pData, iSize, pChunks, iChunks, pIndex, 0, 0))
+         return -1;
+      iStart = 1;
+   }
+   PlayRecord();
+   do {
+      for (i=iStart; i<iCount; i++)
+      {
+         if (PlayBundleFrame(pData, iSize, pChunks, iChunks, pIndex, i, 1))
+            return -1;
+      }
+   } while (bLoop && !PlayScriptReady());
+   while (bLoop) // the same traffic again, without decoding
+      TransportPlayScript(pTransport, pScript, iDelay);
+   return 0;
+} /* PlayBundle() */
+
+// Read a clip file, expanding it if it's an archive
+// Returns its size (the data is in *ppData), -1 if it can't be read or
+// -2 for a corrupt archive
+static int LoadFile(char *szName, unsigned char **ppData)
+{
+FILE *pf;
+unsigned char *pData, *pRaw;
+int iSize, iRawSize;
+
+   pf = fopen(szName, "rb");
+   if (pf == NULL)
+      return -1;
+   fseek(pf, 0L, SEEK_END);
+   iSize = (int)ftell(pf);
+   fseek(pf, 0L, SEEK_SET);
+   pData = malloc(iSize > 0 ? iSize : 1);
+   if (iSize <= 0 || fread(pData, iSize, 1, pf) != 1)
+   {
+      free(pData);
+      fclose(pf);
+      return -1;
+   }
+   fclose(pf);
+   if (ArcIsArchive(pData, iSize)) // expand it before playing
+   {
+      iRawSize = ArcGetRawSize(pData, iSize);
+      pRaw = (iRawSize > 0) ? malloc(iRawSize) : NULL;
+      if (pRaw == NULL || ArcDecompress(pData, iSize, pRaw, iRawSize) != iRawSize)
+      {
+         free(pRaw);
+         free(pData);
+         return -2;
+      }
+      free(pData);
+      pData = pRaw;
+      iSize = iRawSize;
+   }
+   *ppData = pData;
+   return iSize;
+} /* LoadFile() */
+
+// Returns the header flags of a stream or bundle (0 if it has none)
+static int StreamFlags(unsigned char *pData, int iSize)
+{
+   if (iSize >= BUNDLE_HEADER_SIZE && memcmp(pData, "OAB1", 4) == 0)
+      return pData[8] | (pData[9] << 8);
+   if (iSize >= STREAM_HEADER_SIZE && pData[0] == STREAM_MARKER0 && pData[1] == STREAM_MARKER1)
+      return pData[2] | (pData[3] << 8);
+   return 0;
+} /* StreamFlags() */
+
+//
+// Playlist daemon
+//
+// oledplay --fifo F (or --socket S) keeps the display open and plays a
+// playlist which is edited by text commands, one per line:
+// add FILE [CLIP]   append a stream, archive or bundle clip to the list
+// play FILE [CLIP]  replace the list with this clip and switch to it now
+// next              switch to the next clip now
+// clear             empty the list (the current clip plays to its end)
+// loop on|off       start the list over when it runs out (--loop)
+// status            (socket only) reply with what's playing
+// quit              turn the display off and exit
+// Socket clients get "OK", "ERR <reason>" or the status line back.
+//
+// The clip after the current one is read, expanded and decoded into an
+// image on a separate thread while the current one plays, so switching
+// doesn't stall the display. Instead of sending the intra frame which
+// starts each clip, the player sends only the bytes where the image of
+// the display differs from it. A clip which repeats (the list has one
+// entry or runs out while looping) restarts the same way.
+//
+#define PLAYLIST_MAX 256
+#define DAEMON_CLIENTS 8
+#define DAEMON_LINE 600
+#define TRANSITION_GAP 4 // shorter runs of unchanged bytes are sent rather
+                         // than moving the cursor (3 command bytes)
+
+typedef struct tag_play_entry
+{
+   char szName[512];
+   int iClip; // clip of a bundle
+} PLAYENTRY;
+
+// A clip ready to play; every frame has been checked
+typedef struct tag_play_clip
+{
+   PLAYENTRY entry;
+   int iError; // 0 or the reason it can't be played (CLIP_*)
+   unsigned char *pData;
+   int iSize;
+   int iFlags; // stream header flags
+   unsigned char *pTiles; // tile table (NULL = none)
+   int iFrames;
+   unsigned char **pFrames; // start of each frame
+   unsigned char *pEnd; // end of the frame data
+   unsigned char ucFirst[1024]; // image of the first frame
+   int iFirstState; // display state after it (DISPLAY_*)
+} PLAYCLIP;
+
+#define CLIP_OK 0
+#define CLIP_NO_FILE 1
+#define CLIP_BAD_ARCHIVE 2
+#define CLIP_BAD_STREAM 3
+#define CLIP_BAD_CLIP 4
+#define CLIP_GRAY 5
+static const char *szClipErrors[] = {"ok", "can't read the file", "corrupt archive",
+   "corrupt stream", "bad bundle or clip number", "grayscale clips can't play in the daemon"};
+
+typedef struct tag_daemon_conn
+{
+   int iFile; // -1 = unused
+   int iLen;
+   char szLine[DAEMON_LINE];
+} DAEMONCONN;
+
+static char szFifo[512]; // command FIFO
+static char szSocket[512]; // command socket
+static int iFifo = -1, iListen = -1;
+static DAEMONCONN conns[DAEMON_CLIENTS];
+static PLAYENTRY playlist[PLAYLIST_MAX];
+static int iPlaylistLen = 0;
+static int iCurrent = -1; // playlist entry on the display (-1 = none)
+static int bSwitch = 0; // go to the next clip at the next frame
+static int bQuit = 0;
+static PLAYCLIP *pPlaying = NULL;
+static int iPlayingFrame = 0;
+static PLAYCLIP *pPreload = NULL; // being loaded by the preload thread
+static pthread_t tPreload;
+
+static void ClipFree(PLAYCLIP *pClip)
+{
+   if (pClip != NULL)
+   {
+      free(pClip->pData);
+      free(pClip->pFrames);
+      free(pClip);
+   }
+} /* ClipFree() */
+
+// Add the frame at s to the clip and decode it into the image
+// Returns a pointer past it or NULL for bad data
+static unsigned char *ClipAddFrame(PLAYCLIP *pClip, PLAYSINK *pSink, unsigned char *s)
+{
+   if ((pClip->iFrames & 63) == 0)
+      pClip->pFrames = realloc(pClip->pFrames, (pClip->iFrames + 64) * sizeof(unsigned char *));
+   pClip->pFrames[pClip->iFrames++] = s;
+   s = (unsigned char *)ODecodeFrame(pSink, s, pClip->pEnd);
+   if (pClip->iFrames == 1)
+   {
+      memcpy(pClip->ucFirst, pSink->ucImage, 1024);
+      pClip->iFirstState = pSink->iState;
+   }
+   return s;
+} /* ClipAddFrame() */
+
+// Read the file of a playlist entry and find and check its frames
+// Returns CLIP_OK or the reason it can't be played
+static int ClipLoad(PLAYCLIP *pClip)
+{
+PLAYSINK *pSink;
+unsigned char *s, *pChunks, *pIndex;
+int i, k, iClips, iChunks, iFirst, iCount, iOff, iErr;
+
+   pClip->iSize = LoadFile(pClip->entry.szName, &pClip->pData);
+   if (pClip->iSize < 0)
+   {
+      pClip->pData = NULL;
+      return (pClip->iSize == -2) ? CLIP_BAD_ARCHIVE : CLIP_NO_FILE;
+   }
+   pSink = calloc(1, sizeof(PLAYSINK));
+   pSink->iState = DISPLAY_DEFAULT;
+   pSink->bImageOnly = 1;
+   s = pClip->pData;
+   pClip->pEnd = &s[pClip->iSize];
+   pSink->pTiles = pClip->pTiles = StreamTiles(s, pClip->iSize);
+   iErr = CLIP_OK;
+   if (pClip->iSize >= BUNDLE_HEADER_SIZE && memcmp(s, "OAB1", 4) == 0)
+   {
+      iClips = s[4] | (s[5] << 8);
+      iChunks = s[6] | (s[7] << 8);
+      pClip->iFlags = s[8] | (s[9] << 8);
+      pChunks = &s[BUNDLE_HEADER_SIZE + iClips * 4];
+      pIndex = &pChunks[(iChunks + 1) * 4];
+      if ((pClip->iFlags & STREAM_TILES) && pClip->pTiles == NULL)
+         iErr = CLIP_BAD_STREAM;
+      i = pClip->entry.iClip;
+      if (i < 0 || i >= iClips || pIndex > pClip->pEnd)
+         iErr = CLIP_BAD_CLIP;
+      else
+      {
+         iFirst = s[BUNDLE_HEADER_SIZE + i*4] | (s[BUNDLE_HEADER_SIZE + i*4 + 1] << 8);
+         iCount = s[BUNDLE_HEADER_SIZE + i*4 + 2] | (s[BUNDLE_HEADER_SIZE + i*4 + 3] << 8);
+         if (iCount == 0 || &pIndex[(iFirst + iCount) * 2] > pClip->pEnd)
+            iErr = CLIP_BAD_CLIP;
+      }
+      pSink->bVertical = (pClip->iFlags & STREAM_VERTICAL) != 0;
+      pSink->iFields = STREAM_FIELDS(pClip->iFlags);
+      for (i=0; iErr == CLIP_OK && i<iCount; i++)
+      {
+         k = pIndex[(iFirst + i) * 2] | (pIndex[(iFirst + i) * 2 + 1] << 8);
+         if (k >= iChunks)
+            iErr = CLIP_BAD_CLIP;
+         else
+         {
+            iOff = pChunks[k*4] | (pChunks[k*4+1] << 8) | (pChunks[k*4+2] << 16) | (pChunks[k*4+3] << 24);
+            if (iOff < 0 || iOff >= pClip->iSize || ClipAddFrame(pClip, pSink, &s[iOff]) == NULL)
+               iErr = CLIP_BAD_STREAM;
+         }
+      }
+   }
+   else
+   {
+      if (pClip->iSize >= STREAM_HEADER_SIZE && s[0] == STREAM_MARKER0 && s[1] == STREAM_MARKER1)
+      {
+         pClip->iFlags = s[2] | (s[3] << 8);
+         s += STREAM_HEADER_SIZE;
+      }
+      if (pClip->pTiles) // the frames follow the tile table
+         s += 1 + (pClip->pTiles[0] + 1) * TILE_SIZE;
+      else if (pClip->iFlags & STREAM_TILES)
+         iErr = CLIP_BAD_STREAM;
+      pSink->bVertical = (pClip->iFlags & STREAM_VERTICAL) != 0;
+      pSink->iFields = STREAM_FIELDS(pClip->iFlags);
+      while (iErr == CLIP_OK && s < pClip->pEnd)
+      {
+         s = ClipAddFrame(pClip, pSink, s);
+         if (s == NULL)
+            iErr = CLIP_BAD_STREAM;
+      }
+      if (pClip->iFrames == 0)
+         iErr = CLIP_BAD_STREAM;
+   }
+   free(pSink);
+   return iErr;
+} /* ClipLoad() */
+
+static void *PreloadThread(void *pArg)
+{
+PLAYCLIP *pClip = (PLAYCLIP *)pArg;
+
+   pClip->iError = ClipLoad(pClip);
+   return NULL;
+} /* PreloadThread() */
+
+static PLAYCLIP *ClipNew(PLAYENTRY *pEntry)
+{
+PLAYCLIP *pClip;
+
+   pClip = calloc(1, sizeof(PLAYCLIP));
+   pClip->entry = *pEntry;
+   return pClip;
+} /* ClipNew() */
+
+static int SameEntry(PLAYENTRY *pA, PLAYENTRY *pB)
+{
+   return pA->iClip == pB->iClip && strcmp(pA->szName, pB->szName) == 0;
+} /* SameEntry() */
+
+// Playlist entry which follows the current one (-1 = none)
+static int DaemonNext(void)
+{
+   if (iCurrent + 1 < iPlaylistLen)
+      return iCurrent + 1;
+   if (bLoop && iPlaylistLen)
+      return 0;
+   return -1;
+} /* DaemonNext() */
+
+// Wait for the preload thread; returns what it loaded
+static PLAYCLIP *PreloadFinish(void)
+{
+PLAYCLIP *pClip = pPreload;
+
+   if (pClip != NULL)
+   {
+      pthread_join(tPreload, NULL);
+      pPreload = NULL;
+   }
+   return pClip;
+} /* PreloadFinish() */
+
+// Start loading the clip which will play next, unless it's already
+// loading or it's the one playing now
+static void DaemonPreload(void)
+{
+int i;
+
+   i = DaemonNext();
+   if (i < 0 || (pPlaying != NULL && SameEntry(&playlist[i], &pPlaying->entry)))
+      return;
+   if (pPreload != NULL)
+   {
+      if (SameEntry(&playlist[i], &pPreload->entry))
+         return;
+      ClipFree(PreloadFinish());
+   }
+   pPreload = ClipNew(&playlist[i]);
+   if (pthread_create(&tPreload, NULL, PreloadThread, pPreload) != 0)
+   {
+      ClipFree(pPreload); // it will be loaded when it's needed
+      pPreload = NULL;
+   }
+} /* DaemonPreload() */
+
+// Parse "FILE [CLIP]" into a playlist entry
+static void DaemonEntry(char *szArg, PLAYENTRY *pEntry)
+{
+char *p;
+
+   pEntry->iClip = 0;
+   p = strrchr(szArg, ' ');
+   if (p != NULL && p[1] != 0 && strspn(&p[1], "0123456789") == strlen(&p[1]))
+   {
+      pEntry->iClip = atoi(&p[1]);
+      *p = 0;
+   }
+   strncpy(pEntry->szName, szArg, sizeof(pEntry->szName) - 1);
+   pEntry->szName[sizeof(pEntry->szName) - 1] = 0;
+} /* DaemonEntry() */
+
+// Carry out one command line; the reply is for socket clients
+static void DaemonCommand(char *szLine, char *szReply)
+{
+char *szArg;
+int i;
+
+   i = (int)strlen(szLine);
+   while (i > 0 && (szLine[i-1] == '\r' || szLine[i-1] == ' '))
+      szLine[--i] = 0;
+   szArg = strchr(szLine, ' ');
+   if (szArg != NULL)
+   {
+      *szArg++ = 0;
+      szArg += strspn(szArg, " ");
+   }
+   strcpy(szReply, "OK\n");
+   if (szLine[0] == 0)
+      szReply[0] = 0; // blank line
+   else if ((strcmp(szLine, "add") == 0 || strcmp(szLine, "play") == 0) && szArg != NULL && szArg[0])
+   {
+      if (strcmp(szLine, "play") == 0)
+      {
+         iPlaylistLen = 0;
+         iCurrent = -1;
+         bSwitch = 1;
+      }
+      if (iPlaylistLen == PLAYLIST_MAX)
+         strcpy(szReply, "ERR playlist full\n");
+      else
+         DaemonEntry(szArg, &playlist[iPlaylistLen++]);
+   }
+   else if (strcmp(szLine, "next") == 0)
+      bSwitch = 1;
+   else if (strcmp(szLine, "clear") == 0)
+   {
+      iPlaylistLen = 0;
+      iCurrent = -1;
+   }
+   else if (strcmp(szLine, "loop") == 0 && szArg != NULL && (strcmp(szArg, "on") == 0 || strcmp(szArg, "off") == 0))
+      bLoop = (strcmp(szArg, "on") == 0);
+   else if (strcmp(szLine, "status") == 0)
+   {
+      if (pPlaying == NULL)
+         sprintf(szReply, "idle, %d queued\n", iPlaylistLen);
+      else
+         snprintf(szReply, DAEMON_LINE, "playing %s %d frame %d/%d, %d queued\n", pPlaying->entry.szName,
+            pPlaying->entry.iClip, iPlayingFrame, pPlaying->iFrames, iPlaylistLen);
+   }
+   else if (strcmp(szLine, "quit") == 0)
+      bQuit = 1;
+   else
+      strcpy(szReply, "ERR unknown command\n");
+   DaemonPreload(); // the next clip may have changed
+} /* DaemonCommand() */
+
+// Take the complete lines out of a connection's buffer
+// Returns 0, or -1 if the client went away
+static int DaemonRead(DAEMONCONN *pConn, int bReply)
+{
+char szReply[DAEMON_LINE], *p;
+int i, iLen;
+
+   iLen = (int)read(pConn->iFile, &pConn->szLine[pConn->iLen], DAEMON_LINE - 1 - pConn->iLen);
+   if (iLen <= 0)
+      return (iLen == 0 || (errno != EAGAIN && errno != EINTR)) ? -1 : 0;
+   pConn->iLen += iLen;
+   pConn->szLine[pConn->iLen] = 0;
+   while ((p = strchr(pConn->szLine, '\n')) != NULL)
+   {
+      *p++ = 0;
+      DaemonCommand(pConn->szLine, szReply);
+      if (bReply && szReply[0])
+         send(pConn->iFile, szReply, strlen(szReply), MSG_NOSIGNAL);
+      i = pConn->iLen - (int)(p - pConn->szLine);
+      memmove(pConn->szLine, p, i + 1);
+      pConn->iLen = i;
+   }
+   if (pConn->iLen == DAEMON_LINE - 1) // no room for the rest of the line
+      pConn->iLen = 0;
+   return 0;
+} /* DaemonRead() */
+
+// Wait up to iTimeout ms (-1 = forever) for commands and carry them out
+static void DaemonPoll(int iTimeout)
+{
+struct pollfd fds[DAEMON_CLIENTS + 2];
+DAEMONCONN *pConn[DAEMON_CLIENTS + 2];
+static DAEMONCONN fifo;
+int i, j, k, iCount = 0;
+
+   if (iFifo >= 0)
+   {
+      fifo.iFile = iFifo;
+      pConn[iCount] = &fifo;
+      fds[iCount].fd = iFifo;
+      fds[iCount++].events = POLLIN;
+   }
+   if (iListen >= 0)
+   {
+      pConn[iCount] = NULL;
+      fds[iCount].fd = iListen;
+      fds[iCount++].events = POLLIN;
+   }
+   for (i=0; i<DAEMON_CLIENTS; i++)
+   {
+      if (conns[i].iFile >= 0)
+      {
+         pConn[iCount] = &conns[i];
+         fds[iCount].fd = conns[i].iFile;
+         fds[iCount++].events = POLLIN;
+      }
+   }
+   if (poll(fds, iCount, iTimeout) <= 0)
+      return;
+   for (i=0; i<iCount; i++)
+   {
+      if (fds[i].revents == 0)
+         continue;
+      if (pConn[i] == NULL) // new client
+      {
+         j = accept(iListen, NULL, NULL);
+         if (j < 0)
+            continue;
+         fcntl(j, F_SETFL, O_NONBLOCK);
+         for (k=0; k<DAEMON_CLIENTS && conns[k].iFile >= 0; k++)
+            ;
+         if (k == DAEMON_CLIENTS)
+            close(j); // too many
+         else
+         {
+            conns[k].iFile = j;
+            conns[k].iLen = 0;
+         }
+         continue;
+      }
+      if (DaemonRead(pConn[i], pConn[i] != &fifo) && pConn[i] != &fifo)
+      {
+         close(pConn[i]->iFile);
+         pConn[i]->iFile = -1;
+      }
+   }
+} /* DaemonPoll() */
+
+// Carry out commands until the time for the next frame
+static void DaemonWait(struct timespec *pNext)
+{
+struct timespec ts;
+long lWait;
+
+   while (!bQuit && !bSwitch)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      lWait = (pNext->tv_sec - ts.tv_sec) * 1000000L + (pNext->tv_nsec - ts.tv_nsec) / 1000;
+      if (lWait <= 0)
+      {
+         if (lWait < -iDelay) // fell behind; don't rush to catch up
+            *pNext = ts;
+         break;
+      }
+      DaemonPoll((int)((lWait + 999) / 1000));
+   }
+} /* DaemonWait() */
+
+// Open the command FIFO and/or socket; returns 0 for success
+static int DaemonOpen(void)
+{
+struct sockaddr_un addr;
+struct stat st;
+int i;
+
+   for (i=0; i<DAEMON_CLIENTS; i++)
+      conns[i].iFile = -1;
+   if (szFifo[0])
+   {
+      if (stat(szFifo, &st) != 0 && mkfifo(szFifo, 0666) != 0)
+         return -1;
+      iFifo = open(szFifo, O_RDWR | O_NONBLOCK); // (a writer of our own keeps it from reaching EOF)
+      if (iFifo < 0)
+         return -1;
+   }
+   if (szSocket[0])
+   {
+      if (strlen(szSocket) >= sizeof(addr.sun_path))
+         return -1;
+      if (stat(szSocket, &st) == 0 && S_ISSOCK(st.st_mode))
+         unlink(szSocket); // left over from an earlier run
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, szSocket);
+      iListen = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (iListen < 0 || bind(iListen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(iListen, 4) != 0)
+         return -1;
+      fcntl(iListen, F_SETFL, O_NONBLOCK);
+   }
+   return 0;
+} /* DaemonOpen() */
+
+static void DaemonClose(void)
+{
+int i;
+
+   for (i=0; i<DAEMON_CLIENTS; i++)
+   {
+      if (conns[i].iFile >= 0)
+         close(conns[i].iFile);
+   }
+   if (iFifo >= 0)
+      close(iFifo);
+   if (iListen >= 0)
+   {
+      close(iListen);
+      unlink(szSocket);
+   }
+} /* DaemonClose() */
+
+// Send the bytes of an image (page by page) which differ from the image
+// of the display; the display has to be in horizontal addressing mode
+// Returns the number of data bytes sent
+static int PlayDiff(unsigned char *pTarget)
+{
+unsigned char *pImage = sink.ucImage;
+int i, j, iEnd, iSent = 0;
+
+   i = 0;
+   while (i < 1024)
+   {
+      if (pTarget[i] == pImage[i])
+      {
+         i++;
+         continue;
+      }
+      iEnd = i + 1;
+      for (j=iEnd; j<1024 && j - iEnd < TRANSITION_GAP; j++)
+      {
+         if (pTarget[j] != pImage[j])
+            iEnd = j + 1;
+      }
+      oledSetOffset(i);
+      oledWriteDataBlock(&pTarget[i], iEnd - i);
+      iSent += iEnd - i;
+      i = iEnd;
+   }
+   memcpy(pImage, pTarget, 1024);
+   return iSent;
+} /* PlayDiff() */
+
+// Send the display commands which change the state of the display to
+// iState; the display goes off first and on last so that nothing in
+// between shows
+static void PlayState(int iState)
+{
+int iChange = iState ^ sink.iState;
+
+   if ((iChange & DISPLAY_OFF) && (iState & DISPLAY_OFF))
+      oledDisplayCommand(0xae, 0);
+   if (iChange & DISPLAY_INVERTED)
+      oledDisplayCommand((iState & DISPLAY_INVERTED) ? 0xa7 : 0xa6, 0);
+   if (iChange & DISPLAY_CONTRAST)
+      oledDisplayCommand(0x81, iState & DISPLAY_CONTRAST);
+   if ((iChange & DISPLAY_OFF) && !(iState & DISPLAY_OFF))
+      oledDisplayCommand(0xaf, 0);
+   sink.iState = iState;
+} /* PlayState() */
+
+// Make the display show the first frame of a clip by sending only the
+// bytes which differ from what it shows now (and the display commands
+// for its state), then set up the clip's addressing mode
+// Returns the number of data bytes sent
+static int PlayTransition(PLAYCLIP *pClip)
+{
+int iSent;
+
+   bPageAligned = 0; // the runs below can cross lines
+   if (bVertical) // the image is page by page
+   {
+      bVertical = sink.bVertical = 0;
+      oledWriteCommand2(0x20, 0x00);
+   }
+   iSent = PlayDiff(pClip->ucFirst);
+   PlayState(pClip->iFirstState);
+   bPageAligned = (pClip->iFlags & STREAM_PAGE_ALIGNED) != 0;
+   sink.iFields = STREAM_FIELDS(pClip->iFlags);
+   sink.pTiles = pClip->pTiles;
+   if (pClip->iFlags & STREAM_VERTICAL)
+   {
+      bVertical = sink.bVertical = 1;
+      oledWriteCommand2(0x20, 0x01);
+   }
+   return iSent;
+} /* PlayTransition() */
+
+// Move on to the next playlist entry (or start the current clip over)
+// Returns 0 if something is playing, -1 if there's nothing to play
+static int DaemonSwitch(void)
+{
+PLAYCLIP *pClip;
+int i, iSent;
+
+   bSwitch = 0;
+   while (1)
+   {
+      i = DaemonNext();
+      if (i < 0)
+      {
+         if (pPlaying == NULL || !bLoop)
+            return -1;
+         pClip = pPlaying; // looping with an empty list
+         break;
+      }
+      if (pPlaying != NULL && SameEntry(&playlist[i], &pPlaying->entry))
+         pClip = pPlaying;
+      else
+      {
+         pClip = PreloadFinish();
+         if (pClip != NULL && !SameEntry(&playlist[i], &pClip->entry))
+         {
+            ClipFree(pClip);
+            pClip = NULL;
+         }
+         if (pClip == NULL) // load it now
+         {
+            pClip = ClipNew(&playlist[i]);
+            pClip->iError = ClipLoad(pClip);
+         }
+      }
+      if (pClip->iError == CLIP_OK && (pClip->iFlags & STREAM_PLANES_MASK))
+         pClip->iError = CLIP_GRAY; // the planes need the whole frame time
+      if (pClip->iError == CLIP_OK)
+      {
+         iCurrent = i;
+         break;
+      }
+      fprintf(stderr, "Error playing %s (clip %d): %s; dropped from the playlist\n",
+         pClip->entry.szName, pClip->entry.iClip, szClipErrors[pClip->iError]);
+      ClipFree(pClip);
+      iPlaylistLen--;
+      memmove(&playlist[i], &playlist[i+1], (iPlaylistLen - i) * sizeof(PLAYENTRY));
+      if (i <= iCurrent)
+         iCurrent--;
+   }
+   if (pClip != pPlaying)
+   {
+      ClipFree(pPlaying);
+      pPlaying = pClip;
+   }
+   iSent = PlayTransition(pClip);
+   fprintf(stderr, "Playing %s (clip %d): %d frames, %d bytes to switch\n", pClip->entry.szName,
+      pClip->entry.iClip, pClip->iFrames, iSent);
+   iPlayingFrame = 1;
+   if ((pClip->iFlags & STREAM_LOOP_FRAME) && pClip->iFrames > 1)
+      iPlayingFrame = 2; // the loop frame would only show frame 0 again
+   DaemonPreload();
+   return 0;
+} /* DaemonSwitch() */
+
+// Play the playlist until a quit command
+// Returns 0 for success, -1 if the FIFO or socket can't be opened
+int PlayDaemon(void)
+{
+struct timespec tNext;
+
+   if (DaemonOpen())
+   {
+      DaemonClose();
+      return -1;
+   }
+   if (szIn[0]) // the first entry
+   {
+      strcpy(playlist[0].szName, szIn);
+      playlist[0].iClip = iClip;
+      iPlaylistLen = 1;
+   }
+   oledFill(0); // the image starts out blank too
+   TransportEndFrame(pTransport);
+   clock_gettime(CLOCK_MONOTONIC, &tNext);
+   while (!bQuit)
+   {
+      if ((pPlaying == NULL || bSwitch || iPlayingFrame >= pPlaying->iFrames) && DaemonSwitch() == 0)
+      {
+         // the transition put up the first frame
+      }
+      else if (pPlaying != NULL && iPlayingFrame < pPlaying->iFrames)
+      {
+         if (PlayFrame(pPlaying->pFrames[iPlayingFrame], pPlaying->pEnd) == NULL)
+            iPlayingFrame = pPlaying->iFrames; // (was checked when it loaded)
+         else
+            iPlayingFrame++;
+      }
+      else
+      {
+         DaemonPoll(-1); // nothing to play; the last frame stays up
+         clock_gettime(CLOCK_MONOTONIC, &tNext);
+         continue;
+      }
+      TransportEndFrame(pTransport);
+      tNext.tv_nsec += iDelay * 1000L;
+      tNext.tv_sec += tNext.tv_nsec / 1000000000L;
+      tNext.tv_nsec %= 1000000000L;
+      DaemonWait(&tNext);
+   }
+   ClipFree(PreloadFinish());
+   ClipFree(pPlaying);
+   pPlaying = NULL;
+   DaemonClose();
+   return 0;
+} /* PlayDaemon() */
+
+//
+// Grayscale streams (tcomp --gray) hold a few bit planes per frame, each
+// coded against the same plane of the frame before. The display is
+// 1-bpp, so the planes are shown in turn at --plane-hz sub-frames a
+// second, each for as many sub-frames as its weight. Sub-frame t of the
+// cycle (1 .. 2^planes - 1) shows the plane numbered by the trailing
+// zeros of t, which spreads the most significant plane over every other
+// sub-frame instead of showing it in one block.
+//
+typedef struct tag_gray_play
+{
+   int iPlanes;
+   int iSlot; // sub-frame of the cycle
+   struct timespec tNext; // when the next sub-frame is due
+   int iSubFrames, iLate; // sent, and sent after their time
+   int iShown[GRAY_MAX_PLANES], iMax[GRAY_MAX_PLANES]; // per plane
+   long lBytes[GRAY_MAX_PLANES];
+} GRAYPLAY;
+
+// Wait for the time of the next sub-frame
+static void GrayWait(GRAYPLAY *pGray, long lPeriod)
+{
+struct timespec ts;
+long lLate;
+
+   pGray->tNext.tv_nsec += lPeriod;
+   pGray->tNext.tv_sec += pGray->tNext.tv_nsec / 1000000000L;
+   pGray->tNext.tv_nsec %= 1000000000L;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   lLate = (ts.tv_sec - pGray->tNext.tv_sec) * 1000000000L + (ts.tv_nsec - pGray->tNext.tv_nsec);
+   if (lLate <= 0)
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pGray->tNext, NULL);
+   else
+   {
+      pGray->iLate++;
+      if (lLate > lPeriod) // fell behind; don't rush to catch up
+         pGray->tNext = ts;
+   }
+} /* GrayWait() */
+
+// Show one frame of images (one per plane) in display state iState for
+// a frame time
+static void PlayImage(GRAYPLAY *pGray, unsigned char *pImage, int iState)
+{
+int i, p, iSent, iSubFrames;
+long lPeriod;
+
+   if (pGray->iPlanes == 1)
+   {
+      PlayDiff(pImage);
+      PlayState(iState);
+      TransportEndFrame(pTransport);
+      usleep(iDelay);
+      return;
+   }
+   lPeriod = 1000000000L / iPlaneHz;
+   iSubFrames = (int)(((long)iDelay * iPlaneHz + 500000L) / 1000000L);
+   if (iSubFrames < 1)
+      iSubFrames = 1;
+   for (i=0; i<iSubFrames; i++)
+   {
+      for (p=0; !(pGray->iSlot & (1 << p)); p++)
+         ;
+      iSent = PlayDiff(&pImage[p * 1024]);
+      TransportEndFrame(pTransport);
+      pGray->iSubFrames++;
+      pGray->iShown[p]++;
+      pGray->lBytes[p] += iSent;
+      if (iSent > pGray->iMax[p])
+         pGray->iMax[p] = iSent;
+      pGray->iSlot = (pGray->iSlot % ((1 << pGray->iPlanes) - 1)) + 1;
+      GrayWait(pGray, lPeriod);
+   }
+} /* PlayImage() */
+
+// Report how well the bus kept up with the sub-frames
+static void GrayReport(GRAYPLAY *pGray)
+{
+int p;
+
+   fprintf(stderr, "Grayscale: %d planes at %dHz, %d of %d sub-frames late\n", pGray->iPlanes,
+      iPlaneHz, pGray->iLate, pGray->iSubFrames);
+   for (p=0; p<pGray->iPlanes; p++)
+   {
+      if (pGray->iShown[p])
+         fprintf(stderr, "  plane %d (weight %d): %ld bytes per sub-frame, %d at most\n", p,
+            1 << (pGray->iPlanes - 1 - p), pGray->lBytes[p] / pGray->iShown[p], pGray->iMax[p]);
+   }
+} /* GrayReport() */
+
+//
+// Play the frames of a clip backward (--reverse) or forward and back
+// (--pingpong) on the Linux player, where there's RAM to spare: every
+// frame is decoded to an image first and each step sends the bytes which
+// differ from the image before it, so any stream or bundle clip works
+// without extra data. (The Arduino player needs the way back in flash;
+// see tcomp --pingpong. Such a stream already goes back down, so it's
+// played as it is.) When the order ends on the frame it started with,
+// later passes skip it. Grayscale clips are always played this way,
+// with an image for each plane.
+// Returns 0 for success, -1 if the clip can't be played
+//
+static int PlayImages(void)
+{
+PLAYENTRY entry;
+PLAYCLIP *pClip;
+PLAYSINK *pSinks;
+GRAYPLAY gray;
+unsigned char *pImages;
+int *pOrder, *pStates;
+int i, j, p, iCount, iFrames, iSize, iStart, bReported = 0;
+
+   memset(&entry, 0, sizeof(entry));
+   strcpy(entry.szName, szIn);
+   entry.iClip = iClip;
+   pClip = ClipNew(&entry);
+   pClip->iError = ClipLoad(pClip);
+   memset(&gray, 0, sizeof(gray));
+   gray.iPlanes = ((pClip->iFlags & STREAM_PLANES_MASK) >> STREAM_PLANES_SHIFT) + 1;
+   gray.iSlot = 1;
+   if (pClip->iError == CLIP_OK && (gray.iPlanes > GRAY_MAX_PLANES || pClip->iFrames % gray.iPlanes))
+      pClip->iError = CLIP_BAD_STREAM;
+   if (pClip->iError != CLIP_OK)
+   {
+      fprintf(stderr, "Error playing %s: %s\n", szIn, szClipErrors[pClip->iError]);
+      ClipFree(pClip);
+      return -1;
+   }
+   iFrames = pClip->iFrames / gray.iPlanes;
+   iSize = gray.iPlanes * 1024; // images of a frame
+   pImages = malloc(pClip->iFrames * 1024);
+   pOrder = malloc(iFrames * 2 * sizeof(int));
+   pStates = malloc(iFrames * sizeof(int));
+   pSinks = calloc(gray.iPlanes, sizeof(PLAYSINK));
+   for (p=0; p<gray.iPlanes; p++)
+   {
+      pSinks[p].iState = DISPLAY_DEFAULT;
+      pSinks[p].bImageOnly = 1;
+      pSinks[p].bVertical = (pClip->iFlags & STREAM_VERTICAL) != 0;
+      pSinks[p].iFields = STREAM_FIELDS(pClip->iFlags);
+      pSinks[p].pTiles = pClip->pTiles;
+   }
+   iCount = 0;
+   for (i=0; i<iFrames; i++) // (checked when it loaded)
+   {
+      for (p=0; p<gray.iPlanes; p++) // each plane follows its own
+      {
+         ODecodeFrame(&pSinks[p], pClip->pFrames[i * gray.iPlanes + p], pClip->pEnd);
+         memcpy(&pImages[i * iSize + p * 1024], pSinks[p].ucImage, 1024);
+      }
+      pStates[i] = pSinks[0].iState;
+      if (i != 1 || !(pClip->iFlags & STREAM_LOOP_FRAME)) // (frame 0 again)
+         pOrder[iCount++] = i;
+   }
+   if (bPingPong && !(pClip->iFlags & STREAM_PINGPONG))
+   {
+      for (i=iCount-2; i>=0; i--)
+         pOrder[iCount + iCount-2 - i] = pOrder[i];
+      iCount = iCount * 2 - 1;
+   }
+   if (bReverse)
+   {
+      for (i=0; i<iCount/2; i++)
+      {
+         j = pOrder[i];
+         pOrder[i] = pOrder[iCount-1-i];
+         pOrder[iCount-1-i] = j;
+      }
+   }
+   bVertical = sink.bVertical = bPageAligned = 0; // the images are page by page
+   oledWriteCommand2(0x20, 0x00);
+   oledSetOffset(0); // what the display shows isn't known yet
+   memcpy(sink.ucImage, &pImages[pOrder[0] * iSize], 1024);
+   oledWriteDataBlock(sink.ucImage, 1024);
+   clock_gettime(CLOCK_MONOTONIC, &gray.tNext);
+   PlayImage(&gray, &pImages[pOrder[0] * iSize], pStates[pOrder[0]]);
+   iStart = (iCount > 1 && memcmp(&pImages[pOrder[0] * iSize], &pImages[pOrder[iCount-1] * iSize], iSize) == 0 &&
+      pStates[pOrder[0]] == pStates[pOrder[iCount-1]]) ? 1 : 0;
+   i = 1;
+   do {
+      for (; i<iCount; i++)
+         PlayImage(&gray, &pImages[pOrder[i] * iSize], pStates[pOrder[i]]);
+      if (gray.iPlanes > 1 && !bReported)
+      {
+         GrayReport(&gray); // after the first pass
+         bReported = 1;
+      }
+      i = iStart;
+   } while (bLoop);
+   free(pSinks);
+   free(pStates);
+   free(pOrder);
+   free(pImages);
+   ClipFree(pClip);
+   return 0;
+} /* PlayImages() */
+
 static void parse_opts(int argc, char *argv[])
 {
 // set default options
@@ -367,9 +1635,59 @@ int i = 1;
 	} else if (0 == strcmp("--loop", argv[i])) {
 	    bLoop = 1;
 	    i++;
+	} else if (0 == strcmp("--pingpong", argv[i])) {
+	    bPingPong = 1;
+	    i++;
+	} else if (0 == strcmp("--reverse", argv[i])) {
+	    bReverse = 1;
+	    i++;
         } else if (0 == strcmp("--chan", argv[i])) {
             iChannel = atoi(argv[i+1]);
             i += 2;
+        } else if (0 == strcmp("--spi", argv[i])) {
+            iTransport = TRANSPORT_SPI;
+            strcpy(szDevice, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--speed", argv[i])) {
+            iSPISpeed = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--gpiochip", argv[i])) {
+            iGPIOChip = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--dc", argv[i])) {
+            iDCLine = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--reset", argv[i])) {
+            iResetLine = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--fb", argv[i])) {
+            iTransport = TRANSPORT_FB;
+            strcpy(szDevice, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--capture", argv[i])) {
+            iTransport = TRANSPORT_FILE;
+            strcpy(szDevice, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--replay", argv[i])) {
+            strcpy(szReplay, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--clip", argv[i])) {
+            iClip = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--fifo", argv[i])) {
+            strcpy(szFifo, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--socket", argv[i])) {
+            strcpy(szSocket, argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--script-kb", argv[i])) {
+            iScriptKB = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--plane-hz", argv[i])) {
+            iPlaneHz = atoi(argv[i+1]);
+            if (iPlaneHz < 1)
+               iPlaneHz = 1;
+            i += 2;
         }  else {
             fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
             exit(1);
@@ -379,7 +1697,6 @@ int i = 1;
 
 int main(int argc, char *argv[])
 {
-FILE *pf;
 int iSize, i;
 unsigned char *pData;
 
@@ -394,31 +1711,73 @@ unsigned char *pData;
 		printf("--addr  optional hex I2C addess; defaults to 0x3c\n");
 		printf("--rate  optional framerate; defaults to 15FPS\n");
 		printf("--loop  loops animation until CTRL-C is pressed\n");
+		printf("--pingpong  plays the frames forward, then backward\n");
+		printf("--reverse   plays the frames backward\n");
 		printf("--bad 	indicates the display doesn't support horizontal address mode\n");
+		printf("--spi   SPI device (e.g. /dev/spidev0.0) instead of I2C\n");
+		printf("--speed optional SPI clock in Hz; defaults to 8000000\n");
+		printf("--gpiochip optional GPIO chip of the SPI D/C line; defaults to 0\n");
+		printf("--dc    GPIO line of the SPI D/C signal; defaults to 24\n");
+		printf("--reset optional GPIO line of the SPI reset signal\n");
+		printf("--fb    framebuffer device (e.g. /dev/fb1) instead of I2C\n");
+		printf("--capture  write the bus traffic to a file (- for stdout)\n");
+		printf("--replay   send a captured bus traffic file to the display\n");
+		printf("--clip  clip number to play from a bundle; defaults to 0\n");
+		printf("--script-kb  memory for pre-rendering a looped clip; defaults to 4096 (0 = off)\n");
+		printf("--plane-hz  sub-frames per second of a grayscale clip; defaults to 180\n");
+		printf("--fifo  run as a playlist daemon taking commands from a FIFO\n");
+		printf("--socket  run as a playlist daemon taking commands from a Unix socket\n");
 		return -1;
 	}
 	parse_opts(argc, argv);
 	iDelay = 1000000 / iFrameRate;
-	i = oledInit(iChannel, iAddress, 0, 0);
+	i = oledInit(0, 0);
 	if (i)
 	{
 		printf("Error initializing OLED; are you running as sudo?\n");
 		return -1;
 	}
-	pf = fopen(szIn, "rb");
-	if (pf == NULL)
+	sink.iState = DISPLAY_DEFAULT;
+	if (szReplay[0])
+	{
+		i = TransportReplay(pTransport, szReplay, iDelay);
+		if (i)
+			printf("Error replaying %s\n", szReplay);
+		oledShutdown();
+		return i;
+	}
+	if (szFifo[0] || szSocket[0])
 	{
-		printf("Error opening %s\n", szIn);
+		i = PlayDaemon();
+		if (i)
+			printf("Error opening the playlist FIFO or socket\n");
+		oledShutdown();
+		return i;
+	}
+	iSize = LoadFile(szIn, &pData);
+	if (iSize < 0)
+	{
+		if (iSize == -2)
+			printf("Error expanding %s; corrupt archive\n", szIn);
+		else
+			printf("Error opening %s\n", szIn);
 		oledShutdown();
 		return -1;
 	}
-	fseek(pf, 0L, SEEK_END);
-	iSize = (int)ftell(pf);
-	fseek(pf, 0L, SEEK_SET);
-	pData = malloc(iSize);
-	fread(pData, iSize, 1, pf);
-	fclose(pf);
-	PlayAnimation(pData, iSize);
+	if (bPingPong || bReverse || (StreamFlags(pData, iSize) & STREAM_PLANES_MASK))
+	{
+		free(pData);
+		i = PlayImages();
+		oledShutdown();
+		return i;
+	}
+	if (iSize >= BUNDLE_HEADER_SIZE && memcmp(pData, "OAB1", 4) == 0)
+	{
+		if (PlayBundle(pData, iSize, iClip))
+			printf("Error playing clip %d of %s\n", iClip, szIn);
+	}
+	else if (PlayAnimation(pData, iSize))
+		printf("Error playing %s; corrupt stream\n", szIn);
 	oledShutdown();
 	return 0;
 } /* main() */
@@ -0,0 +1,673 @@
+//
+// Display transport layer for the OLED animation player
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// Each backend batches the traffic in the way that suits it best:
+// I2C  - queued commands share one transaction, data blocks get their own
+// SPI  - the D/C line is only toggled when the byte type changes
+// FB   - no system calls at all, bytes are drawn straight into the mmap
+// FILE - buffered writes, flushed at the end of each frame
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+#include <linux/fb.h>
+#include "transport.h"
+
+static TRANSPORT *TransportAlloc(int iType)
+{
+TRANSPORT *pT;
+
+   pT = calloc(1, sizeof(TRANSPORT));
+   pT->iType = iType;
+   pT->iFile = pT->iDCLine = pT->iResetLine = -1;
+   pT->iDC = -1;
+   return pT;
+} /* TransportAlloc() */
+//
+// I2C - each transaction starts with a control byte
+// 0x00 = the rest are commands, 0x40 = the rest are data
+//
+static int I2CWriteBlock(TRANSPORT *pT, unsigned char ucControl, unsigned char *pData, int iLen)
+{
+int j, rc = 0;
+
+   pT->ucBuf[0] = ucControl;
+   while (iLen)
+   {
+      j = (iLen > TRANSPORT_BUF_SIZE) ? TRANSPORT_BUF_SIZE : iLen;
+      memcpy(&pT->ucBuf[1], pData, j);
+      if (write(pT->iFile, pT->ucBuf, j+1) != j+1)
+         rc = -1;
+      pData += j;
+      iLen -= j;
+   }
+   return rc;
+} /* I2CWriteBlock() */
+
+static int I2CCommand(TRANSPORT *pT, unsigned char *pCmd, int iLen)
+{
+   return I2CWriteBlock(pT, 0x00, pCmd, iLen);
+} /* I2CCommand() */
+
+static int I2CData(TRANSPORT *pT, unsigned char *pData, int iLen)
+{
+   return I2CWriteBlock(pT, 0x40, pData, iLen);
+} /* I2CData() */
+
+static void DeviceClose(TRANSPORT *pT)
+{
+   if (pT->iFile >= 0)
+      close(pT->iFile);
+   if (pT->iDCLine >= 0)
+      close(pT->iDCLine);
+   if (pT->iResetLine >= 0)
+      close(pT->iResetLine);
+} /* DeviceClose() */
+
+TRANSPORT *TransportOpenI2C(int iChannel, int iAddr)
+{
+TRANSPORT *pT;
+char filename[32];
+
+   pT = TransportAlloc(TRANSPORT_I2C);
+   sprintf(filename, "/dev/i2c-%d", iChannel);
+   if ((pT->iFile = open(filename, O_RDWR)) < 0)
+   {
+      fprintf(stderr, "Failed to open the i2c bus\n");
+      free(pT);
+      return NULL;
+   }
+   if (ioctl(pT->iFile, I2C_SLAVE, iAddr) < 0)
+   {
+      fprintf(stderr, "Failed to acquire bus access or talk to slave\n");
+      close(pT->iFile);
+      free(pT);
+      return NULL;
+   }
+   pT->pfnCommand = I2CCommand;
+   pT->pfnData = I2CData;
+   pT->pfnClose = DeviceClose;
+   return pT;
+} /* TransportOpenI2C() */
+//
+// SPI - commands and data are told apart by the D/C line
+//
+static int GPIORequest(int iChip, int iLine, int iValue)
+{
+struct gpiohandle_request req;
+char filename[32];
+int iFile, rc;
+
+   sprintf(filename, "/dev/gpiochip%d", iChip);
+   if ((iFile = open(filename, O_RDWR)) < 0)
+      return -1;
+   memset(&req, 0, sizeof(req));
+   req.lineoffsets[0] = iLine;
+   req.lines = 1;
+   req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+   req.default_values[0] = (unsigned char)iValue;
+   strcpy(req.consumer_label, "oledplay");
+   rc = ioctl(iFile, GPIO_GET_LINEHANDLE_IOCTL, &req);
+   close(iFile); // the line handle stays valid
+   return (rc < 0) ? -1 : req.fd;
+} /* GPIORequest() */
+
+static void GPIOSet(int iLine, int iValue)
+{
+struct gpiohandle_data data;
+
+   memset(&data, 0, sizeof(data));
+   data.values[0] = (unsigned char)iValue;
+   ioctl(iLine, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+} /* GPIOSet() */
+
+static int SPIWrite(TRANSPORT *pT, int iDC, unsigned char *pData, int iLen)
+{
+int j, rc = 0;
+
+   if (pT->iDC != iDC) // only toggle D/C when it changes
+   {
+      GPIOSet(pT->iDCLine, iDC);
+      pT->iDC = iDC;
+   }
+   while (iLen)
+   {
+      j = (iLen > TRANSPORT_BUF_SIZE) ? TRANSPORT_BUF_SIZE : iLen;
+      if (write(pT->iFile, pData, j) != j)
+         rc = -1;
+      pData += j;
+      iLen -= j;
+   }
+   return rc;
+} /* SPIWrite() */
+
+static int SPICommand(TRANSPORT *pT, unsigned char *pCmd, int iLen)
+{
+   return SPIWrite(pT, 0, pCmd, iLen);
+} /* SPICommand() */
+
+static int SPIData(TRANSPORT *pT, unsigned char *pData, int iLen)
+{
+   return SPIWrite(pT, 1, pData, iLen);
+} /* SPIData() */
+
+TRANSPORT *TransportOpenSPI(char *szDevice, int iSpeed, int iGPIOChip, int iDCLine, int iResetLine)
+{
+TRANSPORT *pT;
+unsigned char ucMode = SPI_MODE_0;
+unsigned int uiSpeed = (unsigned int)iSpeed;
+
+   pT = TransportAlloc(TRANSPORT_SPI);
+   if ((pT->iFile = open(szDevice, O_RDWR)) < 0)
+   {
+      fprintf(stderr, "Failed to open %s\n", szDevice);
+      free(pT);
+      return NULL;
+   }
+   if (ioctl(pT->iFile, SPI_IOC_WR_MODE, &ucMode) < 0 ||
+       ioctl(pT->iFile, SPI_IOC_WR_MAX_SPEED_HZ, &uiSpeed) < 0)
+   {
+      fprintf(stderr, "Failed to configure %s\n", szDevice);
+      DeviceClose(pT);
+      free(pT);
+      return NULL;
+   }
+   pT->iDCLine = GPIORequest(iGPIOChip, iDCLine, 0);
+   if (pT->iDCLine < 0)
+   {
+      fprintf(stderr, "Failed to get GPIO line %d for D/C\n", iDCLine);
+      DeviceClose(pT);
+      free(pT);
+      return NULL;
+   }
+   pT->iDC = 0;
+   if (iResetLine >= 0) // pulse the reset line if there is one
+   {
+      pT->iResetLine = GPIORequest(iGPIOChip, iResetLine, 1);
+      if (pT->iResetLine >= 0)
+      {
+         usleep(1000);
+         GPIOSet(pT->iResetLine, 0);
+         usleep(10000);
+         GPIOSet(pT->iResetLine, 1);
+         usleep(10000);
+      }
+   }
+   pT->pfnCommand = SPICommand;
+   pT->pfnData = SPIData;
+   pT->pfnClose = DeviceClose;
+   return pT;
+} /* TransportOpenSPI() */
+//
+// Controller model
+//
+void EmuInit(OLED_EMU *pEmu)
+{
+   memset(pEmu, 0, sizeof(OLED_EMU));
+   pEmu->iMode = 2; // page mode after reset
+   pEmu->iColEnd = 127;
+   pEmu->iPageEnd = 7;
+} /* EmuInit() */
+//
+// Number of argument bytes which follow each command
+//
+static int EmuArgCount(unsigned char c)
+{
+   switch (c)
+   {
+      case 0x20: case 0x81: case 0x8d: case 0xa8: case 0xd3:
+      case 0xd5: case 0xd9: case 0xda: case 0xdb:
+         return 1;
+      case 0x21: case 0x22: case 0xa3:
+         return 2;
+      case 0x29: case 0x2a:
+         return 5;
+      case 0x26: case 0x27:
+         return 6;
+      default:
+         return 0;
+   }
+} /* EmuArgCount() */
+
+void EmuCommand(OLED_EMU *pEmu, unsigned char c)
+{
+   if (pEmu->iArgsNeeded) // collecting the arguments of a command
+   {
+      pEmu->ucArgs[pEmu->iArgCount++] = c;
+      if (pEmu->iArgCount < pEmu->iArgsNeeded)
+         return;
+      pEmu->iArgsNeeded = 0;
+      switch (pEmu->ucArgs[0])
+      {
+         case 0x20: // memory addressing mode
+            pEmu->iMode = pEmu->ucArgs[1] & 3;
+            break;
+         case 0x21: // column range
+            pEmu->iColStart = pEmu->iCol = pEmu->ucArgs[1] & 0x7f;
+            pEmu->iColEnd = pEmu->ucArgs[2] & 0x7f;
+            break;
+         case 0x22: // page range
+            pEmu->iPageStart = pEmu->iPage = pEmu->ucArgs[1] & 7;
+            pEmu->iPageEnd = pEmu->ucArgs[2] & 7;
+            break;
+      }
+      return;
+   }
+   if (EmuArgCount(c))
+   {
+      pEmu->ucArgs[0] = c;
+      pEmu->iArgCount = 1;
+      pEmu->iArgsNeeded = EmuArgCount(c) + 1;
+      return;
+   }
+   if (c < 0x10) // lower column nibble
+      pEmu->iCol = (pEmu->iCol & 0x70) | c;
+   else if (c < 0x20) // upper column nibble
+      pEmu->iCol = (pEmu->iCol & 0xf) | ((c & 7) << 4);
+   else if (c >= 0xb0 && c <= 0xb7) // page
+      pEmu->iPage = c & 7;
+   else if (c == 0xa6 || c == 0xa7)
+      pEmu->bInvert = c & 1;
+   else if (c == 0xae || c == 0xaf)
+      pEmu->bOn = c & 1;
+} /* EmuCommand() */
+
+int EmuData(OLED_EMU *pEmu, unsigned char b)
+{
+int iOffset;
+
+   iOffset = pEmu->iPage * 128 + pEmu->iCol;
+   pEmu->ucRAM[iOffset] = b;
+   if (pEmu->iMode == 1) // vertical
+   {
+      if (++pEmu->iPage > pEmu->iPageEnd)
+      {
+         pEmu->iPage = pEmu->iPageStart;
+         if (++pEmu->iCol > pEmu->iColEnd)
+            pEmu->iCol = pEmu->iColStart;
+      }
+   }
+   else if (++pEmu->iCol > pEmu->iColEnd) // horizontal and page
+   {
+      pEmu->iCol = pEmu->iColStart;
+      if (pEmu->iMode == 0 && ++pEmu->iPage > pEmu->iPageEnd)
+         pEmu->iPage = pEmu->iPageStart;
+   }
+   return iOffset;
+} /* EmuData() */
+//
+// Framebuffer - draw each display byte as 8 vertical pixels
+//
+static void FBDrawByte(TRANSPORT *pT, int iOffset)
+{
+int i, x, y, iOn;
+unsigned char b, *d;
+
+   b = pT->emu.ucRAM[iOffset];
+   if (!pT->emu.bOn)
+      b = 0;
+   else if (pT->emu.bInvert)
+      b = ~b;
+   x = iOffset & 0x7f;
+   y = (iOffset >> 7) * 8;
+   if (x >= pT->iFBWidth || y >= pT->iFBHeight)
+      return;
+   for (i=0; i<8 && y+i < pT->iFBHeight; i++)
+   {
+      iOn = (b >> i) & 1;
+      d = &pT->pFB[(y+i) * pT->iFBPitch];
+      switch (pT->iFBBpp)
+      {
+         case 1:
+            if (iOn)
+               d[x>>3] |= (0x80 >> (x & 7));
+            else
+               d[x>>3] &= ~(0x80 >> (x & 7));
+            break;
+         case 8:
+            d[x] = iOn ? 0xff : 0;
+            break;
+         case 16:
+            d[x*2] = d[x*2+1] = iOn ? 0xff : 0;
+            break;
+         case 24:
+            memset(&d[x*3], iOn ? 0xff : 0, 3);
+            break;
+         case 32:
+            memset(&d[x*4], iOn ? 0xff : 0, 4);
+            break;
+      }
+   }
+} /* FBDrawByte() */
+
+static int FBCommand(TRANSPORT *pT, unsigned char *pCmd, int iLen)
+{
+int i, bInvert, bOn;
+
+   bInvert = pT->emu.bInvert;
+   bOn = pT->emu.bOn;
+   for (i=0; i<iLen; i++)
+      EmuCommand(&pT->emu, pCmd[i]);
+   if (bInvert != pT->emu.bInvert || bOn != pT->emu.bOn) // redraw everything
+   {
+      for (i=0; i<1024; i++)
+         FBDrawByte(pT, i);
+   }
+   return 0;
+} /* FBCommand() */
+
+static int FBData(TRANSPORT *pT, unsigned char *pData, int iLen)
+{
+int i;
+
+   for (i=0; i<iLen; i++)
+      FBDrawByte(pT, EmuData(&pT->emu, pData[i]));
+   return 0;
+} /* FBData() */
+
+static void FBClose(TRANSPORT *pT)
+{
+   munmap(pT->pFB, pT->iFBSize);
+   close(pT->iFile);
+} /* FBClose() */
+
+TRANSPORT *TransportOpenFB(char *szDevice)
+{
+TRANSPORT *pT;
+struct fb_var_screeninfo vinfo;
+struct fb_fix_screeninfo finfo;
+
+   pT = TransportAlloc(TRANSPORT_FB);
+   if ((pT->iFile = open(szDevice, O_RDWR)) < 0)
+   {
+      fprintf(stderr, "Failed to open %s\n", szDevice);
+      free(pT);
+      return NULL;
+   }
+   if (ioctl(pT->iFile, FBIOGET_VSCREENINFO, &vinfo) < 0 ||
+       ioctl(pT->iFile, FBIOGET_FSCREENINFO, &finfo) < 0)
+   {
+      fprintf(stderr, "%s is not a framebuffer device\n", szDevice);
+      close(pT->iFile);
+      free(pT);
+      return NULL;
+   }
+   pT->iFBBpp = vinfo.bits_per_pixel;
+   pT->iFBWidth = vinfo.xres;
+   pT->iFBHeight = vinfo.yres;
+   pT->iFBPitch = finfo.line_length;
+   pT->iFBSize = finfo.smem_len;
+   pT->pFB = mmap(NULL, pT->iFBSize, PROT_READ | PROT_WRITE, MAP_SHARED, pT->iFile, 0);
+   if (pT->pFB == MAP_FAILED)
+   {
+      fprintf(stderr, "Failed to map %s\n", szDevice);
+      close(pT->iFile);
+      free(pT);
+      return NULL;
+   }
+   EmuInit(&pT->emu);
+   pT->pfnCommand = FBCommand;
+   pT->pfnData = FBData;
+   pT->pfnClose = FBClose;
+   return pT;
+} /* TransportOpenFB() */
+//
+// File - records each transaction so that it can be replayed later
+//
+static int FileRecord(TRANSPORT *pT, unsigned char ucType, unsigned char *pData, int iLen)
+{
+unsigned char ucHeader[3];
+int j;
+
+   do {
+      j = (iLen > 0xffff) ? 0xffff : iLen;
+      ucHeader[0] = ucType;
+      ucHeader[1] = (unsigned char)j;
+      ucHeader[2] = (unsigned char)(j >> 8);
+      if (fwrite(ucHeader, 1, 3, pT->pFile) != 3 || (int)fwrite(pData, 1, j, pT->pFile) != j)
+         return -1;
+      pData += j;
+      iLen -= j;
+   } while (iLen);
+   return 0;
+} /* FileRecord() */
+
+static int FileCommand(TRANSPORT *pT, unsigned char *pCmd, int iLen)
+{
+   return FileRecord(pT, CAPTURE_COMMAND, pCmd, iLen);
+} /* FileCommand() */
+
+static int FileData(TRANSPORT *pT, unsigned char *pData, int iLen)
+{
+   return FileRecord(pT, CAPTURE_DATA, pData, iLen);
+} /* FileData() */
+
+static void FileEndFrame(TRANSPORT *pT)
+{
+   FileRecord(pT, CAPTURE_FRAME, NULL, 0);
+   fflush(pT->pFile);
+} /* FileEndFrame() */
+
+static void FileClose(TRANSPORT *pT)
+{
+   if (pT->pFile != stdout)
+      fclose(pT->pFile);
+   else
+      fflush(pT->pFile);
+} /* FileClose() */
+
+TRANSPORT *TransportOpenFile(char *szFile)
+{
+TRANSPORT *pT;
+
+   pT = TransportAlloc(TRANSPORT_FILE);
+   if (strcmp(szFile, "-") == 0)
+      pT->pFile = stdout;
+   else
+      pT->pFile = fopen(szFile, "wb");
+   if (pT->pFile == NULL)
+   {
+      fprintf(stderr, "Failed to create %s\n", szFile);
+      free(pT);
+      return NULL;
+   }
+   pT->pfnCommand = FileCommand;
+   pT->pfnData = FileData;
+   pT->pfnEndFrame = FileEndFrame;
+   pT->pfnClose = FileClose;
+   return pT;
+} /* TransportOpenFile() */
+//
+// Script - the same records as a capture file, kept in memory
+// Commands are recorded as they leave the queue, so each record is one
+// transaction with the positioning commands already merged
+//
+SCRIPT *ScriptAlloc(int iMax)
+{
+SCRIPT *pScript;
+
+   pScript = calloc(1, sizeof(SCRIPT));
+   pScript->iMax = iMax;
+   return pScript;
+} /* ScriptAlloc() */
+
+void ScriptFree(SCRIPT *pScript)
+{
+   if (pScript == NULL)
+      return;
+   free(pScript->pData);
+   free(pScript);
+} /* ScriptFree() */
+
+static void ScriptRecord(SCRIPT *pScript, unsigned char ucType, unsigned char *pData, int iLen)
+{
+int j;
+
+   do {
+      j = (iLen > 0xffff) ? 0xffff : iLen;
+      if (pScript->bFull || pScript->iLen + 3 + j > pScript->iMax)
+      {
+         pScript->bFull = 1;
+         return;
+      }
+      if (pScript->iLen + 3 + j > pScript->iSize) // grow it
+      {
+         pScript->iSize = (pScript->iSize + 3 + j) * 2;
+         if (pScript->iSize > pScript->iMax)
+            pScript->iSize = pScript->iMax;
+         pScript->pData = realloc(pScript->pData, pScript->iSize);
+      }
+      pScript->pData[pScript->iLen++] = ucType;
+      pScript->pData[pScript->iLen++] = (unsigned char)j;
+      pScript->pData[pScript->iLen++] = (unsigned char)(j >> 8);
+      if (j)
+         memcpy(&pScript->pData[pScript->iLen], pData, j);
+      pScript->iLen += j;
+      pData += j;
+      iLen -= j;
+   } while (iLen);
+   if (ucType == CAPTURE_FRAME)
+      pScript->iFrames++;
+} /* ScriptRecord() */
+
+void TransportRecord(TRANSPORT *pT, SCRIPT *pScript)
+{
+   TransportFlush(pT); // queued commands belong to what came before
+   pT->pRecord = pScript;
+} /* TransportRecord() */
+
+void TransportPlayScript(TRANSPORT *pT, SCRIPT *pScript, int iDelay)
+{
+unsigned char *s, *pEnd;
+int iLen;
+
+   TransportFlush(pT);
+   s = pScript->pData;
+   pEnd = &s[pScript->iLen];
+   while (s < pEnd)
+   {
+      iLen = s[1] | (s[2] << 8);
+      if (s[0] == CAPTURE_COMMAND)
+         (*pT->pfnCommand)(pT, &s[3], iLen);
+      else if (s[0] == CAPTURE_DATA)
+         (*pT->pfnData)(pT, &s[3], iLen);
+      else // CAPTURE_FRAME
+      {
+         if (pT->pfnEndFrame)
+            (*pT->pfnEndFrame)(pT);
+         usleep(iDelay);
+      }
+      s += 3 + iLen;
+   }
+} /* TransportPlayScript() */
+//
+// Backend independent part
+//
+void TransportFlush(TRANSPORT *pT)
+{
+   if (pT->iCmdLen)
+   {
+      (*pT->pfnCommand)(pT, pT->ucCmd, pT->iCmdLen);
+      if (pT->pRecord)
+         ScriptRecord(pT->pRecord, CAPTURE_COMMAND, pT->ucCmd, pT->iCmdLen);
+      pT->iCmdLen = 0;
+   }
+} /* TransportFlush() */
+
+int TransportCommand(TRANSPORT *pT, unsigned char *pCmd, int iLen)
+{
+   if (pT->iCmdLen + iLen > TRANSPORT_MAX_CMDS)
+      TransportFlush(pT);
+   if (iLen > TRANSPORT_MAX_CMDS) // too big to queue
+   {
+      if (pT->pRecord)
+         ScriptRecord(pT->pRecord, CAPTURE_COMMAND, pCmd, iLen);
+      return (*pT->pfnCommand)(pT, pCmd, iLen);
+   }
+   memcpy(&pT->ucCmd[pT->iCmdLen], pCmd, iLen);
+   pT->iCmdLen += iLen;
+   return 0;
+} /* TransportCommand() */
+
+int TransportData(TRANSPORT *pT, unsigned char *pData, int iLen)
+{
+   TransportFlush(pT);
+   if (pT->pRecord)
+      ScriptRecord(pT->pRecord, CAPTURE_DATA, pData, iLen);
+   return (*pT->pfnData)(pT, pData, iLen);
+} /* TransportData() */
+
+void TransportEndFrame(TRANSPORT *pT)
+{
+   TransportFlush(pT);
+   if (pT->pRecord)
+      ScriptRecord(pT->pRecord, CAPTURE_FRAME, NULL, 0);
+   if (pT->pfnEndFrame)
+      (*pT->pfnEndFrame)(pT);
+} /* TransportEndFrame() */
+
+void TransportClose(TRANSPORT *pT)
+{
+   if (pT == NULL)
+      return;
+   TransportFlush(pT);
+   (*pT->pfnClose)(pT);
+   free(pT);
+} /* TransportClose() */
+
+int TransportReplay(TRANSPORT *pT, char *szFile, int iDelay)
+{
+FILE *pf;
+unsigned char ucHeader[3];
+unsigned char *pData;
+int iLen, rc = 0;
+
+   pf = fopen(szFile, "rb");
+   if (pf == NULL)
+      return -1;
+   pData = malloc(0x10000);
+   while (fread(ucHeader, 1, 3, pf) == 3)
+   {
+      iLen = ucHeader[1] | (ucHeader[2] << 8);
+      if ((int)fread(pData, 1, iLen, pf) != iLen)
+      {
+         rc = -1; // truncated capture
+         break;
+      }
+      if (ucHeader[0] == CAPTURE_COMMAND)
+         TransportCommand(pT, pData, iLen);
+      else if (ucHeader[0] == CAPTURE_DATA)
+         TransportData(pT, pData, iLen);
+      else if (ucHeader[0] == CAPTURE_FRAME)
+      {
+         TransportEndFrame(pT);
+         usleep(iDelay);
+      }
+   }
+   TransportFlush(pT);
+   free(pData);
+   fclose(pf);
+   return rc;
+} /* TransportReplay() */
@@ -0,0 +1,112 @@
+//
+// Display transport layer for the OLED animation player
+// Copyright (c) 2018 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// The player talks to the SSD1306 in terms of command bytes and
+// data bytes. A transport carries those to the display:
+// I2C     - /dev/i2c-N, control byte (0x00/0x40) prefixed transactions
+// SPI     - /dev/spidevB.C with the D/C line on a GPIO character device
+// FB      - mmap'd /dev/fbN; the controller is emulated in memory
+// FILE    - a file or pipe which captures the bus traffic for replay
+//
+// Commands are queued and sent in as few transactions as each backend
+// allows; they are always delivered before the next data block and at
+// the end of each frame.
+//
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdio.h>
+
+#define TRANSPORT_I2C 0
+#define TRANSPORT_SPI 1
+#define TRANSPORT_FB 2
+#define TRANSPORT_FILE 3
+
+#define TRANSPORT_MAX_CMDS 64
+#define TRANSPORT_BUF_SIZE 4096 // also the default spidev transfer limit
+
+// Capture file record types (1 byte type, 2 byte little endian length, data)
+#define CAPTURE_COMMAND 0x00
+#define CAPTURE_DATA 0x40
+#define CAPTURE_FRAME 0xff
+
+//
+// In-memory model of the SSD1306 display RAM and address pointer
+// Used by the framebuffer backend
+//
+typedef struct tag_oled_emu
+{
+   unsigned char ucRAM[1024];
+   unsigned char ucArgs[4]; // arguments of a multi-byte command
+   int iArgCount, iArgsNeeded;
+   int iCol, iPage;
+   int iColStart, iColEnd, iPageStart, iPageEnd;
+   int iMode; // 0=horizontal, 1=vertical, 2=page
+   int bInvert, bOn;
+} OLED_EMU;
+
+//
+// Pre-rendered bus traffic: the capture records of a clip kept in memory
+// so that a looped clip can be sent again without decoding it
+//
+typedef struct tag_script
+{
+   unsigned char *pData;
+   int iLen; // bytes of records
+   int iSize; // bytes allocated
+   int iMax; // memory cap
+   int iFrames;
+   int bFull; // hit the cap; the script is incomplete
+} SCRIPT;
+
+typedef struct tag_transport TRANSPORT;
+struct tag_transport
+{
+   int iType;
+   int (*pfnCommand)(TRANSPORT *pT, unsigned char *pCmd, int iLen);
+   int (*pfnData)(TRANSPORT *pT, unsigned char *pData, int iLen);
+   void (*pfnEndFrame)(TRANSPORT *pT);
+   void (*pfnClose)(TRANSPORT *pT);
+   int iFile; // device handle
+   int iDCLine, iResetLine; // GPIO line handles (SPI)
+   int iDC; // current state of the D/C line
+   FILE *pFile; // capture file
+   unsigned char *pFB; // mmap'd framebuffer
+   int iFBSize, iFBPitch, iFBBpp, iFBWidth, iFBHeight;
+   OLED_EMU emu;
+   SCRIPT *pRecord; // also append everything sent to this script
+   int iCmdLen; // queued commands
+   unsigned char ucCmd[TRANSPORT_MAX_CMDS];
+   unsigned char ucBuf[TRANSPORT_BUF_SIZE + 1];
+};
+
+TRANSPORT *TransportOpenI2C(int iChannel, int iAddr);
+TRANSPORT *TransportOpenSPI(char *szDevice, int iSpeed, int iGPIOChip, int iDCLine, int iResetLine);
+TRANSPORT *TransportOpenFB(char *szDevice);
+TRANSPORT *TransportOpenFile(char *szFile);
+// Queue command bytes (sent before the next data or at the end of the frame)
+int TransportCommand(TRANSPORT *pT, unsigned char *pCmd, int iLen);
+// Send display data bytes
+int TransportData(TRANSPORT *pT, unsigned char *pData, int iLen);
+// Send any queued commands
+void TransportFlush(TRANSPORT *pT);
+// Mark the end of a frame (flushes everything to the device)
+void TransportEndFrame(TRANSPORT *pT);
+void TransportClose(TRANSPORT *pT);
+// Send a captured bus stream to another transport; iDelay = usecs per frame
+int TransportReplay(TRANSPORT *pT, char *szFile, int iDelay);
+// Pre-rendered bus traffic of at most iMax bytes
+SCRIPT *ScriptAlloc(int iMax);
+void ScriptFree(SCRIPT *pScript);
+// Record the traffic sent from now on into a script (NULL stops)
+void TransportRecord(TRANSPORT *pT, SCRIPT *pScript);
+// Send a recorded script to the display; iDelay = usecs per frame
+void TransportPlayScript(TRANSPORT *pT, SCRIPT *pScript, int iDelay);
+// Feed bytes through the controller model
+void EmuInit(OLED_EMU *pEmu);
+void EmuCommand(OLED_EMU *pEmu, unsigned char c);
+int EmuData(OLED_EMU *pEmu, unsigned char b); // returns the RAM offset written
+
+#endif // __TRANSPORT_H__